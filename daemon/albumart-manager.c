@@ -37,9 +37,19 @@ static GFileMonitor *artmon;
 
 void keep_alive (void);
 
+/* A failed Fetch counts as this much latency, so that a provider that keeps
+ * failing ends up behind the ones that answer */
+#define FAILURE_PENALTY		(2 * G_USEC_PER_SEC)
+
+/* How long we give a provider before we also ask the next one */
+#define HEDGE_DELAY_DEFAULT	1000
+#define HEDGE_DELAY_MIN		250
+#define HEDGE_DELAY_MAX		3000
+
 typedef struct {
 	DBusGConnection *connection;
 	GList *handlers;
+	GHashTable *latencies;
 	GMutex mutex;
 } AlbumartManagerPrivate;
 
@@ -69,23 +79,108 @@ free_valueinfo (ValueInfo *info) {
 
 
 
+/* Average latency in microseconds of a provider, 0 if we never asked it.
+ * Called with the mutex held */
+static gint64
+get_latency (AlbumartManagerPrivate *priv, const gchar *name)
+{
+	gint64 *latency = g_hash_table_lookup (priv->latencies, name);
+
+	return latency ? *latency : 0;
+}
+
+static gint 
+handler_compare (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	ValueInfo *info_a = (ValueInfo *) a;
+	ValueInfo *info_b = (ValueInfo *) b;
+	AlbumartManagerPrivate *priv = user_data;
+	gint64 latency_a, latency_b;
+
+	if (info_a->prio != info_b->prio)
+		return info_b->prio - info_a->prio;
+
+	/* Within the same priority, the fastest first. One that we didn't
+	 * try yet gets a chance before the others */
+	latency_a = get_latency (priv, info_a->name);
+	latency_b = get_latency (priv, info_b->name);
+
+	return latency_a < latency_b ? -1 : (latency_a > latency_b ? 1 : 0);
+}
+
 GList*
 albumart_manager_get_handlers (AlbumartManager *object)
 {
 	AlbumartManagerPrivate *priv = ALBUMART_MANAGER_GET_PRIVATE (object);
-	GList *retval = NULL, *copy = priv->handlers;
+	GList *retval = NULL, *sorted, *copy;
 
 	g_mutex_lock (&priv->mutex);
 
-	while (copy) {
+	sorted = g_list_sort_with_data (g_list_copy (priv->handlers),
+					handler_compare, priv);
+
+	for (copy = sorted; copy; copy = g_list_next (copy)) {
 		ValueInfo *info = copy->data;
 		retval = g_list_prepend (retval, g_object_ref (info->proxy));
-		copy = g_list_next (copy);
 	}
 
 	g_mutex_unlock (&priv->mutex);
 
-	return retval;
+	g_list_free (sorted);
+
+	return g_list_reverse (retval);
+}
+
+/* Called when a Fetch call on proxy came back after usec. The latency is
+ * an exponential moving average, so that a provider that got slow (or
+ * fast) moves in the order after a few requests */
+void
+albumart_manager_record_latency (AlbumartManager *object, DBusGProxy *proxy, gint64 usec, gboolean success)
+{
+	AlbumartManagerPrivate *priv = ALBUMART_MANAGER_GET_PRIVATE (object);
+	const gchar *name = dbus_g_proxy_get_bus_name (proxy);
+	gint64 *latency;
+
+	if (!name)
+		return;
+
+	if (!success)
+		usec += FAILURE_PENALTY;
+
+	g_mutex_lock (&priv->mutex);
+
+	latency = g_hash_table_lookup (priv->latencies, name);
+
+	if (!latency) {
+		latency = g_new (gint64, 1);
+		*latency = usec;
+		g_hash_table_replace (priv->latencies, g_strdup (name), latency);
+	} else {
+		*latency = (*latency * 3 + usec) / 4;
+	}
+
+	g_mutex_unlock (&priv->mutex);
+}
+
+/* Milliseconds to wait for proxy before the next provider is asked too */
+guint
+albumart_manager_get_hedge_delay (AlbumartManager *object, DBusGProxy *proxy)
+{
+	AlbumartManagerPrivate *priv = ALBUMART_MANAGER_GET_PRIVATE (object);
+	const gchar *name = dbus_g_proxy_get_bus_name (proxy);
+	gint64 latency;
+
+	if (!name)
+		return HEDGE_DELAY_DEFAULT;
+
+	g_mutex_lock (&priv->mutex);
+	latency = get_latency (priv, name);
+	g_mutex_unlock (&priv->mutex);
+
+	if (latency == 0)
+		return HEDGE_DELAY_DEFAULT;
+
+	return CLAMP (2 * latency / 1000, HEDGE_DELAY_MIN, HEDGE_DELAY_MAX);
 }
 
 
@@ -288,6 +383,8 @@ albumart_manager_finalize (GObject *object)
 		g_list_free (priv->handlers);
 	}
 
+	g_hash_table_unref (priv->latencies);
+
 	G_OBJECT_CLASS (albumart_manager_parent_class)->finalize (object);
 }
 
@@ -360,6 +457,11 @@ albumart_manager_init (AlbumartManager *object)
 
 	g_mutex_init (&priv->mutex);
 	priv->handlers = NULL;
+
+	/* Kept by bus name, so that it survives reloading the providers */
+	priv->latencies = g_hash_table_new_full (g_str_hash, g_str_equal,
+						 (GDestroyNotify) g_free,
+						 (GDestroyNotify) g_free);
 }
 
 void 
@@ -46,6 +46,8 @@ struct AlbumartManagerClass {
 GType albumart_manager_get_type (void);
 
 GList* albumart_manager_get_handlers (AlbumartManager *object);
+void albumart_manager_record_latency (AlbumartManager *object, DBusGProxy *proxy, gint64 usec, gboolean success);
+guint albumart_manager_get_hedge_delay (AlbumartManager *object, DBusGProxy *proxy);
 
 void albumart_manager_do_stop (void);
 void albumart_manager_do_init (DBusGConnection *connection, AlbumartManager **albumart_manager, GError **error);
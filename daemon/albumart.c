@@ -38,15 +38,32 @@
 #include "dbus-utils.h"
 #include "utils.h"
 #include "thumbnailer.h"
+#include "art-item.h"
 
 #define ALBUMART_ERROR_DOMAIN	"HildonAlbumart"
 #define ALBUMART_ERROR		g_quark_from_static_string (ALBUMART_ERROR_DOMAIN)
 
+/* The D-Bus timeout of a single Fetch call, in milliseconds */
+#define FETCH_TIMEOUT		(60 * 1000)
+
+/* QueueMany reports its results in ReadyMany/ErrorMany signals of at most
+ * this many entries. It's also how many items of a batch we do before we
+ * let other requests go first */
+#define BATCH_SIZE		32
+
+/* a(ssss): artist, album, kind and the art's path or the error message */
+#define BATCH_ENTRIES_TYPE	(dbus_g_type_get_collection ("GPtrArray", \
+				 dbus_g_type_get_struct ("GValueArray", \
+							 G_TYPE_STRING, G_TYPE_STRING, \
+							 G_TYPE_STRING, G_TYPE_STRING, \
+							 G_TYPE_INVALID)))
+
 void keep_alive (void);
 
 
 typedef struct {
 	AlbumartManager *manager;
+	Thumbnailer *thumbnailer;
 	GThreadPool *normal_pool;
 	GMutex mutex;
 	GList *tasks;
@@ -58,7 +75,8 @@ G_DEFINE_TYPE_WITH_PRIVATE (Albumart, albumart, G_TYPE_OBJECT)
 
 enum {
 	PROP_0,
-	PROP_MANAGER
+	PROP_MANAGER,
+	PROP_THUMBNAILER
 };
 
 enum {
@@ -66,6 +84,8 @@ enum {
 	FINISHED_SIGNAL,
 	READY_SIGNAL,
 	ERROR_SIGNAL,
+	READY_MANY_SIGNAL,
+	ERROR_MANY_SIGNAL,
 	LAST_SIGNAL
 };
 
@@ -79,34 +99,170 @@ typedef struct {
 	gchar *kind;
 	guint num;
 	gboolean unqueued;
+
+	/* For QueueMany, where we are in the batch */
+	GPtrArray *items;
+	guint next_item;
 } WorkTask;
 
+static guint queue_num = 0;
+
+/* One request for album art, raced over the providers. It lives in the
+ * mainloop (that's where dbus-glib delivers the replies), the pool's thread
+ * waits on cond until done is set */
+typedef struct {
+	AlbumartManager *manager;
+	gchar *artist, *album, *kind;
+	GList *proxies;
+	GList *calls;
+	guint hedge_id;
+	GPtrArray *errors;
+	gboolean won;
+	gboolean done;
+	GMutex mutex;
+	GCond cond;
+} FetchRace;
+
+typedef struct {
+	FetchRace *race;
+	DBusGProxy *proxy;
+	DBusGProxyCall *call;
+	gint64 started;
+} FetchCall;
+
+static gboolean race_launch_next (FetchRace *race);
 
+static void
+fetch_call_free (FetchCall *fcall)
+{
+	g_object_unref (fcall->proxy);
+	g_slice_free (FetchCall, fcall);
+}
 
-static DBusGProxy*
-get_thumber (void)
+/* The last thing that happens to a race in the mainloop. After done is set
+ * the pool's thread owns the race again */
+static void
+race_finish (FetchRace *race, gboolean won)
 {
-	static DBusGProxy *proxy = NULL;
+	GList *copy;
 
-	if (!proxy) {
-		GError          *error = NULL;
-		DBusGConnection *connection;
+	if (race->hedge_id != 0) {
+		g_source_remove (race->hedge_id);
+		race->hedge_id = 0;
+	}
 
-		connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
+	/* The others lost, we don't wait for them. They can't be stopped from
+	 * writing the art, but at least we don't get their replies anymore */
+	for (copy = race->calls; copy; copy = g_list_next (copy)) {
+		FetchCall *fcall = copy->data;
+		dbus_g_proxy_cancel_call (fcall->proxy, fcall->call);
+		fetch_call_free (fcall);
+	}
+	g_list_free (race->calls);
+	race->calls = NULL;
+
+	g_list_foreach (race->proxies, (GFunc) g_object_unref, NULL);
+	g_list_free (race->proxies);
+	race->proxies = NULL;
+
+	g_mutex_lock (&race->mutex);
+	race->won = won;
+	race->done = TRUE;
+	g_cond_signal (&race->cond);
+	g_mutex_unlock (&race->mutex);
+}
 
-		if (!error) {
-			proxy = dbus_g_proxy_new_for_name (connection,
-								  THUMBNAILER_SERVICE,
-								  THUMBNAILER_PATH,
-								  THUMBNAILER_INTERFACE);
-		} else {
-			g_error_free (error);
-		}
+static void
+on_fetch_reply (DBusGProxy *proxy, DBusGProxyCall *call, gpointer user_data)
+{
+	FetchCall *fcall = user_data;
+	FetchRace *race = fcall->race;
+	GError *error = NULL;
+
+	dbus_g_proxy_end_call (proxy, call, &error, G_TYPE_INVALID);
+
+	albumart_manager_record_latency (race->manager, proxy,
+					 g_get_monotonic_time () - fcall->started,
+					 error == NULL);
+
+	race->calls = g_list_remove (race->calls, fcall);
+	fetch_call_free (fcall);
+
+	keep_alive ();
+
+	if (!error) {
+		race_finish (race, TRUE);
+		return;
 	}
 
-	return proxy;
+	g_ptr_array_add (race->errors, g_strdup (error->message));
+	g_error_free (error);
+
+	/* Don't wait for the hedge timeout when we know this one failed */
+	if (!race_launch_next (race) && !race->calls)
+		race_finish (race, FALSE);
+}
+
+static gboolean
+on_hedge_timeout (gpointer user_data)
+{
+	FetchRace *race = user_data;
+
+	race->hedge_id = 0;
+	race_launch_next (race);
+
+	return FALSE;
 }
 
+/* Asks the next provider, and gives it a head start before the one after
+ * that gets asked too. Returns FALSE if all providers have been asked */
+static gboolean
+race_launch_next (FetchRace *race)
+{
+	FetchCall *fcall;
+
+	if (!race->proxies)
+		return FALSE;
+
+	fcall = g_slice_new0 (FetchCall);
+	fcall->race = race;
+	fcall->proxy = race->proxies->data;
+	fcall->started = g_get_monotonic_time ();
+	race->proxies = g_list_delete_link (race->proxies, race->proxies);
+
+	race->calls = g_list_prepend (race->calls, fcall);
+
+	fcall->call = dbus_g_proxy_begin_call_with_timeout (fcall->proxy, "Fetch",
+							    on_fetch_reply, fcall, NULL,
+							    FETCH_TIMEOUT,
+							    G_TYPE_STRING, race->artist,
+							    G_TYPE_STRING, race->album,
+							    G_TYPE_STRING, race->kind,
+							    G_TYPE_INVALID);
+
+	if (race->hedge_id != 0)
+		g_source_remove (race->hedge_id);
+
+	race->hedge_id = 0;
+
+	if (race->proxies)
+		race->hedge_id = g_timeout_add (albumart_manager_get_hedge_delay (race->manager,
+										  fcall->proxy),
+						on_hedge_timeout, race);
+
+	return TRUE;
+}
+
+static gboolean
+race_start (gpointer user_data)
+{
+	FetchRace *race = user_data;
+
+	if (!race_launch_next (race))
+		race_finish (race, FALSE);
+
+	return FALSE;
+}
 
 static gint 
 pool_sort_compare (gconstpointer a, gconstpointer b, gpointer user_data)
@@ -147,7 +303,6 @@ albumart_queue (Albumart *object, gchar *artist_or_title, gchar *album, gchar *k
 {
 	AlbumartPrivate *priv = ALBUMART_GET_PRIVATE (object);
 	WorkTask *task;
-	static guint num = 0;
 
 	if (!kind || strlen (album) == 0)
 		kind = (gchar *) "album";
@@ -159,8 +314,8 @@ albumart_queue (Albumart *object, gchar *artist_or_title, gchar *album, gchar *k
 		album = NULL;
 
 	if (!artist_or_title && !album) {
-		num++;
-		dbus_g_method_return (context, num);
+		queue_num++;
+		dbus_g_method_return (context, queue_num);
 		return;
 	}
 
@@ -169,7 +324,7 @@ albumart_queue (Albumart *object, gchar *artist_or_title, gchar *album, gchar *k
 	keep_alive ();
 
 	task->unqueued = FALSE;
-	task->num = ++num;
+	task->num = ++queue_num;
 	task->object = g_object_ref (object);
 
 	task->album = g_strdup (album);
@@ -182,7 +337,234 @@ albumart_queue (Albumart *object, gchar *artist_or_title, gchar *album, gchar *k
 	g_thread_pool_push (priv->normal_pool, task, NULL);
 	g_mutex_unlock (&priv->mutex);
 
-	dbus_g_method_return (context, num);
+	dbus_g_method_return (context, queue_num);
+}
+
+/* Like Queue but for a lot of albums at once, for example when a music
+ * player scans its library. Keys that end up at the same art file are
+ * fetched only once */
+void
+albumart_queue_many (Albumart *object, GPtrArray *requests, guint handle_to_unqueue, DBusGMethodInvocation *context)
+{
+	AlbumartPrivate *priv = ALBUMART_GET_PRIVATE (object);
+	GHashTable *by_path;
+	GPtrArray *items;
+	WorkTask *task;
+	guint i;
+
+	dbus_async_return_if_fail (requests != NULL, context);
+
+	keep_alive ();
+
+	by_path = g_hash_table_new (g_str_hash, g_str_equal);
+	items = g_ptr_array_new_with_free_func ((GDestroyNotify) art_item_free);
+
+	for (i = 0; i < requests->len; i++) {
+		GValueArray *request = g_ptr_array_index (requests, i);
+		const gchar *artist_or_title, *album, *kind;
+		ArtItem *item;
+		gchar *path;
+
+		if (request->n_values < 3)
+			continue;
+
+		artist_or_title = g_value_get_string (g_value_array_get_nth (request, 0));
+		album = g_value_get_string (g_value_array_get_nth (request, 1));
+		kind = g_value_get_string (g_value_array_get_nth (request, 2));
+
+		/* Same defaults as Queue */
+		if (!kind || !album || strlen (album) == 0)
+			kind = "album";
+
+		if (artist_or_title && strlen (artist_or_title) <= 0)
+			artist_or_title = NULL;
+
+		if (album && strlen (album) <= 0)
+			album = NULL;
+
+		if (!artist_or_title && !album)
+			continue;
+
+		hildon_thumbnail_util_get_albumart_path (artist_or_title, album, kind, &path);
+
+		item = g_hash_table_lookup (by_path, path);
+
+		if (!item) {
+			item = art_item_new (path);
+			g_hash_table_insert (by_path, item->path, item);
+			g_ptr_array_add (items, item);
+		} else {
+			g_free (path);
+		}
+
+		art_item_add_key (item, artist_or_title, album, kind);
+	}
+
+	g_hash_table_unref (by_path);
+
+	if (items->len == 0) {
+		g_ptr_array_unref (items);
+		queue_num++;
+		dbus_g_method_return (context, queue_num);
+		return;
+	}
+
+	task = g_slice_new0 (WorkTask);
+
+	task->unqueued = FALSE;
+	task->num = ++queue_num;
+	task->object = g_object_ref (object);
+	task->items = items;
+	task->next_item = 0;
+
+	g_mutex_lock (&priv->mutex);
+	g_list_foreach (priv->tasks, mark_unqueued, GUINT_TO_POINTER (handle_to_unqueue));
+	priv->tasks = g_list_prepend (priv->tasks, task);
+	g_thread_pool_push (priv->normal_pool, task, NULL);
+	g_mutex_unlock (&priv->mutex);
+
+	dbus_g_method_return (context, queue_num);
+}
+
+/* Races the providers for one piece of art. Returns TRUE if one of them
+ * fetched it, the messages of the ones that failed are added to errors */
+static gboolean
+fetch_art (AlbumartPrivate *priv, gchar *artist, gchar *album, gchar *kind, GPtrArray *errors)
+{
+	FetchRace *race;
+	gboolean won;
+
+	race = g_slice_new0 (FetchRace);
+	race->manager = priv->manager;
+	race->artist = artist;
+	race->album = album;
+	race->kind = kind;
+	race->proxies = albumart_manager_get_handlers (priv->manager);
+	race->errors = errors;
+	g_mutex_init (&race->mutex);
+	g_cond_init (&race->cond);
+
+	keep_alive ();
+
+	g_idle_add (race_start, race);
+
+	g_mutex_lock (&race->mutex);
+	while (!race->done)
+		g_cond_wait (&race->cond, &race->mutex);
+	g_mutex_unlock (&race->mutex);
+
+	keep_alive ();
+
+	won = race->won;
+
+	g_mutex_clear (&race->mutex);
+	g_cond_clear (&race->cond);
+	g_slice_free (FetchRace, race);
+
+	return won;
+}
+
+static void
+flush_batch (WorkTask *task, GPtrArray *ready, GPtrArray *failed, GPtrArray *uris)
+{
+	AlbumartPrivate *priv = ALBUMART_GET_PRIVATE (task->object);
+
+	if (uris->len > 0 && priv->thumbnailer) {
+		GPtrArray *mimes = g_ptr_array_new ();
+		guint i;
+
+		for (i = 0; i < uris->len; i++)
+			g_ptr_array_add (mimes, (gpointer) "image/jpeg");
+		g_ptr_array_add (mimes, NULL);
+		g_ptr_array_add (uris, NULL);
+
+		/* A library scan, this can wait for the art of what's shown */
+		thumbnailer_enqueue (priv->thumbnailer, (GStrv) uris->pdata,
+				     (GStrv) mimes->pdata,
+				     THUMBNAILER_PRIORITY_NORMAL);
+
+		g_ptr_array_free (mimes, TRUE);
+	}
+
+	if (ready->len > 0)
+		g_signal_emit (task->object, signals[READY_MANY_SIGNAL],
+			       0, task->num, ready);
+
+	if (failed->len > 0)
+		g_signal_emit (task->object, signals[ERROR_MANY_SIGNAL],
+			       0, task->num, failed);
+
+	g_ptr_array_set_size (uris, 0);
+	g_ptr_array_set_size (ready, 0);
+	g_ptr_array_set_size (failed, 0);
+}
+
+/* Does the next BATCH_SIZE items of a QueueMany. Returns FALSE when the
+ * task isn't done yet and has been put back in the pool */
+static gboolean
+do_the_many_work (WorkTask *task)
+{
+	AlbumartPrivate *priv = ALBUMART_GET_PRIVATE (task->object);
+	GPtrArray *ready, *failed, *uris;
+	guint last;
+	gboolean done;
+
+	ready = g_ptr_array_new_with_free_func ((GDestroyNotify) g_value_array_free);
+	failed = g_ptr_array_new_with_free_func ((GDestroyNotify) g_value_array_free);
+	uris = g_ptr_array_new_with_free_func (g_free);
+
+	last = MIN (task->next_item + BATCH_SIZE, task->items->len);
+
+	for (; task->next_item < last; task->next_item++) {
+		ArtItem *item = g_ptr_array_index (task->items, task->next_item);
+		ArtKey *first = item->keys->data;
+		GPtrArray *errors;
+		gboolean unqueued;
+
+		g_mutex_lock (&priv->mutex);
+		unqueued = task->unqueued;
+		g_mutex_unlock (&priv->mutex);
+
+		if (unqueued)
+			break;
+
+		if (art_item_take_present (item, ready))
+			continue;
+
+		errors = g_ptr_array_new_with_free_func (g_free);
+
+		if (fetch_art (priv, first->artist, first->album, first->kind, errors)) {
+			art_item_add_entries (item, ready, item->path);
+			g_ptr_array_add (uris, g_filename_to_uri (item->path, NULL, NULL));
+		} else {
+			const gchar *message = errors->len > 0 ?
+				g_ptr_array_index (errors, errors->len - 1) :
+				"No album art provider has this art";
+
+			art_item_add_entries (item, failed, message);
+		}
+
+		g_ptr_array_unref (errors);
+	}
+
+	flush_batch (task, ready, failed, uris);
+
+	g_ptr_array_unref (ready);
+	g_ptr_array_unref (failed);
+	g_ptr_array_unref (uris);
+
+	g_mutex_lock (&priv->mutex);
+	done = task->unqueued || task->next_item >= task->items->len;
+
+	/* Requests that came in meanwhile (like the one for the album that
+	 * is now playing) get to go first, the pool being a LIFO */
+	if (!done) {
+		priv->tasks = g_list_prepend (priv->tasks, task);
+		g_thread_pool_push (priv->normal_pool, task, NULL);
+	}
+	g_mutex_unlock (&priv->mutex);
+
+	return done;
 }
 
 /* This is the threadpool's function. This means that everything we do is 
@@ -192,7 +574,12 @@ albumart_queue (Albumart *object, gchar *artist_or_title, gchar *album, gchar *k
  * Thanks to the pool_sort_compare sorter is this pool a LIFO, which means that
  * new requests get a certain priority over older requests. Note that we are not
  * canceling currently running requests. Also note that the thread count of the 
- * pool is set to one. We could increase this number to add some parallelism */
+ * pool is set to one. We could increase this number to add some parallelism.
+ *
+ * The providers are raced in the mainloop: the fastest one (going by earlier
+ * requests) is asked first, and each next one is asked as well when the
+ * previous one fails or takes longer than it usually does. The first one
+ * that succeeds wins */
 
 static void 
 do_the_work (WorkTask *task, gpointer user_data)
@@ -203,8 +590,10 @@ do_the_work (WorkTask *task, gpointer user_data)
 	gchar *kind = task->kind;
 	gchar *path;
 
-	g_signal_emit (task->object, signals[STARTED_SIGNAL], 0,
-			task->num);
+	/* A QueueMany that was put back in the pool already got its Started */
+	if (!task->items || task->next_item == 0)
+		g_signal_emit (task->object, signals[STARTED_SIGNAL], 0,
+			       task->num);
 
 	g_mutex_lock (&priv->mutex);
 	priv->tasks = g_list_remove (priv->tasks, task);
@@ -214,63 +603,45 @@ do_the_work (WorkTask *task, gpointer user_data)
 	}
 	g_mutex_unlock (&priv->mutex);
 
+	if (task->items) {
+		if (!do_the_many_work (task))
+			return;
+		goto unqueued;
+	}
+
 	hildon_thumbnail_util_get_albumart_path (artist, album, kind, &path);
 
 	if (!g_file_test (path, G_FILE_TEST_EXISTS)) {
-		GList *proxies, *copy;
-		gboolean handled = FALSE;
-
-		proxies = albumart_manager_get_handlers (priv->manager);
-		copy = proxies;
-
-		while (copy && !handled) {
-			DBusGProxy *proxy = copy->data;
-			GError *error = NULL;
-
-			keep_alive ();
-
-			dbus_g_proxy_call (proxy, "Fetch", &error, 
-					   G_TYPE_STRING, artist,
-					   G_TYPE_STRING, album,
-					   G_TYPE_STRING, kind,
-					   G_TYPE_INVALID, 
-					   G_TYPE_INVALID);
-
-			keep_alive ();
-
-			if (error) {
-				g_signal_emit (task->object, signals[ERROR_SIGNAL],
-					       0, task->num, 1, error->message);
-				g_clear_error (&error);
-			} else {
-				gchar **uris = (gchar **) g_malloc0 (sizeof (gchar*) * 2);
-				const gchar *mimes[2] = { "image/jpeg", NULL };
-
-				uris[0] = g_filename_to_uri (path, NULL, NULL);
-				uris[1] = NULL;
-				
-				dbus_g_proxy_call_no_reply (get_thumber (),
-							    "Queue",
-							    G_TYPE_STRV, uris,
-							    G_TYPE_STRV, mimes,
-							    G_TYPE_UINT, 0,
-							    G_TYPE_INVALID,
-							    G_TYPE_INVALID);
+		GPtrArray *errors;
+		guint i;
 
-				g_signal_emit (task->object, signals[READY_SIGNAL], 
-				       0, artist, album, kind, path);
+		errors = g_ptr_array_new_with_free_func (g_free);
 
-				g_strfreev (uris);
-				handled = TRUE;
-			}
+		if (fetch_art (priv, artist, album, kind, errors)) {
+			gchar **uris = (gchar **) g_malloc0 (sizeof (gchar*) * 2);
+			const gchar *mimes[2] = { "image/jpeg", NULL };
 
-			copy = g_list_next (copy);
+			uris[0] = g_filename_to_uri (path, NULL, NULL);
+			uris[1] = NULL;
 
-			g_object_unref (proxy);
+			/* Art is asked for when it's about to be shown, so its
+			 * thumbnail goes before the ones of a file scan */
+			if (priv->thumbnailer)
+				thumbnailer_enqueue (priv->thumbnailer, uris,
+						     (GStrv) mimes,
+						     THUMBNAILER_PRIORITY_HIGH);
+
+			g_signal_emit (task->object, signals[READY_SIGNAL], 
+			       0, artist, album, kind, path);
+
+			g_strfreev (uris);
 		}
 
-		if (proxies)
-			g_list_free (proxies);
+		for (i = 0; i < errors->len; i++)
+			g_signal_emit (task->object, signals[ERROR_SIGNAL],
+				       0, task->num, 1, g_ptr_array_index (errors, i));
+
+		g_ptr_array_unref (errors);
 	}
 
 	g_free (path);
@@ -284,6 +655,8 @@ unqueued:
 	g_free (task->artist);
 	g_free (task->album);
 	g_free (task->kind);
+	if (task->items)
+		g_ptr_array_unref (task->items);
 	g_slice_free (WorkTask, task);
 
 	return;
@@ -313,6 +686,8 @@ albumart_finalize (GObject *object)
 
 	g_thread_pool_free (priv->normal_pool, TRUE, TRUE);
 	g_object_unref (priv->manager);
+	if (priv->thumbnailer)
+		g_object_unref (priv->thumbnailer);
 
 	G_OBJECT_CLASS (albumart_parent_class)->finalize (object);
 }
@@ -326,6 +701,15 @@ albumart_set_manager (Albumart *object, AlbumartManager *manager)
 	priv->manager = g_object_ref (manager);
 }
 
+static void 
+albumart_set_thumbnailer (Albumart *object, Thumbnailer *thumbnailer)
+{
+	AlbumartPrivate *priv = ALBUMART_GET_PRIVATE (object);
+	if (priv->thumbnailer)
+		g_object_unref (priv->thumbnailer);
+	priv->thumbnailer = thumbnailer ? g_object_ref (thumbnailer) : NULL;
+}
+
 static void
 albumart_set_property (GObject      *object,
 		      guint         prop_id,
@@ -337,6 +721,10 @@ albumart_set_property (GObject      *object,
 		albumart_set_manager (ALBUMART (object),
 				      g_value_get_object (value));
 		break;
+	case PROP_THUMBNAILER:
+		albumart_set_thumbnailer (ALBUMART (object),
+					  g_value_get_object (value));
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	}
@@ -357,6 +745,9 @@ albumart_get_property (GObject    *object,
 	case PROP_MANAGER:
 		g_value_set_object (value, priv->manager);
 		break;
+	case PROP_THUMBNAILER:
+		g_value_set_object (value, priv->thumbnailer);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	}
@@ -380,6 +771,15 @@ albumart_class_init (AlbumartClass *klass)
 							      G_PARAM_READWRITE |
 							      G_PARAM_CONSTRUCT));
 
+	g_object_class_install_property (object_class,
+					 PROP_THUMBNAILER,
+					 g_param_spec_object ("thumbnailer",
+							      "Thumbnailer",
+							      "Thumbnailer that makes the thumbnails of fetched art",
+							      TYPE_THUMBNAILER,
+							      G_PARAM_READWRITE |
+							      G_PARAM_CONSTRUCT));
+
 	signals[READY_SIGNAL] =
 		g_signal_new ("ready",
 			      G_OBJECT_CLASS_TYPE (object_class),
@@ -428,6 +828,30 @@ albumart_class_init (AlbumartClass *klass)
 			      G_TYPE_UINT,
 			      G_TYPE_INT,
 			      G_TYPE_STRING);
+
+	signals[READY_MANY_SIGNAL] =
+		g_signal_new ("ready-many",
+			      G_OBJECT_CLASS_TYPE (object_class),
+			      G_SIGNAL_RUN_LAST,
+			      0,
+			      NULL, NULL,
+			      albumart_marshal_VOID__UINT_BOXED,
+			      G_TYPE_NONE,
+			      2,
+			      G_TYPE_UINT,
+			      BATCH_ENTRIES_TYPE);
+
+	signals[ERROR_MANY_SIGNAL] =
+		g_signal_new ("error-many",
+			      G_OBJECT_CLASS_TYPE (object_class),
+			      G_SIGNAL_RUN_LAST,
+			      0,
+			      NULL, NULL,
+			      albumart_marshal_VOID__UINT_BOXED,
+			      G_TYPE_NONE,
+			      2,
+			      G_TYPE_UINT,
+			      BATCH_ENTRIES_TYPE);
 }
 
 static void
@@ -456,7 +880,7 @@ albumart_do_stop (void)
 
 
 void 
-albumart_do_init (DBusGConnection *connection, AlbumartManager *manager, Albumart **albumart, GError **error)
+albumart_do_init (DBusGConnection *connection, AlbumartManager *manager, Thumbnailer *thumbnailer, Albumart **albumart, GError **error)
 {
 	guint result;
 	DBusGProxy *proxy;
@@ -475,6 +899,7 @@ albumart_do_init (DBusGConnection *connection, AlbumartManager *manager, Albumar
 
 	object = g_object_new (TYPE_ALBUMART, 
 			       "manager", manager,
+			       "thumbnailer", thumbnailer,
 			       NULL);
 
 	dbus_g_object_type_install_info (G_OBJECT_TYPE (object), 
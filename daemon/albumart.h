@@ -30,6 +30,7 @@
 #include <gmodule.h>
 
 #include "albumart-manager.h"
+#include "thumbnailer.h"
 
 #define ALBUMART_SERVICE         "com.nokia.albumart"
 #define ALBUMART_PATH            "/com/nokia/albumart/Requester"
@@ -60,10 +61,11 @@ struct AlbumartClass {
 GType albumart_get_type (void);
 
 void albumart_queue (Albumart *object, gchar *artist_or_title, gchar *album, gchar *kind, guint handle_to_unqueue, DBusGMethodInvocation *context);
+void albumart_queue_many (Albumart *object, GPtrArray *requests, guint handle_to_unqueue, DBusGMethodInvocation *context);
 void albumart_unqueue (Albumart *object, guint handle, DBusGMethodInvocation *context);
 void albumart_delete (Albumart *object, gchar *artist_or_title, gchar *album, gchar *kind, DBusGMethodInvocation *context);
 
 void albumart_do_stop (void);
-void albumart_do_init (DBusGConnection *connection, AlbumartManager *manager, Albumart **albumart, GError **error);
+void albumart_do_init (DBusGConnection *connection, AlbumartManager *manager, Thumbnailer *thumbnailer, Albumart **albumart, GError **error);
 
 #endif
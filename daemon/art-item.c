@@ -0,0 +1,106 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "art-item.h"
+
+/* Takes path */
+ArtItem *
+art_item_new (gchar *path)
+{
+	ArtItem *item = g_slice_new0 (ArtItem);
+
+	item->path = path;
+
+	return item;
+}
+
+static void
+art_key_free (ArtKey *key)
+{
+	g_free (key->artist);
+	g_free (key->album);
+	g_free (key->kind);
+	g_slice_free (ArtKey, key);
+}
+
+void
+art_item_free (ArtItem *item)
+{
+	g_list_foreach (item->keys, (GFunc) art_key_free, NULL);
+	g_list_free (item->keys);
+	g_free (item->path);
+	g_slice_free (ArtItem, item);
+}
+
+void
+art_item_add_key (ArtItem *item, const gchar *artist, const gchar *album, const gchar *kind)
+{
+	ArtKey *key = g_slice_new0 (ArtKey);
+
+	key->artist = g_strdup (artist);
+	key->album = g_strdup (album);
+	key->kind = g_strdup (kind);
+	item->keys = g_list_append (item->keys, key);
+}
+
+void
+art_item_add_entries (ArtItem *item, GPtrArray *entries, const gchar *last)
+{
+	GList *copy;
+
+	for (copy = item->keys; copy; copy = g_list_next (copy)) {
+		ArtKey *key = copy->data;
+		GValueArray *entry = g_value_array_new (4);
+		const gchar *strs[4] = { key->artist, key->album, key->kind, last };
+		guint i;
+
+		for (i = 0; i < 4; i++) {
+			GValue value = { 0, };
+
+			g_value_init (&value, G_TYPE_STRING);
+			g_value_set_string (&value, strs[i] ? strs[i] : "");
+			g_value_array_append (entry, &value);
+			g_value_unset (&value);
+		}
+
+		g_ptr_array_add (entries, entry);
+	}
+}
+
+/* Art that is there already needs no fetch, but the caller still gets
+ * to hear about it, like for the ones that we did fetch */
+gboolean
+art_item_take_present (ArtItem *item, GPtrArray *ready)
+{
+	if (!g_file_test (item->path, G_FILE_TEST_EXISTS))
+		return FALSE;
+
+	art_item_add_entries (item, ready, item->path);
+
+	return TRUE;
+}
@@ -0,0 +1,61 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __ART_ITEM_H__
+#define __ART_ITEM_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/* One piece of art of a QueueMany, with all the keys that resolve to it.
+ * The ReadyMany and ErrorMany signals get an (artist, album, kind, last)
+ * entry per key, last being the art's path or the error message */
+
+typedef struct {
+	gchar *artist, *album, *kind;
+} ArtKey;
+
+typedef struct {
+	gchar *path;
+	GList *keys;
+} ArtItem;
+
+ArtItem  *art_item_new          (gchar *path);
+void      art_item_free         (ArtItem *item);
+void      art_item_add_key      (ArtItem *item,
+				 const gchar *artist,
+				 const gchar *album,
+				 const gchar *kind);
+void      art_item_add_entries  (ArtItem *item,
+				 GPtrArray *entries,
+				 const gchar *last);
+gboolean  art_item_take_present (ArtItem *item,
+				 GPtrArray *ready);
+
+G_END_DECLS
+
+#endif
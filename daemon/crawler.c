@@ -0,0 +1,389 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "crawler.h"
+
+#define CRAWLER_GROUP		"Crawler"
+
+/* Seconds after we started before the crawl begins, the request that
+ * activated us goes first */
+#define START_DELAY		60
+
+/* Items per background task */
+#define BATCH_SIZE		16
+
+/* Seconds between two looks at the pressure while it's too high */
+#define PRESSURE_POLL		5
+
+void initialize_idle_priority (void);
+
+typedef struct {
+	GStrv directories;
+	guint64 bytes_per_second;	/* Of source files to thumbnail */
+	gdouble max_pressure;		/* The avg10 of "some", in percent */
+	guint quiet_seconds;		/* Pause after a client queued work */
+} CrawlerConfig;
+
+static CrawlerConfig config;
+static Thumbnailer *thumbnailer = NULL;
+static GMutex mutex;
+static GCond cond;
+static GThread *thread = NULL;
+static gboolean stopping = FALSE;
+static gint64 last_activity = 0;
+static gint64 budget_until = 0;
+
+/* Directories=/home/user/MyDocs/DCIM;/home/user/MyDocs/Pictures in the
+ * [Crawler] group of crawler.conf turns the crawler on, there are no
+ * default directories */
+static gboolean
+load_config (void)
+{
+	gchar *path = g_build_filename (g_get_user_config_dir (), "hildon-thumbnailer", "crawler.conf", NULL);
+	GKeyFile *keyfile = g_key_file_new ();
+	GError *error = NULL;
+	gint value;
+	gdouble dvalue;
+
+	config.bytes_per_second = 4 * 1024 * 1024;
+	config.max_pressure = 10.0;
+	config.quiet_seconds = 30;
+
+	if (g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, NULL)) {
+		config.directories = g_key_file_get_string_list (keyfile, CRAWLER_GROUP,
+								 "Directories", NULL, NULL);
+
+		value = g_key_file_get_integer (keyfile, CRAWLER_GROUP, "BytesPerSecond", &error);
+		if (!error && value > 0)
+			config.bytes_per_second = value;
+		g_clear_error (&error);
+
+		dvalue = g_key_file_get_double (keyfile, CRAWLER_GROUP, "MaxPressure", &error);
+		if (!error && dvalue > 0)
+			config.max_pressure = dvalue;
+		g_clear_error (&error);
+
+		value = g_key_file_get_integer (keyfile, CRAWLER_GROUP, "QuietSeconds", &error);
+		if (!error && value >= 0)
+			config.quiet_seconds = value;
+		g_clear_error (&error);
+	}
+
+	g_key_file_free (keyfile);
+	g_free (path);
+
+	return config.directories && config.directories[0];
+}
+
+/* Sleeps until the monotonic time until, returns FALSE when we're being
+ * stopped */
+static gboolean
+sleep_until (gint64 until)
+{
+	gboolean retval;
+
+	g_mutex_lock (&mutex);
+	while (!stopping && g_get_monotonic_time () < until)
+		g_cond_wait_until (&cond, &mutex, until);
+	retval = !stopping;
+	g_mutex_unlock (&mutex);
+
+	return retval;
+}
+
+/* The avg10 of the "some" line of a /proc/pressure file, or 0 when the
+ * kernel doesn't have them */
+static gdouble
+read_pressure (const gchar *path)
+{
+	gchar *contents = NULL;
+	gdouble pressure = 0;
+	gchar *avg;
+
+	if (!g_file_get_contents (path, &contents, NULL, NULL))
+		return 0;
+
+	if (g_str_has_prefix (contents, "some ") &&
+	    (avg = strstr (contents, "avg10=")) != NULL)
+		pressure = g_ascii_strtod (avg + strlen ("avg10="), NULL);
+
+	g_free (contents);
+
+	return pressure;
+}
+
+/* Holds the crawl back for as long as the governor wants, then charges
+ * bytes to the I/O budget. Returns FALSE when we're being stopped */
+static gboolean
+govern (guint64 bytes)
+{
+	for (;;) {
+		gint64 now = g_get_monotonic_time ();
+		gint64 quiet_until = 0;
+
+		g_mutex_lock (&mutex);
+		if (last_activity)
+			quiet_until = last_activity + config.quiet_seconds * G_TIME_SPAN_SECOND;
+		g_mutex_unlock (&mutex);
+
+		/* Clients first */
+		if (now < quiet_until) {
+			if (!sleep_until (quiet_until))
+				return FALSE;
+			continue;
+		}
+
+		if (thumbnailer_get_background_backlog (thumbnailer) > 0 ||
+		    read_pressure ("/proc/pressure/cpu") > config.max_pressure ||
+		    read_pressure ("/proc/pressure/io") > config.max_pressure) {
+			if (!sleep_until (now + PRESSURE_POLL * G_TIME_SPAN_SECOND))
+				return FALSE;
+			continue;
+		}
+
+		break;
+	}
+
+	/* Paced, a quiet stretch doesn't save up for a burst later */
+	budget_until = MAX (budget_until, g_get_monotonic_time ()) +
+		bytes * G_TIME_SPAN_SECOND / config.bytes_per_second;
+
+	return sleep_until (budget_until);
+}
+
+static gboolean
+has_thumbnail (const gchar *uri)
+{
+	gchar *large = NULL, *normal = NULL, *cropped = NULL;
+	gboolean found = FALSE;
+	guint y;
+
+	for (y = 0; y < 2 && !found; y++) {
+		hildon_thumbnail_util_get_thumb_paths (uri, &large, &normal,
+						       &cropped, NULL, NULL, NULL,
+						       (y == 0));
+
+		found = g_file_test (normal, G_FILE_TEST_EXISTS);
+
+		g_free (large);
+		g_free (normal);
+		g_free (cropped);
+	}
+
+	return found;
+}
+
+static gboolean
+flush_batch (GPtrArray *uris, GPtrArray *mime_types, guint64 bytes)
+{
+	gboolean retval;
+
+	if (uris->len == 0)
+		return TRUE;
+
+	retval = govern (bytes);
+
+	if (retval) {
+		g_ptr_array_add (uris, NULL);
+		g_ptr_array_add (mime_types, NULL);
+		thumbnailer_enqueue (thumbnailer, (GStrv) uris->pdata,
+				     (GStrv) mime_types->pdata,
+				     THUMBNAILER_PRIORITY_BACKGROUND);
+	}
+
+	g_ptr_array_set_size (uris, 0);
+	g_ptr_array_set_size (mime_types, 0);
+
+	return retval;
+}
+
+/* Queues the files of path that need thumbnails and adds its
+ * subdirectories to dirs. Returns FALSE when we're being stopped */
+static gboolean
+crawl_directory (const gchar *path, GQueue *dirs)
+{
+	GPtrArray *uris = g_ptr_array_new_with_free_func (g_free);
+	GPtrArray *mime_types = g_ptr_array_new_with_free_func (g_free);
+	guint64 bytes = 0;
+	gboolean retval = TRUE;
+	const gchar *name;
+	GDir *dir;
+
+	dir = g_dir_open (path, 0, NULL);
+
+	if (!dir)
+		goto out;
+
+	hildon_thumbnail_trace_begin ("crawl", path, NULL);
+
+	while (retval && (name = g_dir_read_name (dir)) != NULL) {
+		gchar *child, *uri, *mime_type;
+		GStatBuf st;
+
+		/* Also keeps us out of .thumblocal and friends */
+		if (name[0] == '.')
+			continue;
+
+		child = g_build_filename (path, name, NULL);
+
+		/* No following of links, that can loop */
+		if (g_lstat (child, &st) != 0) {
+			g_free (child);
+			continue;
+		}
+
+		if (S_ISDIR (st.st_mode)) {
+			g_queue_push_tail (dirs, child);
+			continue;
+		}
+
+		if (!S_ISREG (st.st_mode)) {
+			g_free (child);
+			continue;
+		}
+
+		/* By name only, reading every file would be the I/O that we
+		 * are trying to keep low */
+		mime_type = g_content_type_guess (name, NULL, 0, NULL);
+		uri = g_filename_to_uri (child, NULL, NULL);
+
+		if (uri && thumbnailer_handles (thumbnailer, "file", mime_type) &&
+		    !has_thumbnail (uri)) {
+			g_ptr_array_add (uris, uri);
+			g_ptr_array_add (mime_types, mime_type);
+			bytes += st.st_size;
+			uri = NULL;
+			mime_type = NULL;
+
+			if (uris->len >= BATCH_SIZE) {
+				retval = flush_batch (uris, mime_types, bytes);
+				bytes = 0;
+			}
+		}
+
+		g_free (uri);
+		g_free (mime_type);
+		g_free (child);
+	}
+
+	if (retval)
+		retval = flush_batch (uris, mime_types, bytes);
+
+	hildon_thumbnail_trace_end ("crawl", path, NULL);
+
+	g_dir_close (dir);
+
+out:
+	g_ptr_array_unref (uris);
+	g_ptr_array_unref (mime_types);
+
+	return retval;
+}
+
+/* Breadth first, the top of each tree is what gets opened first */
+static gpointer
+crawler_thread (gpointer user_data)
+{
+	GQueue dirs = G_QUEUE_INIT;
+	gboolean running;
+	guint i;
+
+	initialize_idle_priority ();
+
+	running = sleep_until (g_get_monotonic_time () + START_DELAY * G_TIME_SPAN_SECOND);
+
+	for (i = 0; config.directories[i] != NULL; i++) {
+		gchar *path = g_str_has_prefix (config.directories[i], "file://") ?
+			g_filename_from_uri (config.directories[i], NULL, NULL) :
+			g_strdup (config.directories[i]);
+
+		if (path)
+			g_queue_push_tail (&dirs, path);
+	}
+
+	while (running && !g_queue_is_empty (&dirs)) {
+		gchar *path = g_queue_pop_head (&dirs);
+
+		running = crawl_directory (path, &dirs);
+		g_free (path);
+	}
+
+	g_queue_foreach (&dirs, (GFunc) g_free, NULL);
+	g_queue_clear (&dirs);
+
+	return NULL;
+}
+
+/* Called for every task that a client queued */
+void
+crawler_notify_activity (void)
+{
+	g_mutex_lock (&mutex);
+	last_activity = g_get_monotonic_time ();
+	g_mutex_unlock (&mutex);
+}
+
+/* Call once the plugins are registered */
+void
+crawler_init (Thumbnailer *object)
+{
+	if (!load_config ())
+		return;
+
+	thumbnailer = g_object_ref (object);
+	thread = g_thread_new ("crawler", crawler_thread, NULL);
+}
+
+void
+crawler_shutdown (void)
+{
+	g_mutex_lock (&mutex);
+	stopping = TRUE;
+	g_cond_signal (&cond);
+	g_mutex_unlock (&mutex);
+
+	if (thread)
+		g_thread_join (thread);
+	thread = NULL;
+
+	if (thumbnailer)
+		g_object_unref (thumbnailer);
+	thumbnailer = NULL;
+
+	g_strfreev (config.directories);
+	config.directories = NULL;
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __CRAWLER_H__
+#define __CRAWLER_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+
+#include "thumbnailer.h"
+
+G_BEGIN_DECLS
+
+/* Walks the directories of crawler.conf at idle priority and queues what
+ * doesn't have thumbnails yet, so that opening a big folder for the first
+ * time doesn't have to wait for them. It holds back while clients queue
+ * work, while the system is under pressure and beyond its I/O budget */
+
+void crawler_init            (Thumbnailer *thumbnailer);
+void crawler_shutdown        (void);
+void crawler_notify_activity (void);
+
+G_END_DECLS
+
+#endif
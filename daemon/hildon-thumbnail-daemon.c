@@ -48,9 +48,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/resource.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <dbus/dbus-glib-bindings.h>
 #include <gio/gio.h>
 
@@ -61,6 +63,17 @@
 #include "thumbnail-manager.h"
 #include "albumart-manager.h"
 #include "thumb-hal.h"
+#include "trace.h"
+#include "plugin-farm.h"
+#include "memory-budget.h"
+#include "write-back.h"
+#include "uri-index.h"
+#include "crawler.h"
+#include "page-cache.h"
+#include "state-snapshot.h"
+
+/* How often, in seconds, the state snapshot gets written while we run */
+#define SNAPSHOT_INTERVAL	300
 
 /* Maximum here is a G_MAXLONG, so if you want to use > 2GB, you have
  * to set MEM_LIMIT to RLIM_INFINITY
@@ -142,6 +155,7 @@ enum {
 #define IOPRIO_CLASS_SHIFT 13
 
 void initialize_priority (void);
+void initialize_idle_priority (void);
 
 
 static inline int
@@ -150,10 +164,11 @@ ioprio_set (int which, int who, int ioprio_val)
 	return syscall (__NR_ioprio_set, which, who, ioprio_val);
 }
 
+/* Only for the calling thread, on Linux the nice value, the I/O priority
+ * and the scheduling policy are all per thread */
 void
-initialize_priority (void)
+initialize_idle_priority (void)
 {
-#if 0
 	struct sched_param sp;
 	int ioprio, ioclass;
 
@@ -173,6 +188,13 @@ initialize_priority (void)
 		}
 	 }
 #endif
+}
+
+void
+initialize_priority (void)
+{
+#if 0
+	initialize_idle_priority ();
 #endif
 }
 
@@ -300,6 +322,124 @@ shut_down_after_timeout (gpointer user_data)
 }
 
 
+/* The registrations that the plugins did at their init are remembered in a
+ * cache. When neither the module nor the config changed since, we register
+ * from the cache and the plugin's init waits until its first create. That
+ * keeps loading the plugins' configs, monitors and libraries out of the
+ * way of the request that activated us */
+
+#define PLUGIN_CACHE_GROUP	"Registrations"
+
+typedef struct {
+	Thumbnailer *thumbnailer;
+	GPtrArray *entries;
+} PluginRecorder;
+
+static void
+record_registration (gpointer self, const gchar *mime_type, GModule *module, const GStrv uri_schemes, gint priority)
+{
+	PluginRecorder *recorder = self;
+	guint i;
+
+	for (i = 0; uri_schemes[i] != NULL; i++)
+		g_ptr_array_add (recorder->entries,
+				 g_strdup_printf ("%d %s %s", priority,
+						  uri_schemes[i], mime_type));
+
+	thumbnailer_register_plugin (recorder->thumbnailer, mime_type, module,
+				     uri_schemes, priority);
+}
+
+static gboolean
+register_cached (Thumbnailer *thumbnailer, GModule *module, GStrv entries)
+{
+	guint i;
+
+	for (i = 0; entries[i] != NULL; i++) {
+		gchar **parts = g_strsplit (entries[i], " ", 3);
+		gchar *uri_schemes[2] = { NULL, NULL };
+
+		if (g_strv_length (parts) != 3) {
+			g_strfreev (parts);
+			return FALSE;
+		}
+
+		uri_schemes[0] = parts[1];
+		thumbnailer_register_plugin (thumbnailer, parts[2], module,
+					     uri_schemes, atoi (parts[0]));
+		g_strfreev (parts);
+	}
+
+	return TRUE;
+}
+
+#ifndef GDK_PIXBUF_CACHE_FILE
+#define GDK_PIXBUF_CACHE_FILE ""
+#endif
+
+/* The gdkpixbuf plugin registers for whatever the installed loaders can
+ * read, a loader that comes or goes changes gdk-pixbuf's loaders.cache */
+static guint64
+get_loaders_stamp (void)
+{
+	const gchar *path = g_getenv ("GDK_PIXBUF_MODULE_FILE");
+	GStatBuf st;
+
+	if (!path || !*path)
+		path = GDK_PIXBUF_CACHE_FILE;
+
+	if (!*path || g_stat (path, &st) != 0)
+		return 0;
+
+	return (guint64) st.st_mtime;
+}
+
+/* Plugins read their config at init, so a change in any of those must make
+ * the cached registrations invalid too. So must a change in what they
+ * register for without a config of ours, the pixbuf loaders */
+static gchar *
+get_config_stamp (void)
+{
+	gchar *path = g_build_filename (g_get_user_config_dir (), "hildon-thumbnailer", NULL);
+	GDir *dir = g_dir_open (path, 0, NULL);
+	guint64 newest = 0;
+	guint count = 0;
+
+	if (dir) {
+		const gchar *name;
+
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			gchar *full = g_build_filename (path, name, NULL);
+			GStatBuf st;
+
+			if (g_stat (full, &st) == 0) {
+				newest = MAX (newest, (guint64) st.st_mtime);
+				count++;
+			}
+			g_free (full);
+		}
+		g_dir_close (dir);
+	}
+
+	g_free (path);
+
+	return g_strdup_printf ("%" G_GUINT64_FORMAT ".%u.%" G_GUINT64_FORMAT,
+				newest, count, get_loaders_stamp ());
+}
+
+static gchar *
+get_plugin_stamp (const gchar *full, const gchar *config_stamp)
+{
+	GStatBuf st;
+
+	if (g_stat (full, &st) != 0)
+		return NULL;
+
+	return g_strdup_printf ("%" G_GUINT64_FORMAT ".%" G_GUINT64_FORMAT ".%s",
+				(guint64) st.st_mtime, (guint64) st.st_size,
+				config_stamp);
+}
+
 static GHashTable*
 init_plugins (DBusGConnection *connection, Thumbnailer *thumbnailer)
 {
@@ -308,34 +448,77 @@ init_plugins (DBusGConnection *connection, Thumbnailer *thumbnailer)
 	GError *error = NULL;
 	GDir *dir;
 	const gchar *plugin;
+	GKeyFile *cache;
+	gchar *cache_path, *config_stamp;
+	gboolean cache_dirty = FALSE;
 
 	regs = g_hash_table_new_full (g_str_hash, g_str_equal,
 				      (GDestroyNotify) g_free, 
 				      (GDestroyNotify) NULL);
 
+	cache_path = g_build_filename (g_get_user_cache_dir (), "hildon-thumbnailer",
+				       "plugins.cache", NULL);
+	cache = g_key_file_new ();
+	g_key_file_load_from_file (cache, cache_path, G_KEY_FILE_NONE, NULL);
+	config_stamp = get_config_stamp ();
+
 	dir = g_dir_open (PLUGINS_DIR, 0, &error);
 
 	if (dir) {
 	  while ((plugin = g_dir_read_name (dir)) != NULL) {
 		gboolean cropping;
-		gchar *full;
+		gchar *full, *stamp, *cached_stamp = NULL;
+		GStrv cached = NULL;
 
 		if (!g_str_has_suffix (plugin, "." G_MODULE_SUFFIX)) {
 			continue;
 		}
 
 		full = g_build_filename (PLUGINS_DIR, plugin, NULL);
+		stamp = get_plugin_stamp (full, config_stamp);
+
+		if (stamp)
+			cached_stamp = g_key_file_get_string (cache, full, "Stamp", NULL);
+		if (cached_stamp && strcmp (stamp, cached_stamp) == 0)
+			cached = g_key_file_get_string_list (cache, full, PLUGIN_CACHE_GROUP, NULL, NULL);
 
 		module = hildon_thumbnail_plugin_load (full);
-		if (module)
+
+		if (module && cached && register_cached (thumbnailer, module, cached)) {
+			hildon_thumbnail_plugin_defer_init (module,
+							    (hildon_thumbnail_register_func) thumbnailer_register_plugin,
+							    thumbnailer);
+		} else if (module) {
+			PluginRecorder recorder;
+
+			recorder.thumbnailer = thumbnailer;
+			recorder.entries = g_ptr_array_new_with_free_func (g_free);
+
 			hildon_thumbnail_plugin_do_init (module, &cropping,
-							 (hildon_thumbnail_register_func) thumbnailer_register_plugin,
-							 thumbnailer,
+							 record_registration,
+							 &recorder,
 							 &error);
+
+			if (!error && stamp) {
+				g_key_file_set_string (cache, full, "Stamp", stamp);
+				g_key_file_set_string_list (cache, full, PLUGIN_CACHE_GROUP,
+							    (const gchar * const *) recorder.entries->pdata,
+							    recorder.entries->len);
+				cache_dirty = TRUE;
+			}
+
+			g_ptr_array_unref (recorder.entries);
+		}
+
+		g_free (stamp);
+		g_free (cached_stamp);
+		g_strfreev (cached);
+
 		if (error) {
 			g_warning ("Can't load plugin [%s]: %s\n", plugin, 
 				   error->message);
 			g_error_free (error);
+			error = NULL;
 			g_free (full);
 			if (module)
 				g_module_close (module);
@@ -350,6 +533,21 @@ init_plugins (DBusGConnection *connection, Thumbnailer *thumbnailer)
 	if (error)
 		g_error_free (error);
 
+	if (cache_dirty) {
+		gchar *cache_dir = g_path_get_dirname (cache_path);
+		gchar *data = g_key_file_to_data (cache, NULL, NULL);
+
+		g_mkdir_with_parents (cache_dir, S_IRWXU);
+		g_file_set_contents (cache_path, data, -1, NULL);
+
+		g_free (data);
+		g_free (cache_dir);
+	}
+
+	g_key_file_free (cache);
+	g_free (cache_path);
+	g_free (config_stamp);
+
 	return regs;
 }
 
@@ -467,6 +665,17 @@ on_plugin_changed (GFileMonitor *monitor, GFile *file, GFile *other_file, GFileM
 
 
 
+/* The plugins watch their config from their init on. For the ones that
+ * didn't get it yet a change must not go unnoticed, they get it now */
+static void
+on_config_changed (GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data)
+{
+	if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+	    event_type == G_FILE_MONITOR_EVENT_CREATED ||
+	    event_type == G_FILE_MONITOR_EVENT_DELETED)
+		hildon_thumbnail_plugin_init_deferred ();
+}
+
 static void
 on_outputplugin_changed (GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data)
 {
@@ -527,6 +736,60 @@ static void set_oom_adj(void)
 
 #endif
 
+/* Startup is timed per phase, with G_MESSAGES_DEBUG=all to see the phases */
+
+static gint64 startup_begin, startup_last;
+
+static void
+startup_phase (const gchar *phase)
+{
+	gint64 now = g_get_monotonic_time ();
+
+	g_debug ("Startup: %s took %.1f ms", phase,
+		 (now - startup_last) / 1000.0);
+
+	startup_last = now;
+}
+
+static gboolean
+startup_done (gpointer user_data)
+{
+	startup_phase ("reaching the main loop");
+
+	g_message ("Started in %.1f ms",
+		   (g_get_monotonic_time () - startup_begin) / 1000.0);
+
+	return FALSE;
+}
+
+typedef struct {
+	ThumbnailManager *manager;
+	Thumbnailer *thumbnailer;
+} SnapshotSources;
+
+static void
+save_state (SnapshotSources *sources)
+{
+	StateWriter *writer = state_writer_new ();
+	GError *error = NULL;
+
+	thumbnail_manager_save_state (sources->manager, writer);
+	thumbnailer_save_state (sources->thumbnailer, writer);
+
+	if (!state_writer_commit (writer, &error)) {
+		g_warning ("Can't write the state snapshot: %s", error->message);
+		g_error_free (error);
+	}
+}
+
+static gboolean
+save_state_periodically (gpointer user_data)
+{
+	save_state (user_data);
+
+	return TRUE;
+}
+
 static void
 create_dummy_files (void)
 {
@@ -548,6 +811,8 @@ main (int argc, char **argv)
 	DBusGConnection *connection;
 	GError *error = NULL;
 
+	startup_begin = startup_last = g_get_monotonic_time ();
+
 #if defined (HAVE_MALLOPT) && defined(M_MMAP_THRESHOLD)
 	mallopt (M_MMAP_THRESHOLD, 128 *1024);
 #endif
@@ -561,10 +826,22 @@ main (int argc, char **argv)
 
 	memory_setrlimits ();
 
+	/* A batch helper of the exec plugin that died between two items
+	 * must not take us down with it, we see EPIPE instead */
+	signal (SIGPIPE, SIG_IGN);
+
+	/* Decoding gets half of what we may use, the rest is for us */
+	memory_budget_init (CLAMP (MEM_LIMIT, 0, get_memory_total ()) / 2);
+	page_cache_init ();
+
 	create_dummy_files ();
 
+	hildon_thumbnail_trace_init ();
+
 	connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
 
+	startup_phase ("connecting to the session bus");
+
 	if (!connection)
 		g_critical ("Could not connect to the DBus session bus, %s",
 			    error ? error->message : "no error given.");
@@ -575,15 +852,26 @@ main (int argc, char **argv)
 		Thumbnailer *thumbnailer;
 		Albumart *arter;
 		DBusGProxy *manager_proxy;
-		GFile *file, *fileo;
-		GFileMonitor *monitor, *monitoro;
+		GFile *file, *fileo, *filec;
+		GFileMonitor *monitor, *monitoro, *monitorc;
+		gchar *config_dir;
+		SnapshotSources sources;
 		gint lowmemlim;
 
+		state_snapshot_init ();
+		startup_phase ("mapping the state snapshot");
+
+		write_back_init ();
+		uri_index_init ();
+
+		/* These claim our bus names, before any of the slower work */
 		thumbnail_manager_do_init (connection, &manager, &error);
 		thumbnailer_do_init (connection, manager, &thumbnailer, &error);
 
 		albumart_manager_do_init (connection, &a_manager, &error);
-		albumart_do_init (connection, a_manager, &arter, &error);
+		albumart_do_init (connection, a_manager, thumbnailer, &arter, &error);
+
+		startup_phase ("claiming the bus names and service dirs");
 
 		manager_proxy = dbus_g_proxy_new_for_name (connection, 
 					   MANAGER_SERVICE,
@@ -591,7 +879,13 @@ main (int argc, char **argv)
 					   MANAGER_INTERFACE);
 
 		registrations = init_plugins (connection, thumbnailer);
+		startup_phase ("loading the plugins");
+
 		outregistrations = init_outputplugins (connection, thumbnailer);
+		startup_phase ("loading the output plugins");
+
+		plugin_farm_init (connection, registrations);
+		startup_phase ("starting the plugin farm");
 
 		file = g_file_new_for_path (PLUGINS_DIR);
 		monitor =  g_file_monitor_directory (file, G_FILE_MONITOR_NONE, NULL, NULL);
@@ -603,11 +897,28 @@ main (int argc, char **argv)
 		g_signal_connect (G_OBJECT (monitoro), "changed", 
 				  G_CALLBACK (on_outputplugin_changed), thumbnailer);
 
+		config_dir = g_build_filename (g_get_user_config_dir (), "hildon-thumbnailer", NULL);
+		filec = g_file_new_for_path (config_dir);
+		monitorc = g_file_monitor_directory (filec, G_FILE_MONITOR_NONE, NULL, NULL);
+		g_signal_connect (G_OBJECT (monitorc), "changed",
+				  G_CALLBACK (on_config_changed), NULL);
+		g_free (config_dir);
 
 		thumb_hal_init (thumbnailer);
 
+		thumbnailer_restore_state (thumbnailer);
+		crawler_init (thumbnailer);
+
 		main_loop = g_main_loop_new (NULL, FALSE);
 
+		startup_phase ("setting up the monitors");
+
+		sources.manager = manager;
+		sources.thumbnailer = thumbnailer;
+		g_timeout_add_seconds (SNAPSHOT_INTERVAL, save_state_periodically,
+				       &sources);
+		g_idle_add_full (G_PRIORITY_HIGH, startup_done, NULL, NULL);
+
 /*
 		g_timeout_add_seconds (600, 
 				       shut_down_after_timeout,
@@ -631,12 +942,19 @@ main (int argc, char **argv)
 */
 		g_main_loop_run (main_loop);
 
+		save_state (&sources);
+
+		crawler_shutdown ();
 		thumb_hal_shutdown ();
 
+		plugin_farm_shutdown ();
+
 		g_object_unref (monitor);
 		g_object_unref (file);
 		g_object_unref (monitoro);
 		g_object_unref (fileo);
+		g_object_unref (monitorc);
+		g_object_unref (filec);
 
 		stop_plugins (registrations, thumbnailer);
 		stop_outputplugins (outregistrations, thumbnailer);
@@ -655,6 +973,11 @@ main (int argc, char **argv)
 		g_object_unref (a_manager);
 
 		g_main_loop_unref (main_loop);
+
+		page_cache_shutdown ();
+		write_back_shutdown ();
+		uri_index_shutdown ();
+		state_snapshot_shutdown ();
 	}
 
 	return 0;
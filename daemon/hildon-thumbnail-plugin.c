@@ -24,11 +24,31 @@
  *
  */
 
+#include <string.h>
+
 #include <hildon-thumbnail-plugin.h>
 
+#include "trace.h"
+
 static GList *outplugs = NULL;
 static GRecMutex mutex;
 
+/* Short name of a module for the trace, ie. libhildon-thumbnailer-gdkpixbuf.so.
+ * Points into the module's name, the trace copies it */
+static const gchar *
+trace_name (GModule *module)
+{
+	const gchar *name, *slash;
+
+	if (!hildon_thumbnail_trace_enabled ())
+		return NULL;
+
+	name = g_module_name (module);
+	slash = strrchr (name, G_DIR_SEPARATOR);
+
+	return slash ? slash + 1 : name;
+}
+
 typedef gboolean (*IsActiveFunc) (void);
 typedef gboolean (*StopFunc) (void);
 typedef gchar * (*GetOrigFunc) (const gchar *path);
@@ -222,7 +242,9 @@ hildon_thumbnail_outplugins_do_out (const guchar *rgb8_pixmap,  guint width,
 	GString *errors = NULL;
 	GQuark domain;
 
+	hildon_thumbnail_trace_begin ("out-lock", uri, NULL);
 	g_rec_mutex_lock (&mutex);
+	hildon_thumbnail_trace_end ("out-lock", uri, NULL);
 	copy = outplugs;
 
 	while (copy) {
@@ -236,8 +258,11 @@ hildon_thumbnail_outplugins_do_out (const guchar *rgb8_pixmap,  guint width,
 
 			if (g_module_symbol (module, "hildon_thumbnail_outplugin_is_active", (gpointer *) &isac_func)) {
 				if (isac_func ()) {
+					const gchar *name = trace_name (module);
 
+					hildon_thumbnail_trace_begin ("out", uri, name);
 					out_func (rgb8_pixmap, width, height, rowstride, bits_per_sample, has_alpha, type, mtime, uri, &nerror);
+					hildon_thumbnail_trace_end ("out", uri, name);
 
 					if (nerror) {
 						if (!errors) {
@@ -327,6 +352,91 @@ hildon_thumbnail_plugin_do_init (GModule *module, gboolean *cropping, hildon_thu
 
 }
 
+typedef struct {
+	hildon_thumbnail_register_func func;
+	gpointer instance;
+} PendingInit;
+
+/* Modules of which the init got postponed until they are first needed */
+static GHashTable *pending_inits = NULL;
+
+void
+hildon_thumbnail_plugin_defer_init (GModule *module, hildon_thumbnail_register_func func, gpointer instance)
+{
+	PendingInit *pending = g_slice_new0 (PendingInit);
+
+	pending->func = func;
+	pending->instance = instance;
+
+	g_rec_mutex_lock (&mutex);
+
+	if (!pending_inits)
+		pending_inits = g_hash_table_new (NULL, NULL);
+
+	g_hash_table_replace (pending_inits, module, pending);
+
+	g_rec_mutex_unlock (&mutex);
+}
+
+/* Call with the mutex held. Returns FALSE if the module never got its init */
+static gboolean
+ensure_init (GModule *module, gboolean do_it)
+{
+	PendingInit *pending;
+
+	if (!pending_inits)
+		return TRUE;
+
+	pending = g_hash_table_lookup (pending_inits, module);
+
+	if (!pending)
+		return TRUE;
+
+	g_hash_table_remove (pending_inits, module);
+
+	if (do_it) {
+		const gchar *name = trace_name (module);
+		gboolean cropping = FALSE;
+		GError *error = NULL;
+
+		hildon_thumbnail_trace_begin ("init", NULL, name);
+		hildon_thumbnail_plugin_do_init (module, &cropping,
+						 pending->func,
+						 pending->instance,
+						 &error);
+		hildon_thumbnail_trace_end ("init", NULL, name);
+
+		if (error) {
+			g_warning ("Can't initialize plugin [%s]: %s",
+				   g_module_name (module), error->message);
+			g_error_free (error);
+		}
+	}
+
+	g_slice_free (PendingInit, pending);
+
+	return do_it;
+}
+
+/* Gives all modules of which the init got postponed their init now, they
+ * then read their config and watch it themselves */
+void
+hildon_thumbnail_plugin_init_deferred (void)
+{
+	GList *modules, *l;
+
+	g_rec_mutex_lock (&mutex);
+
+	if (pending_inits) {
+		modules = g_hash_table_get_keys (pending_inits);
+		for (l = modules; l; l = l->next)
+			ensure_init (l->data, TRUE);
+		g_list_free (modules);
+	}
+
+	g_rec_mutex_unlock (&mutex);
+}
+
 typedef void (*CreateFunc) (GStrv uris, gchar *mime_hint, GStrv *failed_uris, GError **error);
 
 void 
@@ -336,14 +446,42 @@ hildon_thumbnail_plugin_do_create (GModule *module, GStrv uris, gchar *mime_hint
 
 	g_rec_mutex_lock (&mutex);
 
+	ensure_init (module, TRUE);
+
 	if (g_module_symbol (module, "hildon_thumbnail_plugin_create", (gpointer *) &func)) {
+		const gchar *name = trace_name (module);
+
 		g_rec_mutex_unlock (&mutex);
+		hildon_thumbnail_trace_begin ("create", uris[0], name);
 		(func) (uris, mime_hint, failed_uris, error);
+		hildon_thumbnail_trace_end ("create", uris[0], name);
 	} else
 		g_rec_mutex_unlock (&mutex);
 
 }
 
+typedef guint (*WidthFunc) (void);
+
+/* How many items of one create the plugin has in the works at once. The
+ * ones that don't say do them one after the other */
+guint
+hildon_thumbnail_plugin_get_width (GModule *module)
+{
+	WidthFunc func;
+	guint width = 1;
+
+	g_rec_mutex_lock (&mutex);
+
+	ensure_init (module, TRUE);
+
+	if (g_module_symbol (module, "hildon_thumbnail_plugin_width", (gpointer *) &func))
+		width = MAX ((func) (), 1);
+
+	g_rec_mutex_unlock (&mutex);
+
+	return width;
+}
+
 void
 hildon_thumbnail_plugin_do_stop (GModule *module)
 {
@@ -352,7 +490,9 @@ hildon_thumbnail_plugin_do_stop (GModule *module)
 
 	g_rec_mutex_lock (&mutex);
 
-	if (g_module_symbol (module, "hildon_thumbnail_plugin_stop", (gpointer *) &func)) {
+	/* A plugin that never got its init has nothing to stop */
+	if (ensure_init (module, FALSE) &&
+	    g_module_symbol (module, "hildon_thumbnail_plugin_stop", (gpointer *) &func)) {
 		resident = (func) ();
 	}
 
@@ -52,12 +52,17 @@ void        hildon_thumbnail_plugin_do_init       (GModule *module,
 						   hildon_thumbnail_register_func func,
 						   gpointer self,
 						   GError **error);
+void        hildon_thumbnail_plugin_defer_init    (GModule *module,
+						   hildon_thumbnail_register_func func,
+						   gpointer self);
+void        hildon_thumbnail_plugin_init_deferred (void);
 void        hildon_thumbnail_plugin_do_create     (GModule *module, 
 						   GStrv uris, 
 						   gchar *mime_hint,
 						   GStrv *failed_uris, 
 						   GError **error);
 void        hildon_thumbnail_plugin_do_stop       (GModule *module);
+guint       hildon_thumbnail_plugin_get_width     (GModule *module);
 
 
 GModule*    hildon_thumbnail_outplugin_load       (const gchar *module_name);
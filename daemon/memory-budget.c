@@ -0,0 +1,303 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "memory-budget.h"
+
+/* Decoders work on 32 bits per pixel, plus what they and the scaled
+ * copies need next to that */
+#define BYTES_PER_PIXEL		4
+#define DECODER_OVERHEAD	(256 * 1024)
+
+/* An item that costs more than this share of the budget is heavy */
+#define HEAVY_SHARE		2
+
+/* JPEG files put their SOF after the APPn segments, we give up when we
+ * didn't find it after this many */
+#define MAX_JPEG_SEGMENTS	64
+
+/* libjpeg decodes at 1/2, 1/4 or 1/8 of the size straight from the DCT,
+ * epeg asks for the smallest of those that still covers the largest
+ * flavor on both sides */
+#define JPEG_MAX_DENOM		8
+#define JPEG_MIN_SIDE		256
+
+static GMutex mutex;
+static GCond cond;
+static gsize budget = 0;
+static gsize in_use = 0;
+static gboolean heavy_running = FALSE;
+static guint heavy_waiting = 0;
+
+void
+memory_budget_init (gsize budget_)
+{
+	g_mutex_lock (&mutex);
+	budget = budget_;
+	g_mutex_unlock (&mutex);
+}
+
+static guint
+read_be16 (const guchar *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static guint
+read_be32 (const guchar *p)
+{
+	return ((guint) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static guint
+read_le16 (const guchar *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+/* From the head we already have, and for what lies beyond it from fd */
+static gboolean
+read_at (const guchar *head, gsize len, gint fd, goffset offset, guchar *buf, gsize n)
+{
+	if (offset + n <= len) {
+		memcpy (buf, head + offset, n);
+		return TRUE;
+	}
+
+	return fd >= 0 && pread (fd, buf, n, offset) == (gssize) n;
+}
+
+static gboolean
+probe_jpeg (const guchar *head, gsize len, gint fd, guint *width, guint *height)
+{
+	goffset offset = 2;
+	guchar buf[5];
+	guint i;
+
+	for (i = 0; i < MAX_JPEG_SEGMENTS; i++) {
+		guint c;
+
+		/* The next marker must follow right away */
+		if (!read_at (head, len, fd, offset++, buf, 1) || buf[0] != 0xFF)
+			return FALSE;
+
+		/* Markers can be padded with any number of 0xFF */
+		do {
+			if (!read_at (head, len, fd, offset++, buf, 1))
+				return FALSE;
+		} while (buf[0] == 0xFF);
+
+		c = buf[0];
+
+		/* Standalone markers, no length follows */
+		if (c == 0x01 || (c >= 0xD0 && c <= 0xD7))
+			continue;
+
+		/* The image data starts or ends before we saw a frame */
+		if (c == 0xD9 || c == 0xDA)
+			return FALSE;
+
+		if (!read_at (head, len, fd, offset, buf, 2))
+			return FALSE;
+
+		/* All SOFn, except for DHT, JPG and DAC which share the range */
+		if (c >= 0xC0 && c <= 0xCF && c != 0xC4 && c != 0xC8 && c != 0xCC) {
+			if (!read_at (head, len, fd, offset + 2, buf, 5))
+				return FALSE;
+			*height = read_be16 (buf + 1);
+			*width = read_be16 (buf + 3);
+			return TRUE;
+		}
+
+		if (read_be16 (buf) < 2)
+			return FALSE;
+
+		offset += read_be16 (buf);
+	}
+
+	return FALSE;
+}
+
+/* head has the first len bytes of a file, fd is that file or -1. Only a
+ * JPEG's frame header can lie beyond the head, only then fd is read. Sets
+ * factor to the number of full size buffers that decoding it takes */
+gboolean
+memory_budget_probe_head (const guchar *head, gsize len, gint fd, guint *width, guint *height, guint *factor)
+{
+	if (len >= 2 && head[0] == 0xFF && head[1] == 0xD8) {
+		*factor = 1;
+		return probe_jpeg (head, len, fd, width, height);
+	}
+
+	if (len < 24)
+		return FALSE;
+
+	if (memcmp (head, "\211PNG\r\n\032\n", 8) == 0 &&
+	    memcmp (head + 12, "IHDR", 4) == 0) {
+		*width = read_be32 (head + 16);
+		*height = read_be32 (head + 20);
+		*factor = 1;
+		return TRUE;
+	}
+
+	if (memcmp (head, "GIF87a", 6) == 0 ||
+	    memcmp (head, "GIF89a", 6) == 0) {
+		/* The logical screen, frames are composited on a copy */
+		*width = read_le16 (head + 6);
+		*height = read_le16 (head + 8);
+		*factor = 2;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gsize
+cost_of (guint width, guint height, guint factor)
+{
+	guint64 cost = (guint64) width * height * BYTES_PER_PIXEL * factor + DECODER_OVERHEAD;
+
+	return (gsize) MIN (cost, G_MAXSIZE);
+}
+
+static guint
+jpeg_denom (guint width, guint height)
+{
+	guint denom = 1;
+
+	while (denom < JPEG_MAX_DENOM &&
+	       MIN (width, height) / (denom * 2) >= JPEG_MIN_SIDE)
+		denom *= 2;
+
+	return denom;
+}
+
+/* Returns 0 when we don't know, those items aren't held back */
+gsize
+memory_budget_estimate_head (const guchar *head, gsize len, gint fd)
+{
+	guint width = 0, height = 0, factor = 1;
+
+	if (!memory_budget_probe_head (head, len, fd, &width, &height, &factor))
+		return 0;
+
+	/* What gets decoded of a JPEG is the scaled down image */
+	if (head[0] == 0xFF) {
+		guint denom = jpeg_denom (width, height);
+
+		width = (width + denom - 1) / denom;
+		height = (height + denom - 1) / denom;
+	}
+
+	return cost_of (width, height, factor);
+}
+
+gboolean
+memory_budget_is_heavy (gsize cost)
+{
+	return budget > 0 && cost > budget / HEAVY_SHARE;
+}
+
+/* Blocks until cost fits. A heavy item waits for everything else to be
+ * done and then runs alone, the others wait for it. Each acquire must be
+ * paired with a release of the same cost, and a thread must not acquire
+ * while it already holds some of the budget */
+void
+memory_budget_acquire (gsize cost)
+{
+	if (cost == 0 || budget == 0)
+		return;
+
+	g_mutex_lock (&mutex);
+
+	if (memory_budget_is_heavy (cost)) {
+		heavy_waiting++;
+		while (heavy_running || in_use > 0)
+			g_cond_wait (&cond, &mutex);
+		heavy_waiting--;
+		heavy_running = TRUE;
+	} else {
+		while (heavy_running || heavy_waiting > 0 || in_use + cost > budget)
+			g_cond_wait (&cond, &mutex);
+	}
+
+	in_use += cost;
+
+	g_mutex_unlock (&mutex);
+}
+
+/* Like memory_budget_acquire, but gives up where that would wait. It
+ * doesn't get in line either, whoever waits already goes first */
+gboolean
+memory_budget_try_acquire (gsize cost)
+{
+	gboolean heavy, retval;
+
+	if (cost == 0 || budget == 0)
+		return TRUE;
+
+	g_mutex_lock (&mutex);
+
+	heavy = memory_budget_is_heavy (cost);
+
+	if (heavy_running || heavy_waiting > 0)
+		retval = FALSE;
+	else if (heavy)
+		retval = in_use == 0;
+	else
+		retval = in_use + cost <= budget;
+
+	if (retval) {
+		in_use += cost;
+		if (heavy)
+			heavy_running = TRUE;
+	}
+
+	g_mutex_unlock (&mutex);
+
+	return retval;
+}
+
+void
+memory_budget_release (gsize cost)
+{
+	if (cost == 0 || budget == 0)
+		return;
+
+	g_mutex_lock (&mutex);
+
+	in_use -= cost;
+	if (memory_budget_is_heavy (cost))
+		heavy_running = FALSE;
+	g_cond_broadcast (&cond);
+
+	g_mutex_unlock (&mutex);
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __MEMORY_BUDGET_H__
+#define __MEMORY_BUDGET_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Decoding happens on several threads at once, this makes them share one
+ * budget of memory. What an item will cost is estimated from its header,
+ * an item that doesn't fit in a share of the budget goes to the heavy
+ * lane, where it runs on its own */
+
+void     memory_budget_init         (gsize budget);
+
+gboolean memory_budget_probe_head   (const guchar *head,
+				     gsize len,
+				     gint fd,
+				     guint *width,
+				     guint *height,
+				     guint *factor);
+gsize    memory_budget_estimate_head (const guchar *head,
+				     gsize len,
+				     gint fd);
+gboolean memory_budget_is_heavy     (gsize cost);
+
+void     memory_budget_acquire      (gsize cost);
+gboolean memory_budget_try_acquire  (gsize cost);
+void     memory_budget_release      (gsize cost);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,208 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "memory-budget.h"
+#include "mime-sniff.h"
+
+static gboolean
+has_at (const guchar *head, gsize len, gsize offset, const gchar *magic, gsize magic_len)
+{
+	return len >= offset + magic_len &&
+	       memcmp (head + offset, magic, magic_len) == 0;
+}
+
+#define HAS_AT(offset, magic) has_at (head, len, offset, magic, sizeof (magic) - 1)
+
+/* The brands of an ISO base media file, ftyp at offset 4. The generic
+ * ones like isom are used for audio and HEIF images as well, what we
+ * don't know is left to GIO */
+static const gchar *
+sniff_ftyp (const guchar *head, gsize len)
+{
+	if (HAS_AT (8, "qt  "))
+		return "video/quicktime";
+	if (HAS_AT (8, "M4A ") || HAS_AT (8, "M4B "))
+		return "audio/mp4";
+	if (HAS_AT (8, "M4V ") || HAS_AT (8, "mp41") ||
+	    HAS_AT (8, "mp42") || HAS_AT (8, "avc1"))
+		return "video/mp4";
+	if (HAS_AT (8, "3gp"))
+		return "video/3gpp";
+	if (HAS_AT (8, "3g2"))
+		return "video/3gpp2";
+
+	return NULL;
+}
+
+/* Matroska and WebM differ in their DocType, which is near the start of
+ * the EBML header */
+static const gchar *
+sniff_ebml (const guchar *head, gsize len)
+{
+	gsize end = MIN (len, 64);
+	gsize i;
+
+	for (i = 4; i + 4 <= end; i++)
+		if (memcmp (head + i, "webm", 4) == 0)
+			return "video/webm";
+
+	return "video/x-matroska";
+}
+
+/* Returns NULL when none of the signatures matched */
+const gchar *
+mime_sniff (const guchar *head, gsize len)
+{
+	if (HAS_AT (0, "\377\330\377"))
+		return "image/jpeg";
+	if (HAS_AT (0, "\211PNG\r\n\032\n"))
+		return "image/png";
+	if (HAS_AT (0, "GIF87a") || HAS_AT (0, "GIF89a"))
+		return "image/gif";
+	if (HAS_AT (0, "IIRO") || HAS_AT (0, "IIRS") || HAS_AT (0, "MMOR"))
+		return "image/x-olympus-orf";
+	if (HAS_AT (0, "II*\0") && HAS_AT (8, "CR"))
+		return "image/x-canon-cr2";
+	if (HAS_AT (0, "II*\0") || HAS_AT (0, "MM\0*"))
+		return "image/tiff";
+	if (HAS_AT (0, "RIFF")) {
+		if (HAS_AT (8, "WEBP"))
+			return "image/webp";
+		if (HAS_AT (8, "AVI "))
+			return "video/x-msvideo";
+		if (HAS_AT (8, "WAVE"))
+			return "audio/x-wav";
+		return NULL;
+	}
+	if (HAS_AT (4, "ftyp"))
+		return sniff_ftyp (head, len);
+	if (HAS_AT (0, "ID3"))
+		return "audio/mpeg";
+	if (HAS_AT (0, "\032\105\337\243"))
+		return sniff_ebml (head, len);
+
+	return NULL;
+}
+
+/* Most camera RAW formats are TIFF inside and have nothing in their head
+ * that tells them apart, their extension does */
+static gchar *
+refine_tiff (const gchar *path)
+{
+	gchar *guess = g_content_type_guess (path, NULL, 0, NULL);
+	gchar *mime_type = guess ? g_content_type_get_mime_type (guess) : NULL;
+
+	g_free (guess);
+
+	if (mime_type && g_str_has_prefix (mime_type, "image/") &&
+	    strcmp (mime_type, "image/tiff") != 0)
+		return mime_type;
+
+	g_free (mime_type);
+
+	return g_strdup ("image/tiff");
+}
+
+/* One open and one read for the type, the mtime and what decoding it will
+ * cost. Whatever the signatures don't know goes to GIO's sniffing, with
+ * the same bytes */
+gboolean
+mime_sniff_file (const gchar *path, gchar **mime_type, guint64 *mtime, gsize *cost, GError **error)
+{
+	guchar head[MIME_SNIFF_HEAD_SIZE];
+	const gchar *found;
+	struct stat st;
+	gssize len;
+	gint fd;
+
+	*mime_type = NULL;
+	if (cost)
+		*cost = 0;
+
+	/* A FIFO or a device would block the read, or the open itself */
+	fd = g_open (path, O_RDONLY | O_NONBLOCK | O_NOCTTY, 0);
+
+	if (fd < 0 || fstat (fd, &st) != 0) {
+		gint saved = errno;
+
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved),
+			     "Can't open %s: %s", path, g_strerror (saved));
+		if (fd >= 0)
+			close (fd);
+		return FALSE;
+	}
+
+	if (mtime)
+		*mtime = st.st_mtime;
+
+	if (S_ISDIR (st.st_mode)) {
+		close (fd);
+		*mime_type = g_strdup ("inode/directory");
+		return TRUE;
+	}
+
+	if (!S_ISREG (st.st_mode)) {
+		close (fd);
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_REGULAR_FILE,
+			     "%s is not a regular file", path);
+		return FALSE;
+	}
+
+	do {
+		len = read (fd, head, sizeof (head));
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0)
+		len = 0;
+
+	if (cost)
+		*cost = memory_budget_estimate_head (head, len, fd);
+
+	close (fd);
+
+	found = mime_sniff (head, len);
+
+	if (found && strcmp (found, "image/tiff") == 0)
+		*mime_type = refine_tiff (path);
+	else if (found)
+		*mime_type = g_strdup (found);
+	else
+		*mime_type = g_content_type_guess (path, head, len, NULL);
+
+	return TRUE;
+}
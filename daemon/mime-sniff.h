@@ -0,0 +1,49 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __MIME_SNIFF_H__
+#define __MIME_SNIFF_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* What a local file is, told from its first bytes. The formats that we
+ * thumbnail have signatures that a few compares recognise, GIO's sniffing
+ * is only asked about the rest */
+
+#define MIME_SNIFF_HEAD_SIZE	4096
+
+const gchar *mime_sniff      (const guchar *head,
+			      gsize len);
+gboolean     mime_sniff_file (const gchar *path,
+			      gchar **mime_type,
+			      guint64 *mtime,
+			      gsize *cost,
+			      GError **error);
+
+G_END_DECLS
+
+#endif
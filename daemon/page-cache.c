@@ -0,0 +1,289 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "page-cache.h"
+
+#define PAGE_CACHE_GROUP	"Page Cache"
+
+/* Whether a file is in the page cache is judged by its head, mapping all
+ * of a big one would count against our address space limit */
+#define PROBE_SIZE		(4 * 1024 * 1024)
+
+typedef enum {
+	ORIGIN_CACHED,		/* Somebody else had it in the cache */
+	ORIGIN_OURS		/* We read it in */
+} PageCacheOrigin;
+
+/* An original is opened once, when it's prefetched or touched, and
+ * closed when it's released */
+typedef struct {
+	PageCacheOrigin origin;
+	gint fd;
+	struct stat st;
+} PageCacheOriginal;
+
+/* The originals of one task, and where their pages came from */
+struct PageCacheSet {
+	GHashTable *originals;
+};
+
+static guint readahead = 2;
+static goffset readahead_bytes = 8 * 1024 * 1024;
+static gboolean drop_after_use = TRUE;
+
+static gint stat_prefetched, stat_hits, stat_misses, stat_dropped;
+
+/* Readahead=2, ReadaheadBytes=8388608 and DropAfterUse=true in the
+ * [Page Cache] group of page-cache.conf, Readahead=0 turns the prefetching
+ * off */
+void
+page_cache_init (void)
+{
+	gchar *config = g_build_filename (g_get_user_config_dir (), "hildon-thumbnailer", "page-cache.conf", NULL);
+	GKeyFile *keyfile = g_key_file_new ();
+	GError *error = NULL;
+	gint value;
+	gboolean bvalue;
+
+	if (g_key_file_load_from_file (keyfile, config, G_KEY_FILE_NONE, NULL)) {
+		value = g_key_file_get_integer (keyfile, PAGE_CACHE_GROUP, "Readahead", &error);
+		if (!error && value >= 0)
+			readahead = value;
+		g_clear_error (&error);
+
+		value = g_key_file_get_integer (keyfile, PAGE_CACHE_GROUP, "ReadaheadBytes", &error);
+		if (!error && value > 0)
+			readahead_bytes = value;
+		g_clear_error (&error);
+
+		bvalue = g_key_file_get_boolean (keyfile, PAGE_CACHE_GROUP, "DropAfterUse", &error);
+		if (!error)
+			drop_after_use = bvalue;
+		g_clear_error (&error);
+	}
+
+	g_key_file_free (keyfile);
+	g_free (config);
+}
+
+void
+page_cache_shutdown (void)
+{
+	g_message ("Page cache: %d prefetched, %d hits, %d misses, %d dropped",
+		   g_atomic_int_get (&stat_prefetched),
+		   g_atomic_int_get (&stat_hits),
+		   g_atomic_int_get (&stat_misses),
+		   g_atomic_int_get (&stat_dropped));
+}
+
+/* How many of the items that come next get prefetched */
+guint
+page_cache_get_readahead (void)
+{
+	return readahead;
+}
+
+static gint
+open_uri (const gchar *uri, struct stat *st)
+{
+	gchar *path;
+	gint fd;
+
+	if (!g_str_has_prefix (uri, "file://"))
+		return -1;
+
+	path = g_filename_from_uri (uri, NULL, NULL);
+	if (!path)
+		return -1;
+
+	fd = g_open (path, O_RDONLY, 0);
+	g_free (path);
+
+	if (fd >= 0 && (fstat (fd, st) != 0 || !S_ISREG (st->st_mode))) {
+		close (fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
+/* Whether all of the head of the file is in the page cache */
+static gboolean
+is_cached (gint fd, const struct stat *st)
+{
+	gsize len = MIN ((goffset) st->st_size, PROBE_SIZE);
+	gsize page = sysconf (_SC_PAGESIZE);
+	gboolean cached = TRUE;
+	guchar *vec;
+	gpointer map;
+	gsize i;
+
+	if (len == 0)
+		return TRUE;
+
+	map = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return FALSE;
+
+	vec = g_malloc ((len + page - 1) / page);
+
+	if (mincore (map, len, vec) == 0) {
+		for (i = 0; i < (len + page - 1) / page && cached; i++)
+			cached = (vec[i] & 1);
+	} else {
+		cached = FALSE;
+	}
+
+	g_free (vec);
+	munmap (map, len);
+
+	return cached;
+}
+
+/* Closes the original, and drops its pages when we read them in */
+static void
+original_free (PageCacheOriginal *original)
+{
+	if (drop_after_use && original->origin == ORIGIN_OURS) {
+		posix_fadvise (original->fd, 0, 0, POSIX_FADV_DONTNEED);
+		g_atomic_int_inc (&stat_dropped);
+	}
+
+	close (original->fd);
+	g_slice_free (PageCacheOriginal, original);
+}
+
+PageCacheSet *
+page_cache_set_new (void)
+{
+	PageCacheSet *set = g_slice_new0 (PageCacheSet);
+
+	set->originals = g_hash_table_new_full (g_str_hash, g_str_equal,
+						(GDestroyNotify) g_free,
+						(GDestroyNotify) original_free);
+
+	return set;
+}
+
+static PageCacheOriginal *
+get_original (PageCacheSet *set, const gchar *uri)
+{
+	PageCacheOriginal *original = g_hash_table_lookup (set->originals, uri);
+	struct stat st;
+	gint fd;
+
+	if (original)
+		return original;
+
+	fd = open_uri (uri, &st);
+	if (fd < 0)
+		return NULL;
+
+	original = g_slice_new (PageCacheOriginal);
+	original->fd = fd;
+	original->st = st;
+	original->origin = is_cached (fd, &st) ? ORIGIN_CACHED : ORIGIN_OURS;
+
+	g_hash_table_replace (set->originals, g_strdup (uri), original);
+
+	return original;
+}
+
+/* Starts reading uri in the background */
+void
+page_cache_prefetch (PageCacheSet *set, const gchar *uri)
+{
+	PageCacheOriginal *original;
+
+	if (readahead == 0 || g_hash_table_lookup (set->originals, uri))
+		return;
+
+	original = get_original (set, uri);
+	if (!original)
+		return;
+
+	posix_fadvise (original->fd, 0, MIN ((goffset) original->st.st_size, readahead_bytes),
+		       POSIX_FADV_WILLNEED);
+	g_atomic_int_inc (&stat_prefetched);
+}
+
+/* Call right before uri gets decoded, counts a hit when it's in the page
+ * cache by then. Without prefetching nor dropping there's nothing to find
+ * out, the file isn't opened at all */
+void
+page_cache_touch (PageCacheSet *set, const gchar *uri)
+{
+	PageCacheOriginal *original;
+
+	if (readahead == 0) {
+		if (drop_after_use)
+			get_original (set, uri);
+		return;
+	}
+
+	original = g_hash_table_lookup (set->originals, uri);
+
+	/* Not prefetched, get_original just probed it */
+	if (!original) {
+		original = get_original (set, uri);
+		if (original && original->origin == ORIGIN_CACHED)
+			g_atomic_int_inc (&stat_hits);
+		else if (original)
+			g_atomic_int_inc (&stat_misses);
+		return;
+	}
+
+	if (is_cached (original->fd, &original->st))
+		g_atomic_int_inc (&stat_hits);
+	else
+		g_atomic_int_inc (&stat_misses);
+}
+
+/* Call once all flavours of uri's thumbnail are written. What somebody
+ * else had in the page cache stays there */
+void
+page_cache_release (PageCacheSet *set, const gchar *uri)
+{
+	g_hash_table_remove (set->originals, uri);
+}
+
+/* What was prefetched but never decoded is dropped just the same */
+void
+page_cache_set_free (PageCacheSet *set)
+{
+	g_hash_table_unref (set->originals);
+	g_slice_free (PageCacheSet, set);
+}
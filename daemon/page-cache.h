@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __PAGE_CACHE_H__
+#define __PAGE_CACHE_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Asks the kernel to read the originals that come next while the current
+ * ones decode, and to drop the ones that we brought into the page cache
+ * once their thumbnails are written. A multi-megabyte photo that nobody
+ * else reads shouldn't push the UI's libraries and thumbnails out */
+
+typedef struct PageCacheSet PageCacheSet;
+
+void          page_cache_init          (void);
+void          page_cache_shutdown      (void);
+guint         page_cache_get_readahead (void);
+
+PageCacheSet *page_cache_set_new       (void);
+void          page_cache_prefetch      (PageCacheSet *set,
+					const gchar *uri);
+void          page_cache_touch         (PageCacheSet *set,
+					const gchar *uri);
+void          page_cache_release       (PageCacheSet *set,
+					const gchar *uri);
+void          page_cache_set_free      (PageCacheSet *set);
+
+G_END_DECLS
+
+#endif
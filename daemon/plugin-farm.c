@@ -0,0 +1,780 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <dbus/dbus-glib-bindings.h>
+
+#include <hildon-thumbnail-plugin.h>
+
+#include "plugin-farm.h"
+#include "trace.h"
+
+/* The heavy plugins (the ones that decode images in-process) run in a few
+ * hildon-thumbnailer-plugin-runner processes instead of inside the daemon.
+ * A bad image then only takes down one worker, which we restart, and each
+ * worker gets its own memory limit. The items a dying worker had are tried
+ * again one by one, so that only the item that really crashes it fails. */
+
+#define FARM_ERROR_DOMAIN	"HildonThumbnailerFarm"
+#define FARM_ERROR		g_quark_from_static_string (FARM_ERROR_DOMAIN)
+
+/* The farm is opt-in, Workers in plugin-farm.conf turns it on */
+#define DEFAULT_WORKERS		0
+
+/* In MiB of RLIMIT_DATA, per worker. Not RLIMIT_AS, that also counts the
+ * libraries, the loaders and the mapped files */
+#ifdef __x86_64__
+#define DEFAULT_MEMORY_LIMIT	512
+#else
+#define DEFAULT_MEMORY_LIMIT	192
+#endif
+
+/* How long we give a worker per item before we consider it hung */
+#define CALL_TIMEOUT_PER_URI	30000
+
+/* How long we wait for a worker to come up before doing the work ourselves */
+#define READY_TIMEOUT		5
+
+#define MAX_BACKOFF		30
+
+typedef struct _FarmPool FarmPool;
+
+typedef struct {
+	FarmPool *pool;
+	gchar *bus_name;
+	gchar *bus_path;
+	DBusGProxy *proxy;
+	GPid pid;
+	GIOChannel *channel;
+	guint channel_id;
+	guint child_id;
+	guint respawn_id;
+	gchar frame[sizeof (FARM_READY)];
+	guint frame_len;
+	gboolean ready;
+	guint inflight;
+	gint64 started;
+	guint backoff;
+} FarmWorker;
+
+struct _FarmPool {
+	gchar *module_path;
+	GPtrArray *workers;
+};
+
+typedef struct {
+	GMutex mutex;
+	GCond cond;
+	guint remaining;
+} FarmBatch;
+
+typedef struct {
+	FarmBatch *batch;
+	FarmWorker *worker;
+	GStrv uris;
+	gchar *mime_hint;
+	GStrv failed_uris;
+	gchar *message;
+	gboolean lost;
+} FarmChunk;
+
+static DBusGConnection *connection = NULL;
+static GHashTable *pools = NULL;
+static GThreadPool *callers = NULL;
+static GMutex mutex;
+static GCond ready_cond;
+static gboolean shutting_down = FALSE;
+static guint memory_limit = DEFAULT_MEMORY_LIMIT;
+
+typedef struct {
+	guint memory_limit;
+	gint ready_fd;
+} WorkerSetup;
+
+static void worker_spawn (FarmWorker *worker);
+
+/* Runs in the forked child, before exec */
+static void
+worker_child_setup (gpointer user_data)
+{
+	WorkerSetup *setup = user_data;
+	rlim_t limit = (rlim_t) setup->memory_limit * 1024 * 1024;
+	struct rlimit rl;
+
+#ifdef __linux__
+	/* Don't outlive the daemon, thumb-hal can make it exit () at any time */
+	prctl (PR_SET_PDEATHSIG, SIGTERM);
+#endif
+
+	/* GSpawn marked every descriptor close-on-exec, dup2 () clears that
+	 * on the copy but leaves it when the pipe already is FARM_READY_FD */
+	if (setup->ready_fd == FARM_READY_FD)
+		fcntl (FARM_READY_FD, F_SETFD, 0);
+	else
+		dup2 (setup->ready_fd, FARM_READY_FD);
+
+	if (limit == 0)
+		return;
+
+	getrlimit (RLIMIT_DATA, &rl);
+	rl.rlim_cur = limit;
+	if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max)
+		rl.rlim_cur = rl.rlim_max;
+	setrlimit (RLIMIT_DATA, &rl);
+}
+
+static gboolean
+worker_respawn (gpointer user_data)
+{
+	FarmWorker *worker = user_data;
+
+	worker->respawn_id = 0;
+
+	if (!shutting_down)
+		worker_spawn (worker);
+
+	return FALSE;
+}
+
+static void
+worker_schedule_respawn (FarmWorker *worker)
+{
+	gint64 lived = g_get_monotonic_time () - worker->started;
+
+	/* Back off when a worker keeps dying right after it started */
+	if (lived < 10 * G_TIME_SPAN_SECOND)
+		worker->backoff = MIN (MAX (worker->backoff * 2, 1), MAX_BACKOFF);
+	else
+		worker->backoff = 1;
+
+	worker->respawn_id = g_timeout_add_seconds (worker->backoff,
+						    worker_respawn,
+						    worker);
+}
+
+/* The plugin-runner tells us on its own pipe when it owns its bus name, the
+ * plugin's output doesn't go there. It is ready once the whole frame came,
+ * in however many reads, and nothing but the frame */
+static gboolean
+on_worker_ready (GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+	FarmWorker *worker = user_data;
+	gssize n = 0;
+
+	if (condition & G_IO_IN)
+		n = read (g_io_channel_unix_get_fd (source),
+			  worker->frame + worker->frame_len,
+			  sizeof (worker->frame) - worker->frame_len);
+
+	if (n > 0)
+		worker->frame_len += n;
+
+	/* Until the worker closed it, or wrote more than a frame */
+	if (n > 0 && worker->frame_len < sizeof (worker->frame))
+		return TRUE;
+
+	g_mutex_lock (&mutex);
+	if (worker->frame_len == sizeof (worker->frame) - 1 &&
+	    memcmp (worker->frame, FARM_READY, worker->frame_len) == 0) {
+		worker->ready = TRUE;
+		g_cond_broadcast (&ready_cond);
+	} else {
+		g_warning ("Worker %s didn't report ready", worker->bus_name);
+	}
+	g_mutex_unlock (&mutex);
+
+	worker->channel_id = 0;
+	g_io_channel_unref (worker->channel);
+	worker->channel = NULL;
+
+	return FALSE;
+}
+
+static void
+on_worker_exit (GPid pid, gint status, gpointer user_data)
+{
+	FarmWorker *worker = user_data;
+
+	worker->child_id = 0;
+
+	g_mutex_lock (&mutex);
+	worker->ready = FALSE;
+	worker->pid = 0;
+	g_mutex_unlock (&mutex);
+
+	g_spawn_close_pid (pid);
+
+	if (worker->channel_id) {
+		g_source_remove (worker->channel_id);
+		worker->channel_id = 0;
+	}
+
+	if (worker->channel) {
+		g_io_channel_unref (worker->channel);
+		worker->channel = NULL;
+	}
+
+	if (!shutting_down) {
+		g_warning ("Worker %s exited with status %d, restarting it",
+			   worker->bus_name, status);
+		worker_schedule_respawn (worker);
+	}
+}
+
+static void
+worker_spawn (FarmWorker *worker)
+{
+	GError *error = NULL;
+	WorkerSetup setup;
+	gchar *argv[12];
+	gchar *ready_fd;
+	gint fds[2];
+
+	argv[0] = (gchar *) PLUGIN_RUNNER;
+	argv[1] = (gchar *) "--module-name";
+	argv[2] = worker->pool->module_path;
+	argv[3] = (gchar *) "--bus-name";
+	argv[4] = worker->bus_name;
+	argv[5] = (gchar *) "--bus-path";
+	argv[6] = worker->bus_path;
+	argv[7] = (gchar *) "--timeout=-1";
+	argv[8] = (gchar *) "--worker";
+	argv[9] = (gchar *) "--no-register";
+	argv[10] = ready_fd = g_strdup_printf ("--ready-fd=%d", FARM_READY_FD);
+	argv[11] = NULL;
+
+	worker->started = g_get_monotonic_time ();
+	worker->frame_len = 0;
+
+	if (pipe (fds) != 0) {
+		g_warning ("Can't start worker %s: %s", worker->bus_name,
+			   g_strerror (errno));
+		g_free (ready_fd);
+		worker->pid = 0;
+		worker_schedule_respawn (worker);
+		return;
+	}
+
+	fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+
+	setup.memory_limit = memory_limit;
+	setup.ready_fd = fds[1];
+
+	if (!g_spawn_async (NULL, argv, NULL,
+			    G_SPAWN_DO_NOT_REAP_CHILD,
+			    worker_child_setup, &setup,
+			    &worker->pid, &error)) {
+		g_warning ("Can't start worker %s: %s", worker->bus_name,
+			   error->message);
+		g_error_free (error);
+		g_free (ready_fd);
+		close (fds[0]);
+		close (fds[1]);
+		worker->pid = 0;
+		worker_schedule_respawn (worker);
+		return;
+	}
+
+	g_free (ready_fd);
+	close (fds[1]);
+
+	worker->channel = g_io_channel_unix_new (fds[0]);
+	g_io_channel_set_close_on_unref (worker->channel, TRUE);
+	worker->channel_id = g_io_add_watch (worker->channel,
+					     G_IO_IN | G_IO_HUP | G_IO_ERR,
+					     on_worker_ready, worker);
+
+	worker->child_id = g_child_watch_add (worker->pid, on_worker_exit, worker);
+}
+
+static void
+call_worker (FarmChunk *chunk, gpointer user_data)
+{
+	FarmWorker *worker = chunk->worker;
+	GError *error = NULL;
+	GPid pid;
+
+	g_mutex_lock (&mutex);
+	pid = worker->pid;
+	g_mutex_unlock (&mutex);
+
+	if (!dbus_g_proxy_call_with_timeout (worker->proxy, "Process",
+					     CALL_TIMEOUT_PER_URI * g_strv_length (chunk->uris),
+					     &error,
+					     G_TYPE_STRV, chunk->uris,
+					     G_TYPE_STRING, chunk->mime_hint,
+					     G_TYPE_INVALID,
+					     G_TYPE_STRV, &chunk->failed_uris,
+					     G_TYPE_STRING, &chunk->message,
+					     G_TYPE_INVALID)) {
+
+		/* Anything that isn't an error coming from the worker itself
+		 * means that the worker crashed, hung or went away */
+
+		if (error->domain == DBUS_GERROR &&
+		    error->code != DBUS_GERROR_REMOTE_EXCEPTION) {
+			chunk->lost = TRUE;
+
+			if (error->code == DBUS_GERROR_NO_REPLY) {
+				g_mutex_lock (&mutex);
+				if (pid != 0 && worker->pid == pid)
+					kill (pid, SIGKILL);
+				g_mutex_unlock (&mutex);
+			}
+		}
+
+		chunk->message = g_strdup (error->message);
+		g_error_free (error);
+	}
+
+	g_mutex_lock (&mutex);
+	worker->inflight--;
+	g_mutex_unlock (&mutex);
+
+	g_mutex_lock (&chunk->batch->mutex);
+	chunk->batch->remaining--;
+	g_cond_broadcast (&chunk->batch->cond);
+	g_mutex_unlock (&chunk->batch->mutex);
+}
+
+static gint
+compare_inflight (gconstpointer a, gconstpointer b)
+{
+	const FarmWorker *worker_a = *((FarmWorker **) a);
+	const FarmWorker *worker_b = *((FarmWorker **) b);
+
+	return (gint) worker_a->inflight - (gint) worker_b->inflight;
+}
+
+/* Returns the workers that are up, least busy first. Must be called with
+ * mutex held */
+static GPtrArray *
+get_ready_workers (FarmPool *pool)
+{
+	GPtrArray *ready = g_ptr_array_new ();
+	gint64 end_time = g_get_monotonic_time () + READY_TIMEOUT * G_TIME_SPAN_SECOND;
+
+	for (;;) {
+		guint i;
+
+		for (i = 0; i < pool->workers->len; i++) {
+			FarmWorker *worker = g_ptr_array_index (pool->workers, i);
+			if (worker->ready)
+				g_ptr_array_add (ready, worker);
+		}
+
+		if (ready->len > 0 || shutting_down)
+			break;
+
+		if (!g_cond_wait_until (&ready_cond, &mutex, end_time))
+			break;
+	}
+
+	g_ptr_array_sort (ready, compare_inflight);
+
+	return ready;
+}
+
+static GStrv
+strv_slice (GStrv uris, guint from, guint to)
+{
+	GStrv slice = (GStrv) g_malloc0 (sizeof (gchar *) * (to - from + 1));
+	guint i;
+
+	for (i = from; i < to; i++)
+		slice[i - from] = g_strdup (uris[i]);
+
+	return slice;
+}
+
+static void
+add_failure (GList **failed, GString **errors, const gchar *uri, const gchar *message)
+{
+	if (!*errors)
+		*errors = g_string_new ("");
+	g_string_append_printf (*errors, "[`%s': %s] ", uri, message);
+	*failed = g_list_prepend (*failed, g_strdup (uri));
+}
+
+gboolean
+plugin_farm_handles (GModule *module)
+{
+	gboolean retval;
+
+	if (!pools)
+		return FALSE;
+
+	g_mutex_lock (&mutex);
+	retval = g_hash_table_lookup (pools, g_module_name (module)) != NULL;
+	g_mutex_unlock (&mutex);
+
+	return retval;
+}
+
+/* How many items of one request can be in the works at the same time */
+guint
+plugin_farm_get_width (GModule *module)
+{
+	FarmPool *pool;
+	guint retval = 1;
+
+	if (!pools)
+		return retval;
+
+	g_mutex_lock (&mutex);
+	pool = g_hash_table_lookup (pools, g_module_name (module));
+	if (pool)
+		retval = MAX (pool->workers->len, 1);
+	g_mutex_unlock (&mutex);
+
+	return retval;
+}
+
+/* Same contract as hildon_thumbnail_plugin_do_create, but the work happens in
+ * the module's workers. Runs in one of the thumbnailer's pool threads */
+void
+plugin_farm_create (GModule *module, GStrv uris, gchar *mime_hint, GStrv *failed_uris, GError **error)
+{
+	FarmPool *pool;
+	GPtrArray *units;
+	GList *failed = NULL;
+	GString *errors = NULL;
+	gboolean first = TRUE;
+
+	g_mutex_lock (&mutex);
+	pool = g_hash_table_lookup (pools, g_module_name (module));
+	g_mutex_unlock (&mutex);
+
+	units = g_ptr_array_new ();
+	g_ptr_array_add (units, g_strdupv (uris));
+
+	hildon_thumbnail_trace_begin ("farm", uris[0], NULL);
+
+	while (units->len > 0) {
+		GPtrArray *ready, *chunks;
+		FarmBatch batch;
+		guint i, n;
+
+		g_mutex_lock (&mutex);
+		ready = get_ready_workers (pool);
+
+		if (ready->len == 0) {
+			g_mutex_unlock (&mutex);
+			g_ptr_array_free (ready, TRUE);
+
+			if (first) {
+				/* No worker came up, rather do it ourselves
+				 * than not at all */
+				g_strfreev (g_ptr_array_index (units, 0));
+				g_ptr_array_free (units, TRUE);
+				hildon_thumbnail_plugin_do_create (module, uris, mime_hint,
+								   failed_uris, error);
+				hildon_thumbnail_trace_end ("farm", uris[0], NULL);
+				return;
+			}
+
+			for (i = 0; i < units->len; i++) {
+				GStrv unit = g_ptr_array_index (units, i);
+				guint y;
+				for (y = 0; unit[y] != NULL; y++)
+					add_failure (&failed, &errors, unit[y], "No worker available");
+				g_strfreev (unit);
+			}
+			g_ptr_array_set_size (units, 0);
+			break;
+		}
+
+		/* On the first round we spread the request over the workers,
+		 * after that units are single items of a worker that died. A
+		 * worker never gets more than one unit per round, that way we
+		 * know which item killed it */
+
+		if (first && ready->len > 1) {
+			GStrv all = g_ptr_array_index (units, 0);
+			guint len = g_strv_length (all);
+			guint n = MIN (ready->len, len);
+			guint from = 0;
+
+			g_ptr_array_set_size (units, 0);
+
+			for (i = 0; i < n; i++) {
+				guint to = from + (len - from) / (n - i);
+				g_ptr_array_add (units, strv_slice (all, from, to));
+				from = to;
+			}
+
+			g_strfreev (all);
+		}
+
+		first = FALSE;
+
+		n = MIN (units->len, ready->len);
+
+		g_mutex_init (&batch.mutex);
+		g_cond_init (&batch.cond);
+		batch.remaining = n;
+
+		chunks = g_ptr_array_new ();
+
+		for (i = 0; i < n; i++) {
+			FarmChunk *chunk = g_slice_new0 (FarmChunk);
+
+			chunk->batch = &batch;
+			chunk->worker = g_ptr_array_index (ready, i);
+			chunk->worker->inflight++;
+			chunk->uris = g_ptr_array_index (units, i);
+			chunk->mime_hint = mime_hint;
+
+			g_ptr_array_add (chunks, chunk);
+		}
+
+		g_mutex_unlock (&mutex);
+		g_ptr_array_free (ready, TRUE);
+		g_ptr_array_remove_range (units, 0, n);
+
+		for (i = 0; i < chunks->len; i++)
+			g_thread_pool_push (callers, g_ptr_array_index (chunks, i), NULL);
+
+		g_mutex_lock (&batch.mutex);
+		while (batch.remaining > 0)
+			g_cond_wait (&batch.cond, &batch.mutex);
+		g_mutex_unlock (&batch.mutex);
+
+		g_mutex_clear (&batch.mutex);
+		g_cond_clear (&batch.cond);
+
+		for (i = 0; i < chunks->len; i++) {
+			FarmChunk *chunk = g_ptr_array_index (chunks, i);
+			guint y;
+
+			if (chunk->lost && g_strv_length (chunk->uris) > 1) {
+				for (y = 0; chunk->uris[y] != NULL; y++)
+					g_ptr_array_add (units, strv_slice (chunk->uris, y, y + 1));
+			} else if (chunk->lost) {
+				add_failure (&failed, &errors, chunk->uris[0], chunk->message);
+			} else if (chunk->failed_uris && chunk->failed_uris[0]) {
+				for (y = 0; chunk->failed_uris[y] != NULL; y++)
+					add_failure (&failed, &errors, chunk->failed_uris[y],
+						     chunk->message ? chunk->message : "");
+			} else if (!chunk->failed_uris && chunk->message) {
+				/* An error from the worker itself */
+				for (y = 0; chunk->uris[y] != NULL; y++)
+					add_failure (&failed, &errors, chunk->uris[y], chunk->message);
+			}
+
+			g_strfreev (chunk->uris);
+			g_strfreev (chunk->failed_uris);
+			g_free (chunk->message);
+			g_slice_free (FarmChunk, chunk);
+		}
+
+		g_ptr_array_free (chunks, TRUE);
+	}
+
+	g_ptr_array_free (units, TRUE);
+
+	hildon_thumbnail_trace_end ("farm", uris[0], NULL);
+
+	if (failed) {
+		GStrv furis = (GStrv) g_malloc0 (sizeof (gchar *) * (g_list_length (failed) + 1));
+		GList *copy;
+		guint t = 0;
+
+		for (copy = failed; copy; copy = g_list_next (copy))
+			furis[t++] = copy->data;
+
+		*failed_uris = furis;
+		g_list_free (failed);
+
+		g_set_error (error, FARM_ERROR, 0, "%s", errors->str);
+		g_string_free (errors, TRUE);
+	}
+}
+
+static void
+free_pool (FarmPool *pool)
+{
+	guint i;
+
+	for (i = 0; i < pool->workers->len; i++) {
+		FarmWorker *worker = g_ptr_array_index (pool->workers, i);
+
+		/* The worker goes, its exit must not find it */
+		if (worker->child_id)
+			g_source_remove (worker->child_id);
+		if (worker->respawn_id)
+			g_source_remove (worker->respawn_id);
+		if (worker->channel_id)
+			g_source_remove (worker->channel_id);
+		if (worker->channel)
+			g_io_channel_unref (worker->channel);
+		if (worker->pid)
+			kill (worker->pid, SIGTERM);
+
+		g_object_unref (worker->proxy);
+		g_free (worker->bus_name);
+		g_free (worker->bus_path);
+		g_slice_free (FarmWorker, worker);
+	}
+
+	g_ptr_array_free (pool->workers, TRUE);
+	g_free (pool->module_path);
+	g_slice_free (FarmPool, pool);
+}
+
+static gboolean
+wants_farm (const gchar *module_path, GStrv names)
+{
+	gchar *base = g_path_get_basename (module_path);
+	gboolean found = FALSE;
+	guint i;
+
+	/* Plugins=gdkpixbuf matches libhildon-thumbnailer-gdkpixbuf.so */
+	for (i = 0; names[i] != NULL && !found; i++) {
+		gchar *needle = g_strdup_printf ("-%s.", names[i]);
+		found = (strstr (base, needle) != NULL);
+		g_free (needle);
+	}
+
+	g_free (base);
+
+	return found;
+}
+
+void
+plugin_farm_init (DBusGConnection *connection_, GHashTable *registrations)
+{
+	gchar *config = g_build_filename (g_get_user_config_dir (), "hildon-thumbnailer", "plugin-farm.conf", NULL);
+	GKeyFile *keyfile = g_key_file_new ();
+	GStrv names = NULL;
+	gint workers = DEFAULT_WORKERS;
+	guint total = 0;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (g_key_file_load_from_file (keyfile, config, G_KEY_FILE_NONE, NULL)) {
+		GError *error = NULL;
+		gint value_;
+
+		names = g_key_file_get_string_list (keyfile, "Plugin Farm", "Plugins", NULL, NULL);
+
+		value_ = g_key_file_get_integer (keyfile, "Plugin Farm", "Workers", &error);
+		if (!error)
+			workers = MAX (value_, 0);
+		g_clear_error (&error);
+
+		value_ = g_key_file_get_integer (keyfile, "Plugin Farm", "MemoryLimit", &error);
+		if (!error)
+			memory_limit = MAX (value_, 0);
+		g_clear_error (&error);
+	}
+
+	g_key_file_free (keyfile);
+	g_free (config);
+
+	if (!names) {
+		names = (GStrv) g_malloc0 (sizeof (gchar *) * 3);
+		names[0] = g_strdup ("gdkpixbuf");
+		names[1] = g_strdup ("epeg");
+	}
+
+	connection = connection_;
+	pools = g_hash_table_new_full (g_str_hash, g_str_equal,
+				       NULL,
+				       (GDestroyNotify) free_pool);
+
+	g_hash_table_iter_init (&iter, registrations);
+
+	while (workers > 0 && g_hash_table_iter_next (&iter, &key, &value)) {
+		GModule *module = value;
+		FarmPool *pool;
+		gint i;
+
+		if (!wants_farm (g_module_name (module), names))
+			continue;
+
+		pool = g_slice_new0 (FarmPool);
+		pool->module_path = g_strdup (g_module_name (module));
+		pool->workers = g_ptr_array_new ();
+
+		for (i = 0; i < workers; i++) {
+			FarmWorker *worker = g_slice_new0 (FarmWorker);
+
+			worker->pool = pool;
+			worker->bus_name = g_strdup_printf ("%s.W%u", FARM_SERVICE, total);
+			worker->bus_path = g_strdup_printf ("%s/W%u", FARM_PATH, total);
+			worker->proxy = dbus_g_proxy_new_for_name (connection,
+								   worker->bus_name,
+								   worker->bus_path,
+								   FARM_INTERFACE);
+
+			g_ptr_array_add (pool->workers, worker);
+			worker_spawn (worker);
+			total++;
+		}
+
+		g_hash_table_replace (pools, pool->module_path, pool);
+	}
+
+	g_strfreev (names);
+
+	if (total > 0)
+		callers = g_thread_pool_new ((GFunc) call_worker, NULL,
+					     total, FALSE, NULL);
+}
+
+void
+plugin_farm_shutdown (void)
+{
+	if (!pools)
+		return;
+
+	g_mutex_lock (&mutex);
+	shutting_down = TRUE;
+	g_cond_broadcast (&ready_cond);
+	g_mutex_unlock (&mutex);
+
+	if (callers)
+		g_thread_pool_free (callers, TRUE, TRUE);
+	callers = NULL;
+
+	g_hash_table_unref (pools);
+	pools = NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef __PLUGIN_FARM_H__
+#define __PLUGIN_FARM_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+#include <gmodule.h>
+#include <dbus/dbus-glib-bindings.h>
+
+#define FARM_SERVICE		"org.freedesktop.thumbnailer.Worker"
+#define FARM_PATH		"/org/freedesktop/thumbnailer/Worker"
+#define FARM_INTERFACE		"org.freedesktop.thumbnailer.Thumbnailer"
+
+/* A worker writes FARM_READY to FARM_READY_FD once it owns its bus name,
+ * and closes it. Nothing else is written there */
+#define FARM_READY_FD		3
+#define FARM_READY		"ready\n"
+
+G_BEGIN_DECLS
+
+void     plugin_farm_init     (DBusGConnection *connection, GHashTable *registrations);
+void     plugin_farm_shutdown (void);
+gboolean plugin_farm_handles  (GModule *module);
+guint    plugin_farm_get_width (GModule *module);
+void     plugin_farm_create   (GModule *module, GStrv uris, gchar *mime_hint,
+			       GStrv *failed_uris, GError **error);
+
+G_END_DECLS
+
+#endif
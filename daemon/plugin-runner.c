@@ -24,13 +24,20 @@
  *
  */
 
+#include <stdio.h>
 #include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <gio/gio.h>
 #include <dbus/dbus-glib-bindings.h>
 
 #include <hildon-thumbnail-plugin.h>
 
+#include "plugin-farm.h"
+
 #define MANAGER_SERVICE        "org.freedesktop.thumbnailer"
 #define MANAGER_PATH           "/org/freedesktop/thumbnailer/Manager"
 #define MANAGER_INTERFACE      "org.freedesktop.thumbnailer.Manager"
@@ -64,6 +71,7 @@ enum {
 };
 
 void daemon_create (Daemon *object, GStrv uris, gchar *mime_hint, DBusGMethodInvocation *context);
+void daemon_process (Daemon *object, GStrv uris, gchar *mime_hint, DBusGMethodInvocation *context);
 GType daemon_get_type (void);
 
 G_DEFINE_TYPE_WITH_PRIVATE (Daemon, daemon, G_TYPE_OBJECT)
@@ -71,6 +79,7 @@ G_DEFINE_TYPE_WITH_PRIVATE (Daemon, daemon, G_TYPE_OBJECT)
 #define DAEMON_GET_PRIVATE(obj) ((DaemonPrivate *)daemon_get_instance_private((Daemon *)(obj)))
 
 #define plugin_runner_create daemon_create
+#define plugin_runner_process daemon_process
 
 
 static gboolean do_shut_down_next_time = TRUE;
@@ -117,6 +126,34 @@ daemon_create (Daemon *object, GStrv uris, gchar *mime_hint, DBusGMethodInvocati
 		g_strfreev (failed_uris);
 }
 
+/* Like Create, but for the daemon's own workers (see plugin-farm.c): the
+ * failed URIs and the error message come back together, so that the daemon
+ * knows which items of the batch failed */
+void 
+daemon_process (Daemon *object, GStrv uris, gchar *mime_hint, DBusGMethodInvocation *context)
+{
+	DaemonPrivate *priv = DAEMON_GET_PRIVATE (object);
+	GError *error = NULL;
+	GStrv failed_uris = NULL;
+
+	keep_alive ();
+
+	hildon_thumbnail_plugin_do_create (priv->module, uris, mime_hint, &failed_uris, &error);
+
+	if (error && !failed_uris)
+		failed_uris = g_strdupv (uris);
+
+	if (!failed_uris)
+		failed_uris = (GStrv) g_malloc0 (sizeof (gchar *));
+
+	dbus_g_method_return (context, failed_uris, error ? error->message : "");
+
+	if (error)
+		g_error_free (error);
+
+	g_strfreev (failed_uris);
+}
+
 #include "plugin-runner-glue.h"
 
 
@@ -255,7 +292,7 @@ daemon_start (Daemon *object, gboolean do_register)
 						   MANAGER_INTERFACE);
 
 	hildon_thumbnail_plugin_do_init (module, &priv->cropping, 
-					 daemon_register_func, 
+					 do_register ? daemon_register_func : NULL, 
 					 manager_proxy, &error);
 
 	g_object_unref (manager_proxy);
@@ -267,11 +304,41 @@ daemon_start (Daemon *object, gboolean do_register)
 
 }
 
+/* The output plugins normally live in hildon-thumbnailerd, a worker has to
+ * write its thumbnails itself */
+static void
+load_outputplugins (void)
+{
+	GDir *dir;
+	const gchar *plugin;
+
+	dir = g_dir_open (OUTPUTPLUGINS_DIR, 0, NULL);
+
+	if (!dir)
+		return;
+
+	while ((plugin = g_dir_read_name (dir)) != NULL) {
+		gchar *full;
+
+		if (!g_str_has_suffix (plugin, "." G_MODULE_SUFFIX))
+			continue;
+
+		full = g_build_filename (OUTPUTPLUGINS_DIR, plugin, NULL);
+		hildon_thumbnail_outplugin_load (full);
+		g_free (full);
+	}
+
+	g_dir_close (dir);
+}
+
 static gchar *module_name;
 static gboolean dynamic_register = FALSE;
+static gboolean no_register = FALSE;
 static gchar *bus_name;
 static gchar *bus_path;
 static gint timeout = 600;
+static gboolean worker = FALSE;
+static gint ready_fd = -1;
 
 static GOptionEntry entries_daemon[] = {
 	{ "module-name", 'm', G_OPTION_FLAG_REVERSE|G_OPTION_FLAG_OPTIONAL_ARG, 
@@ -294,6 +361,18 @@ static GOptionEntry entries_daemon[] = {
 	  G_OPTION_ARG_NONE, &dynamic_register, 
 	  "Dynamic registration using org.freedesktop.Thumbnailer.Manager", 
 	  NULL },
+	{ "no-register", 'n', 0, 
+	  G_OPTION_ARG_NONE, &no_register, 
+	  "Don't register with org.freedesktop.Thumbnailer.Manager (the workers of hildon-thumbnailerd)", 
+	  NULL },
+	{ "worker", 'w', 0, 
+	  G_OPTION_ARG_NONE, &worker, 
+	  "Run as a worker of hildon-thumbnailerd: load the output plugins", 
+	  NULL },
+	{ "ready-fd", 'r', 0, 
+	  G_OPTION_ARG_INT, &ready_fd, 
+	  "Descriptor to report readiness on (the workers of hildon-thumbnailerd)", 
+	  NULL },
 	{ NULL }
 };
 
@@ -330,6 +409,13 @@ main (int argc, char **argv)
 		return -1;
 	}
 
+	/* The plugin's own children may go away while we write to them */
+	signal (SIGPIPE, SIG_IGN);
+
+	/* Nor should they hold on to the descriptor we report readiness on */
+	if (ready_fd > -1)
+		fcntl (ready_fd, F_SETFD, FD_CLOEXEC);
+
 	module = hildon_thumbnail_plugin_load (module_name);
 
 	connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
@@ -357,14 +443,31 @@ main (int argc, char **argv)
 					     bus_path, 
 					     object);
 
-	daemon_start (DAEMON (object), dynamic_register);
+	/* Registering is what we always did, -d is still accepted for the
+	 * Exec lines that ask for it */
+	daemon_start (DAEMON (object), !no_register);
+
+	if (worker)
+		load_outputplugins ();
+
+	/* hildon-thumbnailerd waits for this before it sends us work */
+	if (ready_fd > -1) {
+		gssize n;
+
+		do {
+			n = write (ready_fd, FARM_READY, strlen (FARM_READY));
+		} while (n < 0 && errno == EINTR);
+
+		close (ready_fd);
+	}
+
+	main_loop = g_main_loop_new (NULL, FALSE);
 
 	if (timeout > -1)
 		g_timeout_add_seconds (timeout, 
 				       shut_down_after_timeout,
 				       main_loop);
 
-	main_loop = g_main_loop_new (NULL, FALSE);
 	g_main_loop_run (main_loop);
 
 	g_main_loop_unref (main_loop);
@@ -0,0 +1,596 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <dbus/dbus-glib-bindings.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+
+#define DEFAULT_ERROR_DOMAIN	"HildonThumbnailerEmbeddedArt"
+#define DEFAULT_ERROR		g_quark_from_static_string (DEFAULT_ERROR_DOMAIN)
+
+/* We never read more than this of a file's tags */
+#define MAX_TAG_SIZE		(1024*1024*16)
+
+/* Cover art is decoded at a size where its smallest side is this, the
+ * largest flavor fits in it and the cropped one can take its square */
+#define DECODE_SIZE		256
+
+/* The picture type of a front cover, in ID3v2 and FLAC alike */
+#define FRONT_COVER		3
+
+#define BE16(p)		(((guint) (p)[0] << 8) | (guint) (p)[1])
+#define BE24(p)		(((guint32) (p)[0] << 16) | ((guint32) (p)[1] << 8) | (guint32) (p)[2])
+#define BE32(p)		(((guint32) (p)[0] << 24) | ((guint32) (p)[1] << 16) | \
+			 ((guint32) (p)[2] << 8) | (guint32) (p)[3])
+#define LE32(p)		(((guint32) (p)[3] << 24) | ((guint32) (p)[2] << 16) | \
+			 ((guint32) (p)[1] << 8) | (guint32) (p)[0])
+#define SYNCSAFE(p)	((((guint32) (p)[0] & 0x7f) << 21) | (((guint32) (p)[1] & 0x7f) << 14) | \
+			 (((guint32) (p)[2] & 0x7f) << 7) | ((guint32) (p)[3] & 0x7f))
+
+#include "utils.h"
+#include "plugin-util.h"
+#include "embedded-art-plugin.h"
+
+#include <hildon-thumbnail-plugin.h>
+
+static const gchar *supported[] = {
+	"audio/mpeg",
+	"audio/mp3",
+	"audio/x-mp3",
+	"audio/mp4",
+	"audio/m4a",
+	"audio/x-m4a",
+	"audio/flac",
+	"audio/x-flac",
+	"audio/ogg",
+	"audio/x-vorbis+ogg",
+	"audio/x-opus+ogg",
+	"application/ogg",
+	NULL
+};
+
+/* The best picture so far: a front cover beats any other */
+typedef struct {
+	GBytes *image;
+	gint type;
+} Cover;
+
+const gchar**
+hildon_thumbnail_plugin_supported (void)
+{
+	return supported;
+}
+
+static guchar *
+read_blob (GInputStream *stream, goffset offset, guint64 len)
+{
+	guchar *blob;
+
+	if (len == 0 || len > MAX_TAG_SIZE)
+		return NULL;
+
+	blob = g_malloc (len);
+
+	if (!plugin_util_read_at (stream, offset, blob, len)) {
+		g_free (blob);
+		return NULL;
+	}
+
+	return blob;
+}
+
+static void
+cover_offer (Cover *cover, gint type, const guchar *data, gsize len)
+{
+	if (len == 0)
+		return;
+
+	if (cover->image && (cover->type == FRONT_COVER || type != FRONT_COVER))
+		return;
+
+	if (cover->image)
+		g_bytes_unref (cover->image);
+
+	cover->image = g_bytes_new (data, len);
+	cover->type = type;
+}
+
+/* Undoes the ID3v2 unsynchronisation (every 0xff 0x00 was 0xff) in place */
+static gsize
+id3v2_resync (guchar *data, gsize len)
+{
+	gsize i, o = 0;
+
+	for (i = 0; i < len; i++) {
+		data[o++] = data[i];
+		if (data[i] == 0xff && i + 1 < len && data[i + 1] == 0x00)
+			i++;
+	}
+
+	return o;
+}
+
+/* The size of the ID3v2 tag in front of the file, or 0 */
+static guint64
+id3v2_skip (GInputStream *stream)
+{
+	guchar header[10];
+
+	if (!plugin_util_read_at (stream, 0, header, 10) || memcmp (header, "ID3", 3) != 0)
+		return 0;
+
+	return 10 + SYNCSAFE (header + 6) + ((header[5] & 0x10) ? 10 : 0);
+}
+
+/* APIC (PIC in 2.2): encoding, mime type (or a three letter format), picture
+ * type, a description in that encoding and then the image */
+static void
+id3v2_parse_picture (Cover *cover, const guchar *frame, gsize len, guint version)
+{
+	const guchar *end;
+	guint encoding;
+	gsize p = 1;
+	gint type;
+
+	if (len < 2)
+		return;
+
+	encoding = frame[0];
+
+	if (version == 2) {
+		p += 3;
+	} else {
+		end = memchr (frame + p, 0, len - p);
+		if (!end)
+			return;
+		p = end - frame + 1;
+	}
+
+	if (p >= len)
+		return;
+
+	type = frame[p++];
+
+	if (encoding == 1 || encoding == 2) {
+		for (; p + 1 < len; p += 2) {
+			if (frame[p] == 0 && frame[p + 1] == 0)
+				break;
+		}
+		p += 2;
+	} else {
+		end = memchr (frame + p, 0, len - p);
+		if (!end)
+			return;
+		p = end - frame + 1;
+	}
+
+	if (p >= len)
+		return;
+
+	cover_offer (cover, type, frame + p, len - p);
+}
+
+static void
+id3v2_find_cover (GInputStream *stream, Cover *cover)
+{
+	guchar header[10];
+	guchar *tag;
+	gsize size, pos = 0, hlen;
+	guint version;
+
+	if (!plugin_util_read_at (stream, 0, header, 10) || memcmp (header, "ID3", 3) != 0)
+		return;
+
+	version = header[3];
+	if (version < 2 || version > 4)
+		return;
+
+	size = SYNCSAFE (header + 6);
+	tag = read_blob (stream, 10, size);
+	if (!tag)
+		return;
+
+	/* Before 2.4 the whole tag is unsynchronised, 2.4 does it per frame */
+	if (version < 4 && (header[5] & 0x80))
+		size = id3v2_resync (tag, size);
+
+	if (version > 2 && (header[5] & 0x40) && size >= 4)
+		pos = version == 3 ? BE32 (tag) + 4 : SYNCSAFE (tag);
+
+	hlen = version == 2 ? 6 : 10;
+
+	while (pos + hlen <= size && tag[pos] != 0) {
+		guchar *frame = tag + pos + hlen;
+		gsize fsize;
+		guint flags = 0;
+		gboolean picture;
+
+		if (version == 2) {
+			fsize = BE24 (tag + pos + 3);
+			picture = memcmp (tag + pos, "PIC", 3) == 0;
+		} else {
+			fsize = version == 4 ? SYNCSAFE (tag + pos + 4) : BE32 (tag + pos + 4);
+			flags = BE16 (tag + pos + 8);
+			picture = memcmp (tag + pos, "APIC", 4) == 0;
+		}
+
+		if (fsize > size - pos - hlen)
+			break;
+
+		/* We don't do compressed or encrypted frames */
+		if (version == 3 && (flags & 0x00c0))
+			picture = FALSE;
+		if (version == 4 && (flags & 0x000c))
+			picture = FALSE;
+
+		if (picture) {
+			gsize flen = fsize;
+
+			if (version == 4 && (flags & 0x0001) && flen >= 4) {
+				frame += 4;
+				flen -= 4;
+			}
+
+			if (version == 4 && (flags & 0x0002))
+				flen = id3v2_resync (frame, flen);
+
+			id3v2_parse_picture (cover, frame, flen, version);
+		}
+
+		pos += hlen + fsize;
+	}
+
+	g_free (tag);
+}
+
+/* moov/udta/meta/ilst/covr/data, meta has four bytes of version and flags
+ * and data eight bytes of type and locale in front of the image */
+static void
+mp4_find_cover (GInputStream *stream, guint64 file_size, Cover *cover)
+{
+	const gchar *path[] = { "moov", "udta", "meta", "ilst", "covr", "data", NULL };
+	guchar header[8];
+	guint64 start = 0, end = file_size;
+	guchar *image;
+	guint i;
+
+	if (!plugin_util_read_at (stream, 0, header, 8) || memcmp (header + 4, "ftyp", 4) != 0)
+		return;
+
+	for (i = 0; path[i]; i++) {
+		if (!plugin_util_mp4_find_box (stream, start, end, path[i], &start, &end))
+			return;
+		if (strcmp (path[i], "meta") == 0)
+			start += 4;
+	}
+
+	if (end - start <= 8)
+		return;
+
+	image = read_blob (stream, start + 8, end - start - 8);
+	if (image) {
+		cover_offer (cover, FRONT_COVER, image, end - start - 8);
+		g_free (image);
+	}
+}
+
+/* A FLAC PICTURE block, which is also what Vorbis comments carry base64'd in
+ * METADATA_BLOCK_PICTURE */
+static void
+flac_parse_picture (Cover *cover, const guchar *block, gsize len)
+{
+	guint32 type, skip, image_len;
+	gsize p = 0;
+
+	if (len < 8)
+		return;
+
+	type = BE32 (block);
+	skip = BE32 (block + 4);
+	p = 8;
+
+	/* Mime type, then the description */
+	if (skip > len - p || len - p - skip < 4)
+		return;
+	p += skip;
+	skip = BE32 (block + p);
+	p += 4;
+
+	/* Description, then width, height, depth and colors */
+	if (skip > len - p || len - p - skip < 20)
+		return;
+	p += skip + 16;
+
+	image_len = BE32 (block + p);
+	p += 4;
+
+	if (image_len > len - p)
+		return;
+
+	cover_offer (cover, type, block + p, image_len);
+}
+
+static void
+flac_find_cover (GInputStream *stream, Cover *cover)
+{
+	guint64 pos = id3v2_skip (stream);
+	guchar header[4];
+	gboolean last = FALSE;
+
+	if (!plugin_util_read_at (stream, pos, header, 4) || memcmp (header, "fLaC", 4) != 0)
+		return;
+
+	pos += 4;
+
+	/* The metadata blocks come before any audio, skip all but PICTURE */
+	while (!last && plugin_util_read_at (stream, pos, header, 4)) {
+		guint32 len = BE24 (header + 1);
+
+		last = (header[0] & 0x80) != 0;
+
+		if ((header[0] & 0x7f) == 6) {
+			guchar *block = read_blob (stream, pos + 4, len);
+
+			if (block) {
+				flac_parse_picture (cover, block, len);
+				g_free (block);
+			}
+		}
+
+		pos += 4 + len;
+	}
+}
+
+/* Collects the second packet of the first logical stream, which is the
+ * comment header of both Vorbis and Opus */
+static GByteArray *
+ogg_read_comments (GInputStream *stream)
+{
+	GByteArray *packet = g_byte_array_new ();
+	guint64 pos = 0;
+	guint32 serial = 0;
+	guint index = 0;
+	gboolean first = TRUE;
+
+	while (packet->len < MAX_TAG_SIZE) {
+		guchar header[27], lacing[255];
+		guchar *body;
+		guint i, nsegs, body_len = 0, offset = 0;
+
+		if (!plugin_util_read_at (stream, pos, header, 27) || memcmp (header, "OggS", 4) != 0)
+			break;
+
+		nsegs = header[26];
+		if (!plugin_util_read_at (stream, pos + 27, lacing, nsegs))
+			break;
+
+		for (i = 0; i < nsegs; i++)
+			body_len += lacing[i];
+
+		if (first) {
+			serial = LE32 (header + 14);
+			first = FALSE;
+		} else if (LE32 (header + 14) != serial) {
+			pos += 27 + nsegs + body_len;
+			continue;
+		}
+
+		body = g_malloc (body_len + 1);
+		if (body_len > 0 && !plugin_util_read_at (stream, pos + 27 + nsegs, body, body_len)) {
+			g_free (body);
+			break;
+		}
+
+		for (i = 0; i < nsegs && index < 2; i++) {
+			if (index == 1)
+				g_byte_array_append (packet, body + offset, lacing[i]);
+			offset += lacing[i];
+			if (lacing[i] < 255)
+				index++;
+		}
+
+		g_free (body);
+
+		if (index >= 2)
+			return packet;
+
+		pos += 27 + nsegs + body_len;
+	}
+
+	g_byte_array_free (packet, TRUE);
+
+	return NULL;
+}
+
+static void
+ogg_find_cover (GInputStream *stream, Cover *cover)
+{
+	GByteArray *packet = ogg_read_comments (stream);
+	const guchar *data;
+	guint32 count, len, i;
+	gsize p;
+
+	if (!packet)
+		return;
+
+	data = packet->data;
+
+	if (packet->len >= 7 && memcmp (data, "\003vorbis", 7) == 0)
+		p = 7;
+	else if (packet->len >= 8 && memcmp (data, "OpusTags", 8) == 0)
+		p = 8;
+	else
+		goto out;
+
+	/* The vendor string */
+	if (packet->len - p < 4)
+		goto out;
+	len = LE32 (data + p);
+	p += 4;
+	if (len > packet->len - p || packet->len - p - len < 4)
+		goto out;
+	p += len;
+
+	count = LE32 (data + p);
+	p += 4;
+
+	for (i = 0; i < count && packet->len - p >= 4; i++) {
+		const gchar *comment;
+
+		len = LE32 (data + p);
+		p += 4;
+		if (len > packet->len - p)
+			break;
+
+		comment = (const gchar *) data + p;
+
+		if (len > 23 && g_ascii_strncasecmp (comment, "METADATA_BLOCK_PICTURE=", 23) == 0) {
+			gchar *value = g_strndup (comment + 23, len - 23);
+			gsize block_len;
+			guchar *block = g_base64_decode (value, &block_len);
+
+			flac_parse_picture (cover, block, block_len);
+			g_free (block);
+			g_free (value);
+		} else if (len > 9 && g_ascii_strncasecmp (comment, "COVERART=", 9) == 0) {
+			/* The old way: just the image, with no picture type */
+			gchar *value = g_strndup (comment + 9, len - 9);
+			gsize image_len;
+			guchar *image = g_base64_decode (value, &image_len);
+
+			cover_offer (cover, 0, image, image_len);
+			g_free (image);
+			g_free (value);
+		}
+
+		p += len;
+	}
+
+out:
+	g_byte_array_free (packet, TRUE);
+}
+
+static void
+on_size_prepared (GdkPixbufLoader *loader, gint width, gint height, gpointer user_data)
+{
+	gint smallest = MIN (width, height);
+
+	/* The JPEG loader does this while decoding, which is a lot cheaper
+	 * than scaling afterwards */
+	if (smallest > DECODE_SIZE)
+		gdk_pixbuf_loader_set_size (loader,
+					    MAX (1, (gint) ((gint64) width * DECODE_SIZE / smallest)),
+					    MAX (1, (gint) ((gint64) height * DECODE_SIZE / smallest)));
+}
+
+static GdkPixbuf *
+decode_cover (GBytes *image, GError **error)
+{
+	GdkPixbufLoader *loader = gdk_pixbuf_loader_new ();
+	GdkPixbuf *pixbuf = NULL;
+	gsize len;
+	const guchar *data = g_bytes_get_data (image, &len);
+
+	g_signal_connect (loader, "size-prepared", G_CALLBACK (on_size_prepared), NULL);
+
+	if (!gdk_pixbuf_loader_write (loader, data, len, error)) {
+		gdk_pixbuf_loader_close (loader, NULL);
+		g_object_unref (loader);
+		return NULL;
+	}
+
+	if (gdk_pixbuf_loader_close (loader, error)) {
+		pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+		if (pixbuf)
+			g_object_ref (pixbuf);
+		else
+			g_set_error (error, DEFAULT_ERROR, 0, "Can't decode the cover art");
+	}
+
+	g_object_unref (loader);
+
+	return pixbuf;
+}
+
+/* Each of these only looks at the file's first bytes unless they are what
+ * it's looking for, so we don't need the mime-type. The cover is decoded
+ * at DECODE_SIZE, whatever flavor is still wanted */
+static GdkPixbuf *
+load_cover (GInputStream *stream, guint64 file_size, guint wanted, GError **error)
+{
+	Cover cover = { NULL, 0 };
+	GdkPixbuf *pixbuf;
+
+	id3v2_find_cover (stream, &cover);
+	if (!cover.image)
+		flac_find_cover (stream, &cover);
+	if (!cover.image)
+		mp4_find_cover (stream, file_size, &cover);
+	if (!cover.image)
+		ogg_find_cover (stream, &cover);
+
+	if (!cover.image) {
+		g_set_error (error, DEFAULT_ERROR, 0, "No embedded cover art");
+		return NULL;
+	}
+
+	pixbuf = decode_cover (cover.image, error);
+	g_bytes_unref (cover.image);
+
+	return pixbuf;
+}
+
+void
+hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris, GError **error)
+{
+	plugin_util_create (uris, load_cover, DEFAULT_ERROR, failed_uris, error);
+}
+
+gboolean
+hildon_thumbnail_plugin_stop (void)
+{
+	return FALSE;
+}
+
+void
+hildon_thumbnail_plugin_init (gboolean *cropping, hildon_thumbnail_register_func func, gpointer thumbnailer, GModule *module, GError **error)
+{
+	/* We seek around in the file, that's only cheap for local ones */
+	const gchar *uri_schemes[2] = { "file", NULL };
+	guint i;
+
+	*cropping = TRUE;
+
+	if (func) {
+		for (i = 0; supported[i] != NULL; i++)
+			func (thumbnailer, supported[i], module, (const GStrv) uri_schemes, 0);
+	}
+}
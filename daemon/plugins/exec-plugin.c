@@ -28,6 +28,13 @@
 #include "config.h"
 
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
 #include <glib.h>
 #include <gio/gio.h>
 #include <dbus/dbus-glib-bindings.h>
@@ -36,20 +43,101 @@
 #define EXEC_ERROR_DOMAIN	"HildonThumbnailerExec"
 #define EXEC_ERROR		g_quark_from_static_string (EXEC_ERROR_DOMAIN)
 
+/* What a helper that runs with Batch=true gets on its stdin for each item,
+ * unless the mime-type's group has an Input key. The helper must answer
+ * each line with one line on its stdout: "OK" or an error message */
+#define DEFAULT_BATCH_INPUT	"{uri}\t{large}\t{normal}\t{cropped}\t{mime}\t{mtime}\t{docrop}"
+
+#define DEFAULT_MAX_PROCESSES	2
+#define DEFAULT_TIMEOUT		30
+
 #include "utils.h"
 #include "exec-plugin.h"
 
 #include <hildon-thumbnail-plugin.h>
 
+typedef struct {
+	gchar *exec;
+	gchar *input;
+	gboolean batch;
+} ExecInfo;
+
+typedef struct {
+	GMutex lock;
+	gint ref_count;
+	gchar *command;
+	GPid pid;
+	gint in_fd, out_fd;
+	GString *buffer;
+	gboolean running;
+} BatchHelper;
+
+typedef struct {
+	GMainContext *context;
+	GMainLoop *loop;
+	GList *pending;
+	guint running;
+	GList *failed;
+	GList *transient;
+	GString *errors;
+} ExecRun;
+
+typedef struct {
+	ExecRun *run;
+	gchar *uri;
+	gchar *command;
+	gchar *input;
+	BatchHelper *helper;
+	GPid pid;
+	GSource *timeout_source;
+	gboolean timed_out;
+} ExecItem;
+
 static gchar **supported = NULL;
 static gboolean do_cropped = TRUE;
 static gboolean do_pngs = FALSE;
+static guint max_processes = DEFAULT_MAX_PROCESSES;
+static guint timeout = DEFAULT_TIMEOUT;
 static GHashTable *execs = NULL;
+static GHashTable *helpers = NULL;
+static GList *children = NULL;
+static GMutex mutex;
 static GFileMonitor *monitor = NULL;
 
-const gchar** 
+static void
+free_execinfo (ExecInfo *info)
+{
+	g_free (info->exec);
+	g_free (info->input);
+	g_slice_free (ExecInfo, info);
+}
+
+/* The children of one create run side by side */
+guint
+hildon_thumbnail_plugin_width (void)
+{
+	guint width;
+
+	g_mutex_lock (&mutex);
+	width = max_processes;
+	g_mutex_unlock (&mutex);
+
+	return width;
+}
+
+const gchar**
 hildon_thumbnail_plugin_supported (void)
 {
+	static const gchar *none[] = { NULL };
+
+	g_mutex_lock (&mutex);
+
+	/* Stopped, there is nothing to offer until the next init */
+	if (!execs) {
+		g_mutex_unlock (&mutex);
+		return none;
+	}
+
 	if (!supported) {
 		GList *formats = g_hash_table_get_keys (execs);
 		GList *copy;
@@ -67,280 +155,583 @@ hildon_thumbnail_plugin_supported (void)
 		g_list_free (formats);
 	}
 
+	g_mutex_unlock (&mutex);
+
 	return (const gchar**) supported;
 }
 
+#define IS_KEY(key, len, name) (len == strlen (name) && strncmp (key, name, len) == 0)
 
+/* Replaces {uri}, {large}, {normal}, {cropped}, {mime}, {mime_at}, {mtime}
+ * and {docrop} in in. Unknown {keys} are copied as-is */
 static gchar*
-string_replace (const gchar *in, const gchar *uri, const gchar *large, const gchar *normal, const gchar *cropped, const gchar *mime_type, const gchar *mime_type_at, gboolean cropping, guint mtime)
+string_replace (const gchar *in, const gchar *uri, const gchar *large, const gchar *normal, const gchar *cropped, const gchar *mime_type, const gchar *mime_type_at, gboolean cropping, guint64 mtime)
 {
-	gchar *ptr;
-	guint total = strlen (in);
-	guint len, i, off = 0, z, in_len = total;
-	guint large_len, normal_len, cropped_len, mime_len, 
-		mtime_len, cropping_len, mime_at_len, uri_len;
-	gchar *s_mtime = g_strdup_printf ("%u", mtime);
-	gchar *ret;
-
-
-	ptr = (gchar *) in;
-	len = strlen (uri);
-	while (ptr) {
-		ptr = strstr ("{uri}", ptr);
-		total += len;
+	GString *ret = g_string_sized_new (strlen (in) + 256);
+	const gchar *ptr = in;
+
+	while (*ptr != '\0') {
+		const gchar *end = NULL;
+
+		if (*ptr == '{')
+			end = strchr (ptr, '}');
+
+		if (end) {
+			const gchar *key = ptr + 1;
+			gsize len = end - key;
+
+			if (IS_KEY (key, len, "uri"))
+				g_string_append (ret, uri);
+			else if (IS_KEY (key, len, "large"))
+				g_string_append (ret, large);
+			else if (IS_KEY (key, len, "normal"))
+				g_string_append (ret, normal);
+			else if (IS_KEY (key, len, "cropped"))
+				g_string_append (ret, cropped);
+			else if (IS_KEY (key, len, "mime"))
+				g_string_append (ret, mime_type);
+			else if (IS_KEY (key, len, "mime_at"))
+				g_string_append (ret, mime_type_at);
+			else if (IS_KEY (key, len, "mtime"))
+				g_string_append_printf (ret, "%" G_GUINT64_FORMAT, mtime);
+			else if (IS_KEY (key, len, "docrop"))
+				g_string_append (ret, cropping ? "yes" : "no");
+			else
+				g_string_append_len (ret, ptr, len + 2);
+
+			ptr = end + 1;
+		} else {
+			g_string_append_c (ret, *ptr);
+			ptr++;
+		}
 	}
-	uri_len = len;
 
-	ptr = (gchar *) in;
-	len = strlen (normal);
-	while (ptr) {
-		ptr = strstr ("{normal}", ptr);
-		total += len;
-	}
-	normal_len = len;
+	return g_string_free (ret, FALSE);
+}
 
-	ptr = (gchar *) in;
-	len = strlen (large);
-	while (ptr) {
-		ptr = strstr ("{large}", ptr);
-		total += len;
-	}
-	large_len = len;
+static void
+add_failure (ExecRun *run, const gchar *uri, const gchar *message)
+{
+	if (!run->errors)
+		run->errors = g_string_new ("");
+	g_string_append_printf (run->errors, "[`%s': %s] ", uri, message);
+	run->failed = g_list_prepend (run->failed, g_strdup (uri));
+}
 
-	ptr = (gchar *) in;
-	len = strlen (cropped);
-	while (ptr) {
-		ptr = strstr ("{cropped}", ptr);
-		total += len;
-	}
-	cropped_len = len;
+/* A timeout or a crash might not happen next time, those get no fail file */
+static void
+add_transient_failure (ExecRun *run, const gchar *uri, const gchar *message)
+{
+	add_failure (run, uri, message);
+	run->transient = g_list_prepend (run->transient, run->failed->data);
+}
+
+static void helper_stop (BatchHelper *helper);
+
+static void
+free_helper (BatchHelper *helper)
+{
+	g_mutex_lock (&helper->lock);
+	helper_stop (helper);
+	g_mutex_unlock (&helper->lock);
+
+	g_mutex_clear (&helper->lock);
+	g_string_free (helper->buffer, TRUE);
+	g_free (helper->command);
+	g_slice_free (BatchHelper, helper);
+}
+
+/* The helpers table holds one reference, every item that is going to talk
+ * to the helper another one. A stop or reload drops the table's, the
+ * helper goes once the last item that uses it is done */
+static BatchHelper *
+helper_ref (BatchHelper *helper)
+{
+	g_atomic_int_inc (&helper->ref_count);
+	return helper;
+}
+
+static void
+helper_unref (BatchHelper *helper)
+{
+	if (g_atomic_int_dec_and_test (&helper->ref_count))
+		free_helper (helper);
+}
+
+static void
+free_item (ExecItem *item)
+{
+	if (item->helper)
+		helper_unref (item->helper);
+	g_free (item->uri);
+	g_free (item->command);
+	g_free (item->input);
+	g_slice_free (ExecItem, item);
+}
+
+static BatchHelper *
+get_helper (const gchar *command)
+{
+	BatchHelper *helper;
 
-	ptr = (gchar *) in;
-	len = strlen (mime_type);
-	while (ptr) {
-		ptr = strstr ("{mime}", ptr);
-		total += len;
+	/* Must be called with mutex held */
+
+	helper = g_hash_table_lookup (helpers, command);
+
+	if (!helper) {
+		helper = g_slice_new0 (BatchHelper);
+		helper->ref_count = 1;
+		g_mutex_init (&helper->lock);
+		helper->command = g_strdup (command);
+		helper->buffer = g_string_new ("");
+		helper->in_fd = helper->out_fd = -1;
+		g_hash_table_replace (helpers, helper->command, helper);
 	}
-	mime_len = len;
 
-	ptr = (gchar *) in;
-	len = strlen (mime_type_at);
-	while (ptr) {
-		ptr = strstr ("{mime_at}", ptr);
-		total += len;
+	return helper_ref (helper);
+}
+
+static ExecItem *
+prepare_item (ExecRun *run, const gchar *uri, GError **error)
+{
+	ExecItem *item = NULL;
+	GFile *file;
+	GFileInfo *info;
+	const gchar *content_type;
+	gchar *large = NULL, *normal = NULL, *cropped = NULL;
+	gchar *mime_type_at, *slash_pos;
+	ExecInfo *exec;
+	guint64 mtime;
+
+	file = g_file_new_for_uri (uri);
+	info = g_file_query_info (file,
+				  G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","
+				  G_FILE_ATTRIBUTE_TIME_MODIFIED,
+				  G_FILE_QUERY_INFO_NONE,
+				  NULL, error);
+	g_object_unref (file);
+
+	if (!info)
+		return NULL;
+
+	mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+	content_type = g_file_info_get_content_type (info);
+
+	if (!content_type)
+		content_type = "unknown/unknown";
+
+	hildon_thumbnail_util_get_thumb_paths (uri, &large, &normal,
+					       &cropped, NULL, NULL, NULL, do_pngs);
+
+	mime_type_at = g_strdup (content_type);
+	slash_pos = strchr (mime_type_at, '/');
+	if (slash_pos)
+		*slash_pos = '@';
+
+	g_mutex_lock (&mutex);
+
+	exec = execs ? g_hash_table_lookup (execs, content_type) : NULL;
+
+	if (exec && exec->exec) {
+		item = g_slice_new0 (ExecItem);
+		item->run = run;
+		item->uri = g_strdup (uri);
+
+		if (exec->batch) {
+			item->helper = get_helper (exec->exec);
+			item->input = string_replace (exec->input ? exec->input : DEFAULT_BATCH_INPUT,
+						      uri, large, normal, cropped,
+						      content_type, mime_type_at,
+						      do_cropped, mtime);
+		} else
+			item->command = string_replace (exec->exec, uri, large, normal,
+							cropped, content_type, mime_type_at,
+							do_cropped, mtime);
+	} else
+		g_set_error (error, EXEC_ERROR, 0,
+			     "No Exec configured for %s", content_type);
+
+	g_mutex_unlock (&mutex);
+
+	g_free (mime_type_at);
+	g_free (large);
+	g_free (normal);
+	g_free (cropped);
+	g_object_unref (info);
+
+	return item;
+}
+
+static void spawn_next (ExecRun *run);
+
+static gboolean
+on_child_timeout (gpointer user_data)
+{
+	ExecItem *item = user_data;
+
+	item->timed_out = TRUE;
+	kill (item->pid, SIGKILL);
+
+	/* The child watch will clean up once the kill went through */
+	g_source_unref (item->timeout_source);
+	item->timeout_source = NULL;
+
+	return FALSE;
+}
+
+static void
+on_child_exit (GPid pid, gint status, gpointer user_data)
+{
+	ExecItem *item = user_data;
+	ExecRun *run = item->run;
+
+	if (item->timeout_source) {
+		g_source_destroy (item->timeout_source);
+		g_source_unref (item->timeout_source);
+		item->timeout_source = NULL;
 	}
-	mime_at_len = len;
 
-	ptr = (gchar *) in;
-	len = strlen (s_mtime);
-	while (ptr) {
-		ptr = strstr ("{mtime}", ptr);
-		total += len;
+	g_mutex_lock (&mutex);
+	children = g_list_remove (children, GINT_TO_POINTER (pid));
+	g_mutex_unlock (&mutex);
+
+	g_spawn_close_pid (pid);
+
+	if (item->timed_out) {
+		gchar *msg = g_strdup_printf ("Timeout after %u seconds", timeout);
+		add_transient_failure (run, item->uri, msg);
+		g_free (msg);
+	} else if (WIFSIGNALED (status)) {
+		gchar *msg = g_strdup_printf ("`%s' was killed by signal %d",
+					      item->command, WTERMSIG (status));
+		add_transient_failure (run, item->uri, msg);
+		g_free (msg);
+	} else if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+		gchar *msg = g_strdup_printf ("`%s' failed with status %d",
+					      item->command, status);
+		add_failure (run, item->uri, msg);
+		g_free (msg);
 	}
-	mtime_len = len;
 
-	ptr = (gchar *) in;
-	len = cropping?3:2;
-	while (ptr) {
-		ptr = strstr ("{docrop}", ptr);
-		total += len;
+	free_item (item);
+
+	run->running--;
+
+	spawn_next (run);
+
+	if (run->running == 0 && !run->pending)
+		g_main_loop_quit (run->loop);
+}
+
+/* Starts children for pending items until there are max_processes of them */
+static void
+spawn_next (ExecRun *run)
+{
+	while (run->pending && run->running < max_processes) {
+		ExecItem *item = run->pending->data;
+		GError *error = NULL;
+		gchar **argv = NULL;
+		GSource *source;
+
+		run->pending = g_list_delete_link (run->pending, run->pending);
+
+		if (!g_shell_parse_argv (item->command, NULL, &argv, &error) ||
+		    !g_spawn_async (NULL, argv, NULL,
+				    G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+				    NULL, NULL, &item->pid, &error)) {
+			add_failure (run, item->uri, error->message);
+			g_error_free (error);
+			g_strfreev (argv);
+			free_item (item);
+			continue;
+		}
+
+		g_strfreev (argv);
+
+		g_mutex_lock (&mutex);
+		children = g_list_prepend (children, GINT_TO_POINTER (item->pid));
+		g_mutex_unlock (&mutex);
+
+		source = g_child_watch_source_new (item->pid);
+		g_source_set_callback (source, (GSourceFunc) on_child_exit, item, NULL);
+		g_source_attach (source, run->context);
+		g_source_unref (source);
+
+		if (timeout > 0) {
+			item->timeout_source = g_timeout_source_new_seconds (timeout);
+			g_source_set_callback (item->timeout_source, on_child_timeout, item, NULL);
+			g_source_attach (item->timeout_source, run->context);
+		}
+
+		run->running++;
 	}
-	cropping_len = len;
+}
 
-	ret = (gchar *) g_malloc0 (sizeof (gchar) * total + 5);
+static void
+helper_stop (BatchHelper *helper)
+{
+	if (!helper->running)
+		return;
 
-	i = 0;
-	off = 0;
+	close (helper->in_fd);
+	close (helper->out_fd);
+	helper->in_fd = helper->out_fd = -1;
 
-	for (i = 0; i < in_len && (off < total + 1); i++) {
-		if (in[i] == '{') {
-			gchar buf[11];
-			gboolean okay = FALSE;
+	kill (helper->pid, SIGKILL);
+	waitpid (helper->pid, NULL, 0);
+	g_spawn_close_pid (helper->pid);
 
-			i++; /*A*/
+	g_string_truncate (helper->buffer, 0);
+	helper->running = FALSE;
+}
 
-			memset (buf, 0, 11);
+static gboolean
+helper_start (BatchHelper *helper, GError **error)
+{
+	gchar **argv = NULL;
+	gboolean retval;
 
-			for (z = i; z < i + 10; z++) {
-				if (in[z] == '}') {
-					okay = TRUE;
-					break;
-				}
-				buf[z-i] = in[z];
-			}
+	if (!g_shell_parse_argv (helper->command, NULL, &argv, error))
+		return FALSE;
 
-			if (okay) {
+	retval = g_spawn_async_with_pipes (NULL, argv, NULL,
+					   G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+					   NULL, NULL, &helper->pid,
+					   &helper->in_fd, &helper->out_fd, NULL,
+					   error);
 
-				if (buf[0] == 'm' && buf[1] == 't') {
-					memcpy (ret + off, s_mtime, mtime_len);
-					off += mtime_len;
-				}
+	g_strfreev (argv);
 
-				if (buf[0] == 'm' && buf[1] == 'i' && buf[4] != '_') {
-					memcpy (ret + off, mime_type, mime_len);
-					off += mime_len;
-				}
+	helper->running = retval;
 
-				if (buf[0] == 'm' && buf[1] == 'i' && buf[4] == '_') {
-					memcpy (ret + off, mime_type_at, mime_at_len);
-					off += mime_at_len;
-				}
+	return retval;
+}
 
-				if (buf[0] == 'u') {
-					memcpy (ret + off, uri, uri_len);
-					off += uri_len;
-				}
+static gboolean
+helper_write (BatchHelper *helper, const gchar *line)
+{
+	gsize len = strlen (line), done = 0;
 
-				if (buf[0] == 'n') {
-					memcpy (ret + off, normal, normal_len);
-					off += normal_len;
-				}
+	while (done < len) {
+		ssize_t n = write (helper->in_fd, line + done, len - done);
 
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		done += n;
+	}
 
-				if (buf[0] == 'l') {
-					memcpy (ret + off, large, large_len);
-					off += large_len;
-				}
+	return TRUE;
+}
 
-				if (buf[0] == 'c') {
-					memcpy (ret + off, cropped, cropped_len);
-					off += cropped_len;
-				}
+static gchar *
+helper_read_line (BatchHelper *helper)
+{
+	gint64 end_time = g_get_monotonic_time () + (gint64) timeout * G_TIME_SPAN_SECOND;
+
+	for (;;) {
+		gchar *nl = memchr (helper->buffer->str, '\n', helper->buffer->len);
+		struct pollfd pfd;
+		gchar buf[512];
+		gint wait_ms = -1;
+		ssize_t n;
+
+		if (nl) {
+			gchar *line = g_strndup (helper->buffer->str, nl - helper->buffer->str);
+			g_string_erase (helper->buffer, 0, nl - helper->buffer->str + 1);
+			return line;
+		}
 
-				if (buf[0] == 'd' && cropping) {
-					memcpy (ret + off, "yes", 3);
-					off += 3;
-				}
+		if (timeout > 0) {
+			gint64 remaining = end_time - g_get_monotonic_time ();
+			if (remaining <= 0)
+				return NULL;
+			wait_ms = (gint) (remaining / 1000) + 1;
+		}
 
-				if (buf[0] == 'd' && !cropping) {
-					memcpy (ret + off, "no", 2);
-					off += 2;
-				}
+		pfd.fd = helper->out_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
 
-				i += z - i;
+		n = poll (&pfd, 1, wait_ms);
 
-			} else
-				i--; /*A*/
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return NULL;
 
-		} else {
-			ret[off] = in[i];
-			off++;
+		n = read (helper->out_fd, buf, sizeof (buf));
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return NULL;
+
+		g_string_append_len (helper->buffer, buf, n);
+	}
+}
+
+/* Runs a fresh instance of the helper for just this one line: it gets EOF
+ * after the line and answers once before it exits */
+static gchar *
+helper_run_once (const gchar *command, const gchar *line, GError **error)
+{
+	BatchHelper once;
+	gchar *reply = NULL;
+
+	memset (&once, 0, sizeof (BatchHelper));
+	once.command = (gchar *) command;
+	once.buffer = g_string_new ("");
+	once.in_fd = once.out_fd = -1;
+
+	if (helper_start (&once, error)) {
+		if (helper_write (&once, line)) {
+			close (once.in_fd);
+			once.in_fd = -1;
+			reply = helper_read_line (&once);
 		}
+		helper_stop (&once);
 	}
 
-	g_free (s_mtime);
+	g_string_free (once.buffer, TRUE);
 
-	return ret;
+	return reply;
 }
 
-
-void
-hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris, GError **error)
+/* Sends one item to its long-lived helper and waits for the answer. A helper
+ * that dies, misbehaves or takes too long is killed and restarted for the
+ * next item. One that already went away before we could write (EPIPE) is
+ * reaped and the item gets a helper instance of its own */
+static void
+run_batch_item (ExecRun *run, ExecItem *item)
 {
-	guint i = 0;
-	GString *errors = NULL;
-	GList *failed = NULL;
+	BatchHelper *helper = item->helper;
+	GError *error = NULL;
+	gchar *line, *reply = NULL;
 
-	while (uris[i] != NULL) {
-		gchar *uri = uris[i];
-		GError *nerror = NULL;
-		gchar *large = NULL, 
-		      *normal = NULL, 
-		      *cropped = NULL;
-		gchar *exec = NULL;
-		gchar *mime_type = NULL;
-		gchar *mime_type_at = NULL;
-		GFile *file = NULL;
-		GFileInfo *info = NULL;
-		const gchar *content_type;
-		guint64 mtime;
-		gchar *r_exec = NULL;
-		gchar *slash_pos;
-
-		file = g_file_new_for_uri (uri);
-		info = g_file_query_info (file,
-				  G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","
-				  G_FILE_ATTRIBUTE_TIME_MODIFIED,
-				  G_FILE_QUERY_INFO_NONE,
-				  NULL, &nerror);
+	g_mutex_lock (&helper->lock);
+
+	if (!helper->running && !helper_start (helper, &error)) {
+		g_mutex_unlock (&helper->lock);
+		add_failure (run, item->uri, error->message);
+		g_error_free (error);
+		return;
+	}
+
+	line = g_strdup_printf ("%s\n", item->input);
 
-		if (nerror)
-			goto nerror_handler;
+	if (!helper_write (helper, line)) {
+		gchar *command = g_strdup (helper->command);
 
-		mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
-		content_type = g_file_info_get_content_type (info);
+		helper_stop (helper);
+		g_mutex_unlock (&helper->lock);
 
-		hildon_thumbnail_util_get_thumb_paths (uri, &large, &normal, 
-						       &cropped, NULL, NULL, NULL, do_pngs);
+		reply = helper_run_once (command, line, &error);
+		g_free (command);
+		g_free (line);
 
-		mime_type = g_strdup (content_type);
-		mime_type_at = g_strdup (content_type);
-		slash_pos = strchr(mime_type_at, '/');
-		if(slash_pos)
-			*slash_pos = '@';
+		if (error) {
+			add_failure (run, item->uri, error->message);
+			g_error_free (error);
+			return;
+		}
+	} else {
+		reply = helper_read_line (helper);
+		g_free (line);
 
-		exec = g_hash_table_lookup (execs, content_type);
+		if (!reply)
+			helper_stop (helper);
+		g_mutex_unlock (&helper->lock);
+	}
 
-		r_exec = string_replace (exec, uri, large, normal, cropped, 
-					 mime_type, mime_type_at, do_cropped, mtime);
+	if (!reply) {
+		add_transient_failure (run, item->uri, "Batch helper did not answer");
+		return;
+	}
 
-		g_free (exec);
-		g_free (mime_type);
-		g_free (mime_type_at);
+	if (strcmp (reply, "OK") != 0)
+		add_failure (run, item->uri, reply);
 
-		g_spawn_command_line_sync (r_exec, NULL, NULL, NULL, NULL);
+	g_free (reply);
+}
 
-		g_free (r_exec);
+void
+hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris, GError **error)
+{
+	ExecRun run;
+	GList *batch = NULL, *copy;
+	guint i = 0;
 
-		nerror_handler:
+	memset (&run, 0, sizeof (ExecRun));
 
+	while (uris[i] != NULL) {
+		GError *nerror = NULL;
+		ExecItem *item = prepare_item (&run, uris[i], &nerror);
 
 		if (nerror) {
-			if (!errors)
-				errors = g_string_new ("");
-			g_string_append_printf (errors, "[`%s': %s] ", 
-								    uri, nerror->message);
+			add_failure (&run, uris[i], nerror->message);
 			g_error_free (nerror);
-			failed = g_list_prepend (failed, g_strdup (uri));
-			nerror = NULL;
-		}
+		} else if (item->helper)
+			batch = g_list_prepend (batch, item);
+		else
+			run.pending = g_list_prepend (run.pending, item);
 
-		if (file)
-			g_object_unref (file);
-		if (info)
-			g_object_unref (info);
+		i++;
+	}
 
-		g_free (large);
-		g_free (normal);
-		g_free (cropped);
+	run.pending = g_list_reverse (run.pending);
+	batch = g_list_reverse (batch);
 
-		i++;
+	/* Up to max_processes children run concurrently. We are in one of the
+	 * daemon's worker threads, so we wait for them in a private context
+	 * and don't touch the daemon's mainloop */
+
+	if (run.pending) {
+		run.context = g_main_context_new ();
+		run.loop = g_main_loop_new (run.context, FALSE);
+
+		spawn_next (&run);
+
+		if (run.running > 0)
+			g_main_loop_run (run.loop);
+
+		g_main_loop_unref (run.loop);
+		g_main_context_unref (run.context);
+	}
+
+	for (copy = batch; copy; copy = g_list_next (copy)) {
+		run_batch_item (&run, copy->data);
+		free_item (copy->data);
 	}
 
-	if (errors && failed) {
+	g_list_free (batch);
+
+	if (run.errors && run.failed) {
 		guint t = 0;
-		GStrv furis = (GStrv) g_malloc0 (sizeof (gchar*) * (g_list_length (failed) + 1));
-		GList *copy = failed;
+		GStrv furis = (GStrv) g_malloc0 (sizeof (gchar*) * (g_list_length (run.failed) + 1));
 
-		t = 0;
+		copy = run.failed;
 
 		while (copy) {
-			GFile *file;
-			GFileInfo *info;
-
 			furis[t] = copy->data;
 
-			file = g_file_new_for_uri (furis[t]);
-			info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
-						  G_FILE_QUERY_INFO_NONE,
-						  NULL, NULL);
-			if (info) {
-				guint64 mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
-				hildon_thumbnail_outplugins_put_error (mtime, furis[t], NULL);
-				g_object_unref (info);
+			if (!g_list_find (run.transient, copy->data)) {
+				GFile *file = g_file_new_for_uri (furis[t]);
+				GFileInfo *info;
+
+				info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+							  G_FILE_QUERY_INFO_NONE,
+							  NULL, NULL);
+				if (info) {
+					guint64 mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+					hildon_thumbnail_outplugins_put_error (mtime, furis[t], NULL);
+					g_object_unref (info);
+				}
+
+				g_object_unref (file);
 			}
 
-			g_object_unref (file);
 			copy = g_list_next (copy);
 			t++;
 		}
@@ -348,50 +739,89 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 
 		*failed_uris = furis;
 
-		g_list_free (failed);
+		g_list_free (run.failed);
+		g_list_free (run.transient);
 
 		g_set_error (error, EXEC_ERROR, 0,
-			     "%s", errors->str);
+			     "%s", run.errors->str);
 
-		g_string_free (errors, TRUE);
+		g_string_free (run.errors, TRUE);
 	}
 
 	return;
 }
 
-gboolean 
+gboolean
 hildon_thumbnail_plugin_stop (void)
 {
+	GHashTableIter iter;
+	gpointer value;
+	GList *copy;
+
+	g_mutex_lock (&mutex);
+
+	/* Kill whatever is still running, the waiting threads will notice
+	 * through their child watches and broken pipes */
+
+	for (copy = children; copy; copy = g_list_next (copy))
+		kill (GPOINTER_TO_INT (copy->data), SIGKILL);
+
+	g_hash_table_iter_init (&iter, helpers);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		BatchHelper *helper = value;
+		if (helper->running)
+			kill (helper->pid, SIGKILL);
+	}
+
+	/* prepare_item looks these up with the mutex held. Helpers that an
+	 * item still holds stay around until that item is done */
+	g_hash_table_unref (helpers);
+	helpers = NULL;
+	g_hash_table_unref (execs);
+	execs = NULL;
+
 	if (supported)
 		g_strfreev (supported);
 	supported = NULL;
+
+	g_mutex_unlock (&mutex);
+
 	if (monitor)
 		g_object_unref (monitor);
-	g_hash_table_unref (execs);
-	execs = NULL;
 	return FALSE;
 }
 
 static void
-reload_config (const gchar *config) 
+reload_config (const gchar *config)
 {
 	GKeyFile *keyfile;
 	GStrv mimetypes;
 	guint i = 0;
 	gsize length;
 	GError *error = NULL;
+	gint value;
+
+	g_mutex_lock (&mutex);
 
 	if (!execs)
 		execs = g_hash_table_new_full (g_str_hash, g_str_equal,
 					       (GDestroyNotify) g_free,
-					       (GDestroyNotify) g_free);
+					       (GDestroyNotify) free_execinfo);
+
+	if (!helpers)
+		helpers = g_hash_table_new_full (g_str_hash, g_str_equal,
+						 NULL,
+						 (GDestroyNotify) helper_unref);
 
 	keyfile = g_key_file_new ();
 
 	if (!g_key_file_load_from_file (keyfile, config, G_KEY_FILE_NONE, NULL)) {
 		do_cropped = TRUE;
 		do_pngs = FALSE;
+		max_processes = DEFAULT_MAX_PROCESSES;
+		timeout = DEFAULT_TIMEOUT;
 		g_key_file_free (keyfile);
+		g_mutex_unlock (&mutex);
 		return;
 	}
 
@@ -400,19 +830,41 @@ reload_config (const gchar *config)
 
 	if (error) {
 		do_pngs = FALSE;
-		g_error_free (error);
+		g_clear_error (&error);
+	}
+
+	value = g_key_file_get_integer (keyfile, "Hildon Thumbnailer", "MaxProcesses", &error);
+	if (error || value < 1) {
+		value = DEFAULT_MAX_PROCESSES;
+		g_clear_error (&error);
+	}
+	max_processes = value;
+
+	/* In seconds, 0 means that we wait forever */
+	value = g_key_file_get_integer (keyfile, "Hildon Thumbnailer", "Timeout", &error);
+	if (error || value < 0) {
+		value = DEFAULT_TIMEOUT;
+		g_clear_error (&error);
 	}
+	timeout = value;
 
 	mimetypes = g_key_file_get_string_list (keyfile, "Hildon Thumbnailer", "MimeTypes", &length, NULL);
 
 	while (mimetypes && mimetypes[i] != NULL) {
-		gchar *exec = g_key_file_get_string (keyfile, mimetypes[i], "Exec", NULL);
-		g_hash_table_replace (execs, g_strdup (mimetypes[i]), exec);
+		ExecInfo *info = g_slice_new0 (ExecInfo);
+
+		info->exec = g_key_file_get_string (keyfile, mimetypes[i], "Exec", NULL);
+		info->input = g_key_file_get_string (keyfile, mimetypes[i], "Input", NULL);
+		info->batch = g_key_file_get_boolean (keyfile, mimetypes[i], "Batch", NULL);
+
+		g_hash_table_replace (execs, g_strdup (mimetypes[i]), info);
 		i++;
 	}
 
 	g_strfreev (mimetypes);
 	g_key_file_free (keyfile);
+
+	g_mutex_unlock (&mutex);
 }
 
 static void 
@@ -40,6 +40,7 @@
 
 #include "utils.h"
 #include "gdkpixbuf-plugin.h"
+#include "stream-scaler.h"
 
 #include <hildon-thumbnail-plugin.h>
 
@@ -57,6 +58,13 @@
 #define MAX_H		(10000)
 #endif
 
+/* PNGs with more pixels than this are never decoded at full size, they
+ * are streamed through a scaler down to REDUCED_PIX pixels instead. Its
+ * short side stays at least REDUCED_SIDE, the largest flavor */
+#define STREAM_PIX	(2048*2048)
+#define REDUCED_PIX	(320*320)
+#define REDUCED_SIDE	256
+
 GdkPixbuf *
 my_gdk_pixbuf_new_from_stream_at_scale (GInputStream  *stream,
 				     gint	    width,
@@ -119,38 +127,124 @@ crop_resize (GdkPixbuf *src, int width, int height) {
 	return hildon_thumbnail_crop_resize (src, width, height);
 }
 
+/* Skips a chain of data sub-blocks, up to and including the empty one */
 static gboolean
-is_animated_gif (const gchar *filename)
+skip_gif_blocks (GInputStream *stream)
 {
-	guint frame_count = 0;
-	FILE *gif_file = fopen (filename, "r");
-
-	if (gif_file) {
-		while (!feof (gif_file) && frame_count < 2) {
-			gchar buffer[1024] = { '\0' };
-			size_t read;
-			size_t t;
-
-			read = fread (buffer, 1, 1024, gif_file);
-			for (t = 0; t < read; t++) {
-//				if (buffer[t]   == 0x00 && buffer[t+1] == 0x21 &&
-//				    buffer[t+2] == 0xF9 && buffer[t+3] == 0x04) {
-//					    frame_count++;
-//				}
-				if (buffer[t]   == 0x00 && buffer[t+1] == 0x2C) {
-					    frame_count++;
-				}
+	guchar size;
 
-			}
-		}
+	do {
+		if (g_input_stream_read (stream, &size, 1, NULL, NULL) != 1)
+			return FALSE;
+		if (size > 0 && g_input_stream_skip (stream, size, NULL, NULL) != size)
+			return FALSE;
+	} while (size > 0);
 
-		fclose (gif_file);
+	return TRUE;
+}
+
+/* Walks the blocks of the GIF up to its second image. Only the block
+ * headers are looked at, the image data is skipped over. head holds the
+ * file's first bytes */
+static gboolean
+is_animated_gif (GFileInputStream *file_stream, const guchar *head, gsize head_len)
+{
+	GInputStream *stream;
+	guint frame_count = 0;
+	gsize table = 0;
+	guchar block[9];
+
+	if (head_len < 13)
+		return FALSE;
+
+	/* The global color table follows the logical screen descriptor */
+	if (head[10] & 0x80)
+		table = 3 << ((head[10] & 0x07) + 1);
+
+	if (!g_seekable_seek (G_SEEKABLE (file_stream), 13 + table, G_SEEK_SET, NULL, NULL))
+		return FALSE;
+
+	/* The blocks are small, they come from a buffer rather than with a
+	 * system call each */
+	stream = g_buffered_input_stream_new_sized (G_INPUT_STREAM (file_stream), 16384);
+	g_filter_input_stream_set_close_base_stream (G_FILTER_INPUT_STREAM (stream), FALSE);
+
+	while (frame_count < 2) {
+		if (g_input_stream_read (stream, block, 1, NULL, NULL) != 1)
+			break;
+
+		if (block[0] == 0x2C) {
+			/* Image descriptor, maybe a local color table, the
+			 * LZW code size and the image data */
+			frame_count++;
+
+			if (frame_count > 1)
+				break;
+
+			if (g_input_stream_read (stream, block, 9, NULL, NULL) != 9)
+				break;
+
+			table = (block[8] & 0x80) ? 3 << ((block[8] & 0x07) + 1) : 0;
+
+			if (g_input_stream_skip (stream, table + 1, NULL, NULL) != (gssize) (table + 1) ||
+			    !skip_gif_blocks (stream))
+				break;
+		} else if (block[0] == 0x21) {
+			/* Extension, a label and its sub-blocks */
+			if (g_input_stream_read (stream, block, 1, NULL, NULL) != 1 ||
+			    !skip_gif_blocks (stream))
+				break;
+		} else {
+			/* The trailer, or something that isn't a GIF */
+			break;
+		}
 	}
 
+	g_object_unref (stream);
+
 	return (frame_count > 1);
 }
 
 
+/* Like my_gdk_pixbuf_new_from_stream_at_scale, from reduced when we have it */
+static GdkPixbuf *
+load_at_scale (GFileInputStream *stream, GdkPixbuf *reduced, gint size, GError **error)
+{
+	gint width, height;
+
+	if (!reduced)
+		return my_gdk_pixbuf_new_from_stream_at_scale (G_INPUT_STREAM (stream),
+							       size, size,
+							       TRUE,
+							       NULL,
+							       error);
+
+	width = gdk_pixbuf_get_width (reduced);
+	height = gdk_pixbuf_get_height (reduced);
+
+	if ((double) height * (double) size > (double) width * (double) size) {
+		width = 0.5 + (double) width * (double) size / (double) height;
+		height = size;
+	} else {
+		height = 0.5 + (double) height * (double) size / (double) width;
+		width = size;
+	}
+
+	return gdk_pixbuf_scale_simple (reduced, MAX (width, 1), MAX (height, 1),
+					GDK_INTERP_BILINEAR);
+}
+
+static GdkPixbuf *
+load_full (GFileInputStream *stream, GdkPixbuf *reduced, GError **error)
+{
+	if (reduced)
+		return g_object_ref (reduced);
+
+	return my_gdk_pixbuf_new_from_stream (G_INPUT_STREAM (stream), 
+					      NULL, MAX_PIX, 
+					      MAX_W, MAX_H, error);
+}
+
 void
 hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris, GError **error)
 {
@@ -160,7 +254,7 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 
 	while (uris[i] != NULL) {
 		GError *nerror = NULL;
-		GFileInfo *info;
+		GFileInfo *info = NULL;
 		GFile *file;
 		GFileInputStream *stream=NULL;
 		gchar *uri = uris[i];
@@ -173,35 +267,54 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 		guint rowstride; 
 		gboolean err_file = FALSE;
 		gchar *path; 
+		GdkPixbuf *reduced = NULL;
+		gboolean streamed = FALSE;
+		guchar head[32];
+		gsize head_len = 0;
 
 		file = g_file_new_for_uri (uri);
 
 		path = g_file_get_path (file);
 
-		if (path) {
-			gchar *up = g_utf8_strup (path, -1);
-			if (g_str_has_suffix (up, "GIF")) {
-				if (is_animated_gif (path)) {
-					g_set_error (&nerror, DEFAULT_ERROR, 0,
-						     "Animated GIF (%s) is not supported",
-						     uri);
-				}
-			}
-			g_free (path);
-			g_free (up);
+		/* The one open of the item, what's needed before decoding
+		 * comes from its first bytes and from the open stream */
+		stream = g_file_read (file, NULL, &nerror);
+
+		if (nerror)
+			goto nerror_handler;
+
+		info = g_file_input_stream_query_info (stream, G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+							       G_FILE_ATTRIBUTE_STANDARD_SIZE,
+						       NULL, &nerror);
+
+		if (nerror)
+			goto nerror_handler;
+
+		g_input_stream_read_all (G_INPUT_STREAM (stream), head, sizeof (head),
+					 &head_len, NULL, &nerror);
+
+		if (nerror)
+			goto nerror_handler;
+
+		if (head_len >= 6 && memcmp (head, "GIF8", 4) == 0 &&
+		    is_animated_gif (stream, head, head_len)) {
+			g_set_error (&nerror, DEFAULT_ERROR, 0,
+				     "Animated GIF (%s) is not supported",
+				     uri);
+			goto nerror_handler;
 		}
-		
-		info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED ","
-					        G_FILE_ATTRIBUTE_STANDARD_SIZE,
-					  G_FILE_QUERY_INFO_NONE,
-					  NULL, &nerror);
+
+		streamed = path && stream_scaler_probe_png (head, head_len, &width, &height) &&
+			   (guint64) width * height > STREAM_PIX;
+
+		g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, NULL, &nerror);
 
 		if (nerror)
 			goto nerror_handler;
 
 		msize = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
 		
-		if (msize > MAX_SIZE) {
+		if (msize > MAX_SIZE && !streamed) {
 			g_set_error (&nerror, DEFAULT_ERROR, 0, "%s is too large",
 				     uri);
 			goto nerror_handler;
@@ -219,7 +332,9 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 		    !hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_CROPPED, mtime, uri, &err_file))
 			goto nerror_handler;
 
-		stream = g_file_read (file, NULL, &nerror);
+		if (streamed)
+			reduced = stream_scaler_load_png (path, REDUCED_PIX, REDUCED_SIDE,
+							  &nerror);
 
 		if (nerror)
 			goto nerror_handler;
@@ -227,11 +342,7 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 #ifdef LARGE_THUMBNAILS
 		if (hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_LARGE, mtime, uri, &err_file)) {
 
-			GdkPixbuf *pixbuf_large1 = my_gdk_pixbuf_new_from_stream_at_scale (G_INPUT_STREAM (stream),
-									    256, 256,
-									    TRUE,
-									    NULL,
-									    &nerror);
+			GdkPixbuf *pixbuf_large1 = load_at_scale (stream, reduced, 256, &nerror);
 
 			if (nerror) {
 				if (pixbuf_large1)
@@ -263,7 +374,8 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 			if (nerror)
 				goto nerror_handler;
 
-			g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, NULL, &nerror);
+			if (stream)
+				g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, NULL, &nerror);
 
 			if (nerror)
 				goto nerror_handler;
@@ -276,11 +388,7 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 
 		if (hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_NORMAL, mtime, uri, &err_file)) {
 
-			GdkPixbuf *pixbuf_normal1 = my_gdk_pixbuf_new_from_stream_at_scale (G_INPUT_STREAM (stream),
-									     128, 128,
-									     TRUE,
-									     NULL,
-									     &nerror);
+			GdkPixbuf *pixbuf_normal1 = load_at_scale (stream, reduced, 128, &nerror);
 
 			if (nerror) {
 				if (pixbuf_normal1)
@@ -312,7 +420,8 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 			if (nerror)
 				goto nerror_handler;
 
-			g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, NULL, &nerror);
+			if (stream)
+				g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, NULL, &nerror);
 
 			if (nerror)
 				goto nerror_handler;
@@ -324,9 +433,7 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 		if (do_cropped && hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_CROPPED, mtime, uri, &err_file)) {
 			int a, b;
 
-			GdkPixbuf *pixbuf1 = my_gdk_pixbuf_new_from_stream (G_INPUT_STREAM (stream), 
-									    NULL, MAX_PIX, 
-									    MAX_W, MAX_H, &nerror);
+			GdkPixbuf *pixbuf1 = load_full (stream, reduced, &nerror);
 
 			if (nerror) {
 				if (pixbuf1)
@@ -434,6 +541,9 @@ hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris
 
 		if (stream)
 			g_object_unref (stream);
+		if (reduced)
+			g_object_unref (reduced);
+		g_free (path);
 
 		if (info)
 			g_object_unref (info);
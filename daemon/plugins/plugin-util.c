@@ -0,0 +1,299 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "utils.h"
+#include "plugin-util.h"
+
+#include <hildon-thumbnail-plugin.h>
+
+#define BE32(p)		(((guint32) (p)[0] << 24) | ((guint32) (p)[1] << 16) | \
+			 ((guint32) (p)[2] << 8) | (guint32) (p)[3])
+
+gboolean
+plugin_util_read_at (GInputStream *stream, guint64 offset, guchar *buffer, gsize len)
+{
+	gsize read = 0;
+
+	if (!g_seekable_seek (G_SEEKABLE (stream), offset, G_SEEK_SET, NULL, NULL))
+		return FALSE;
+
+	return g_input_stream_read_all (stream, buffer, len, &read, NULL, NULL) && read == len;
+}
+
+/* Finds the box of type between start and end, its contents go from body
+ * to body_end. Boxes we don't want, like mdat, are seeked over */
+gboolean
+plugin_util_mp4_find_box (GInputStream *stream, guint64 start, guint64 end, const gchar *type, guint64 *body, guint64 *body_end)
+{
+	guint64 pos = start;
+
+	while (pos + 8 <= end) {
+		guchar header[16];
+		guint64 size;
+		guint hlen = 8;
+
+		if (!plugin_util_read_at (stream, pos, header, 8))
+			return FALSE;
+
+		size = BE32 (header);
+
+		if (size == 1) {
+			if (!plugin_util_read_at (stream, pos + 8, header + 8, 8))
+				return FALSE;
+			size = ((guint64) BE32 (header + 8) << 32) | BE32 (header + 12);
+			hlen = 16;
+		} else if (size == 0) {
+			size = end - pos;
+		}
+
+		if (size < hlen || size > end - pos)
+			return FALSE;
+
+		if (memcmp (header + 4, type, 4) == 0) {
+			*body = pos + hlen;
+			*body_end = pos + size;
+			return TRUE;
+		}
+
+		pos += size;
+	}
+
+	return FALSE;
+}
+
+GdkPixbuf *
+plugin_util_scale_to_fit (GdkPixbuf *pixbuf, gint size)
+{
+	gint w = gdk_pixbuf_get_width (pixbuf);
+	gint h = gdk_pixbuf_get_height (pixbuf);
+
+	if (w <= size && h <= size)
+		return g_object_ref (pixbuf);
+
+	if (w > h)
+		return gdk_pixbuf_scale_simple (pixbuf, size, MAX (1, h * size / w),
+						GDK_INTERP_BILINEAR);
+
+	return gdk_pixbuf_scale_simple (pixbuf, MAX (1, w * size / h), size,
+					GDK_INTERP_BILINEAR);
+}
+
+/* The size the picture's smallest side needs to have for the largest of the
+ * flavors we still have to make, 0 when there's none left */
+guint
+plugin_util_wanted_size (guint64 mtime, const gchar *uri, gboolean *err_file)
+{
+#ifdef LARGE_THUMBNAILS
+	if (hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_LARGE, mtime, uri, err_file))
+		return 256;
+#endif
+#ifdef NORMAL_THUMBNAILS
+	if (hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_NORMAL, mtime, uri, err_file))
+		return 128;
+#endif
+	if (hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_CROPPED, mtime, uri, err_file))
+		return 124;
+
+	return 0;
+}
+
+static void
+output_flavor (GdkPixbuf *pixbuf, HildonThumbnailPluginOutType type, guint64 mtime, const gchar *uri, GError **error)
+{
+	hildon_thumbnail_outplugins_do_out (gdk_pixbuf_get_pixels (pixbuf),
+					    gdk_pixbuf_get_width (pixbuf),
+					    gdk_pixbuf_get_height (pixbuf),
+					    gdk_pixbuf_get_rowstride (pixbuf),
+					    gdk_pixbuf_get_bits_per_sample (pixbuf),
+					    gdk_pixbuf_get_has_alpha (pixbuf),
+					    type,
+					    mtime,
+					    uri,
+					    error);
+}
+
+void
+plugin_util_create_flavors (GdkPixbuf *pixbuf, guint64 mtime, const gchar *uri, gboolean *err_file, GError **error)
+{
+	GdkPixbuf *flavor;
+	GError *nerror = NULL;
+
+#ifdef LARGE_THUMBNAILS
+	if (hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_LARGE, mtime, uri, err_file)) {
+		flavor = plugin_util_scale_to_fit (pixbuf, 256);
+		output_flavor (flavor, HILDON_THUMBNAIL_PLUGIN_OUTTYPE_LARGE, mtime, uri, &nerror);
+		g_object_unref (flavor);
+
+		if (nerror) {
+			g_propagate_error (error, nerror);
+			return;
+		}
+	}
+#endif
+
+#ifdef NORMAL_THUMBNAILS
+	if (hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_NORMAL, mtime, uri, err_file)) {
+		flavor = plugin_util_scale_to_fit (pixbuf, 128);
+		output_flavor (flavor, HILDON_THUMBNAIL_PLUGIN_OUTTYPE_NORMAL, mtime, uri, &nerror);
+		g_object_unref (flavor);
+
+		if (nerror) {
+			g_propagate_error (error, nerror);
+			return;
+		}
+	}
+#endif
+
+	if (hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_CROPPED, mtime, uri, err_file)) {
+
+		/* Same rules as the gdkpixbuf plugin, from NB#118963 */
+
+		if (gdk_pixbuf_get_width (pixbuf) < 124 || gdk_pixbuf_get_height (pixbuf) < 124)
+			flavor = plugin_util_scale_to_fit (pixbuf, 124);
+		else
+			flavor = hildon_thumbnail_crop_resize (pixbuf, 124, 124);
+
+		output_flavor (flavor, HILDON_THUMBNAIL_PLUGIN_OUTTYPE_CROPPED, mtime, uri, &nerror);
+		g_object_unref (flavor);
+
+		if (nerror)
+			g_propagate_error (error, nerror);
+	}
+}
+
+/* The body of hildon_thumbnail_plugin_create for these plugins: load's
+ * picture for each item that still misses a flavor, failures reported the
+ * way the daemon expects them, in domain */
+void
+plugin_util_create (GStrv uris, PluginUtilLoadFunc load, GQuark domain, GStrv *failed_uris, GError **error)
+{
+	guint i = 0;
+	GString *errors = NULL;
+	GList *failed = NULL;
+
+	while (uris[i] != NULL) {
+		GError *nerror = NULL;
+		GFileInfo *info = NULL;
+		GFile *file;
+		GFileInputStream *stream = NULL;
+		gchar *uri = uris[i];
+		GdkPixbuf *pixbuf;
+		guint64 mtime, size;
+		gboolean err_file = FALSE;
+		guint wanted;
+
+		file = g_file_new_for_uri (uri);
+
+		info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+					        G_FILE_ATTRIBUTE_STANDARD_SIZE,
+					  G_FILE_QUERY_INFO_NONE,
+					  NULL, &nerror);
+
+		if (nerror)
+			goto nerror_handler;
+
+		mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+		size = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
+
+		wanted = plugin_util_wanted_size (mtime, uri, &err_file);
+
+		if (wanted == 0)
+			goto nerror_handler;
+
+		stream = g_file_read (file, NULL, &nerror);
+
+		if (nerror)
+			goto nerror_handler;
+
+		pixbuf = load (G_INPUT_STREAM (stream), size, wanted, &nerror);
+
+		if (nerror)
+			goto nerror_handler;
+
+		plugin_util_create_flavors (pixbuf, mtime, uri, &err_file, &nerror);
+
+		g_object_unref (pixbuf);
+
+		nerror_handler:
+
+		if (stream)
+			g_input_stream_close (G_INPUT_STREAM (stream), NULL, NULL);
+
+		if (nerror || err_file) {
+			if (!errors)
+				errors = g_string_new ("");
+			g_string_append_printf (errors, "[`%s': %s] ",
+						uri, nerror ? nerror->message:"Had error before");
+
+			if (!err_file && info) {
+				hildon_thumbnail_outplugins_put_error (g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+								       uri, nerror);
+			}
+
+			failed = g_list_prepend (failed, g_strdup (uri));
+			if (nerror)
+				g_error_free (nerror);
+			nerror = NULL;
+		}
+
+		if (stream)
+			g_object_unref (stream);
+		if (info)
+			g_object_unref (info);
+		g_object_unref (file);
+
+		i++;
+	}
+
+	if (errors && failed) {
+		guint t = 0;
+		GStrv furis = (GStrv) g_malloc0 (sizeof (gchar*) * (g_list_length (failed) + 1));
+		GList *copy = failed;
+
+		while (copy) {
+			furis[t] = copy->data;
+			copy = g_list_next (copy);
+			t++;
+		}
+		furis[t] = NULL;
+
+		*failed_uris = furis;
+
+		g_list_free (failed);
+
+		g_set_error (error, domain, 0,
+			     "%s", errors->str);
+
+		g_string_free (errors, TRUE);
+	}
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __PLUGIN_UTIL_H__
+#define __PLUGIN_UTIL_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+G_BEGIN_DECLS
+
+/* What the plugins that dig a picture out of a file have in common: reading
+ * at an offset, walking MP4 boxes, and making the flavors out of what they
+ * found. The load function gets the file's stream and the size the smallest
+ * side of its picture needs to have */
+
+typedef GdkPixbuf * (*PluginUtilLoadFunc) (GInputStream *stream,
+					   guint64 file_size,
+					   guint wanted,
+					   GError **error);
+
+gboolean   plugin_util_read_at        (GInputStream *stream,
+				       guint64 offset,
+				       guchar *buffer,
+				       gsize len);
+gboolean   plugin_util_mp4_find_box   (GInputStream *stream,
+				       guint64 start,
+				       guint64 end,
+				       const gchar *type,
+				       guint64 *body,
+				       guint64 *body_end);
+GdkPixbuf *plugin_util_scale_to_fit   (GdkPixbuf *pixbuf,
+				       gint size);
+guint      plugin_util_wanted_size    (guint64 mtime,
+				       const gchar *uri,
+				       gboolean *err_file);
+void       plugin_util_create_flavors (GdkPixbuf *pixbuf,
+				       guint64 mtime,
+				       const gchar *uri,
+				       gboolean *err_file,
+				       GError **error);
+void       plugin_util_create         (GStrv uris,
+				       PluginUtilLoadFunc load,
+				       GQuark domain,
+				       GStrv *failed_uris,
+				       GError **error);
+
+G_END_DECLS
+
+#endif
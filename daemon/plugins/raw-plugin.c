@@ -0,0 +1,580 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <dbus/dbus-glib-bindings.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#ifdef HAVE_EPEG
+#include <Epeg.h>
+#endif
+
+#define RAW_ERROR_DOMAIN	"HildonThumbnailerRaw"
+#define RAW_ERROR		g_quark_from_static_string (RAW_ERROR_DOMAIN)
+
+/* Full size previews of current cameras are a few MB */
+#define MAX_PREVIEW_SIZE	(1024*1024*32)
+
+/* Bounds for walking the IFDs of broken or hostile files */
+#define MAX_IFDS		32
+#define MAX_DEPTH		4
+#define MAX_ENTRIES		1024
+
+/* TIFF tags */
+#define TAG_COMPRESSION		0x0103
+#define TAG_PHOTOMETRIC		0x0106
+#define TAG_STRIP_OFFSETS	0x0111
+#define TAG_ORIENTATION		0x0112
+#define TAG_STRIP_BYTE_COUNTS	0x0117
+#define TAG_SUB_IFDS		0x014a
+#define TAG_JPEG_OFFSET		0x0201
+#define TAG_JPEG_LENGTH		0x0202
+#define TAG_EXIF_IFD		0x8769
+#define TAG_MAKER_NOTE		0x927c
+
+/* Maker note tags */
+#define TAG_NIKON_PREVIEW_IFD	0x0011
+#define TAG_OLYMPUS_CAMERA	0x2020
+#define TAG_OLYMPUS_PREVIEW	0x0101
+#define TAG_OLYMPUS_LENGTH	0x0102
+
+/* Photometric interpretations of the sensor data itself (CFA, LinearRaw) */
+#define PHOTOMETRIC_CFA		32803
+#define PHOTOMETRIC_LINEAR_RAW	34892
+
+#include "utils.h"
+#include "plugin-util.h"
+#include "raw-plugin.h"
+
+#include <hildon-thumbnail-plugin.h>
+
+typedef enum {
+	IFD_TIFF,
+	IFD_NIKON,
+	IFD_OLYMPUS,
+	IFD_OLYMPUS_CAMERA
+} IfdKind;
+
+typedef struct {
+	guint64 offset, length;
+	guint width, height;
+} Preview;
+
+typedef struct {
+	GInputStream *stream;
+	guint64 file_size;
+	GArray *previews;
+	guint ifds;
+	gint orientation;
+} RawScan;
+
+static const gchar *supported[] = {
+	"image/x-adobe-dng",
+	"image/x-canon-cr2",
+	"image/x-nikon-nef",
+	"image/x-nikon-nrw",
+	"image/x-sony-arw",
+	"image/x-olympus-orf",
+	NULL
+};
+
+const gchar**
+hildon_thumbnail_plugin_supported (void)
+{
+	return supported;
+}
+
+static guint
+get16 (const guchar *p, gboolean big_endian)
+{
+	return big_endian ? ((guint) p[0] << 8) | p[1] : ((guint) p[1] << 8) | p[0];
+}
+
+static guint32
+get32 (const guchar *p, gboolean big_endian)
+{
+	return big_endian ?
+		((guint32) p[0] << 24) | ((guint32) p[1] << 16) | ((guint32) p[2] << 8) | p[3] :
+		((guint32) p[3] << 24) | ((guint32) p[2] << 16) | ((guint32) p[1] << 8) | p[0];
+}
+
+/* The value of a SHORT, LONG or IFD entry with a count of one */
+static guint32
+entry_value (const guchar *entry, gboolean big_endian)
+{
+	guint type = get16 (entry + 2, big_endian);
+
+	if (type == 3 || type == 8)
+		return get16 (entry + 8, big_endian);
+
+	return get32 (entry + 8, big_endian);
+}
+
+/* Checks that there's a JPEG at offset we can decode, and gets its size.
+ * The lossless JPEG (SOF3) that CR2 and DNG use for sensor data is not */
+static gboolean
+probe_jpeg (RawScan *scan, guint64 offset, guint64 length, guint *width, guint *height)
+{
+	guint64 pos = offset + 2, end = offset + length;
+	guchar buffer[9];
+	guint markers;
+
+	if (!plugin_util_read_at (scan->stream, offset, buffer, 2) || buffer[0] != 0xff || buffer[1] != 0xd8)
+		return FALSE;
+
+	for (markers = 0; markers < 64 && pos + 4 <= end; markers++) {
+		guint marker, len;
+
+		if (!plugin_util_read_at (scan->stream, pos, buffer, 4) || buffer[0] != 0xff)
+			return FALSE;
+
+		marker = buffer[1];
+		len = ((guint) buffer[2] << 8) | buffer[3];
+
+		if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			if (marker > 0xc2 || !plugin_util_read_at (scan->stream, pos + 4, buffer, 5))
+				return FALSE;
+
+			*height = ((guint) buffer[1] << 8) | buffer[2];
+			*width = ((guint) buffer[3] << 8) | buffer[4];
+
+			return *width > 0 && *height > 0;
+		}
+
+		if (marker == 0xda || marker == 0xd9)
+			return FALSE;
+
+		pos += 2 + len;
+	}
+
+	return FALSE;
+}
+
+static void
+add_preview (RawScan *scan, guint64 offset, guint64 length)
+{
+	Preview preview;
+	guint i;
+
+	if (length < 4 || length > MAX_PREVIEW_SIZE ||
+	    offset >= scan->file_size || length > scan->file_size - offset)
+		return;
+
+	/* CR2 and NEF point at the same preview from more than one place */
+	for (i = 0; i < scan->previews->len; i++) {
+		if (g_array_index (scan->previews, Preview, i).offset == offset)
+			return;
+	}
+
+	if (!probe_jpeg (scan, offset, length, &preview.width, &preview.height))
+		return;
+
+	preview.offset = offset;
+	preview.length = length;
+
+	g_array_append_val (scan->previews, preview);
+}
+
+static void walk_ifd (RawScan *scan, gboolean big_endian, guint64 base, guint64 offset, guint depth, IfdKind kind);
+
+/* Nikon maker notes are "Nikon\0", a version and then a TIFF of their own.
+ * New Olympus ones are "OLYMPUS\0" and a byte order, offsets in them are
+ * from the maker note's start; old ones, "OLYMP\0", use the file's */
+static void
+walk_maker_note (RawScan *scan, gboolean big_endian, guint64 offset, guint64 length, guint depth)
+{
+	guchar header[18];
+
+	if (length < sizeof (header) || !plugin_util_read_at (scan->stream, offset, header, sizeof (header)))
+		return;
+
+	if (memcmp (header, "Nikon\0", 6) == 0) {
+		gboolean nikon_be;
+
+		if (memcmp (header + 10, "MM", 2) == 0)
+			nikon_be = TRUE;
+		else if (memcmp (header + 10, "II", 2) == 0)
+			nikon_be = FALSE;
+		else
+			return;
+
+		walk_ifd (scan, nikon_be, offset + 10,
+			  get32 (header + 14, nikon_be), depth + 1, IFD_NIKON);
+
+	} else if (memcmp (header, "OLYMPUS\0", 8) == 0) {
+		walk_ifd (scan, memcmp (header + 8, "MM", 2) == 0, offset,
+			  12, depth + 1, IFD_OLYMPUS);
+
+	} else if (memcmp (header, "OLYMP\0", 6) == 0) {
+		walk_ifd (scan, big_endian, 0, offset + 8, depth + 1, IFD_OLYMPUS);
+	}
+}
+
+static void
+walk_ifd (RawScan *scan, gboolean big_endian, guint64 base, guint64 offset, guint depth, IfdKind kind)
+{
+	guchar count_buf[4];
+	guchar *entries;
+	guint count, i;
+	guint32 compression = 0, photometric = 0;
+	guint64 strip_offset = 0, strip_length = 0;
+	guint64 jpeg_offset = 0, jpeg_length = 0;
+
+	if (depth > MAX_DEPTH || ++scan->ifds > MAX_IFDS)
+		return;
+
+	if (!plugin_util_read_at (scan->stream, base + offset, count_buf, 2))
+		return;
+
+	count = get16 (count_buf, big_endian);
+	if (count == 0 || count > MAX_ENTRIES)
+		return;
+
+	entries = g_malloc (count * 12);
+
+	if (!plugin_util_read_at (scan->stream, base + offset + 2, entries, count * 12)) {
+		g_free (entries);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		const guchar *entry = entries + i * 12;
+		guint tag = get16 (entry, big_endian);
+		guint32 n = get32 (entry + 4, big_endian);
+		guint32 value = entry_value (entry, big_endian);
+
+		switch (kind) {
+		case IFD_TIFF:
+			switch (tag) {
+			case TAG_COMPRESSION:
+				compression = value;
+				break;
+			case TAG_PHOTOMETRIC:
+				photometric = value;
+				break;
+			case TAG_STRIP_OFFSETS:
+				if (n == 1)
+					strip_offset = value;
+				break;
+			case TAG_STRIP_BYTE_COUNTS:
+				if (n == 1)
+					strip_length = value;
+				break;
+			case TAG_JPEG_OFFSET:
+				jpeg_offset = value;
+				break;
+			case TAG_JPEG_LENGTH:
+				jpeg_length = value;
+				break;
+			case TAG_ORIENTATION:
+				/* Only IFD0's counts, that's the picture as a whole */
+				if (depth == 0 && !scan->orientation)
+					scan->orientation = value;
+				break;
+			case TAG_SUB_IFDS:
+				if (n == 1) {
+					walk_ifd (scan, big_endian, base, value, depth + 1, IFD_TIFF);
+				} else if (n > 1 && n <= 8) {
+					guchar offsets[32];
+					guint j;
+
+					if (plugin_util_read_at (scan->stream, base + get32 (entry + 8, big_endian), offsets, n * 4)) {
+						for (j = 0; j < n; j++)
+							walk_ifd (scan, big_endian, base,
+								  get32 (offsets + j * 4, big_endian),
+								  depth + 1, IFD_TIFF);
+					}
+				}
+				break;
+			case TAG_EXIF_IFD:
+				walk_ifd (scan, big_endian, base, value, depth + 1, IFD_TIFF);
+				break;
+			case TAG_MAKER_NOTE:
+				if (n > 4)
+					walk_maker_note (scan, big_endian, base + get32 (entry + 8, big_endian), n, depth);
+				break;
+			}
+			break;
+		case IFD_NIKON:
+			if (tag == TAG_NIKON_PREVIEW_IFD)
+				walk_ifd (scan, big_endian, base, value, depth + 1, IFD_TIFF);
+			break;
+		case IFD_OLYMPUS:
+			if (tag == TAG_OLYMPUS_CAMERA)
+				walk_ifd (scan, big_endian, base, value,
+					  depth + 1, IFD_OLYMPUS_CAMERA);
+			break;
+		case IFD_OLYMPUS_CAMERA:
+			if (tag == TAG_OLYMPUS_PREVIEW)
+				jpeg_offset = value;
+			else if (tag == TAG_OLYMPUS_LENGTH)
+				jpeg_length = value;
+			break;
+		}
+	}
+
+	if (jpeg_offset && jpeg_length)
+		add_preview (scan, base + jpeg_offset, jpeg_length);
+
+	/* CR2's IFD0 and DNG's preview SubIFDs are a single JPEG strip. The
+	 * raw data is that too, but it isn't RGB or YCbCr */
+	if (strip_offset && strip_length && (compression == 6 || compression == 7) &&
+	    photometric != PHOTOMETRIC_CFA && photometric != PHOTOMETRIC_LINEAR_RAW)
+		add_preview (scan, base + strip_offset, strip_length);
+
+	g_free (entries);
+
+	/* IFD0 is followed by IFD1 and so on */
+	if (kind == IFD_TIFF && depth == 0 &&
+	    plugin_util_read_at (scan->stream, base + offset + 2 + count * 12, count_buf, 4)) {
+		guint32 next = get32 (count_buf, big_endian);
+
+		if (next)
+			walk_ifd (scan, big_endian, base, next, depth, IFD_TIFF);
+	}
+}
+
+/* The smallest preview that covers size, or the largest one if none does */
+static Preview *
+pick_preview (RawScan *scan, guint size)
+{
+	Preview *best = NULL;
+	guint i;
+
+	for (i = 0; i < scan->previews->len; i++) {
+		Preview *preview = &g_array_index (scan->previews, Preview, i);
+		gboolean covers = MIN (preview->width, preview->height) >= size;
+		guint64 area = (guint64) preview->width * preview->height;
+
+		if (!best) {
+			best = preview;
+		} else {
+			gboolean best_covers = MIN (best->width, best->height) >= size;
+			guint64 best_area = (guint64) best->width * best->height;
+
+			if ((covers && (!best_covers || area < best_area)) ||
+			    (!covers && !best_covers && area > best_area))
+				best = preview;
+		}
+	}
+
+	return best;
+}
+
+#ifdef HAVE_EPEG
+
+/* Like the epeg plugin: let libjpeg's DCT scaling get us close to size */
+static GdkPixbuf *
+decode_preview (guchar *data, gsize len, guint size, GError **error)
+{
+	Epeg_Image *im;
+	GdkPixbuf *wrapper, *pixbuf = NULL;
+	const guchar *pixels;
+	int ow, oh, ww, wh;
+
+	im = epeg_memory_open (data, len);
+
+	if (!im) {
+		g_set_error (error, RAW_ERROR, 0, "Can't open the embedded preview");
+		return NULL;
+	}
+
+	epeg_size_get (im, &ow, &oh);
+
+	if (MIN (ow, oh) > (int) size) {
+		ww = MAX (1, (gint64) ow * size / MIN (ow, oh));
+		wh = MAX (1, (gint64) oh * size / MIN (ow, oh));
+	} else {
+		ww = ow;
+		wh = oh;
+	}
+
+	epeg_decode_colorspace_set (im, EPEG_RGB8);
+	epeg_decode_size_set (im, ww, wh);
+	epeg_thumbnail_comments_enable (im, 0);
+
+	pixels = epeg_pixels_get (im, 0, 0, ww, wh);
+
+	if (pixels) {
+		wrapper = gdk_pixbuf_new_from_data (pixels, GDK_COLORSPACE_RGB, FALSE,
+						    8, ww, wh, ww * 3, NULL, NULL);
+		pixbuf = gdk_pixbuf_copy (wrapper);
+		g_object_unref (wrapper);
+		epeg_pixels_free (im, pixels);
+	} else {
+		g_set_error (error, RAW_ERROR, 0, "Can't decode the embedded preview");
+	}
+
+	epeg_close (im);
+
+	return pixbuf;
+}
+
+#else
+
+static void
+on_size_prepared (GdkPixbufLoader *loader, gint width, gint height, gpointer user_data)
+{
+	gint size = GPOINTER_TO_INT (user_data);
+	gint smallest = MIN (width, height);
+
+	if (smallest > size)
+		gdk_pixbuf_loader_set_size (loader,
+					    MAX (1, (gint) ((gint64) width * size / smallest)),
+					    MAX (1, (gint) ((gint64) height * size / smallest)));
+}
+
+static GdkPixbuf *
+decode_preview (guchar *data, gsize len, guint size, GError **error)
+{
+	GdkPixbufLoader *loader = gdk_pixbuf_loader_new_with_type ("jpeg", error);
+	GdkPixbuf *pixbuf = NULL;
+
+	if (!loader)
+		return NULL;
+
+	g_signal_connect (loader, "size-prepared", G_CALLBACK (on_size_prepared),
+			  GINT_TO_POINTER (size));
+
+	if (!gdk_pixbuf_loader_write (loader, data, len, error)) {
+		gdk_pixbuf_loader_close (loader, NULL);
+		g_object_unref (loader);
+		return NULL;
+	}
+
+	if (gdk_pixbuf_loader_close (loader, error)) {
+		pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+		if (pixbuf)
+			g_object_ref (pixbuf);
+		else
+			g_set_error (error, RAW_ERROR, 0, "Can't decode the embedded preview");
+	}
+
+	g_object_unref (loader);
+
+	return pixbuf;
+}
+
+#endif
+
+static GdkPixbuf *
+load_preview (GInputStream *stream, guint64 file_size, guint size, GError **error)
+{
+	RawScan scan = { stream, file_size, NULL, 0, 0 };
+	GdkPixbuf *pixbuf = NULL, *oriented;
+	guchar header[8];
+	gboolean big_endian;
+	Preview *preview;
+	guchar *data;
+	guint magic;
+
+	if (!plugin_util_read_at (stream, 0, header, 8)) {
+		g_set_error (error, RAW_ERROR, 0, "Can't read the TIFF header");
+		return NULL;
+	}
+
+	if (memcmp (header, "MM", 2) == 0)
+		big_endian = TRUE;
+	else if (memcmp (header, "II", 2) == 0)
+		big_endian = FALSE;
+	else {
+		g_set_error (error, RAW_ERROR, 0, "Not a TIFF based RAW file");
+		return NULL;
+	}
+
+	/* 42 is TIFF, ORF has "RO" or "RS" here */
+	magic = get16 (header + 2, big_endian);
+	if (magic != 42 && magic != 0x4f52 && magic != 0x5352) {
+		g_set_error (error, RAW_ERROR, 0, "Not a TIFF based RAW file");
+		return NULL;
+	}
+
+	scan.previews = g_array_new (FALSE, FALSE, sizeof (Preview));
+
+	walk_ifd (&scan, big_endian, 0, get32 (header + 4, big_endian), 0, IFD_TIFF);
+
+	preview = pick_preview (&scan, size);
+
+	if (!preview) {
+		g_set_error (error, RAW_ERROR, 0, "No embedded JPEG preview");
+		goto out;
+	}
+
+	data = g_malloc (preview->length);
+
+	if (plugin_util_read_at (stream, preview->offset, data, preview->length))
+		pixbuf = decode_preview (data, preview->length, size, error);
+	else
+		g_set_error (error, RAW_ERROR, 0, "Can't read the embedded preview");
+
+	g_free (data);
+
+	if (pixbuf && scan.orientation > 1 && scan.orientation <= 8) {
+		gchar orientation[2] = { '0' + scan.orientation, '\0' };
+
+		gdk_pixbuf_set_option (pixbuf, "orientation", orientation);
+		oriented = gdk_pixbuf_apply_embedded_orientation (pixbuf);
+		g_object_unref (pixbuf);
+		pixbuf = oriented;
+	}
+
+out:
+	g_array_free (scan.previews, TRUE);
+
+	return pixbuf;
+}
+
+void
+hildon_thumbnail_plugin_create (GStrv uris, gchar *mime_hint, GStrv *failed_uris, GError **error)
+{
+	plugin_util_create (uris, load_preview, RAW_ERROR, failed_uris, error);
+}
+
+gboolean
+hildon_thumbnail_plugin_stop (void)
+{
+	return FALSE;
+}
+
+void
+hildon_thumbnail_plugin_init (gboolean *cropping, hildon_thumbnail_register_func func, gpointer thumbnailer, GModule *module, GError **error)
+{
+	const gchar *uri_schemes[2] = { "file", NULL };
+	guint i;
+
+	*cropping = TRUE;
+
+	/* Priority 1 so that we go before an exec thumbnailer that decodes
+	 * the whole sensor dump for the same mime-type */
+	if (func) {
+		for (i = 0; supported[i] != NULL; i++)
+			func (thumbnailer, supported[i], module, (const GStrv) uri_schemes, 1);
+	}
+}
@@ -0,0 +1,373 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#ifdef HAVE_PNG
+#include <png.h>
+#endif
+
+#include "stream-scaler.h"
+
+#define DEFAULT_ERROR_DOMAIN	"HildonThumbnailerStreamScaler"
+#define DEFAULT_ERROR		g_quark_from_static_string (DEFAULT_ERROR_DOMAIN)
+
+/* Positions are kept in units of 1 / (source size * destination size),
+ * that way a source pixel is dst pixels long, a destination pixel src
+ * pixels long and every overlap is a whole number. Colors are summed
+ * premultiplied by their alpha, transparent pixels don't bleed */
+
+struct StreamScaler {
+	guint src_width, src_height;
+	guint dst_width, dst_height;
+	guint channels;
+	guint src_y, dst_y;
+	guint64 *row;		/* The current source row, scaled horizontally */
+	guint64 *sums;		/* The destination row being accumulated */
+	GdkPixbuf *dst;
+};
+
+/* The largest size with the same aspect ratio that has at most max_pix
+ * pixels, or the source size when that one already fits. The short side
+ * doesn't go below min_side though (nor above the source's), a panorama
+ * would otherwise become a strip that no flavor can be cut from */
+void
+stream_scaler_fit (guint src_width, guint src_height, guint max_pix, guint min_side, guint *dst_width, guint *dst_height)
+{
+	guint low = 1, high = src_width;
+	guint side = MIN (min_side, MIN (src_width, src_height));
+
+	while (low < high) {
+		guint mid = low + (high - low + 1) / 2;
+		guint64 h = MAX ((guint64) src_height * mid / src_width, 1);
+
+		if ((guint64) mid * h <= max_pix)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	*dst_width = low;
+	*dst_height = CLAMP ((guint64) src_height * low / src_width, 1, src_height);
+
+	if (MIN (*dst_width, *dst_height) >= side)
+		return;
+
+	if (src_width <= src_height) {
+		*dst_width = side;
+		*dst_height = CLAMP ((guint64) src_height * side / src_width, 1, src_height);
+	} else {
+		*dst_height = side;
+		*dst_width = CLAMP ((guint64) src_width * side / src_height, 1, src_width);
+	}
+}
+
+StreamScaler *
+stream_scaler_new (guint src_width, guint src_height, guint dst_width, guint dst_height, gboolean has_alpha)
+{
+	StreamScaler *scaler;
+
+	g_return_val_if_fail (dst_width > 0 && dst_width <= src_width, NULL);
+	g_return_val_if_fail (dst_height > 0 && dst_height <= src_height, NULL);
+
+	scaler = g_slice_new0 (StreamScaler);
+
+	scaler->dst = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8,
+				      dst_width, dst_height);
+
+	if (!scaler->dst) {
+		g_slice_free (StreamScaler, scaler);
+		return NULL;
+	}
+
+	scaler->src_width = src_width;
+	scaler->src_height = src_height;
+	scaler->dst_width = dst_width;
+	scaler->dst_height = dst_height;
+	scaler->channels = has_alpha ? 4 : 3;
+	scaler->row = g_new0 (guint64, dst_width * scaler->channels);
+	scaler->sums = g_new0 (guint64, dst_width * scaler->channels);
+
+	return scaler;
+}
+
+static void
+scale_row (StreamScaler *scaler, const guchar *pixels)
+{
+	guint n = scaler->channels;
+	guint x, c;
+
+	memset (scaler->row, 0, sizeof (guint64) * scaler->dst_width * n);
+
+	for (x = 0; x < scaler->src_width; x++) {
+		const guchar *p = pixels + x * n;
+		guint64 pos = (guint64) x * scaler->dst_width;
+		guint64 end = pos + scaler->dst_width;
+		guint i = pos / scaler->src_width;
+		guint64 v[4];
+
+		for (c = 0; c < 3; c++)
+			v[c] = (n == 4) ? (guint64) p[c] * p[3] : p[c];
+		v[3] = (n == 4) ? p[3] : 0;
+
+		while (pos < end) {
+			guint64 next = MIN (end, (guint64) (i + 1) * scaler->src_width);
+			guint64 *out = scaler->row + i * n;
+
+			for (c = 0; c < n; c++)
+				out[c] += (next - pos) * v[c];
+
+			pos = next;
+			i++;
+		}
+	}
+}
+
+static void
+emit_row (StreamScaler *scaler)
+{
+	guchar *out = gdk_pixbuf_get_pixels (scaler->dst) +
+		      scaler->dst_y * gdk_pixbuf_get_rowstride (scaler->dst);
+	guint64 total = (guint64) scaler->src_width * scaler->src_height;
+	guint n = scaler->channels;
+	guint i, c;
+
+	for (i = 0; i < scaler->dst_width; i++) {
+		const guint64 *sums = scaler->sums + i * n;
+
+		if (n == 4) {
+			guint64 alpha = sums[3];
+
+			for (c = 0; c < 3; c++)
+				out[c] = alpha ? (sums[c] + alpha / 2) / alpha : 0;
+			out[3] = (alpha + total / 2) / total;
+		} else {
+			for (c = 0; c < 3; c++)
+				out[c] = (sums[c] + total / 2) / total;
+		}
+
+		out += n;
+	}
+}
+
+/* row has src_width pixels of 8 bit RGB, or RGBA when has_alpha */
+void
+stream_scaler_push_row (StreamScaler *scaler, const guchar *row)
+{
+	guint len = scaler->dst_width * scaler->channels;
+	guint64 pos, end;
+	guint k;
+
+	if (scaler->src_y >= scaler->src_height)
+		return;
+
+	scale_row (scaler, row);
+
+	pos = (guint64) scaler->src_y * scaler->dst_height;
+	end = pos + scaler->dst_height;
+
+	while (pos < end) {
+		guint64 row_end = (guint64) (scaler->dst_y + 1) * scaler->src_height;
+		guint64 next = MIN (end, row_end);
+
+		for (k = 0; k < len; k++)
+			scaler->sums[k] += (next - pos) * scaler->row[k];
+
+		pos = next;
+
+		if (next == row_end) {
+			emit_row (scaler);
+			memset (scaler->sums, 0, sizeof (guint64) * len);
+			scaler->dst_y++;
+		}
+	}
+
+	scaler->src_y++;
+}
+
+/* Frees the scaler. Returns NULL when not all rows were pushed */
+GdkPixbuf *
+stream_scaler_finish (StreamScaler *scaler)
+{
+	GdkPixbuf *pixbuf = scaler->dst;
+
+	if (scaler->src_y < scaler->src_height) {
+		g_object_unref (pixbuf);
+		pixbuf = NULL;
+	}
+
+	g_free (scaler->row);
+	g_free (scaler->sums);
+	g_slice_free (StreamScaler, scaler);
+
+	return pixbuf;
+}
+
+/* From the first 29 bytes of the file. Only for non-interlaced ones, an
+ * interlaced PNG delivers its rows in passes over the whole image */
+gboolean
+stream_scaler_probe_png (const guchar *head, gsize len, guint *width, guint *height)
+{
+	if (len < 29 ||
+	    memcmp (head, "\211PNG\r\n\032\n", 8) != 0 ||
+	    memcmp (head + 12, "IHDR", 4) != 0 ||
+	    head[28] != 0)
+		return FALSE;
+
+	*width = ((guint) head[16] << 24) | (head[17] << 16) | (head[18] << 8) | head[19];
+	*height = ((guint) head[20] << 24) | (head[21] << 16) | (head[22] << 8) | head[23];
+
+	return (*width > 0 && *height > 0);
+}
+
+#ifdef HAVE_PNG
+
+/* Everything that must survive a longjmp from libpng */
+typedef struct {
+	FILE *file;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	StreamScaler *scaler;
+	guchar *row;
+	gchar *message;
+} PngLoad;
+
+static void
+png_load_error (png_structp png_ptr, png_const_charp message)
+{
+	PngLoad *load = png_get_error_ptr (png_ptr);
+
+	if (!load->message)
+		load->message = g_strdup (message);
+
+	longjmp (png_jmpbuf (png_ptr), 1);
+}
+
+static void
+png_load_warning (png_structp png_ptr, png_const_charp message)
+{
+}
+
+/* Decodes the PNG row by row straight into a scaler, the result has at
+ * most max_pix pixels unless that takes its short side below min_side */
+GdkPixbuf *
+stream_scaler_load_png (const gchar *path, guint max_pix, guint min_side, GError **error)
+{
+	PngLoad *load = g_slice_new0 (PngLoad);
+	GdkPixbuf *pixbuf = NULL;
+	png_uint_32 width, height, y;
+	int bit_depth, color_type, interlace;
+	guint dst_width, dst_height;
+
+	load->file = g_fopen (path, "rb");
+
+	if (!load->file) {
+		g_set_error (error, DEFAULT_ERROR, 0, "Can't open %s", path);
+		g_slice_free (PngLoad, load);
+		return NULL;
+	}
+
+	load->png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, load,
+						png_load_error, png_load_warning);
+	if (load->png_ptr)
+		load->info_ptr = png_create_info_struct (load->png_ptr);
+
+	if (!load->info_ptr)
+		goto out;
+
+	if (setjmp (png_jmpbuf (load->png_ptr)))
+		goto out;
+
+	png_init_io (load->png_ptr, load->file);
+	png_read_info (load->png_ptr, load->info_ptr);
+	png_get_IHDR (load->png_ptr, load->info_ptr, &width, &height,
+		      &bit_depth, &color_type, &interlace, NULL, NULL);
+
+	if (interlace != PNG_INTERLACE_NONE) {
+		load->message = g_strdup ("interlaced");
+		goto out;
+	}
+
+	/* Whatever it is, we want 8 bit RGB(A) */
+	png_set_expand (load->png_ptr);
+	if (bit_depth == 16)
+		png_set_strip_16 (load->png_ptr);
+	if (color_type == PNG_COLOR_TYPE_GRAY ||
+	    color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+		png_set_gray_to_rgb (load->png_ptr);
+	png_read_update_info (load->png_ptr, load->info_ptr);
+
+	stream_scaler_fit (width, height, max_pix, min_side, &dst_width, &dst_height);
+	load->scaler = stream_scaler_new (width, height, dst_width, dst_height,
+					  png_get_channels (load->png_ptr, load->info_ptr) == 4);
+
+	if (!load->scaler)
+		goto out;
+
+	load->row = g_malloc (png_get_rowbytes (load->png_ptr, load->info_ptr));
+
+	for (y = 0; y < height; y++) {
+		png_read_row (load->png_ptr, load->row, NULL);
+		stream_scaler_push_row (load->scaler, load->row);
+	}
+
+	pixbuf = stream_scaler_finish (load->scaler);
+	load->scaler = NULL;
+
+out:
+	if (!pixbuf)
+		g_set_error (error, DEFAULT_ERROR, 0, "Can't decode %s: %s", path,
+			     load->message ? load->message : "out of memory");
+
+	if (load->scaler)
+		stream_scaler_finish (load->scaler);
+	png_destroy_read_struct (&load->png_ptr,
+				 load->info_ptr ? &load->info_ptr : NULL, NULL);
+	fclose (load->file);
+	g_free (load->row);
+	g_free (load->message);
+	g_slice_free (PngLoad, load);
+
+	return pixbuf;
+}
+
+#else
+
+GdkPixbuf *
+stream_scaler_load_png (const gchar *path, guint max_pix, guint min_side, GError **error)
+{
+	g_set_error (error, DEFAULT_ERROR, 0, "Built without libpng");
+
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __STREAM_SCALER_H__
+#define __STREAM_SCALER_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+G_BEGIN_DECLS
+
+/* Downscales an image one source row at a time, by averaging the area
+ * that each destination pixel covers. Next to the destination it only
+ * keeps two rows of the destination's width, the source never has to be
+ * in memory as a whole */
+
+typedef struct StreamScaler StreamScaler;
+
+void          stream_scaler_fit       (guint src_width,
+				       guint src_height,
+				       guint max_pix,
+				       guint min_side,
+				       guint *dst_width,
+				       guint *dst_height);
+
+StreamScaler *stream_scaler_new       (guint src_width,
+				       guint src_height,
+				       guint dst_width,
+				       guint dst_height,
+				       gboolean has_alpha);
+void          stream_scaler_push_row  (StreamScaler *scaler,
+				       const guchar *row);
+GdkPixbuf    *stream_scaler_finish    (StreamScaler *scaler);
+
+gboolean      stream_scaler_probe_png (const guchar *head,
+				       gsize len,
+				       guint *width,
+				       guint *height);
+GdkPixbuf    *stream_scaler_load_png  (const gchar *path,
+				       guint max_pix,
+				       guint min_side,
+				       GError **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,350 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "state-snapshot.h"
+
+/* The file is a header, the outcomes as an array sorted on uri_hash and
+ * then a blob of records per kind. A record is its number of fields
+ * followed by the fields, all of them as NUL-terminated strings.
+ *
+ * Validating only looks at the header and the bounds, so that opening it
+ * costs what looking things up in it touches. The snapshot is written in
+ * the host's byte order, another one simply doesn't validate */
+
+#define STATE_MAGIC		"HTSTATE"
+#define STATE_VERSION		2
+#define STATE_BYTE_ORDER	0x01020304
+
+typedef struct {
+	gchar magic[8];
+	guint32 version;
+	guint32 byte_order;
+	guint64 size;
+	guint64 outcomes_offset;
+	guint64 n_outcomes;
+	guint64 records_offset[STATE_N_RECORDS];
+	guint64 records_length[STATE_N_RECORDS];
+} StateHeader;
+
+struct StateWriter {
+	GArray *outcomes;
+	GString *records[STATE_N_RECORDS];
+};
+
+static GMappedFile *mapped = NULL;
+static const StateHeader *header = NULL;
+static const StateOutcome *outcomes = NULL;
+
+static gchar *
+get_snapshot_path (void)
+{
+	return g_build_filename (g_get_user_cache_dir (), "hildon-thumbnailer",
+				 "state.snapshot", NULL);
+}
+
+/* FNV-1a, 64 bits so that collisions don't matter at our sizes */
+guint64
+state_hash_uri (const gchar *uri)
+{
+	guint64 hash = G_GUINT64_CONSTANT (14695981039346656037);
+	const guchar *p;
+
+	for (p = (const guchar *) uri; *p; p++) {
+		hash ^= *p;
+		hash *= G_GUINT64_CONSTANT (1099511628211);
+	}
+
+	return hash;
+}
+
+static gboolean
+validate (const gchar *contents, gsize length)
+{
+	const StateHeader *h = (const StateHeader *) contents;
+	guint i;
+
+	if (length < sizeof (StateHeader))
+		return FALSE;
+
+	if (memcmp (h->magic, STATE_MAGIC, sizeof (h->magic)) != 0 ||
+	    h->version != STATE_VERSION ||
+	    h->byte_order != STATE_BYTE_ORDER ||
+	    h->size != length)
+		return FALSE;
+
+	if (h->outcomes_offset % 8 != 0 ||
+	    h->outcomes_offset < sizeof (StateHeader) ||
+	    h->outcomes_offset > length ||
+	    h->n_outcomes > (length - h->outcomes_offset) / sizeof (StateOutcome))
+		return FALSE;
+
+	for (i = 0; i < STATE_N_RECORDS; i++) {
+		if (h->records_offset[i] > length ||
+		    h->records_length[i] > length - h->records_offset[i])
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+void
+state_snapshot_init (void)
+{
+	gchar *path = get_snapshot_path ();
+	GError *error = NULL;
+
+	mapped = g_mapped_file_new (path, FALSE, &error);
+
+	if (!mapped) {
+		g_clear_error (&error);
+	} else if (!validate (g_mapped_file_get_contents (mapped),
+			      g_mapped_file_get_length (mapped))) {
+		g_debug ("Ignoring state snapshot %s, it's not valid", path);
+		g_mapped_file_unref (mapped);
+		mapped = NULL;
+	} else {
+		const gchar *contents = g_mapped_file_get_contents (mapped);
+
+		header = (const StateHeader *) contents;
+		outcomes = (const StateOutcome *) (contents + header->outcomes_offset);
+	}
+
+	g_free (path);
+}
+
+void
+state_snapshot_shutdown (void)
+{
+	if (mapped)
+		g_mapped_file_unref (mapped);
+
+	mapped = NULL;
+	header = NULL;
+	outcomes = NULL;
+}
+
+gboolean
+state_snapshot_lookup_outcome (guint64 uri_hash, StateOutcome *outcome)
+{
+	guint64 low = 0, high;
+
+	if (!header)
+		return FALSE;
+
+	high = header->n_outcomes;
+
+	while (low < high) {
+		guint64 mid = low + (high - low) / 2;
+
+		if (outcomes[mid].uri_hash == uri_hash) {
+			*outcome = outcomes[mid];
+			return TRUE;
+		}
+
+		if (outcomes[mid].uri_hash < uri_hash)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return FALSE;
+}
+
+void
+state_snapshot_foreach_outcome (StateOutcomeFunc func, gpointer user_data)
+{
+	guint64 i;
+
+	if (!header)
+		return;
+
+	for (i = 0; i < header->n_outcomes; i++)
+		func (&outcomes[i], user_data);
+}
+
+void
+state_snapshot_foreach_record (StateRecordKind kind, StateRecordFunc func, gpointer user_data)
+{
+	const gchar *p, *end;
+	GPtrArray *fields;
+
+	if (!header)
+		return;
+
+	p = ((const gchar *) header) + header->records_offset[kind];
+	end = p + header->records_length[kind];
+	fields = g_ptr_array_new ();
+
+	while (p < end) {
+		const gchar *nul = memchr (p, '\0', end - p);
+		guint n, i;
+
+		if (!nul)
+			break;
+
+		n = (guint) strtoul (p, NULL, 10);
+		p = nul + 1;
+
+		g_ptr_array_set_size (fields, 0);
+
+		for (i = 0; i < n && p < end; i++) {
+			nul = memchr (p, '\0', end - p);
+			if (!nul)
+				break;
+			g_ptr_array_add (fields, (gpointer) p);
+			p = nul + 1;
+		}
+
+		/* A truncated record means the rest can't be trusted either */
+		if (i < n)
+			break;
+
+		func ((const gchar * const *) fields->pdata, n, user_data);
+	}
+
+	g_ptr_array_unref (fields);
+}
+
+StateWriter *
+state_writer_new (void)
+{
+	StateWriter *writer = g_slice_new0 (StateWriter);
+	guint i;
+
+	writer->outcomes = g_array_new (FALSE, FALSE, sizeof (StateOutcome));
+
+	for (i = 0; i < STATE_N_RECORDS; i++)
+		writer->records[i] = g_string_new (NULL);
+
+	return writer;
+}
+
+void
+state_writer_add_outcome (StateWriter *writer, const StateOutcome *outcome)
+{
+	g_array_append_vals (writer->outcomes, outcome, 1);
+}
+
+void
+state_writer_add_record (StateWriter *writer, StateRecordKind kind, const gchar * const *fields, guint n_fields)
+{
+	GString *blob = writer->records[kind];
+	guint i;
+
+	g_string_append_printf (blob, "%u", n_fields);
+	g_string_append_c (blob, '\0');
+
+	for (i = 0; i < n_fields; i++) {
+		g_string_append (blob, fields[i] ? fields[i] : "");
+		g_string_append_c (blob, '\0');
+	}
+}
+
+static gint
+compare_outcomes (gconstpointer a, gconstpointer b)
+{
+	const StateOutcome *oa = a, *ob = b;
+
+	if (oa->uri_hash != ob->uri_hash)
+		return oa->uri_hash < ob->uri_hash ? -1 : 1;
+
+	/* The most recent one first, that's the one that we keep */
+	if (oa->stamp != ob->stamp)
+		return oa->stamp > ob->stamp ? -1 : 1;
+
+	return 0;
+}
+
+/* Writes the snapshot and frees the writer */
+gboolean
+state_writer_commit (StateWriter *writer, GError **error)
+{
+	StateHeader h;
+	GString *data;
+	gchar *path, *dir;
+	guint i, n = 0;
+	gboolean retval;
+
+	g_array_sort (writer->outcomes, compare_outcomes);
+
+	/* Drop the duplicates, keeping the most recent */
+	for (i = 0; i < writer->outcomes->len; i++) {
+		StateOutcome *o = &g_array_index (writer->outcomes, StateOutcome, i);
+
+		if (n > 0 && g_array_index (writer->outcomes, StateOutcome, n - 1).uri_hash == o->uri_hash)
+			continue;
+
+		g_array_index (writer->outcomes, StateOutcome, n) = *o;
+		n++;
+	}
+
+	memset (&h, 0, sizeof (h));
+	memcpy (h.magic, STATE_MAGIC, sizeof (h.magic));
+	h.version = STATE_VERSION;
+	h.byte_order = STATE_BYTE_ORDER;
+	h.outcomes_offset = sizeof (StateHeader);
+	h.n_outcomes = n;
+
+	data = g_string_sized_new (sizeof (StateHeader) + n * sizeof (StateOutcome));
+	g_string_append_len (data, (const gchar *) &h, sizeof (h));
+	g_string_append_len (data, writer->outcomes->data, n * sizeof (StateOutcome));
+
+	for (i = 0; i < STATE_N_RECORDS; i++) {
+		h.records_offset[i] = data->len;
+		h.records_length[i] = writer->records[i]->len;
+		g_string_append_len (data, writer->records[i]->str,
+				     writer->records[i]->len);
+		g_string_free (writer->records[i], TRUE);
+	}
+
+	h.size = data->len;
+	memcpy (data->str, &h, sizeof (h));
+
+	g_array_free (writer->outcomes, TRUE);
+	g_slice_free (StateWriter, writer);
+
+	path = get_snapshot_path ();
+	dir = g_path_get_dirname (path);
+	g_mkdir_with_parents (dir, S_IRWXU);
+
+	/* This goes through a temporary file that is renamed over the old
+	 * one, which is what keeps our own mapping of that one valid */
+	retval = g_file_set_contents (path, data->str, data->len, error);
+
+	g_free (dir);
+	g_free (path);
+	g_string_free (data, TRUE);
+
+	return retval;
+}
@@ -0,0 +1,90 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __STATE_SNAPSHOT_H__
+#define __STATE_SNAPSHOT_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* What the daemon learned while it ran, so that the next start doesn't
+ * have to learn it again. The snapshot is mapped at startup and only read
+ * from, a new one is written next to it and renamed over it */
+
+typedef enum {
+	STATE_OUTCOME_FRESH = 1 << 0,	/* Had up-to-date thumbnails */
+	STATE_OUTCOME_FAILED = 1 << 1,	/* Thumbnailing it failed */
+	STATE_OUTCOME_FAIL_FILE = 1 << 2	/* And an out plugin wrote a fail file */
+} StateOutcomeFlags;
+
+/* Fixed size, the snapshot has them sorted on uri_hash */
+typedef struct {
+	guint64 uri_hash;
+	guint64 mtime;
+	guint32 flags;
+	guint32 stamp;		/* When we learned it, in seconds since the epoch */
+} StateOutcome;
+
+typedef enum {
+	STATE_RECORDS_SERVICES,
+	STATE_RECORDS_PENDING,
+	STATE_RECORDS_URIS,
+	STATE_N_RECORDS
+} StateRecordKind;
+
+typedef void (*StateRecordFunc) (const gchar * const *fields,
+				 guint n_fields,
+				 gpointer user_data);
+typedef void (*StateOutcomeFunc) (const StateOutcome *outcome,
+				  gpointer user_data);
+
+typedef struct StateWriter StateWriter;
+
+guint64      state_hash_uri                (const gchar *uri);
+
+void         state_snapshot_init           (void);
+void         state_snapshot_shutdown       (void);
+gboolean     state_snapshot_lookup_outcome (guint64 uri_hash,
+					    StateOutcome *outcome);
+void         state_snapshot_foreach_outcome (StateOutcomeFunc func,
+					     gpointer user_data);
+void         state_snapshot_foreach_record (StateRecordKind kind,
+					    StateRecordFunc func,
+					    gpointer user_data);
+
+StateWriter *state_writer_new              (void);
+void         state_writer_add_outcome      (StateWriter *writer,
+					    const StateOutcome *outcome);
+void         state_writer_add_record       (StateWriter *writer,
+					    StateRecordKind kind,
+					    const gchar * const *fields,
+					    guint n_fields);
+gboolean     state_writer_commit           (StateWriter *writer,
+					    GError **error);
+
+G_END_DECLS
+
+#endif
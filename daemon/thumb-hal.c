@@ -7,41 +7,100 @@
 
 #define CHECK_FILE "/tmp/thumbnailer_please_wait"
 
+/* How long after startup we hold back items of a mount that was going away
+ * when we last went down */
+#define DEFER_SECONDS 15
+
 static GVolumeMonitor *monitor;
 static Thumbnailer *thumbnailer;
 
+/* Both are only written by thumb_hal_init, before any thread reads them */
+static GStrv deferred_roots;
+static gint64 defer_until;
+
 static void
 on_pre_unmount (GVolumeMonitor *volume_monitor,
                 GMount         *mount,
                 gpointer        user_data) 
 {
-	FILE *filep;
+	GFile *root;
+	gchar *uri;
 
 	thumbnailer_crash_out (thumbnailer);
 
 	/* The idea here is that if we had to force-shutdown because of an
 	 * unmount event, that it's possible that we get soon-after more
 	 * items to process that are also on the removable device. So we 
-	 * leave a message for the next startup, to wait for 10 seconds
-	 * before we start for real. */
+	 * leave a message for the next startup, to hold those back for a
+	 * while before we start on them for real. */
+
+	root = g_mount_get_root (mount);
+	uri = g_file_get_uri (root);
 
-	filep = fopen (CHECK_FILE, "w");
-	if (filep)
-	  fclose (filep);
+	g_file_set_contents (CHECK_FILE, uri ? uri : "", -1, NULL);
+
+	g_free (uri);
+	g_object_unref (root);
 
 	exit (0);
 }
 
+static gboolean
+is_deferred (const gchar *uri)
+{
+	guint i;
+
+	/* An empty message, as older versions left it, holds back everything */
+	if (!deferred_roots[0])
+		return TRUE;
+
+	for (i = 0; deferred_roots[i] != NULL; i++) {
+		gsize len = strlen (deferred_roots[i]);
+
+		if (strncmp (uri, deferred_roots[i], len) == 0 &&
+		    (uri[len] == '\0' || uri[len] == '/' ||
+		     deferred_roots[i][len - 1] == '/'))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Returns how many ms the items must wait, 0 if they can go right away */
+guint
+thumb_hal_get_delay (GStrv uris)
+{
+	gint64 now;
+	guint i;
+
+	if (!deferred_roots)
+		return 0;
+
+	now = g_get_monotonic_time ();
+
+	if (now >= defer_until)
+		return 0;
+
+	for (i = 0; uris[i] != NULL; i++) {
+		if (is_deferred (uris[i]))
+			return (guint) ((defer_until - now) / 1000) + 1;
+	}
+
+	return 0;
+}
+
 void
 thumb_hal_init (Thumbnailer *thumbnailer_)
 {
-	FILE *filep;
+	gchar *contents = NULL;
+
+	/* See above, instead of sleeping at startup we only hold back the
+	 * items that are on the mount that went away */
 
-	filep = fopen (CHECK_FILE, "r");
-	if (filep) {
-		/* See above */
-		sleep (15);
-		fclose (filep);
+	if (g_file_get_contents (CHECK_FILE, &contents, NULL, NULL)) {
+		deferred_roots = g_strsplit (g_strstrip (contents), "\n", -1);
+		defer_until = g_get_monotonic_time () + DEFER_SECONDS * G_TIME_SPAN_SECOND;
+		g_free (contents);
 		g_unlink (CHECK_FILE);
 	}
 
@@ -17,6 +17,7 @@ G_BEGIN_DECLS
 
 void thumb_hal_init (Thumbnailer *thumbnailer);
 void thumb_hal_shutdown (void);
+guint thumb_hal_get_delay (GStrv uris);
 
 G_END_DECLS
 
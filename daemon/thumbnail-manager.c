@@ -44,10 +44,52 @@ gchar* dbus_g_method_get_sender (DBusGMethodInvocation *context);
 
 void keep_alive (void);
 
+/* What we know about one thumbnailer-service file, so that a change in a
+ * watched dir only needs that one file to be parsed again */
+
+typedef struct {
+	gchar *name;
+	guint64 mtime;
+	GStrv mime_types;
+	GStrv uri_schemes;
+} ServiceFile;
+
+typedef struct {
+	ThumbnailManager *object;
+	gchar *path;
+	GHashTable *services;	/* basename -> ServiceFile */
+	GHashTable *overrides;	/* scheme -> (mime -> name) */
+} ServiceDir;
+
+enum {
+	DIR_SYSTEM,
+	DIR_HOME,
+	N_DIRS
+};
+
 typedef struct {
 	DBusGConnection *connection;
-	GHashTable *handlers;
+
+	/* The registry is a uri-scheme -> (mime-type -> DBusGProxy) table that
+	 * is never changed once it got published: the writers build a new one
+	 * and swap the pointer. The worker threads look it up while counting
+	 * themselves in the readers of the current epoch. A replaced registry
+	 * goes to retired, the next epoch begins once everybody from the one
+	 * before it left, and what got retired is freed once the readers of
+	 * its epoch left too. New readers never keep an old epoch busy */
+	GHashTable *registry;
+	guint epoch;
+	gint readers[2];
+	GList *retired;		/* replaced during this epoch */
+	GList *draining;	/* replaced during the one before */
+	guint reclaim_id;
+
+	/* Writer side, only touched with the mutex held */
 	GMutex mutex;
+	ServiceDir dirs[N_DIRS];
+	GHashTable *registered;	/* scheme -> (mime -> DBusGProxy) */
+	GHashTable *proxies;	/* service name -> DBusGProxy */
+	GHashTable *seeds;	/* path -> ServiceFile, during the first check */
 	GList *thumber_has;
 } ThumbnailManagerPrivate;
 
@@ -60,27 +102,112 @@ enum {
 	PROP_CONNECTION
 };
 
+static GHashTable *
+registry_enter (ThumbnailManagerPrivate *priv, guint *slot)
+{
+	guint epoch;
+
+	/* Who counted in after the epoch moved on backs out again, else the
+	 * reclaimer could have seen the old count at zero already */
+
+	for (;;) {
+		epoch = g_atomic_int_get (&priv->epoch);
+		g_atomic_int_inc (&priv->readers[epoch % 2]);
+		if (g_atomic_int_get (&priv->epoch) == epoch)
+			break;
+		g_atomic_int_add (&priv->readers[epoch % 2], -1);
+	}
+
+	*slot = epoch % 2;
+
+	return g_atomic_pointer_get (&priv->registry);
+}
+
+static void
+registry_leave (ThumbnailManagerPrivate *priv, guint slot)
+{
+	g_atomic_int_add (&priv->readers[slot], -1);
+}
+
 DBusGProxy*
 thumbnail_manager_get_handler (ThumbnailManager *object, const gchar *uri_scheme, const gchar *mime_type)
 {
 	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
-	DBusGProxy *proxy;
-	gchar *query = g_strdup_printf ("%s-%s", uri_scheme, mime_type);
+	GHashTable *registry, *mimes;
+	DBusGProxy *proxy = NULL;
+	guint slot;
+
+	registry = registry_enter (priv, &slot);
+	mimes = g_hash_table_lookup (registry, uri_scheme);
+	if (mimes)
+		proxy = g_hash_table_lookup (mimes, mime_type);
+	if (proxy)
+		g_object_ref (proxy);
+	registry_leave (priv, slot);
+
+	return proxy;
+}
+
+static void
+free_retired (GList *retired)
+{
+	g_list_foreach (retired, (GFunc) g_hash_table_unref, NULL);
+	g_list_free (retired);
+}
+
+static gboolean
+reclaim_retired (gpointer user_data)
+{
+	ThumbnailManagerPrivate *priv = user_data;
+	gboolean again = TRUE;
 
 	g_mutex_lock (&priv->mutex);
-	proxy = g_hash_table_lookup (priv->handlers, query);
-	if (proxy) {
-		g_object_ref (proxy);
+
+	/* Nobody counts in under the epoch before anymore, its readers can
+	 * only leave. Only they can hold a registry that was replaced before
+	 * this epoch began, readers that came in after a swap only ever see
+	 * the new registry */
+
+	if (g_atomic_int_get (&priv->readers[(priv->epoch + 1) % 2]) != 0)
+		goto out;
+
+	free_retired (priv->draining);
+	priv->draining = NULL;
+
+	if (priv->retired) {
+		priv->draining = priv->retired;
+		priv->retired = NULL;
+		g_atomic_int_inc (&priv->epoch);
+	} else {
+		priv->reclaim_id = 0;
+		again = FALSE;
 	}
+
+out:
 	g_mutex_unlock (&priv->mutex);
 
-	g_free (query);
+	return again;
+}
 
-	return proxy;
+static GHashTable *
+level_lookup (GHashTable *level, const gchar *uri_scheme, gboolean create,
+	      GDestroyNotify key_destroy, GDestroyNotify value_destroy)
+{
+	GHashTable *mimes = g_hash_table_lookup (level, uri_scheme);
+
+	if (!mimes && create) {
+		mimes = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       key_destroy, value_destroy);
+		g_hash_table_replace (level,
+				      key_destroy ? g_strdup (uri_scheme) : (gpointer) uri_scheme,
+				      mimes);
+	}
+
+	return mimes;
 }
 
-static void
-thumbnail_manager_add (ThumbnailManager *object, gchar *mime_type, gchar *name)
+static DBusGProxy *
+thumbnail_manager_new_proxy (ThumbnailManager *object, const gchar *name)
 {
 	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
 	DBusGProxy *mime_proxy;
@@ -95,286 +222,403 @@ thumbnail_manager_add (ThumbnailManager *object, gchar *mime_type, gchar *name)
 			path[i] = '/';
 	}
 
-	mime_proxy = dbus_g_proxy_new_for_name (priv->connection, name, 
+	mime_proxy = dbus_g_proxy_new_for_name (priv->connection, name,
 						path,
 						SPECIALIZED_INTERFACE);
 
-	dbus_g_proxy_add_signal (mime_proxy, "Ready", 
+	dbus_g_proxy_add_signal (mime_proxy, "Ready",
 				 G_TYPE_STRING,
 				 G_TYPE_INVALID);
 
-	dbus_g_proxy_add_signal (mime_proxy, "Error", 
-				 G_TYPE_STRING, 
+	dbus_g_proxy_add_signal (mime_proxy, "Error",
+				 G_TYPE_STRING,
 				 G_TYPE_INT,
 				 G_TYPE_STRING,
 				 G_TYPE_INVALID);
 
 	g_free (path);
 
-	g_hash_table_replace (priv->handlers, 
-			      g_strdup (mime_type),
-			      mime_proxy);
+	return mime_proxy;
+}
+
+static DBusGProxy *
+thumbnail_manager_get_proxy (ThumbnailManager *object, const gchar *name)
+{
+	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
+	DBusGProxy *proxy = g_hash_table_lookup (priv->proxies, name);
 
+	/* Many MIME-types usually point to the same service, they can all
+	 * share the one proxy */
+
+	if (!proxy) {
+		proxy = thumbnail_manager_new_proxy (object, name);
+		g_hash_table_replace (priv->proxies, g_strdup (name), proxy);
+	}
+
+	return proxy;
 }
 
-typedef struct {
-	gchar *name;
-	guint64 mtime;
-	gboolean prio;
-} ValueInfo;
+static gboolean
+proxy_unused (gpointer key, gpointer value, gpointer user_data)
+{
+	return !g_hash_table_contains (user_data, key);
+}
 
-static void
-free_valueinfo (ValueInfo *info) {
-	g_free (info->name);
-	g_slice_free (ValueInfo, info);
+static gint
+compare_mtime (gconstpointer a, gconstpointer b)
+{
+	const ServiceFile *sa = a, *sb = b;
+
+	if (sa->mtime < sb->mtime)
+		return -1;
+	return sa->mtime > sb->mtime ? 1 : 0;
 }
 
 static void
-thumbnail_manager_check_dir (ThumbnailManager *object, gchar *path, gboolean override)
+resolve_dir (ServiceDir *dir, GHashTable *resolved)
 {
-	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
-	const gchar *filen;
-	GDir *dir;
 	GHashTableIter iter;
-	GHashTable *pre;
-	gpointer pkey, pvalue;
-	gboolean has_override = FALSE;
+	gpointer key, value;
+	GList *services, *l;
 
-	dir = g_dir_open (path, 0, NULL);
+	/* The modification time of the thumbnailer-service file is used, as
+	 * specified, to determine the priority. Going from old to new, newer
+	 * ones simply replace the older ones. */
 
-	if (!dir)
-		return;
+	services = g_list_sort (g_hash_table_get_values (dir->services),
+				compare_mtime);
 
-	pre = g_hash_table_new_full (g_str_hash, g_str_equal,
-				     (GDestroyNotify) g_free, 
-				     (GDestroyNotify) free_valueinfo);
-
-	for (filen = g_dir_read_name (dir); filen; filen = g_dir_read_name (dir)) {
-		GKeyFile *keyfile;
-		gchar *fullfilen;
-		gchar *value;
-		GStrv values;
-		GStrv uri_schemes;
-		GError *error = NULL;
-		guint i = 0, y = 0;
-		guint64 mtime;
-		GFileInfo *info;
-		GFile *file;
-
-		/* If the file is the 'overrides', skip it (we'll deal with that later) */
-
-		if (strcmp (filen, "overrides") == 0) {
-			has_override = TRUE;
-			continue;
-		}
+	for (l = services; l; l = l->next) {
+		ServiceFile *sf = l->data;
+		guint i, y;
 
-		fullfilen = g_build_filename (path, filen, NULL);
-		keyfile = g_key_file_new ();
+		for (y = 0; sf->uri_schemes[y] != NULL; y++) {
+			GHashTable *mimes = level_lookup (resolved, sf->uri_schemes[y],
+							  TRUE, NULL, NULL);
 
-		/* If we can't parse it as a key-value file, skip */
-	
-		if (!g_key_file_load_from_file (keyfile, fullfilen, G_KEY_FILE_NONE, NULL)) {
-			g_free (fullfilen);
-			g_key_file_free (keyfile);
-			continue;
+			for (i = 0; sf->mime_types[i] != NULL; i++)
+				g_hash_table_replace (mimes, sf->mime_types[i], sf->name);
 		}
+	}
 
-		value = g_key_file_get_string (keyfile, "D-BUS Thumbnailer", "Name", NULL);
+	g_list_free (services);
 
-		/* If it doesn't have the required things, skip */
+	/* Items in overrides are prioritized */
 
-		if (!value) {
-			g_free (fullfilen);
-			g_key_file_free (keyfile);
-			continue;
-		}
+	g_hash_table_iter_init (&iter, dir->overrides);
 
-		values = g_key_file_get_string_list (keyfile, "D-BUS Thumbnailer", "MimeTypes", NULL, NULL);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		GHashTable *mimes = level_lookup (resolved, key, TRUE, NULL, NULL);
+		GHashTableIter miter;
+		gpointer mkey, mvalue;
 
-		/* If it doesn't have the required things, skip */
+		g_hash_table_iter_init (&miter, value);
+		while (g_hash_table_iter_next (&miter, &mkey, &mvalue))
+			g_hash_table_replace (mimes, mkey, mvalue);
+	}
+}
 
-		if (!values) {
-			g_free (fullfilen);
-			g_free (value);
-			g_key_file_free (keyfile);
-			continue;
-		}
+static void
+thumbnail_manager_publish (ThumbnailManager *object)
+{
+	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
+	GHashTable *resolved, *registry, *used, *old;
+	GHashTableIter iter, miter;
+	gpointer key, value, mkey, mvalue;
+	guint i;
+
+	/* Called with the mutex held. Nothing gets parsed here anymore: the
+	 * files got cached in the ServiceDirs, the merging is all in memory */
+
+	resolved = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  NULL,
+					  (GDestroyNotify) g_hash_table_unref);
+
+	/* The user's homedir overrides the system's dir */
+	for (i = 0; i < N_DIRS; i++)
+		resolve_dir (&priv->dirs[i], resolved);
+
+	registry = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  (GDestroyNotify) g_free,
+					  (GDestroyNotify) g_hash_table_unref);
+	used = g_hash_table_new (g_str_hash, g_str_equal);
 
-		/* Get the supported uri-schemes, if none we default to just `file` */
+	g_hash_table_iter_init (&iter, resolved);
 
-		uri_schemes = g_key_file_get_string_list (keyfile, "D-BUS Thumbnailer", "UriSchemes", NULL, NULL);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		GHashTable *mimes = level_lookup (registry, key, TRUE,
+						  (GDestroyNotify) g_free,
+						  (GDestroyNotify) g_object_unref);
 
-		if (!uri_schemes) {
-			uri_schemes = g_new0 (gchar*, 2);
-			uri_schemes[0] = g_strdup ("file");
-			uri_schemes[1] = NULL;
+		g_hash_table_iter_init (&miter, value);
+		while (g_hash_table_iter_next (&miter, &mkey, &mvalue)) {
+			DBusGProxy *proxy = thumbnail_manager_get_proxy (object, mvalue);
+			g_hash_table_replace (mimes, g_strdup (mkey), g_object_ref (proxy));
+			g_hash_table_add (used, mvalue);
 		}
+	}
 
-		/* Else, get the modificiation time, we'll need it later */
+	/* Services whose files went away, or that got overridden for all their
+	 * MIME-types, lose their proxy. The retired registries keep their own
+	 * references for who still looks at them */
 
-		file = g_file_new_for_path (fullfilen);
+	g_hash_table_foreach_remove (priv->proxies, proxy_unused, used);
+	g_hash_table_unref (used);
 
-		g_free (fullfilen);
+	/* And the dynamically registered ones override what's in the dirs */
 
-		info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
-					  G_FILE_QUERY_INFO_NONE,
-					  NULL, &error);
+	g_hash_table_iter_init (&iter, priv->registered);
 
-		/* If that didn't work out, skip */
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		GHashTable *mimes = level_lookup (registry, key, TRUE,
+						  (GDestroyNotify) g_free,
+						  (GDestroyNotify) g_object_unref);
 
-		if (error) {
-			if (info)
-				g_object_unref (info);
-			if (file)
-				g_object_unref (file);
-			g_free (value);
-			g_strfreev (values);
-			g_strfreev (uri_schemes);
-			g_key_file_free (keyfile);
-			g_clear_error (&error);
-			continue;
-		}
+		g_hash_table_iter_init (&miter, value);
+		while (g_hash_table_iter_next (&miter, &mkey, &mvalue))
+			g_hash_table_replace (mimes, g_strdup (mkey), g_object_ref (mvalue));
+	}
 
-		mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+	g_hash_table_unref (resolved);
 
-		/* And register it in the temporary hashtable that is being formed */
+	old = priv->registry;
+	g_atomic_pointer_set (&priv->registry, registry);
 
-		y = 0;
+	if (old) {
+		priv->retired = g_list_prepend (priv->retired, old);
+		if (priv->reclaim_id == 0)
+			priv->reclaim_id = g_timeout_add (100, reclaim_retired, priv);
+	}
+}
 
-		while (uri_schemes[y] != NULL) {
+static void
+free_service_file (ServiceFile *sf)
+{
+	g_free (sf->name);
+	g_strfreev (sf->mime_types);
+	g_strfreev (sf->uri_schemes);
+	g_slice_free (ServiceFile, sf);
+}
 
-		  i = 0;
+static ServiceFile *
+copy_service_file (const ServiceFile *from)
+{
+	ServiceFile *sf = g_slice_new0 (ServiceFile);
 
-		  while (values[i] != NULL) {
-			ValueInfo *vi;
+	sf->name = g_strdup (from->name);
+	sf->mtime = from->mtime;
+	sf->mime_types = g_strdupv (from->mime_types);
+	sf->uri_schemes = g_strdupv (from->uri_schemes);
 
-			vi = g_hash_table_lookup (pre, values[i]);
+	return sf;
+}
 
-			if (!vi || vi->mtime < mtime) {
-				vi = g_slice_new0 (ValueInfo);
+static ServiceFile *
+load_service_file (const gchar *fullfilen, GHashTable *seeds)
+{
+	ServiceFile *sf, *seed;
+	GKeyFile *keyfile;
+	gchar *value;
+	GStrv values;
+	GStrv uri_schemes;
+	GError *error = NULL;
+	GFileInfo *info;
+	GFile *file;
+	guint64 mtime;
 
-				vi->name = g_strdup (value);
+	/* Get the modificiation time, we'll need it later */
 
-				/* The modification time of the thumbnailer-service file is
-				 * used, as specified, to determine the priority. We simply 
-				 * override older-ones with newer-ones in the hashtable (using 
-				 * replace). */
-				vi->mtime = mtime;
+	file = g_file_new_for_path (fullfilen);
 
-				/* Only items in overrides are prioritized. */
-				vi->prio = FALSE;
+	info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+				  G_FILE_QUERY_INFO_NONE,
+				  NULL, &error);
 
-				g_hash_table_replace (pre, 
-						      g_strdup_printf ("%s-%s", uri_schemes[y], values[i]), 
-						      vi);
-			}
+	g_object_unref (file);
 
-			i++;
-		  }
-		  y++;
-		}
+	/* If that didn't work out, skip */
 
+	if (error) {
 		if (info)
 			g_object_unref (info);
-		if (file)
-			g_object_unref (file);
+		g_clear_error (&error);
+		return NULL;
+	}
+
+	mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+	g_object_unref (info);
+
+	/* The snapshot of the previous run already has it parsed */
+
+	seed = seeds ? g_hash_table_lookup (seeds, fullfilen) : NULL;
 
+	if (seed && seed->mtime == mtime)
+		return copy_service_file (seed);
+
+	keyfile = g_key_file_new ();
+
+	/* If we can't parse it as a key-value file, skip */
+
+	if (!g_key_file_load_from_file (keyfile, fullfilen, G_KEY_FILE_NONE, NULL)) {
+		g_key_file_free (keyfile);
+		return NULL;
+	}
+
+	value = g_key_file_get_string (keyfile, "D-BUS Thumbnailer", "Name", NULL);
+	values = g_key_file_get_string_list (keyfile, "D-BUS Thumbnailer", "MimeTypes", NULL, NULL);
+
+	/* If it doesn't have the required things, skip */
+
+	if (!value || !values) {
 		g_free (value);
-		g_strfreev (uri_schemes);
 		g_strfreev (values);
 		g_key_file_free (keyfile);
+		return NULL;
 	}
 
-	g_dir_close (dir);
+	/* Get the supported uri-schemes, if none we default to just `file` */
+
+	uri_schemes = g_key_file_get_string_list (keyfile, "D-BUS Thumbnailer", "UriSchemes", NULL, NULL);
 
-	if (has_override) {
-		GKeyFile *keyfile;
-		gchar *fullfilen = g_build_filename (path, "overrides", NULL);
-		gsize length;
+	if (!uri_schemes) {
+		uri_schemes = g_new0 (gchar*, 2);
+		uri_schemes[0] = g_strdup ("file");
+		uri_schemes[1] = NULL;
+	}
 
-		keyfile = g_key_file_new ();
+	g_key_file_free (keyfile);
 
-		if (g_key_file_load_from_file (keyfile, fullfilen, G_KEY_FILE_NONE, NULL)) {
-			gchar **urisch_and_mimes = g_key_file_get_groups (keyfile, &length);
-			guint i;
+	sf = g_slice_new0 (ServiceFile);
+	sf->name = value;
+	sf->mime_types = values;
+	sf->uri_schemes = uri_schemes;
+	sf->mtime = mtime;
 
-			for (i = 0; i< length; i++) {
-				ValueInfo *vi = g_slice_new0 (ValueInfo);
+	return sf;
+}
 
-				vi->name = g_key_file_get_string (keyfile, urisch_and_mimes[i], 
-								  "Name", NULL);
+static void
+load_overrides (ServiceDir *dir, const gchar *fullfilen)
+{
+	GKeyFile *keyfile;
+	gsize length;
 
-				/* This is atm unused for items in overrides. */
+	g_hash_table_remove_all (dir->overrides);
 
-				vi->mtime = time (NULL);
+	keyfile = g_key_file_new ();
 
-				/* Items in overrides are prioritized. */
+	if (g_key_file_load_from_file (keyfile, fullfilen, G_KEY_FILE_NONE, NULL)) {
+		gchar **urisch_and_mimes = g_key_file_get_groups (keyfile, &length);
+		guint i;
 
-				vi->prio = TRUE;
+		for (i = 0; i< length; i++) {
+			gchar *name, *ptr;
+			GHashTable *mimes;
 
-				g_hash_table_replace (pre, g_strdup (urisch_and_mimes[i]), 
-						      vi);
+			/* We get it as "vfs-mime/type" */
+			ptr = strchr (urisch_and_mimes[i], '-');
+			name = g_key_file_get_string (keyfile, urisch_and_mimes[i],
+						      "Name", NULL);
+
+			if (!ptr || !name) {
+				g_free (name);
+				continue;
 			}
-			g_strfreev (urisch_and_mimes);
+
+			*ptr = '\0';
+			mimes = level_lookup (dir->overrides, urisch_and_mimes[i], TRUE,
+					      (GDestroyNotify) g_free,
+					      (GDestroyNotify) g_free);
+			g_hash_table_replace (mimes, g_strdup (ptr + 1), name);
 		}
+		g_strfreev (urisch_and_mimes);
+	}
 
-		g_free (fullfilen);
-		g_key_file_free (keyfile);
+	g_key_file_free (keyfile);
+}
+
+static void
+service_dir_update (ServiceDir *dir, const gchar *filen, gboolean deleted)
+{
+	gchar *fullfilen = g_build_filename (dir->path, filen, NULL);
+
+	/* 'overrides' is not a service file, it prioritizes items of the
+	 * service files in its dir */
+
+	if (strcmp (filen, "overrides") == 0) {
+		if (deleted)
+			g_hash_table_remove_all (dir->overrides);
+		else
+			load_overrides (dir, fullfilen);
+	} else {
+		ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (dir->object);
+		ServiceFile *sf = deleted ? NULL : load_service_file (fullfilen, priv->seeds);
+
+		if (sf)
+			g_hash_table_replace (dir->services, g_strdup (filen), sf);
+		else
+			g_hash_table_remove (dir->services, filen);
 	}
 
-	g_hash_table_iter_init (&iter, pre);
+	g_free (fullfilen);
+}
 
-	while (g_hash_table_iter_next (&iter, &pkey, &pvalue))  {
-		gchar *k = pkey;
-		ValueInfo *v = pvalue;
-		const gchar *oname = NULL;
+static void
+service_dir_scan (ServiceDir *dir)
+{
+	const gchar *filen;
+	GDir *gdir;
 
-		/* If this is a prioritized one, we'll always override the older. If we
-		 * are in overriding mode, we'll also override. We override by looking
-		 * up the service-name for the MIME-type and we put that in oname, which
-		 * stands for original-name. */
+	g_hash_table_remove_all (dir->services);
+	g_hash_table_remove_all (dir->overrides);
 
-		if (!v->prio && !override) {
-			DBusGProxy *proxy = g_hash_table_lookup (priv->handlers, k);
-			if (proxy)
-				oname = dbus_g_proxy_get_bus_name (proxy);
-		}
+	gdir = g_dir_open (dir->path, 0, NULL);
 
-		/* Now if the original name is set (we'll override) and if the new name
-		 * is different than the original-name (else there's no point in 
-		 * overriding anything, als the proxy will point to the same thing 
-		 * anyway), we add it (adding here means overriding, as replace is used
-		 * on the hashtable). */
+	if (!gdir)
+		return;
 
-		if (!oname || g_ascii_strcasecmp (v->name, oname) != 0)
-			thumbnail_manager_add (object, k, v->name);
-	}
+	for (filen = g_dir_read_name (gdir); filen; filen = g_dir_read_name (gdir))
+		service_dir_update (dir, filen, FALSE);
 
-	g_hash_table_unref (pre);
+	g_dir_close (gdir);
 }
 
-
 static void
 on_dir_changed (GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data)
 {
-	switch (event_type) 
+	switch (event_type)
 	{
 		case G_FILE_MONITOR_EVENT_CHANGED:
 		case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
 		case G_FILE_MONITOR_EVENT_DELETED:
 		case G_FILE_MONITOR_EVENT_CREATED: {
-			ThumbnailManager *object = user_data;
-			ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
+			ServiceDir *dir = user_data;
+			ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (dir->object);
 			gchar *path = g_file_get_path (file);
-			gboolean override = (strcmp (THUMBNAILERS_DIR, path) == 0);
+
+			if (!path)
+				break;
 
 			g_mutex_lock (&priv->mutex);
-			/* We override when it's the dir in the user's homedir*/
-			thumbnail_manager_check_dir (object, path, override);
+
+			/* Only the file that changed gets parsed again, unless
+			 * it's the watched dir itself that came or went */
+
+			if (strcmp (path, dir->path) == 0) {
+				service_dir_scan (dir);
+			} else {
+				gchar *filen = g_path_get_basename (path);
+				service_dir_update (dir, filen,
+						    event_type == G_FILE_MONITOR_EVENT_DELETED);
+				g_free (filen);
+			}
+
+			thumbnail_manager_publish (dir->object);
+
 			g_mutex_unlock (&priv->mutex);
 
 			g_free (path);
-		} 
+		}
 		break;
 		default:
 		break;
@@ -382,38 +626,99 @@ on_dir_changed (GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMoni
 }
 
 static void
-thumbnail_manager_check (ThumbnailManager *object)
+add_seed (const gchar * const *fields, guint n_fields, gpointer user_data)
+{
+	GHashTable *seeds = user_data;
+	ServiceFile *sf;
+
+	/* path, mtime, name, uri-schemes and MIME-types */
+	if (n_fields != 5)
+		return;
+
+	sf = g_slice_new0 (ServiceFile);
+	sf->mtime = g_ascii_strtoull (fields[1], NULL, 10);
+	sf->name = g_strdup (fields[2]);
+	sf->uri_schemes = g_strsplit (fields[3], ";", -1);
+	sf->mime_types = g_strsplit (fields[4], ";", -1);
+
+	g_hash_table_replace (seeds, g_strdup (fields[0]), sf);
+}
+
+/* Adds the parsed service files to the snapshot, for the next start */
+void
+thumbnail_manager_save_state (ThumbnailManager *object, StateWriter *writer)
 {
 	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
+	GHashTableIter iter;
+	gpointer key, value;
+	guint i;
+
+	g_mutex_lock (&priv->mutex);
+
+	for (i = 0; i < N_DIRS; i++) {
+		g_hash_table_iter_init (&iter, priv->dirs[i].services);
+
+		while (g_hash_table_iter_next (&iter, &key, &value)) {
+			ServiceFile *sf = value;
+			gchar *fields[5];
+
+			fields[0] = g_build_filename (priv->dirs[i].path, key, NULL);
+			fields[1] = g_strdup_printf ("%" G_GUINT64_FORMAT, sf->mtime);
+			fields[2] = sf->name;
+			fields[3] = g_strjoinv (";", sf->uri_schemes);
+			fields[4] = g_strjoinv (";", sf->mime_types);
 
-	gchar *home_thumbnlrs = g_build_filename (g_get_user_data_dir (), 
-		"thumbnailers", NULL);
+			state_writer_add_record (writer, STATE_RECORDS_SERVICES,
+						 (const gchar * const *) fields, 5);
+
+			g_free (fields[0]);
+			g_free (fields[1]);
+			g_free (fields[3]);
+			g_free (fields[4]);
+		}
+	}
+
+	g_mutex_unlock (&priv->mutex);
+}
+
+static void
+thumbnail_manager_check (ThumbnailManager *object)
+{
+	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
+	guint i;
 
 	g_mutex_lock (&priv->mutex);
 
-	/* We override when it's the one in the user's homedir*/
-	thumbnail_manager_check_dir (object, THUMBNAILERS_DIR, FALSE);
-	thumbnail_manager_check_dir (object, home_thumbnlrs, TRUE);
+	priv->seeds = g_hash_table_new_full (g_str_hash, g_str_equal,
+					     (GDestroyNotify) g_free,
+					     (GDestroyNotify) free_service_file);
+	state_snapshot_foreach_record (STATE_RECORDS_SERVICES, add_seed, priv->seeds);
+
+	for (i = 0; i < N_DIRS; i++)
+		service_dir_scan (&priv->dirs[i]);
+
+	g_hash_table_unref (priv->seeds);
+	priv->seeds = NULL;
+
+	thumbnail_manager_publish (object);
 
 	/* Monitor the dir for changes */
-	homedir = g_file_new_for_path (home_thumbnlrs);
+	homedir = g_file_new_for_path (priv->dirs[DIR_HOME].path);
 	homemon =  g_file_monitor_directory (homedir, G_FILE_MONITOR_NONE, NULL, NULL);
-	g_signal_connect (G_OBJECT (homemon), "changed", 
-			  G_CALLBACK (on_dir_changed), object);
+	g_signal_connect (G_OBJECT (homemon), "changed",
+			  G_CALLBACK (on_dir_changed), &priv->dirs[DIR_HOME]);
 
 	/* Monitor the dir for changes */
-	thumbdir = g_file_new_for_path (THUMBNAILERS_DIR);
+	thumbdir = g_file_new_for_path (priv->dirs[DIR_SYSTEM].path);
 	thumbmon =  g_file_monitor_directory (thumbdir, G_FILE_MONITOR_NONE, NULL, NULL);
-	g_signal_connect (G_OBJECT (thumbmon), "changed", 
-			  G_CALLBACK (on_dir_changed), object);
+	g_signal_connect (G_OBJECT (thumbmon), "changed",
+			  G_CALLBACK (on_dir_changed), &priv->dirs[DIR_SYSTEM]);
 
 	g_mutex_unlock (&priv->mutex);
-
-	g_free (home_thumbnlrs);
 }
 
 
-static gboolean 
+static gboolean
 do_remove_or_not (gpointer key, gpointer value, gpointer user_data)
 {
 	if (user_data == value)
@@ -425,6 +730,8 @@ static void
 service_gone (DBusGProxy *proxy, ThumbnailManager *object)
 {
 	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
+	GHashTableIter iter;
+	gpointer key, value;
 
 	g_mutex_lock (&priv->mutex);
 
@@ -432,9 +739,17 @@ service_gone (DBusGProxy *proxy, ThumbnailManager *object)
 	 * unregister it. Note that this is actually only for our plugin-runner to
 	 * work correctly (not to implement any specification related things) */
 
-	g_hash_table_foreach_remove (priv->handlers, 
-				     do_remove_or_not,
-				     proxy);
+	g_hash_table_iter_init (&iter, priv->registered);
+
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		g_hash_table_foreach_remove (value,
+					     do_remove_or_not,
+					     proxy);
+		if (g_hash_table_size (value) == 0)
+			g_hash_table_iter_remove (&iter);
+	}
+
+	thumbnail_manager_publish (object);
 
 	g_mutex_unlock (&priv->mutex);
 }
@@ -447,34 +762,36 @@ thumbnail_manager_register (ThumbnailManager *object, gchar *uri_scheme, gchar *
 {
 	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
 	DBusGProxy *mime_proxy;
+	GHashTable *mimes;
 	gchar *sender;
-	gchar *query;
 
 	dbus_async_return_if_fail (mime_type != NULL, context);
 	dbus_async_return_if_fail (uri_scheme != NULL, context);
 
-	query = g_strdup_printf ("%s-%s", uri_scheme, mime_type);
-
 	keep_alive ();
 
 	g_mutex_lock (&priv->mutex);
 
 	sender = dbus_g_method_get_sender (context);
 
-	thumbnail_manager_add (object, query, sender);
+	mime_proxy = thumbnail_manager_new_proxy (object, sender);
 
 	g_free (sender);
 
-	/* This is not necessary for activatable ones */
+	mimes = level_lookup (priv->registered, uri_scheme, TRUE,
+			      (GDestroyNotify) g_free,
+			      (GDestroyNotify) g_object_unref);
 
-	mime_proxy = g_hash_table_lookup (priv->handlers, query);
+	g_hash_table_replace (mimes, g_strdup (mime_type), mime_proxy);
 
-	g_free (query);
+	/* This is not necessary for activatable ones */
 
 	g_signal_connect (mime_proxy, "destroy",
 			  G_CALLBACK (service_gone),
 			  object);
 
+	thumbnail_manager_publish (object);
+
 	g_mutex_unlock (&priv->mutex);
 
 	dbus_g_method_return (context);
@@ -483,7 +800,7 @@ thumbnail_manager_register (ThumbnailManager *object, gchar *uri_scheme, gchar *
 /* A function for letting the thumbnail_manager know what mime-types we already deal with
  * ourselves outside of the thumbnail_manager's registration procedure (internal plugins) */
 
-void 
+void
 thumbnail_manager_i_have (ThumbnailManager *object, const gchar *mime_type)
 {
 	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
@@ -500,7 +817,7 @@ thumbnail_manager_i_have (ThumbnailManager *object, const gchar *mime_type)
 		list = g_list_next (list);
 	}
 	if (!found)
-		priv->thumber_has = g_list_prepend (priv->thumber_has, 
+		priv->thumber_has = g_list_prepend (priv->thumber_has,
 						    g_strdup (mime_type));
 	g_mutex_unlock (&priv->mutex);
 }
@@ -514,16 +831,16 @@ thumbnail_manager_get_supported (ThumbnailManager *object, DBusGMethodInvocation
 {
 	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
 	GStrv supported;
-	GHashTable *supported_h;
-	GHashTableIter iter;
+	GHashTable *supported_h, *registry;
+	GHashTableIter iter, miter;
 	gpointer key, value;
-	GList *copy, *l;
-	guint y;
+	GList *copy;
+	guint y, slot;
 
 	keep_alive ();
 
 	supported_h = g_hash_table_new_full (g_str_hash, g_str_equal,
-					     (GDestroyNotify) g_free, 
+					     (GDestroyNotify) g_free,
 					     (GDestroyNotify) NULL);
 
 	g_mutex_lock (&priv->mutex);
@@ -532,28 +849,18 @@ thumbnail_manager_get_supported (ThumbnailManager *object, DBusGMethodInvocation
 		g_hash_table_replace (supported_h, g_strdup (copy->data), NULL);
 		copy = g_list_next (copy);
 	}
+	g_mutex_unlock (&priv->mutex);
 
-	copy = g_hash_table_get_keys (priv->handlers);
-	for (l = copy; l; l = l->next) {
-		gchar *mime = g_strdup (l->data), *ptr;
-
-		/* We stored it in the hash as "vfs-mime/type" */
-		ptr = strchr (mime, '-');
-
-		if (ptr) {
-			*ptr = '\0';
-			ptr++;
-		} else {
-			ptr = mime;
-		}
-
-		g_hash_table_replace (supported_h, g_strdup (ptr), NULL);
+	registry = registry_enter (priv, &slot);
+	g_hash_table_iter_init (&iter, registry);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		gpointer mkey;
 
-		g_free (mime);
+		g_hash_table_iter_init (&miter, value);
+		while (g_hash_table_iter_next (&miter, &mkey, NULL))
+			g_hash_table_replace (supported_h, g_strdup (mkey), NULL);
 	}
-	g_list_free (copy);
-
-	g_mutex_unlock (&priv->mutex);
+	registry_leave (priv, slot);
 
 	g_hash_table_iter_init (&iter, supported_h);
 
@@ -575,12 +882,27 @@ static void
 thumbnail_manager_finalize (GObject *object)
 {
 	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
+	guint i;
 
 	if (priv->thumber_has) {
 		g_list_foreach (priv->thumber_has, (GFunc) g_free, NULL);
 		g_list_free (priv->thumber_has);
 	}
-	g_hash_table_unref (priv->handlers);
+
+	if (priv->reclaim_id)
+		g_source_remove (priv->reclaim_id);
+	free_retired (priv->retired);
+	free_retired (priv->draining);
+	g_hash_table_unref (priv->registry);
+
+	for (i = 0; i < N_DIRS; i++) {
+		g_free (priv->dirs[i].path);
+		g_hash_table_unref (priv->dirs[i].services);
+		g_hash_table_unref (priv->dirs[i].overrides);
+	}
+
+	g_hash_table_unref (priv->registered);
+	g_hash_table_unref (priv->proxies);
 
 	G_OBJECT_CLASS (thumbnail_manager_parent_class)->finalize (object);
 }
@@ -659,11 +981,36 @@ thumbnail_manager_init (ThumbnailManager *object)
 {
 	ThumbnailManagerPrivate *priv = THUMBNAIL_MANAGER_GET_PRIVATE (object);
 
+	guint i;
+
 	g_mutex_init (&priv->mutex);
 	priv->thumber_has = NULL;
-	priv->handlers = g_hash_table_new_full (g_str_hash, g_str_equal,
-						(GDestroyNotify) g_free, 
-						(GDestroyNotify) g_object_unref);
+
+	priv->dirs[DIR_SYSTEM].path = g_strdup (THUMBNAILERS_DIR);
+	priv->dirs[DIR_HOME].path = g_build_filename (g_get_user_data_dir (),
+						      "thumbnailers", NULL);
+
+	for (i = 0; i < N_DIRS; i++) {
+		priv->dirs[i].object = object;
+		priv->dirs[i].services = g_hash_table_new_full (g_str_hash, g_str_equal,
+								(GDestroyNotify) g_free,
+								(GDestroyNotify) free_service_file);
+		priv->dirs[i].overrides = g_hash_table_new_full (g_str_hash, g_str_equal,
+								 (GDestroyNotify) g_free,
+								 (GDestroyNotify) g_hash_table_unref);
+	}
+
+	priv->registered = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  (GDestroyNotify) g_free,
+						  (GDestroyNotify) g_hash_table_unref);
+	priv->proxies = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       (GDestroyNotify) g_free,
+					       (GDestroyNotify) g_object_unref);
+
+	/* Readers never get to see a NULL registry */
+	priv->registry = g_hash_table_new_full (g_str_hash, g_str_equal,
+						(GDestroyNotify) g_free,
+						(GDestroyNotify) g_hash_table_unref);
 }
 
 void 
@@ -25,6 +25,8 @@
  *
  */
 
+#include "state-snapshot.h"
+
 #define MANAGER_SERVICE      "org.freedesktop.thumbnailer"
 #define MANAGER_PATH         "/org/freedesktop/thumbnailer/Manager"
 #define MANAGER_INTERFACE    "org.freedesktop.thumbnailer.Manager"
@@ -55,6 +57,7 @@ void thumbnail_manager_get_supported (ThumbnailManager *object, DBusGMethodInvoc
 
 void thumbnail_manager_i_have (ThumbnailManager *object, const gchar *mime_type);
 DBusGProxy* thumbnail_manager_get_handler (ThumbnailManager *object, const gchar *uri_scheme, const gchar *mime_type);
+void thumbnail_manager_save_state (ThumbnailManager *object, StateWriter *writer);
 
 void thumbnail_manager_do_stop (void);
 void thumbnail_manager_do_init (DBusGConnection *connection, ThumbnailManager **thumbnail_manager, GError **error);
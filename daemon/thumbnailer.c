@@ -44,20 +44,46 @@
 
 #include "dbus-utils.h"
 #include "utils.h"
+#include "trace.h"
+#include "plugin-farm.h"
+#include "thumb-hal.h"
+#include "memory-budget.h"
+#include "write-back.h"
+#include "state-snapshot.h"
+#include "uri-index.h"
+#include "crawler.h"
+#include "page-cache.h"
+#include "mime-sniff.h"
 
 #define THUMB_ERROR_DOMAIN	"HildonThumbnailer"
 #define THUMB_ERROR		g_quark_from_static_string (THUMB_ERROR_DOMAIN)
 
+/* A failure is remembered for this long (in seconds), unless the file
+ * changes before that */
+#define NEGATIVE_TTL		(24 * 60 * 60)
+
+/* Upper bound for the outcomes that we keep in memory */
+#define MAX_OUTCOMES		65536
+
+/* Background work that didn't fit in the memory budget is tried again
+ * after this long (in milliseconds) */
+#define BACKGROUND_RETRY	5000
+
 void keep_alive (void);
 void initialize_priority (void);
+void initialize_idle_priority (void);
 
 typedef struct {
 	ThumbnailManager *manager;
 	GHashTable *plugins_perscheme;
 	GThreadPool *large_pool;
 	GThreadPool *normal_pool;
+	GThreadPool *background_pool;
+	GThreadPool *io_pool;
 	GMutex mutex;
 	GList *tasks;
+	GHashTable *outcomes;
+	gboolean forget_snapshot;
 #ifdef HAVE_OSSO
 	GMutex cmutex;
 	gboolean waiting, must_wait;
@@ -65,6 +91,25 @@ typedef struct {
 #endif
 } ThumbnailerPrivate;
 
+/* Move, Copy, Delete and the directory ones run on a thread of their own,
+ * in the order that they came in. The caller gets its reply when it's
+ * done */
+typedef enum {
+	IO_MOVE,
+	IO_COPY,
+	IO_DELETE,
+	IO_MOVE_DIRECTORY,
+	IO_DELETE_DIRECTORY
+} IoKind;
+
+typedef struct {
+	Thumbnailer *object;
+	IoKind kind;
+	GStrv from_urls, to_urls;
+	gchar *from_prefix, *to_prefix;
+	DBusGMethodInvocation *context;
+} IoOp;
+
 #define THUMBNAILER_GET_PRIVATE(obj) ((ThumbnailerPrivate *)thumbnailer_get_instance_private((Thumbnailer *)(obj)))
 
 G_DEFINE_TYPE_WITH_PRIVATE (Thumbnailer, thumbnailer, G_TYPE_OBJECT)
@@ -171,6 +216,20 @@ get_plugin (Thumbnailer *object, const gchar *uri_scheme, const gchar *mime_type
 	return plugin;
 }
 
+gboolean
+thumbnailer_handles (Thumbnailer *object, const gchar *uri_scheme, const gchar *mime_type)
+{
+	ThumbnailerPrivate *priv = THUMBNAILER_GET_PRIVATE (object);
+	gboolean retval;
+
+	/* The crawler asks from its own thread */
+	g_mutex_lock (&priv->mutex);
+	retval = get_plugin (object, uri_scheme, mime_type) != NULL;
+	g_mutex_unlock (&priv->mutex);
+
+	return retval;
+}
+
 void 
 thumbnailer_register_plugin (Thumbnailer *object, const gchar *mime_type, GModule *plugin, const GStrv uri_schemes, gint priority)
 {
@@ -254,13 +313,28 @@ thumbnailer_unregister_plugin (Thumbnailer *object, GModule *plugin)
 }
 
 static void
-get_some_file_infos (const gchar *uri, gchar **mime_type, guint64 *mtime, gchar *mime_hint, GError **error)
+get_some_file_infos (const gchar *uri, gchar **mime_type, guint64 *mtime, gsize *cost, gchar *mime_hint, GError **error)
 {
 	const gchar *content_type;
 	GFileInfo *info;
 	GFile *file;
+	gchar *path;
 
 	*mime_type = NULL;
+	*cost = 0;
+
+	/* Local ones get one open and a look at their first bytes */
+	if (g_str_has_prefix (uri, "file://"))
+		path = g_filename_from_uri (uri, NULL, NULL);
+	else
+		path = (uri[0] == '/') ? g_strdup (uri) : NULL;
+
+	if (path) {
+		if (mime_sniff_file (path, mime_type, mtime, cost, error) && !*mime_type)
+			*mime_type = g_strdup (mime_hint ? mime_hint : "unknown/unknown");
+		g_free (path);
+		return;
+	}
 
 	file = g_file_new_for_uri (uri);
 	info = g_file_query_info (file,
@@ -289,9 +363,17 @@ typedef struct {
 	Thumbnailer *object;
 	GStrv urls, mime_types;
 	guint num;
+	ThumbnailerPriority priority;
 	gboolean unqueued, dead;
 } WorkTask;
 
+/* What the file-info pass learnt about an item that goes to a thumbnailer,
+ * so that nothing has to open it again for that */
+typedef struct {
+	guint64 mtime;
+	gsize cost;
+} ItemInfo;
+
 
 static gint 
 pool_sort_compare (gconstpointer a, gconstpointer b, gpointer user_data)
@@ -299,6 +381,9 @@ pool_sort_compare (gconstpointer a, gconstpointer b, gpointer user_data)
 	WorkTask *task_a = (WorkTask *) a;
 	WorkTask *task_b = (WorkTask *) b;
 
+	if (task_a->priority != task_b->priority)
+		return task_b->priority - task_a->priority;
+
 	/* This makes pool a LIFO */
 
 	return task_b->num - task_a->num;
@@ -346,54 +431,97 @@ thumbnailer_crash_out (Thumbnailer *object)
 	g_mutex_unlock (&priv->mutex);
 }
 
-void
-thumbnailer_queue (Thumbnailer *object, GStrv urls, GStrv mime_hints, guint handle_to_unqueue, DBusGMethodInvocation *context)
+/* Call with the mutex held */
+static void
+push_task (ThumbnailerPrivate *priv, WorkTask *task)
+{
+	if (task->priority == THUMBNAILER_PRIORITY_BACKGROUND)
+		g_thread_pool_push (priv->background_pool, task, NULL);
+	else if (g_strv_length (task->urls) > 50)
+		g_thread_pool_push (priv->large_pool, task, NULL);
+	else
+		g_thread_pool_push (priv->normal_pool, task, NULL);
+}
+
+static gboolean
+push_deferred_task (gpointer user_data)
+{
+	WorkTask *task = user_data;
+	ThumbnailerPrivate *priv = THUMBNAILER_GET_PRIVATE (task->object);
+
+	g_mutex_lock (&priv->mutex);
+	push_task (priv, task);
+	g_mutex_unlock (&priv->mutex);
+
+	return FALSE;
+}
+
+static guint
+queue_task (Thumbnailer *object, GStrv urls, GStrv mime_hints, guint handle_to_unqueue, ThumbnailerPriority priority, guint delay)
 {
 	ThumbnailerPrivate *priv = THUMBNAILER_GET_PRIVATE (object);
 	WorkTask *task;
 	static guint num = 0;
-
-	dbus_async_return_if_fail (urls != NULL, context);
+	guint retval;
 
 	task = g_slice_new0 (WorkTask);
 
 	keep_alive ();
 
 	task->unqueued = FALSE;
-	task->num = ++num;
 	task->object = g_object_ref (object);
 	task->urls = g_strdupv (urls);
+	task->priority = priority;
 	task->dead = FALSE;
 
+	if (priority != THUMBNAILER_PRIORITY_BACKGROUND)
+		crawler_notify_activity ();
+
 	if (mime_hints)
 		task->mime_types = g_strdupv (mime_hints);
 	else
 		task->mime_types = NULL;
 
 	g_mutex_lock (&priv->mutex);
+	/* Queue is called from the D-Bus thread and from Albumart's pool */
+	retval = task->num = ++num;
 	g_list_foreach (priv->tasks, mark_unqueued, GUINT_TO_POINTER (handle_to_unqueue));
 	priv->tasks = g_list_prepend (priv->tasks, task);
-	if (g_strv_length (urls) > 50)
-		g_thread_pool_push (priv->large_pool, task, NULL);
+
+	/* Items on a mount that was going away when we last went down wait
+	 * a bit, it might not be back yet (see thumb-hal.c) */
+	delay = MAX (delay, thumb_hal_get_delay (urls));
+	if (delay > 0)
+		g_timeout_add (delay, push_deferred_task, task);
 	else
-		g_thread_pool_push (priv->normal_pool, task, NULL);
+		push_task (priv, task);
 	g_mutex_unlock (&priv->mutex);
 
+	return retval;
+}
+
+void
+thumbnailer_queue (Thumbnailer *object, GStrv urls, GStrv mime_hints, guint handle_to_unqueue, DBusGMethodInvocation *context)
+{
+	guint num;
+
+	dbus_async_return_if_fail (urls != NULL, context);
+
+	num = queue_task (object, urls, mime_hints, handle_to_unqueue,
+			  THUMBNAILER_PRIORITY_NORMAL, 0);
+
 	dbus_g_method_return (context, num);
 }
 
-static gboolean 
-strv_contains (const gchar **list, gchar *uri)
+/* For the other objects in the daemon, which would otherwise have to go
+ * over the session bus to reach us. The task gets a handle and signals
+ * just like one that came in over D-Bus */
+guint
+thumbnailer_enqueue (Thumbnailer *object, GStrv urls, GStrv mime_hints, ThumbnailerPriority priority)
 {
-	guint i = 0;
-	gboolean found = FALSE;
-	while (list[i] != NULL && !found) {
-		/* We indeed search the full URI for the piece */ 
-		if (strcasestr ((char *) uri, (char *) list[i]) != NULL)
-			found = TRUE;
-		i++;
-	}
-	return found;
+	g_return_val_if_fail (urls != NULL, 0);
+
+	return queue_task (object, urls, mime_hints, 0, priority, 0);
 }
 
 static GStrv
@@ -520,6 +648,422 @@ thumb_check (const gchar *filename, guint64 mtime)
 	return retval;
 }
 
+/* Whether all the flavors of uri are there, and not older than mtime_x */
+
+static gboolean
+has_thumbs (const gchar *uri, guint64 mtime_x)
+{
+	gchar *normal = NULL, *large = NULL, *cropped = NULL;
+	gboolean has_thumb;
+
+	hildon_thumbnail_util_get_thumb_paths (uri, &large, &normal, &cropped, 
+					       NULL, NULL, NULL, FALSE);
+
+#ifdef LARGE_THUMBNAILS
+	has_thumb = (thumb_check (large, mtime_x) && 
+		     thumb_check (normal, mtime_x) && 
+		     thumb_check (cropped, mtime_x));
+#else
+#ifdef NORMAL_THUMBNAILS
+	has_thumb = (thumb_check (normal, mtime_x) && 
+		     thumb_check (cropped, mtime_x));
+#else
+	has_thumb =  thumb_check (cropped, mtime_x);
+#endif
+#endif
+
+
+	if (!has_thumb) {
+		gchar *pnormal = NULL, *plarge = NULL, *pcropped = NULL;
+		hildon_thumbnail_util_get_thumb_paths (uri, &plarge, &pnormal, &pcropped, 
+					       NULL, NULL, NULL, FALSE);
+
+#ifdef LARGE_THUMBNAILS
+		has_thumb = (thumb_check (plarge, mtime_x) && 
+			     thumb_check (pnormal, mtime_x) && 
+			     thumb_check (pcropped, mtime_x));
+#else
+#ifdef NORMAL_THUMBNAILS
+		has_thumb = (thumb_check (pnormal, mtime_x) && 
+			     thumb_check (pcropped, mtime_x));
+#else
+		has_thumb =  thumb_check (pcropped, mtime_x);
+#endif
+#endif
+
+		if (has_thumb) {
+			g_free (normal);
+			normal = pnormal;
+			g_free (large);
+			large = plarge;
+			g_free (cropped);
+			cropped = pcropped;
+		} else {
+			g_free (pcropped);
+			g_free (pnormal);
+			g_free (plarge);
+		}
+	}
+
+	g_free (normal);
+	g_free (large);
+	g_free (cropped);
+
+	return has_thumb;
+}
+
+/* Whether an out plugin left a fail file for uri, the JPEG or the PNG one */
+static gboolean
+has_fail_file (const gchar *uri)
+{
+	gboolean found = FALSE;
+	guint y;
+
+	for (y = 0; y < 2 && !found; y++) {
+		gchar *large = NULL, *normal = NULL, *cropped = NULL;
+		gchar *name, *path;
+
+		hildon_thumbnail_util_get_thumb_paths (uri, &large, &normal, &cropped,
+						       NULL, NULL, NULL, (y == 0));
+
+		name = g_path_get_basename (large);
+		path = g_build_filename (g_get_home_dir (), ".thumbnails", "fail",
+					 PACKAGE_NAME, name, NULL);
+		found = g_file_test (path, G_FILE_TEST_EXISTS);
+
+		g_free (path);
+		g_free (name);
+		g_free (large);
+		g_free (normal);
+		g_free (cropped);
+	}
+
+	return found;
+}
+
+static guint64
+hash_uri (const gchar *uri)
+{
+	guint64 hash;
+	gchar *full;
+
+	if (strchr (uri, ':'))
+		return state_hash_uri (uri);
+
+	/* The same as what's done when grouping, so that both agree */
+	full = g_strdup_printf ("file://%s", uri);
+	hash = state_hash_uri (full);
+	g_free (full);
+
+	return hash;
+}
+
+/* What we know about the thumbnails of uri, at mtime. Either learned while
+ * we ran or, if not, from the snapshot of the previous run */
+
+static guint32
+lookup_outcome (ThumbnailerPrivate *priv, const gchar *uri, guint64 mtime)
+{
+	guint64 hash = hash_uri (uri);
+	StateOutcome *known, found;
+	gboolean have;
+
+	g_mutex_lock (&priv->mutex);
+	known = g_hash_table_lookup (priv->outcomes, &hash);
+	if (known)
+		found = *known;
+	have = known || (!priv->forget_snapshot &&
+			 state_snapshot_lookup_outcome (hash, &found));
+	g_mutex_unlock (&priv->mutex);
+
+	if (!have || found.mtime != mtime)
+		return 0;
+
+	if ((found.flags & STATE_OUTCOME_FAILED) &&
+	    g_get_real_time () / G_USEC_PER_SEC - found.stamp > NEGATIVE_TTL)
+		return 0;
+
+	/* Cleaning the cache removes the fail files, that's a retry */
+	if ((found.flags & STATE_OUTCOME_FAIL_FILE) && !has_fail_file (uri))
+		return 0;
+
+	return found.flags;
+}
+
+static void
+record_outcome (ThumbnailerPrivate *priv, const gchar *uri, guint64 mtime, guint32 flags)
+{
+	StateOutcome *outcome = g_slice_new0 (StateOutcome);
+
+	outcome->uri_hash = hash_uri (uri);
+	outcome->mtime = mtime;
+	outcome->flags = flags;
+	outcome->stamp = (guint32) (g_get_real_time () / G_USEC_PER_SEC);
+
+	if ((flags & STATE_OUTCOME_FAILED) && has_fail_file (uri))
+		outcome->flags |= STATE_OUTCOME_FAIL_FILE;
+
+	if (flags & STATE_OUTCOME_FRESH)
+		uri_index_add (uri);
+
+	g_mutex_lock (&priv->mutex);
+	if (g_hash_table_size (priv->outcomes) >= MAX_OUTCOMES)
+		g_hash_table_remove_all (priv->outcomes);
+	g_hash_table_replace (priv->outcomes, &outcome->uri_hash, outcome);
+	g_mutex_unlock (&priv->mutex);
+}
+
+static void
+record_outcomes (ThumbnailerPrivate *priv, GHashTable *infos, GStrv uris, guint32 flags)
+{
+	guint i;
+
+	for (i = 0; uris && uris[i] != NULL; i++) {
+		ItemInfo *info = g_hash_table_lookup (infos, uris[i]);
+
+		if (info)
+			record_outcome (priv, uris[i], info->mtime, flags);
+	}
+}
+
+/* Only what a plugin put an error for fails again next time. A timeout, a
+ * crash or a lost worker might not, those are tried again */
+static void
+record_failures (ThumbnailerPrivate *priv, GHashTable *infos, GStrv uris)
+{
+	guint i;
+
+	for (i = 0; uris && uris[i] != NULL; i++) {
+		ItemInfo *info = g_hash_table_lookup (infos, uris[i]);
+
+		if (info && has_fail_file (uris[i]))
+			record_outcome (priv, uris[i], info->mtime,
+					STATE_OUTCOME_FAILED);
+	}
+}
+
+static void
+free_item_info (ItemInfo *info)
+{
+	g_slice_free (ItemInfo, info);
+}
+
+static void
+free_outcome (StateOutcome *outcome)
+{
+	g_slice_free (StateOutcome, outcome);
+}
+
+/* The background thread runs at idle priority, were it to wait in line
+ * for the budget it would hold up the requests behind it once admitted.
+ * Its items go back to the queue instead, for when there's room */
+static void
+requeue_background (WorkTask *task, GStrv urls, const gchar *mime_type)
+{
+	GStrv mime_hints = NULL;
+	guint i, len = g_strv_length (urls);
+
+	if (mime_type) {
+		mime_hints = (GStrv) g_malloc0 (sizeof (gchar *) * (len + 1));
+		for (i = 0; i < len; i++)
+			mime_hints[i] = g_strdup (mime_type);
+	}
+
+	queue_task (task->object, urls, mime_hints, 0,
+		    THUMBNAILER_PRIORITY_BACKGROUND, BACKGROUND_RETRY);
+
+	g_strfreev (mime_hints);
+}
+
+/* Runs the plugin on urls once cost fits in the memory budget */
+static gboolean
+create_within_budget (WorkTask *task, GModule *module, GStrv urls, gchar *mime_type, GHashTable *infos, gsize cost)
+{
+	ThumbnailerPrivate *priv = THUMBNAILER_GET_PRIVATE (task->object);
+	GError *error = NULL;
+	GStrv failed_urls = NULL;
+	gboolean had_err = FALSE;
+
+	if (task->priority == THUMBNAILER_PRIORITY_BACKGROUND) {
+		if (!memory_budget_try_acquire (cost)) {
+			requeue_background (task, urls, mime_type);
+			return FALSE;
+		}
+	} else {
+		hildon_thumbnail_trace_begin ("admit", urls[0], NULL);
+		memory_budget_acquire (cost);
+		hildon_thumbnail_trace_end ("admit", urls[0], NULL);
+	}
+
+	keep_alive ();
+
+	/* Heavy plugins run in worker processes */
+	if (plugin_farm_handles (module))
+		plugin_farm_create (module, urls, 
+				    mime_type, 
+				    &failed_urls, 
+				    &error);
+	else
+		hildon_thumbnail_plugin_do_create (module, urls, 
+						   mime_type, 
+						   &failed_urls, 
+						   &error);
+
+	keep_alive ();
+
+	memory_budget_release (cost);
+
+	if (error) {
+		GStrv newlist = subtract_strv (urls, failed_urls);
+
+		if (newlist) {
+			record_outcomes (priv, infos, newlist,
+					 STATE_OUTCOME_FRESH);
+			g_signal_emit (task->object, signals[READY_SIGNAL], 
+				       0, newlist);
+			g_strfreev (newlist);
+		}
+
+		record_failures (priv, infos, failed_urls);
+
+		g_signal_emit (task->object, signals[ERROR_SIGNAL],
+			       0, task->num, failed_urls, 1, 
+			       error->message);
+		g_clear_error (&error);
+		had_err = TRUE;
+	} else {
+		record_outcomes (priv, infos, urls,
+				 STATE_OUTCOME_FRESH);
+		g_signal_emit (task->object, signals[READY_SIGNAL], 
+			       0, urls);
+	}
+
+	if (failed_urls)
+		g_strfreev (failed_urls);
+
+	return had_err;
+}
+
+static gint
+compare_costs (gconstpointer a, gconstpointer b)
+{
+	gsize ca = *(const gsize *) a, cb = *(const gsize *) b;
+
+	return ca < cb ? 1 : (ca > cb ? -1 : 0);
+}
+
+typedef struct {
+	guint start, len;
+	gsize cost;
+} AdmittedRun;
+
+/* What the items of a run can have in the works at once: the width most
+ * expensive of them */
+static gsize
+run_cost (GArray *costs, guint start, guint len, guint width)
+{
+	GArray *sorted = g_array_sized_new (FALSE, FALSE, sizeof (gsize), len);
+	gsize cost = 0;
+	guint i;
+
+	g_array_append_vals (sorted, &g_array_index (costs, gsize, start), len);
+	g_array_sort (sorted, compare_costs);
+
+	for (i = 0; i < MIN (width, len); i++)
+		cost += g_array_index (sorted, gsize, i);
+
+	g_array_free (sorted, TRUE);
+
+	return cost;
+}
+
+/* Items whose headers say they are too big for a share of the memory
+ * budget go one by one through the heavy lane, after the others went as
+ * one batch. Most plugins do one item at a time, the exec plugin as many as
+ * it may spawn and the farm as many as it has workers, so that's what a
+ * run costs.
+ *
+ * With readahead the batch goes in runs as wide as the plugin, while one
+ * run decodes the kernel reads the originals of the next items */
+static gboolean
+create_admitted (WorkTask *task, GModule *module, GStrv urls, gchar *mime_type, GHashTable *infos)
+{
+	GPtrArray *order = g_ptr_array_new ();
+	GPtrArray *heavy = g_ptr_array_new ();
+	GArray *costs = g_array_new (FALSE, FALSE, sizeof (gsize));
+	GArray *runs = g_array_new (FALSE, FALSE, sizeof (AdmittedRun));
+	guint readahead = page_cache_get_readahead ();
+	PageCacheSet *cache = page_cache_set_new ();
+	AdmittedRun run;
+	gboolean had_err = FALSE;
+	guint i, n, width, light, prefetched = 0;
+
+	for (i = 0; urls[i] != NULL; i++) {
+		ItemInfo *info = g_hash_table_lookup (infos, urls[i]);
+		gsize cost = info ? info->cost : 0;
+
+		if (memory_budget_is_heavy (cost)) {
+			g_debug ("%s needs %" G_GSIZE_FORMAT " bytes, it takes the heavy lane",
+				 urls[i], cost);
+			g_ptr_array_add (heavy, urls[i]);
+			g_ptr_array_add (heavy, GSIZE_TO_POINTER (cost));
+		} else {
+			g_ptr_array_add (order, urls[i]);
+			g_array_append_val (costs, cost);
+		}
+	}
+
+	width = plugin_farm_handles (module) ? plugin_farm_get_width (module) :
+		hildon_thumbnail_plugin_get_width (module);
+	light = order->len;
+	n = readahead > 0 ? MAX (width, readahead) : MAX (light, 1);
+
+	for (run.start = 0; run.start < light; run.start += run.len) {
+		run.len = MIN (n, light - run.start);
+		run.cost = run_cost (costs, run.start, run.len, width);
+		g_array_append_val (runs, run);
+	}
+
+	for (i = 0; i < heavy->len; i += 2) {
+		run.start = order->len;
+		run.len = 1;
+		run.cost = GPOINTER_TO_SIZE (g_ptr_array_index (heavy, i + 1));
+		g_array_append_val (runs, run);
+		g_ptr_array_add (order, g_ptr_array_index (heavy, i));
+	}
+
+	for (i = 0; i < runs->len; i++) {
+		AdmittedRun *r = &g_array_index (runs, AdmittedRun, i);
+		GStrv part = (GStrv) g_malloc0 (sizeof (gchar *) * (r->len + 1));
+		guint end = MIN (r->start + r->len + readahead, order->len);
+		guint k;
+
+		for (; prefetched < end; prefetched++)
+			page_cache_prefetch (cache, g_ptr_array_index (order, prefetched));
+
+		for (k = 0; k < r->len; k++) {
+			part[k] = g_ptr_array_index (order, r->start + k);
+			page_cache_touch (cache, part[k]);
+		}
+
+		had_err |= create_within_budget (task, module, part, mime_type,
+						 infos, r->cost);
+
+		for (k = 0; k < r->len; k++)
+			page_cache_release (cache, part[k]);
+
+		g_free (part);
+	}
+
+	page_cache_set_free (cache);
+	g_array_free (runs, TRUE);
+	g_array_free (costs, TRUE);
+	g_ptr_array_free (heavy, TRUE);
+	g_ptr_array_free (order, TRUE);
+
+	return had_err;
+}
+
 /* This is the threadpool's function. This means that everything we do is 
  * asynchronous wrt to the mainloop (we aren't blocking it). Because it all 
  * happens in a thread, we must care about proper locking, too.
@@ -536,18 +1080,14 @@ do_the_work (WorkTask *task, gpointer user_data)
 	GStrv urls = task->urls;
 	GStrv mime_types = task->mime_types;
 	guint i;
-	GHashTable *schemes;
+	GHashTable *schemes, *infos;
 	GHashTableIter s_iter;
 	gpointer s_key, s_value;
 	GList *thumb_items = NULL, *copy;
 	GStrv cached_items;
 
-	static const gchar *remotefss[10] = { 
-		"smb://", "file:///media", 
-		"file:///mnt", "obex://", "ftp://", 
-		"ftps://", "dav://", "nfs://",
-		"file:///home/user/MyDocs",
-		NULL };
+	hildon_thumbnail_trace_set_task (task->num);
+	hildon_thumbnail_trace_begin ("task", NULL, NULL);
 
 	g_signal_emit (task->object, signals[STARTED_SIGNAL], 0,
 			task->num);
@@ -567,85 +1107,55 @@ do_the_work (WorkTask *task, gpointer user_data)
 					 (GDestroyNotify) g_free, 
 					 (GDestroyNotify) g_hash_table_unref);
 
+	/* What we know of each item that goes to a thumbnailer */
+	infos = g_hash_table_new_full (g_str_hash, g_str_equal,
+				       (GDestroyNotify) g_free,
+				       (GDestroyNotify) free_item_info);
+
 	i = 0;
 
 	while (urls[i] != NULL) {
 		gchar *mime_type = NULL;
 		gboolean has_thumb = FALSE;
 		GError *error = NULL;
-		gchar *normal = NULL, *large = NULL, *cropped = NULL;
 		guint64 mtime_x = 0;
+		gsize cost = 0;
 		gchar *mhint = NULL;
+		guint32 known;
 
 #ifdef HAVE_OSSO
 		if (big_thread && priv->must_wait) {
+			hildon_thumbnail_trace_begin ("wait-tracker", NULL, NULL);
 			g_mutex_lock (&priv->cmutex);
 			priv->waiting = TRUE;
 			g_debug ("Big-queue thread waiting for Tracker to finish Indexing (Maemo specific)");
 			g_cond_wait (&priv->cond, &priv->cmutex);
 			g_mutex_unlock (&priv->cmutex);
+			hildon_thumbnail_trace_end ("wait-tracker", NULL, NULL);
 		}
 #endif
 
-		hildon_thumbnail_util_get_thumb_paths (urls[i], &large, &normal, &cropped, 
-						       NULL, NULL, NULL, FALSE);
+		hildon_thumbnail_trace_begin ("file-info", urls[i], NULL);
 
-		if (mime_types && g_strv_length (mime_types) >= i)
+		/* An empty hint is how a client says it has none for this one */
+		if (mime_types && g_strv_length (mime_types) > i && *mime_types[i])
 			mhint = mime_types[i];
 
 		get_some_file_infos (urls[i], &mime_type, &mtime_x,
-				     mhint, &error);
-
-
-#ifdef LARGE_THUMBNAILS
-		has_thumb = (thumb_check (large, mtime_x) && 
-			     thumb_check (normal, mtime_x) && 
-			     thumb_check (cropped, mtime_x));
-#else
-	#ifdef NORMAL_THUMBNAILS
-		has_thumb = (thumb_check (normal, mtime_x) && 
-			     thumb_check (cropped, mtime_x));
-	#else
-		has_thumb =  thumb_check (cropped, mtime_x);
-	#endif
-#endif
+				     &cost, mhint, &error);
 
 
-		if (!has_thumb) {
-			gchar *pnormal = NULL, *plarge = NULL, *pcropped = NULL;
-			hildon_thumbnail_util_get_thumb_paths (urls[i], &plarge, &pnormal, &pcropped, 
-						       NULL, NULL, NULL, FALSE);
-
-#ifdef LARGE_THUMBNAILS
-			has_thumb = (thumb_check (plarge, mtime_x) && 
-				     thumb_check (pnormal, mtime_x) && 
-				     thumb_check (pcropped, mtime_x));
-#else
-	#ifdef NORMAL_THUMBNAILS
-			has_thumb = (thumb_check (pnormal, mtime_x) && 
-				     thumb_check (pcropped, mtime_x));
-	#else
-			has_thumb =  thumb_check (pcropped, mtime_x);
-	#endif
-#endif
+		known = error ? 0 : lookup_outcome (priv, urls[i], mtime_x);
 
-			if (has_thumb) {
-				g_free (normal);
-				normal = pnormal;
-				g_free (large);
-				large = plarge;
-				g_free (cropped);
-				cropped = pcropped;
-			} else {
-				g_free (pcropped);
-				g_free (pnormal);
-				g_free (plarge);
-			}
+		/* The thumbnails themselves are always looked at, clients
+		 * delete them behind our back */
+		if (!error && !(known & STATE_OUTCOME_FAILED)) {
+			has_thumb = has_thumbs (urls[i], mtime_x);
+			if (has_thumb && !(known & STATE_OUTCOME_FRESH))
+				record_outcome (priv, urls[i], mtime_x, STATE_OUTCOME_FRESH);
 		}
 
-		g_free (normal);
-		g_free (large);
-		g_free (cropped);
+		hildon_thumbnail_trace_end ("file-info", urls[i], NULL);
 
 		if (error) {
 			GStrv oneurl = (GStrv) g_malloc0 (sizeof (gchar*) * 2);
@@ -655,6 +1165,14 @@ do_the_work (WorkTask *task, gpointer user_data)
 				       0, task->num, oneurl, 1, error->message);
 			g_error_free (error);
 			g_strfreev (oneurl);
+		} else if (known & STATE_OUTCOME_FAILED) {
+			GStrv oneurl = (GStrv) g_malloc0 (sizeof (gchar*) * 2);
+			oneurl[0] = g_strdup (urls[i]);
+			oneurl[1] = NULL;
+			g_signal_emit (task->object, signals[ERROR_SIGNAL],
+				       0, task->num, oneurl, 1,
+				       "Failed before, not trying again until it changes");
+			g_strfreev (oneurl);
 		} else {
 			if (mime_type && !has_thumb) {
 				GList *urls_for_mime;
@@ -662,6 +1180,7 @@ do_the_work (WorkTask *task, gpointer user_data)
 				gchar *uri_scheme = g_strdup (urls[i]);
 				gchar *ptr = strchr (uri_scheme, ':');
 				gchar *uri;
+				ItemInfo *info;
 
 				if (ptr) {
 					/* We set the ':' to end-of-string */
@@ -691,6 +1210,11 @@ do_the_work (WorkTask *task, gpointer user_data)
 					g_free (uri_scheme);
 				}
 
+				info = g_slice_new (ItemInfo);
+				info->mtime = mtime_x;
+				info->cost = cost;
+				g_hash_table_replace (infos, g_strdup (uri), info);
+
 				urls_for_mime = g_list_prepend (urls_for_mime, uri);
 				g_hash_table_replace (hash, g_strdup(mime_type), 
 				                      urls_for_mime);
@@ -784,6 +1308,9 @@ do_the_work (WorkTask *task, gpointer user_data)
 
 				keep_alive ();
 
+				hildon_thumbnail_trace_begin ("specialized", urlss[o],
+							      dbus_g_proxy_get_bus_name (proxy));
+
 				g_cond_init (&info.condition);
 				info.had_callback = FALSE;
 				g_mutex_init (&info.mutex);
@@ -836,6 +1363,9 @@ do_the_work (WorkTask *task, gpointer user_data)
 								G_CALLBACK (specialized_ready),
 								&info);
 
+				hildon_thumbnail_trace_end ("specialized", urlss[o],
+							    dbus_g_proxy_get_bus_name (proxy));
+
 				keep_alive ();
 
 				if (error) {
@@ -850,6 +1380,18 @@ do_the_work (WorkTask *task, gpointer user_data)
 
 					g_clear_error (&error);
 
+					/* Only when the thumbnailer said so, a timeout
+					 * might not happen next time. The fail file is
+					 * what a recreate removes to have it tried again */
+					if (info.had_callback) {
+						ItemInfo *failed = g_hash_table_lookup (infos, info.uri);
+
+						if (failed)
+							hildon_thumbnail_outplugins_put_error (failed->mtime,
+											       info.uri, NULL);
+						record_failures (priv, infos, failed_urls);
+					}
+
 					g_strfreev (failed_urls);
 
 					had_err = TRUE;
@@ -859,6 +1401,9 @@ do_the_work (WorkTask *task, gpointer user_data)
 					succeeded_urls[0] = g_strdup (info.uri);
 					succeeded_urls[1] = NULL;
 
+					record_outcomes (priv, infos, succeeded_urls,
+							 STATE_OUTCOME_FRESH);
+
 					g_signal_emit (task->object, signals[READY_SIGNAL], 
 						       0, succeeded_urls);
 
@@ -878,38 +1423,8 @@ do_the_work (WorkTask *task, gpointer user_data)
 			g_mutex_unlock (&priv->mutex);
 
 			if (module) {
-				GError *error = NULL;
-				GStrv failed_urls = NULL;
-
-				keep_alive ();
-
-				hildon_thumbnail_plugin_do_create (module, urlss, 
-								   mime_type, 
-								   &failed_urls, 
-								   &error);
-
-				keep_alive ();
-
-				if (error) {
-					GStrv newlist = subtract_strv (urlss, failed_urls);
-
-					if (newlist) {
-						g_signal_emit (task->object, signals[READY_SIGNAL], 
-							       0, newlist);
-						g_strfreev (newlist);
-					}
-
-					g_signal_emit (task->object, signals[ERROR_SIGNAL],
-						       0, task->num, failed_urls, 1, 
-						       error->message);
-					g_clear_error (&error);
-					had_err = TRUE;
-				} else
-					g_signal_emit (task->object, signals[READY_SIGNAL], 
-						       0, urlss);
-
-				if (failed_urls)
-					g_strfreev (failed_urls);
+				had_err = create_admitted (task, module, urlss,
+							   mime_type, infos);
 
 			/* And if even that is not the case, we are very sorry */
 
@@ -922,49 +1437,13 @@ do_the_work (WorkTask *task, gpointer user_data)
 			}
 		}
 
-		i = 0;
-
-		while (!had_err && urlss[i] != NULL) {
-			if (strv_contains (remotefss, urlss[i])) {
-			  guint y = 0;
-			  for (y = 0; y < 2; y++) {
-				gchar *from[4] = { NULL, NULL, NULL, NULL };
-				gchar *to[4] = { NULL, NULL, NULL, NULL };
-				guint z = 0;
-				GError *error = NULL;
-
-				hildon_thumbnail_util_get_thumb_paths (urlss[i], 
-								       &from[0], 
-								       &from[1], 
-								       &from[2], 
-								       &to[0], 
-								       &to[1], 
-								       &to[2], 
-								       (y == 0));
-
-				for (z = 0; z < 3 && !error; z++) {
-					GFile *from_file, *to_file;
-
-					from_file = g_file_new_for_path (from[z]);
-					to_file = g_file_new_for_uri (to[z]);
-
-					g_file_copy (from_file, to_file, 0, NULL, 
-						     NULL, NULL, &error);
-
-					g_object_unref (from_file);
-					g_object_unref (to_file);
-				}
-
-				for (z = 0; z < 3; z++) {
-					g_free (from[z]);
-					g_free (to[z]);
-				}
-
-				g_clear_error (&error);
-			  }
-			}
-			i++;
+		/* Items on remote and removable media also get a copy of
+		 * their thumbnails next to them, that happens in the background */
+		for (i = 0; !had_err && urlss[i] != NULL; i++) {
+			if (write_back_wants (urlss[i]))
+				write_back_queue (urlss[i]);
 		}
+
 		if (mime_type) {
 			g_free (mime_type);
 		}
@@ -976,6 +1455,7 @@ do_the_work (WorkTask *task, gpointer user_data)
 	}
 
 	g_hash_table_unref (schemes);
+	g_hash_table_unref (infos);
 
 unqueued:
 
@@ -984,6 +1464,9 @@ unqueued:
 				       task->num);
 	}
 
+	hildon_thumbnail_trace_end ("task", NULL, NULL);
+	hildon_thumbnail_trace_set_task (0);
+
 	g_object_unref (task->object);
 	g_strfreev (task->urls);
 	if (task->mime_types)
@@ -1008,169 +1491,336 @@ do_the_large_work (WorkTask *task, gpointer user_data)
 	do_the_work (task, user_data);
 }
 
+static void 
+do_the_background_work (WorkTask *task, gpointer user_data)
+{
+	static __thread gboolean idle = FALSE;
 
-void
-thumbnailer_move (Thumbnailer *object, GStrv from_urls, GStrv to_urls, DBusGMethodInvocation *context)
+	if (!idle) {
+		initialize_idle_priority ();
+		idle = TRUE;
+	}
+
+	do_the_work (task, user_data);
+}
+
+/* How many background tasks wait for the background thread */
+guint
+thumbnailer_get_background_backlog (Thumbnailer *object)
 {
-	guint i = 0;
+	ThumbnailerPrivate *priv = THUMBNAILER_GET_PRIVATE (object);
 
-	dbus_async_return_if_fail (from_urls != NULL, context);
-	dbus_async_return_if_fail (to_urls != NULL, context);
+	return g_thread_pool_unprocessed (priv->background_pool);
+}
 
-	keep_alive ();
 
-	while (from_urls[i] != NULL && to_urls[i] != NULL) {
-
-	  guint y = 0;
-	  for (y = 0; y < 2; y++ ) {
-		const gchar *from_uri = from_urls[i];
-		const gchar *to_uri = to_urls[i];
-		gchar *from_normal = NULL, 
-		      *from_large = NULL, 
-		      *from_cropped = NULL;
-		gchar *to_normal = NULL, 
-		      *to_large = NULL,
-		      *to_cropped = NULL;
-
-		hildon_thumbnail_util_get_thumb_paths (from_uri, &from_large, 
-						       &from_normal, 
-						       &from_cropped,
-						       NULL, NULL, NULL,
-						       (y == 0));
-
-
-		hildon_thumbnail_util_get_thumb_paths (to_uri, &to_large, 
-						       &to_normal, 
-						       &to_cropped,
-						       NULL, NULL, NULL,
-						       (y == 0));
-
-		g_rename (from_large, to_large);
-		g_rename (from_normal, to_normal);
-		g_rename (from_cropped, to_cropped);
-
-		g_free (from_normal);
-		g_free (from_large);
-		g_free (from_cropped);
-		g_free (to_normal);
-		g_free (to_large);
-		g_free (to_cropped);
+static void
+forget_outcomes (ThumbnailerPrivate *priv, GStrv urls)
+{
+	guint i;
 
-	  }
-	  i++;
-	}
+	/* Also hides what the snapshot might still know about them */
+	for (i = 0; urls[i] != NULL; i++)
+		record_outcome (priv, urls[i], 0, 0);
+}
 
-	dbus_g_method_return (context);
+/* The JPEG flavours go in paths[0..2], the PNG ones in paths[3..5]. They
+ * only differ in their extension, so the URI is hashed only once */
+static void
+get_all_thumb_paths (const gchar *uri, gchar *paths[6])
+{
+	guint n;
+
+	hildon_thumbnail_util_get_thumb_paths (uri, &paths[0], &paths[1],
+					       &paths[2], NULL, NULL, NULL,
+					       FALSE);
+
+	for (n = 0; n < 3; n++) {
+		gsize len = strlen (paths[n]) - strlen (".jpeg");
+
+		paths[n + 3] = g_strdup_printf ("%.*s.png", (gint) len, paths[n]);
+	}
 }
 
-void
-thumbnailer_copy (Thumbnailer *object, GStrv from_urls, GStrv to_urls, DBusGMethodInvocation *context)
+static void
+free_all_thumb_paths (gchar *paths[6])
 {
-	guint i = 0;
+	guint n;
 
-	dbus_async_return_if_fail (from_urls != NULL, context);
-	dbus_async_return_if_fail (to_urls != NULL, context);
+	for (n = 0; n < 6; n++)
+		g_free (paths[n]);
+}
 
-	keep_alive ();
+static void
+move_items (ThumbnailerPrivate *priv, GStrv from_urls, GStrv to_urls)
+{
+	guint i;
 
-	while (from_urls[i] != NULL && to_urls[i] != NULL) {
-	  guint y = 0;
-	  for (y = 0; y < 2; y++ ) {
-		const gchar *from_uri = from_urls[i];
-		const gchar *to_uri = to_urls[i];
-		gchar *from_s[3] = { NULL, NULL, NULL };
-		gchar *to_s[3] = { NULL, NULL, NULL };
+	/* An outcome recorded for the destination was for another file */
+	forget_outcomes (priv, from_urls);
+	forget_outcomes (priv, to_urls);
+
+	for (i = 0; from_urls[i] != NULL && to_urls[i] != NULL; i++) {
+		gchar *from_s[6], *to_s[6];
+		gboolean moved = FALSE;
 		guint n;
 
-		hildon_thumbnail_util_get_thumb_paths (from_uri, &from_s[0], 
-						       &from_s[1], 
-						       &from_s[2],
-						       NULL, NULL, NULL,
-						       (y == 0));
+		get_all_thumb_paths (from_urls[i], from_s);
+		get_all_thumb_paths (to_urls[i], to_s);
+
+		for (n = 0; n < 6; n++)
+			if (g_rename (from_s[n], to_s[n]) == 0)
+				moved = TRUE;
 
-		hildon_thumbnail_util_get_thumb_paths (to_uri, &to_s[0], 
-						       &to_s[1], 
-						       &to_s[2],
-						       NULL, NULL, NULL,
-						       (y == 0));
+		uri_index_remove (from_urls[i]);
+		if (moved)
+			uri_index_add (to_urls[i]);
+
+		free_all_thumb_paths (from_s);
+		free_all_thumb_paths (to_s);
+	}
+}
+
+static void
+copy_items (ThumbnailerPrivate *priv, GStrv from_urls, GStrv to_urls)
+{
+	guint i;
+
+	for (i = 0; from_urls[i] != NULL && to_urls[i] != NULL; i++) {
+		gchar *from_s[6], *to_s[6];
+		gboolean copied = FALSE;
+		guint n;
 
-		for (n = 0; n<3; n++) {
+		get_all_thumb_paths (from_urls[i], from_s);
+		get_all_thumb_paths (to_urls[i], to_s);
+
+		for (n = 0; n < 6; n++) {
 			GFile *from, *to;
 
-			if (!from_s[n] || !to_s[n])
-				continue;
-			
 			from = g_file_new_for_path (from_s[n]);
 			to = g_file_new_for_path (to_s[n]);
 
 			/* We indeed ignore copy errors here */
 
-			g_file_copy (from, to, 
-				     G_FILE_COPY_NONE|G_FILE_COPY_OVERWRITE|G_FILE_COPY_ALL_METADATA,
-				     NULL, NULL, NULL,
-				     NULL);
+			if (g_file_copy (from, to,
+					 G_FILE_COPY_NONE|G_FILE_COPY_OVERWRITE|G_FILE_COPY_ALL_METADATA,
+					 NULL, NULL, NULL,
+					 NULL))
+				copied = TRUE;
 
 			g_object_unref (from);
 			g_object_unref (to);
-
 		}
 
-		for (n = 0; n<3; n++) {
-			/* These can be NULL, but that's ok for g_free */
-			g_free (from_s[n]);
-			g_free (to_s[n]);
-		}
-	  }
-	  i++;
+		if (copied)
+			uri_index_add (to_urls[i]);
+
+		free_all_thumb_paths (from_s);
+		free_all_thumb_paths (to_s);
 	}
+}
 
-	dbus_g_method_return (context);
+static void
+delete_items (ThumbnailerPrivate *priv, GStrv urls)
+{
+	guint i;
+
+	forget_outcomes (priv, urls);
+
+	for (i = 0; urls[i] != NULL; i++) {
+		gchar *paths[6];
+		guint n;
+
+		get_all_thumb_paths (urls[i], paths);
+
+		for (n = 0; n < 6; n++)
+			g_unlink (paths[n]);
+
+		uri_index_remove (urls[i]);
+
+		free_all_thumb_paths (paths);
+	}
+}
+
+/* A directory prefix as the index has it, with a scheme and a slash */
+static gchar *
+prefix_to_dir (const gchar *prefix)
+{
+	return g_strconcat (strchr (prefix, ':') ? "" : "file://", prefix,
+			    g_str_has_suffix (prefix, "/") ? "" : "/", NULL);
+}
+
+/* What's under from_prefix now lives under to_prefix */
+static GStrv
+rebase_urls (GStrv urls, const gchar *from_prefix, const gchar *to_prefix)
+{
+	guint i, len = g_strv_length (urls);
+	GStrv rebased = (GStrv) g_malloc0 (sizeof (gchar *) * (len + 1));
+	gchar *from_dir = prefix_to_dir (from_prefix);
+	gchar *to_dir = prefix_to_dir (to_prefix);
+	gsize skip = strlen (from_dir);
+
+	for (i = 0; i < len; i++)
+		rebased[i] = g_strconcat (to_dir, urls[i] + skip, NULL);
+
+	g_free (from_dir);
+	g_free (to_dir);
+
+	return rebased;
+}
+
+static void
+free_io_op (IoOp *op)
+{
+	g_strfreev (op->from_urls);
+	g_strfreev (op->to_urls);
+	g_free (op->from_prefix);
+	g_free (op->to_prefix);
+	g_object_unref (op->object);
+	g_slice_free (IoOp, op);
+}
+
+/* dbus-glib is only to be used from the main loop */
+static gboolean
+io_op_done (gpointer user_data)
+{
+	IoOp *op = user_data;
+
+	dbus_g_method_return (op->context);
+	free_io_op (op);
+
+	return FALSE;
+}
+
+static void
+do_the_io (IoOp *op, gpointer user_data)
+{
+	ThumbnailerPrivate *priv = THUMBNAILER_GET_PRIVATE (op->object);
+	GStrv found, rebased;
+
+	hildon_thumbnail_trace_begin ("io", op->from_prefix, NULL);
+
+	switch (op->kind) {
+	case IO_MOVE:
+		move_items (priv, op->from_urls, op->to_urls);
+		break;
+	case IO_COPY:
+		copy_items (priv, op->from_urls, op->to_urls);
+		break;
+	case IO_DELETE:
+		delete_items (priv, op->from_urls);
+		break;
+	case IO_MOVE_DIRECTORY:
+		found = uri_index_take_prefix (op->from_prefix);
+		rebased = rebase_urls (found, op->from_prefix, op->to_prefix);
+		move_items (priv, found, rebased);
+		g_strfreev (found);
+		g_strfreev (rebased);
+		break;
+	case IO_DELETE_DIRECTORY:
+		found = uri_index_take_prefix (op->from_prefix);
+		delete_items (priv, found);
+		g_strfreev (found);
+		break;
+	}
+
+	hildon_thumbnail_trace_end ("io", op->from_prefix, NULL);
+
+	g_idle_add (io_op_done, op);
+}
+
+static void
+queue_io (Thumbnailer *object, IoKind kind, GStrv from_urls, GStrv to_urls,
+	  const gchar *from_prefix, const gchar *to_prefix,
+	  DBusGMethodInvocation *context)
+{
+	ThumbnailerPrivate *priv = THUMBNAILER_GET_PRIVATE (object);
+	IoOp *op = g_slice_new0 (IoOp);
+
+	keep_alive ();
+
+	op->object = g_object_ref (object);
+	op->kind = kind;
+	op->from_urls = g_strdupv (from_urls);
+	op->to_urls = g_strdupv (to_urls);
+	op->from_prefix = g_strdup (from_prefix);
+	op->to_prefix = g_strdup (to_prefix);
+	op->context = context;
+
+	g_thread_pool_push (priv->io_pool, op, NULL);
 }
 
 void
-thumbnailer_delete (Thumbnailer *object, GStrv urls, DBusGMethodInvocation *context)
+thumbnailer_move (Thumbnailer *object, GStrv from_urls, GStrv to_urls, DBusGMethodInvocation *context)
 {
-	guint i = 0;
+	dbus_async_return_if_fail (from_urls != NULL, context);
+	dbus_async_return_if_fail (to_urls != NULL, context);
+
+	queue_io (object, IO_MOVE, from_urls, to_urls, NULL, NULL, context);
+}
+
+void
+thumbnailer_copy (Thumbnailer *object, GStrv from_urls, GStrv to_urls, DBusGMethodInvocation *context)
+{
+	dbus_async_return_if_fail (from_urls != NULL, context);
+	dbus_async_return_if_fail (to_urls != NULL, context);
+
+	queue_io (object, IO_COPY, from_urls, to_urls, NULL, NULL, context);
+}
 
+void
+thumbnailer_delete (Thumbnailer *object, GStrv urls, DBusGMethodInvocation *context)
+{
 	dbus_async_return_if_fail (urls != NULL, context);
 
-	keep_alive ();
+	queue_io (object, IO_DELETE, urls, NULL, NULL, NULL, context);
+}
 
-	while (urls[i] != NULL) {
-	  guint y = 0;
-	  for (y = 0; y < 2; y++ ) {
-		const gchar *uri = urls[i];
-		gchar *normal = NULL, 
-		      *large = NULL, 
-		      *cropped = NULL;
-
-		hildon_thumbnail_util_get_thumb_paths (uri, &large, 
-						       &normal, 
-						       &cropped,
-						       NULL, NULL, NULL,
-						       (y == 0));
-
-		g_unlink (large);
-		g_unlink (normal);
-		g_unlink (cropped);
+void
+thumbnailer_move_directory (Thumbnailer *object, gchar *from_prefix, gchar *to_prefix, DBusGMethodInvocation *context)
+{
+	dbus_async_return_if_fail (from_prefix != NULL && *from_prefix, context);
+	dbus_async_return_if_fail (to_prefix != NULL && *to_prefix, context);
 
-		g_free (normal);
-		g_free (large);
-		g_free (cropped);
-	  }
-	  i++;
-	}
+	queue_io (object, IO_MOVE_DIRECTORY, NULL, NULL, from_prefix, to_prefix, context);
+}
 
-	dbus_g_method_return (context);
+void
+thumbnailer_delete_directory (Thumbnailer *object, gchar *prefix, DBusGMethodInvocation *context)
+{
+	dbus_async_return_if_fail (prefix != NULL && *prefix, context);
+
+	queue_io (object, IO_DELETE_DIRECTORY, NULL, NULL, prefix, NULL, context);
 }
 
 void
 thumbnailer_cleanup (Thumbnailer *object, gchar *uri_prefix, guint since, DBusGMethodInvocation *context)
 {
+	ThumbnailerPrivate *priv = THUMBNAILER_GET_PRIVATE (object);
+
+	/* We only have hashes of the URIs, so we can't tell what matches */
+	g_mutex_lock (&priv->mutex);
+	g_hash_table_remove_all (priv->outcomes);
+	priv->forget_snapshot = TRUE;
+	g_mutex_unlock (&priv->mutex);
+
 	hildon_thumbnail_outplugins_cleanup (uri_prefix, since);
 	dbus_g_method_return (context);
 }
 
+void
+thumbnailer_set_trace (Thumbnailer *object, gchar *filename, DBusGMethodInvocation *context)
+{
+	dbus_async_return_if_fail (filename != NULL, context);
+
+	if (*filename)
+		hildon_thumbnail_trace_start (filename);
+	else
+		hildon_thumbnail_trace_stop ();
+
+	dbus_g_method_return (context);
+}
+
 static void
 thumbnailer_finalize (GObject *object)
 {
@@ -1178,9 +1828,12 @@ thumbnailer_finalize (GObject *object)
 
 	g_thread_pool_free (priv->normal_pool, TRUE, TRUE);
 	g_thread_pool_free (priv->large_pool, TRUE, TRUE);
+	g_thread_pool_free (priv->background_pool, TRUE, TRUE);
+	g_thread_pool_free (priv->io_pool, FALSE, TRUE);
 
 	g_object_unref (priv->manager);
 	g_hash_table_unref (priv->plugins_perscheme);
+	g_hash_table_unref (priv->outcomes);
 
 	G_OBJECT_CLASS (thumbnailer_parent_class)->finalize (object);
 }
@@ -1314,15 +1967,22 @@ thumbnailer_init (Thumbnailer *object)
 							 (GDestroyNotify) g_free,
 							 (GDestroyNotify) g_hash_table_unref);
 
+	priv->outcomes = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+						NULL,
+						(GDestroyNotify) free_outcome);
+
 	/* We could increase the amount of threads to add some parallelism */
 
 	priv->large_pool = g_thread_pool_new ((GFunc) do_the_large_work,NULL,1,TRUE,NULL);
 	priv->normal_pool = g_thread_pool_new ((GFunc) do_the_work,NULL,2,TRUE,NULL);
+	priv->background_pool = g_thread_pool_new ((GFunc) do_the_background_work,NULL,1,TRUE,NULL);
+	priv->io_pool = g_thread_pool_new ((GFunc) do_the_io,NULL,1,TRUE,NULL);
 
 	/* This sort function makes the pool a LIFO */
 
 	g_thread_pool_set_sort_function (priv->large_pool, pool_sort_compare, NULL);
 	g_thread_pool_set_sort_function (priv->normal_pool, pool_sort_compare, NULL);
+	g_thread_pool_set_sort_function (priv->background_pool, pool_sort_compare, NULL);
 }
 
 #ifdef HAVE_OSSO
@@ -1351,6 +2011,119 @@ tracker_index_state_changed (DBusGProxy *tracker, gchar *state, gboolean initial
 }
 #endif
 
+static void
+save_snapshot_outcome (const StateOutcome *outcome, gpointer user_data)
+{
+	gpointer *data = user_data;
+	ThumbnailerPrivate *priv = data[0];
+
+	/* Ours are newer, the writer would keep those anyway, but this
+	 * saves it the sorting */
+	if (!g_hash_table_lookup (priv->outcomes, &outcome->uri_hash))
+		state_writer_add_outcome (data[1], outcome);
+}
+
+static void
+save_pending (WorkTask *task, StateWriter *writer)
+{
+	GPtrArray *fields;
+	gchar *priority;
+	guint i, len;
+
+	/* The crawler finds those again */
+	if (task->unqueued || task->dead ||
+	    task->priority == THUMBNAILER_PRIORITY_BACKGROUND)
+		return;
+
+	len = g_strv_length (task->urls);
+	priority = g_strdup_printf ("%d", task->priority);
+	fields = g_ptr_array_new ();
+
+	g_ptr_array_add (fields, priority);
+
+	for (i = 0; i < len; i++) {
+		g_ptr_array_add (fields, task->urls[i]);
+		g_ptr_array_add (fields, (task->mime_types && i < g_strv_length (task->mime_types)) ?
+				 task->mime_types[i] : "");
+	}
+
+	state_writer_add_record (writer, STATE_RECORDS_PENDING,
+				 (const gchar * const *) fields->pdata, fields->len);
+
+	g_ptr_array_unref (fields);
+	g_free (priority);
+}
+
+/* Adds the outcomes that we know about and the tasks that haven't
+ * started yet to the snapshot */
+void
+thumbnailer_save_state (Thumbnailer *object, StateWriter *writer)
+{
+	ThumbnailerPrivate *priv = THUMBNAILER_GET_PRIVATE (object);
+	GHashTableIter iter;
+	gpointer key, value;
+	gpointer data[2] = { priv, writer };
+
+	g_mutex_lock (&priv->mutex);
+
+	g_hash_table_iter_init (&iter, priv->outcomes);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		StateOutcome *outcome = value;
+
+		/* A forgotten one has no reason to be in there anymore */
+		if (outcome->flags != 0)
+			state_writer_add_outcome (writer, outcome);
+	}
+
+	if (!priv->forget_snapshot)
+		state_snapshot_foreach_outcome (save_snapshot_outcome, data);
+
+	g_list_foreach (priv->tasks, (GFunc) save_pending, writer);
+
+	g_mutex_unlock (&priv->mutex);
+
+	uri_index_save_state (writer);
+}
+
+static void
+restore_pending (const gchar * const *fields, guint n_fields, gpointer user_data)
+{
+	Thumbnailer *object = user_data;
+	GStrv urls, mime_hints;
+	gboolean has_hints = FALSE;
+	guint i, n;
+
+	if (n_fields < 3 || n_fields % 2 != 1)
+		return;
+
+	n = (n_fields - 1) / 2;
+	urls = (GStrv) g_malloc0 (sizeof (gchar *) * (n + 1));
+	mime_hints = (GStrv) g_malloc0 (sizeof (gchar *) * (n + 1));
+
+	for (i = 0; i < n; i++) {
+		urls[i] = g_strdup (fields[1 + i * 2]);
+		mime_hints[i] = g_strdup (fields[2 + i * 2]);
+		if (*mime_hints[i])
+			has_hints = TRUE;
+	}
+
+	queue_task (object, urls, has_hints ? mime_hints : NULL, 0,
+		    atoi (fields[0]) == THUMBNAILER_PRIORITY_HIGH ?
+		    THUMBNAILER_PRIORITY_HIGH : THUMBNAILER_PRIORITY_NORMAL, 0);
+
+	g_strfreev (urls);
+	g_strfreev (mime_hints);
+}
+
+/* Queues again what didn't get done before the last shutdown. Only call
+ * this when the plugins got registered */
+void
+thumbnailer_restore_state (Thumbnailer *object)
+{
+	state_snapshot_foreach_record (STATE_RECORDS_PENDING,
+				       restore_pending, object);
+}
+
 void 
 thumbnailer_do_stop (void)
 {
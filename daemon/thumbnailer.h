@@ -28,6 +28,7 @@
 #include <gmodule.h>
 
 #include "thumbnail-manager.h"
+#include "state-snapshot.h"
 
 #define THUMBNAILER_SERVICE      "org.freedesktop.thumbnailer"
 #define THUMBNAILER_PATH         "/org/freedesktop/thumbnailer/Generic"
@@ -39,6 +40,17 @@
 #define THUMBNAILER_CLASS(c)         (G_TYPE_CHECK_CLASS_CAST ((c), TYPE_THUMBNAILER, ThumbnailerClass))
 #define THUMBNAILER_GET_CLASS(o)     (G_TYPE_INSTANCE_GET_CLASS ((o), TYPE_THUMBNAILER, ThumbnailerClass))
 
+/* Tasks with a higher priority are started before all tasks with a lower
+ * one, within the same priority the newest task goes first. Background
+ * ones have a thread of their own at idle priority, they never share a
+ * pool with the others. The values end up in the state snapshot, new ones
+ * go at the end */
+typedef enum {
+	THUMBNAILER_PRIORITY_NORMAL,
+	THUMBNAILER_PRIORITY_HIGH,
+	THUMBNAILER_PRIORITY_BACKGROUND
+} ThumbnailerPriority;
+
 typedef struct Thumbnailer Thumbnailer;
 typedef struct ThumbnailerClass ThumbnailerClass;
 
@@ -59,15 +71,24 @@ GType thumbnailer_get_type (void);
 
 void thumbnailer_queue (Thumbnailer *object, GStrv urls, GStrv mime_hints, guint handle_to_unqueue, DBusGMethodInvocation *context);
 void thumbnailer_unqueue (Thumbnailer *object, guint handle, DBusGMethodInvocation *context);
+guint thumbnailer_enqueue (Thumbnailer *object, GStrv urls, GStrv mime_hints, ThumbnailerPriority priority);
 void thumbnailer_move (Thumbnailer *object, GStrv from_urls, GStrv to_urls, DBusGMethodInvocation *context);
 void thumbnailer_copy (Thumbnailer *object, GStrv from_urls, GStrv to_urls, DBusGMethodInvocation *context);
 void thumbnailer_delete (Thumbnailer *object, GStrv urls, DBusGMethodInvocation *context);
+void thumbnailer_move_directory (Thumbnailer *object, gchar *from_prefix, gchar *to_prefix, DBusGMethodInvocation *context);
+void thumbnailer_delete_directory (Thumbnailer *object, gchar *prefix, DBusGMethodInvocation *context);
 void thumbnailer_cleanup (Thumbnailer *object, gchar *uri_prefix, guint mtime, DBusGMethodInvocation *context);
+void thumbnailer_set_trace (Thumbnailer *object, gchar *filename, DBusGMethodInvocation *context);
 
 void thumbnailer_register_plugin (Thumbnailer *object, const gchar *mime_type, GModule *plugin, const GStrv uri_schemes, gint priority);
 void thumbnailer_unregister_plugin (Thumbnailer *object, GModule *plugin);
 
+gboolean thumbnailer_handles (Thumbnailer *object, const gchar *uri_scheme, const gchar *mime_type);
+guint thumbnailer_get_background_backlog (Thumbnailer *object);
+
 void thumbnailer_crash_out (Thumbnailer *object);
+void thumbnailer_save_state (Thumbnailer *object, StateWriter *writer);
+void thumbnailer_restore_state (Thumbnailer *object);
 
 void thumbnailer_do_stop (void);
 void thumbnailer_do_init (DBusGConnection *connection, ThumbnailManager *manager, Thumbnailer **thumbnailer, GError **error);
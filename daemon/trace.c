@@ -0,0 +1,301 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <glib.h>
+
+#include "trace.h"
+
+/* Number of events kept per thread. When a thread records more than this
+ * before the trace is flushed, its oldest events are overwritten */
+#define TRACE_RING_SIZE		8192
+
+/* Plugin and bus names are copied into the event, cut off at this length */
+#define TRACE_PLUGIN_SIZE	48
+
+typedef struct {
+	gint64 ts;
+	const gchar *stage;
+	gchar plugin[TRACE_PLUGIN_SIZE];
+	guint task;
+	guint uri_hash;
+	gchar phase;
+} TraceEvent;
+
+/* Each thread only ever writes into its own ring, holding the ring's lock
+ * while it fills in an event. Only the flusher ever takes it as well, so
+ * recording doesn't wait on the other threads */
+typedef struct {
+	TraceEvent events[TRACE_RING_SIZE];
+	GMutex lock;
+	gint head;
+	guint task;
+	gulong tid;
+	gchar *name;
+} TraceRing;
+
+static volatile gint enabled = 0;
+static gboolean exit_hooked = FALSE;
+/* The trace file and the list of rings */
+static gchar *trace_file = NULL;
+static GMutex rings_mutex;
+static GList *rings = NULL;
+static GPrivate ring_key;
+
+static gulong
+current_tid (void)
+{
+#ifdef SYS_gettid
+	return (gulong) syscall (SYS_gettid);
+#else
+	static volatile gint counter = 0;
+	return (gulong) g_atomic_int_add (&counter, 1) + 1;
+#endif
+}
+
+static TraceRing *
+get_ring (void)
+{
+	TraceRing *ring = g_private_get (&ring_key);
+
+	if (!ring) {
+		/* Rings are never freed: a thread pool thread that exits still
+		 * has events that we want to see in the trace */
+		ring = g_new0 (TraceRing, 1);
+		ring->tid = current_tid ();
+		ring->name = g_strdup_printf ("thread-%lu", ring->tid);
+		g_private_set (&ring_key, ring);
+
+		g_mutex_lock (&rings_mutex);
+		rings = g_list_prepend (rings, ring);
+		g_mutex_unlock (&rings_mutex);
+	}
+
+	return ring;
+}
+
+static void
+record (gchar phase, const gchar *stage, const gchar *uri, const gchar *plugin)
+{
+	TraceRing *ring;
+	TraceEvent *event;
+	gint head;
+
+	if (!g_atomic_int_get (&enabled))
+		return;
+
+	ring = get_ring ();
+	g_mutex_lock (&ring->lock);
+	head = ring->head;
+	event = &ring->events[head % TRACE_RING_SIZE];
+
+	event->ts = g_get_monotonic_time ();
+	event->phase = phase;
+	event->stage = stage;
+	/* A copy, interning would take GLib's global lock for each event */
+	if (plugin)
+		g_strlcpy (event->plugin, plugin, sizeof (event->plugin));
+	else
+		event->plugin[0] = '\0';
+	event->task = ring->task;
+	event->uri_hash = uri ? g_str_hash (uri) : 0;
+
+	ring->head = head + 1;
+	g_mutex_unlock (&ring->lock);
+}
+
+gboolean
+hildon_thumbnail_trace_enabled (void)
+{
+	return g_atomic_int_get (&enabled) != 0;
+}
+
+void
+hildon_thumbnail_trace_set_task (guint task)
+{
+	if (!g_atomic_int_get (&enabled))
+		return;
+
+	get_ring ()->task = task;
+}
+
+void
+hildon_thumbnail_trace_begin (const gchar *stage, const gchar *uri, const gchar *plugin)
+{
+	record ('B', stage, uri, plugin);
+}
+
+void
+hildon_thumbnail_trace_end (const gchar *stage, const gchar *uri, const gchar *plugin)
+{
+	record ('E', stage, uri, plugin);
+}
+
+/* Call with the ring's lock held */
+static void
+write_ring (FILE *out, TraceRing *ring, gint pid, gboolean *first)
+{
+	gint head = ring->head;
+	gint start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	gint i;
+
+	fprintf (out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		 "\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+		 *first ? "" : ",", pid, ring->tid, ring->name);
+	*first = FALSE;
+
+	for (i = start; i < head; i++) {
+		TraceEvent *event = &ring->events[i % TRACE_RING_SIZE];
+		gchar *stage = g_strescape (event->stage, NULL);
+
+		fprintf (out, ",\n{\"name\":\"%s\",\"cat\":\"thumbnailer\","
+			 "\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,"
+			 "\"tid\":%lu,\"args\":{\"task\":%u,\"uri\":\"%08x\"",
+			 stage, event->phase, event->ts, pid, ring->tid,
+			 event->task, event->uri_hash);
+
+		if (event->plugin[0]) {
+			gchar *plugin = g_strescape (event->plugin, NULL);
+			fprintf (out, ",\"plugin\":\"%s\"", plugin);
+			g_free (plugin);
+		}
+
+		fputs ("}}", out);
+		g_free (stage);
+	}
+}
+
+/* Writes everything that is in the rings to the trace file. Each ring is
+ * locked while it's written, threads that are still recording wait for
+ * that */
+void
+hildon_thumbnail_trace_flush (void)
+{
+	FILE *out;
+	GList *copy;
+	gboolean first = TRUE;
+	gint pid;
+
+	g_mutex_lock (&rings_mutex);
+
+	if (!trace_file) {
+		g_mutex_unlock (&rings_mutex);
+		return;
+	}
+
+	out = fopen (trace_file, "w");
+
+	if (!out) {
+		g_warning ("Can't write trace to %s", trace_file);
+		g_mutex_unlock (&rings_mutex);
+		return;
+	}
+
+	pid = (gint) getpid ();
+
+	fputs ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+
+	for (copy = rings; copy; copy = g_list_next (copy)) {
+		TraceRing *ring = copy->data;
+
+		g_mutex_lock (&ring->lock);
+		write_ring (out, ring, pid, &first);
+		g_mutex_unlock (&ring->lock);
+	}
+
+	g_mutex_unlock (&rings_mutex);
+
+	fputs ("\n]}\n", out);
+	fclose (out);
+}
+
+static void
+flush_at_exit (void)
+{
+	hildon_thumbnail_trace_stop ();
+}
+
+/* Starts recording into empty rings, the trace goes to filename once
+ * recording stops or the daemon exits */
+void
+hildon_thumbnail_trace_start (const gchar *filename)
+{
+	GList *copy;
+
+	g_return_if_fail (filename != NULL && filename[0] != '\0');
+
+	g_mutex_lock (&rings_mutex);
+
+	g_free (trace_file);
+	trace_file = g_strdup (filename);
+
+	for (copy = rings; copy; copy = g_list_next (copy)) {
+		TraceRing *ring = copy->data;
+
+		g_mutex_lock (&ring->lock);
+		ring->head = 0;
+		g_mutex_unlock (&ring->lock);
+	}
+
+	/* thumb-hal leaves with exit () when a mount goes away, this makes
+	 * sure we also get a trace in that case */
+	if (!exit_hooked) {
+		atexit (flush_at_exit);
+		exit_hooked = TRUE;
+	}
+
+	g_atomic_int_set (&enabled, 1);
+
+	g_mutex_unlock (&rings_mutex);
+}
+
+/* Stops recording and writes the trace */
+void
+hildon_thumbnail_trace_stop (void)
+{
+	if (g_atomic_int_compare_and_exchange (&enabled, 1, 0))
+		hildon_thumbnail_trace_flush ();
+}
+
+void
+hildon_thumbnail_trace_init (void)
+{
+	const gchar *filename = g_getenv (TRACE_ENV_VAR);
+
+	if (!filename || filename[0] == '\0')
+		return;
+
+	hildon_thumbnail_trace_start (filename);
+}
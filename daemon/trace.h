@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Set HILDON_THUMBNAIL_TRACE to a filename to record a Chrome trace
+ * (chrome://tracing, ui.perfetto.dev) of the daemon's work from its start
+ * on, or call SetTrace on the Thumbnailer while it runs */
+#define TRACE_ENV_VAR		"HILDON_THUMBNAIL_TRACE"
+
+void     hildon_thumbnail_trace_init     (void);
+void     hildon_thumbnail_trace_start    (const gchar *filename);
+void     hildon_thumbnail_trace_stop     (void);
+gboolean hildon_thumbnail_trace_enabled  (void);
+void     hildon_thumbnail_trace_set_task (guint task);
+void     hildon_thumbnail_trace_begin    (const gchar *stage,
+					  const gchar *uri,
+					  const gchar *plugin);
+void     hildon_thumbnail_trace_end      (const gchar *stage,
+					  const gchar *uri,
+					  const gchar *plugin);
+void     hildon_thumbnail_trace_flush    (void);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,201 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "uri-index.h"
+
+/* Upper bound for the URIs that we keep, beyond it new ones are left out
+ * and only the per-URI operations find their thumbnails */
+#define MAX_URIS		262144
+
+static GMutex mutex;
+static GSequence *uris = NULL;
+
+static gint
+compare_uris (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	return strcmp (a, b);
+}
+
+/* Like the outcomes, a plain path is taken for a local file */
+static gchar *
+normalize_uri (const gchar *uri)
+{
+	if (strchr (uri, ':'))
+		return g_strdup (uri);
+
+	return g_strdup_printf ("file://%s", uri);
+}
+
+/* Call with the mutex held */
+static void
+insert_uri (gchar *uri)
+{
+	GSequenceIter *last = g_sequence_get_end_iter (uris);
+
+	/* The snapshot has them sorted already, that's the cheap case */
+	if (!g_sequence_iter_is_begin (last)) {
+		last = g_sequence_iter_prev (last);
+		if (strcmp (g_sequence_get (last), uri) < 0) {
+			g_sequence_append (uris, uri);
+			return;
+		}
+	}
+
+	if (g_sequence_lookup (uris, uri, compare_uris, NULL)) {
+		g_free (uri);
+		return;
+	}
+
+	g_sequence_insert_sorted (uris, uri, compare_uris, NULL);
+}
+
+void
+uri_index_add (const gchar *uri)
+{
+	gchar *full = normalize_uri (uri);
+
+	g_mutex_lock (&mutex);
+
+	if (uris && g_sequence_get_length (uris) < MAX_URIS) {
+		insert_uri (full);
+		full = NULL;
+	}
+
+	g_mutex_unlock (&mutex);
+
+	g_free (full);
+}
+
+void
+uri_index_remove (const gchar *uri)
+{
+	gchar *full = normalize_uri (uri);
+	GSequenceIter *iter;
+
+	g_mutex_lock (&mutex);
+
+	if (uris) {
+		iter = g_sequence_lookup (uris, full, compare_uris, NULL);
+		if (iter)
+			g_sequence_remove (iter);
+	}
+
+	g_mutex_unlock (&mutex);
+
+	g_free (full);
+}
+
+/* Removes and returns every URI below the directory prefix, which is
+ * taken as a directory whether or not it ends with a slash */
+GStrv
+uri_index_take_prefix (const gchar *prefix)
+{
+	GPtrArray *found = g_ptr_array_new ();
+	gchar *dir = normalize_uri (prefix);
+	GSequenceIter *iter;
+
+	if (!g_str_has_suffix (dir, "/")) {
+		gchar *slashed = g_strconcat (dir, "/", NULL);
+
+		g_free (dir);
+		dir = slashed;
+	}
+
+	g_mutex_lock (&mutex);
+
+	if (uris) {
+		iter = g_sequence_search (uris, dir, compare_uris, NULL);
+
+		while (!g_sequence_iter_is_end (iter)) {
+			GSequenceIter *next;
+			gchar *uri = g_sequence_get (iter);
+
+			if (!g_str_has_prefix (uri, dir))
+				break;
+
+			next = g_sequence_iter_next (iter);
+			g_ptr_array_add (found, g_strdup (uri));
+			g_sequence_remove (iter);
+			iter = next;
+		}
+	}
+
+	g_mutex_unlock (&mutex);
+
+	g_free (dir);
+	g_ptr_array_add (found, NULL);
+
+	return (GStrv) g_ptr_array_free (found, FALSE);
+}
+
+static void
+save_uri (gchar *uri, StateWriter *writer)
+{
+	const gchar *fields[1] = { uri };
+
+	state_writer_add_record (writer, STATE_RECORDS_URIS, fields, 1);
+}
+
+void
+uri_index_save_state (StateWriter *writer)
+{
+	g_mutex_lock (&mutex);
+	if (uris)
+		g_sequence_foreach (uris, (GFunc) save_uri, writer);
+	g_mutex_unlock (&mutex);
+}
+
+static void
+restore_uri (const gchar * const *fields, guint n_fields, gpointer user_data)
+{
+	if (n_fields == 1 && g_sequence_get_length (uris) < MAX_URIS)
+		insert_uri (g_strdup (fields[0]));
+}
+
+/* Call after state_snapshot_init () */
+void
+uri_index_init (void)
+{
+	g_mutex_lock (&mutex);
+	uris = g_sequence_new (g_free);
+	state_snapshot_foreach_record (STATE_RECORDS_URIS, restore_uri, NULL);
+	g_mutex_unlock (&mutex);
+}
+
+void
+uri_index_shutdown (void)
+{
+	g_mutex_lock (&mutex);
+	if (uris)
+		g_sequence_free (uris);
+	uris = NULL;
+	g_mutex_unlock (&mutex);
+}
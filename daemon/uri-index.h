@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __URI_INDEX_H__
+#define __URI_INDEX_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+
+#include "state-snapshot.h"
+
+G_BEGIN_DECLS
+
+/* The URIs that have thumbnails, kept sorted so that everything below a
+ * directory is one range. Thumbnails are named after a hash of their URI,
+ * without this a directory can't be moved or deleted as a whole */
+
+void  uri_index_init        (void);
+void  uri_index_shutdown    (void);
+void  uri_index_add         (const gchar *uri);
+void  uri_index_remove      (const gchar *uri);
+GStrv uri_index_take_prefix (const gchar *prefix);
+void  uri_index_save_state  (StateWriter *writer);
+
+G_END_DECLS
+
+#endif
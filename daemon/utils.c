@@ -26,6 +26,7 @@
 
 #include <gio/gio.h>
 #include <string.h>
+#include <locale.h>
 #include "utils.h"
 
 static gchar *
@@ -241,142 +242,256 @@ hildon_thumbnail_util_get_thumb_paths (const gchar *uri, gchar **large, gchar **
 }
 
 
+/* The characters the MediaArtStorageSpec removes, tab becomes a space */
+static const gchar invalid_chars[] = "()[]<>{}_!@#$^&*+=|\\/\"'?~";
+static const gchar block_open[] = "({[<";
+static const gchar block_close[] = ")}]>";
+
+/* The number of normalized keys → paths we remember. A track list shows a
+ * few hundred rows at most, and they repeat the same albums */
+#define ALBUMART_CACHE_SIZE	256
+
+static GMutex cache_mutex;
+static GHashTable *cache_paths = NULL;
+static GQueue cache_lru = G_QUEUE_INIT;
+static gchar *art_dir = NULL;
+
+typedef struct {
+	gchar *key;
+	gchar *path;
+} CacheEntry;
+
+/* With tr and az locales g_utf8_strdown doesn't lowercase 'I' to 'i' */
 static gboolean
-strip_find_next_block (const gchar    *original,
-		       const gunichar  open_char,
-		       const gunichar  close_char,
-		       gint           *open_pos,
-		       gint           *close_pos)
+locale_is_turkic (void)
 {
-	const gchar *p1, *p2;
+	const gchar *locale = setlocale (LC_CTYPE, NULL);
 
-	if (open_pos) {
-		*open_pos = -1;
-	}
+	return locale && (g_str_has_prefix (locale, "tr") ||
+			  g_str_has_prefix (locale, "az"));
+}
 
-	if (close_pos) {
-		*close_pos = -1;
-	}
+/* Removes (..), {..}, [..] and <..> blocks. At each character, an opening
+ * one starts a block if its closing one comes somewhere after it; the block
+ * ends at the first closing one. This gives the same as the spec's repeated
+ * search for the earliest block */
+static gsize
+strip_blocks (const gchar *original, gchar *out, gboolean *ascii)
+{
+	const gchar *last_close[4];
+	const gchar *p;
+	gsize len = 0;
+	gint i;
 
-	p1 = g_utf8_strchr (original, -1, open_char);
-	if (p1) {
-		if (open_pos) {
-			*open_pos = p1 - original;
-		}
+	for (i = 0; i < 4; i++)
+		last_close[i] = strrchr (original, block_close[i]);
+
+	*ascii = TRUE;
+
+	for (p = original; *p; p++) {
+		const gchar *open = strchr (block_open, *p);
 
-		p2 = g_utf8_strchr (g_utf8_next_char (p1), -1, close_char);
-		if (p2) {
-			if (close_pos) {
-				*close_pos = p2 - original;
+		if (open) {
+			i = open - block_open;
+			if (last_close[i] && last_close[i] > p) {
+				p = strchr (p + 1, block_close[i]);
+				continue;
 			}
-			
-			return TRUE;
 		}
+
+		if ((guchar) *p >= 0x80)
+			*ascii = FALSE;
+
+		out[len++] = *p;
 	}
 
-	return FALSE;
+	out[len] = '\0';
+
+	return len;
 }
 
+/* Drops the invalid characters, turns tabs into spaces, halves runs of
+ * spaces (like splitting on "  " and joining with " " does) and strips the
+ * white space at both ends. Lowercases ASCII on the way when asked to */
 static gchar *
-strip_characters (const gchar *original)
+strip_filter (const gchar *in, gsize len, gboolean lower)
 {
-	GString         *str_no_blocks;
-	gchar          **strv;
-	gchar           *str;
-	gboolean         blocks_done = FALSE;
-	const gchar     *p;
-	const gchar     *invalid_chars = "()[]<>{}_!@#$^&*+=|\\/\"'?~";
-	const gchar     *invalid_chars_delimiter = "*";
-	const gchar     *convert_chars = "\t";
-	const gchar     *convert_chars_delimiter = " ";
-	const gunichar   blocks[5][2] = {
-		{ '(', ')' },
-		{ '{', '}' }, 
-		{ '[', ']' }, 
-		{ '<', '>' }, 
-		{  0,   0  }
-	};
-
-	str_no_blocks = g_string_new ("");
-
-	p = original;
-
-	while (!blocks_done) {
-		gint pos1, pos2, i;
-
-		pos1 = -1;
-		pos2 = -1;
-	
-		for (i = 0; blocks[i][0] != 0; i++) {
-			gint start, end;
-			
-			/* Go through blocks, find the earliest block we can */
-			if (strip_find_next_block (p, blocks[i][0], blocks[i][1], &start, &end)) {
-				if (pos1 == -1 || start < pos1) {
-					pos1 = start;
-					pos2 = end;
-				}
-			}
+	gchar *out = g_malloc (len + 1);
+	gsize i, o = 0;
+	guint spaces = 0;
+
+	for (i = 0; i < len; i++) {
+		gchar c = in[i];
+
+		if (lower && c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+
+		if (strchr (invalid_chars, c))
+			continue;
+
+		if (c == ' ' || c == '\t') {
+			spaces++;
+			continue;
 		}
-		
-		/* If either are -1 we didn't find any */
-		if (pos1 == -1) {
-			/* This means no blocks were found */
-			g_string_append (str_no_blocks, p);
-			blocks_done = TRUE;
-		} else {
-			/* Append the test BEFORE the block */
-                        if (pos1 > 0) {
-                                g_string_append_len (str_no_blocks, p, pos1);
-                        }
 
-                        p = g_utf8_next_char (p + pos2);
+		if (spaces > 0) {
+			guint n = (spaces + 1) / 2;
 
-			/* Do same again for position AFTER block */
-			if (*p == '\0') {
-				blocks_done = TRUE;
+			if (o > 0) {
+				memset (out + o, ' ', n);
+				o += n;
 			}
-		}	
+			spaces = 0;
+		}
+
+		if (o == 0 && g_ascii_isspace (c))
+			continue;
+
+		out[o++] = c;
 	}
 
-	/* Now convert chars to lower case */
-	str = g_utf8_strdown (str_no_blocks->str, -1);
-	g_string_free (str_no_blocks, TRUE);
+	while (o > 0 && g_ascii_isspace (out[o - 1]))
+		o--;
 
-	/* Now strip invalid chars */
-	g_strdelimit (str, invalid_chars, *invalid_chars_delimiter);
-	strv = g_strsplit (str, invalid_chars_delimiter, -1);
-	g_free (str);
-        str = g_strjoinv (NULL, strv);
-	g_strfreev (strv);
+	out[o] = '\0';
 
-	/* Now convert chars */
-	g_strdelimit (str, convert_chars, *convert_chars_delimiter);
-	strv = g_strsplit (str, convert_chars_delimiter, -1);
-	g_free (str);
-        str = g_strjoinv (convert_chars_delimiter, strv);
-	g_strfreev (strv);
+	return out;
+}
 
-        /* Now remove double spaces */
-	strv = g_strsplit (str, "  ", -1);
-	g_free (str);
-        str = g_strjoinv (" ", strv);
-	g_strfreev (strv);
-        
-        /* Now strip leading/trailing white space */
-        g_strstrip (str);
+/* http://live.gnome.org/MediaArtStorageSpec, the result is the same as that
+ * of the spec's split and join steps but done in two passes over the
+ * string. Sets lowered when the result is known to be lowercase already */
+static gchar *
+strip_characters (const gchar *original, gboolean *lowered)
+{
+	gchar *no_blocks, *str;
+	gboolean ascii;
+	gsize len;
+
+	no_blocks = g_malloc (strlen (original) + 1);
+	len = strip_blocks (original, no_blocks, &ascii);
+
+	if (ascii && !locale_is_turkic ()) {
+		str = strip_filter (no_blocks, len, TRUE);
+		*lowered = TRUE;
+	} else {
+		gchar *down = g_utf8_strdown (no_blocks, len);
+
+		str = strip_filter (down, strlen (down), FALSE);
+		g_free (down);
+		*lowered = FALSE;
+	}
+
+	g_free (no_blocks);
 
 	return str;
 }
 
+static gchar *
+normalize_part (const gchar *part)
+{
+	gboolean lowered;
+	gchar *str, *down;
+
+	if (!part)
+		return g_strdup (" ");
+
+	str = strip_characters (part, &lowered);
+
+	if (lowered)
+		return str;
+
+	down = g_utf8_strdown (str, -1);
+	g_free (str);
+
+	return down;
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+	g_free (entry->key);
+	g_free (entry->path);
+	g_slice_free (CacheEntry, entry);
+}
+
+static gchar *
+cache_lookup (const gchar *key)
+{
+	GList *link;
+	gchar *path = NULL;
+
+	g_mutex_lock (&cache_mutex);
+
+	if (cache_paths) {
+		link = g_hash_table_lookup (cache_paths, key);
+		if (link) {
+			g_queue_unlink (&cache_lru, link);
+			g_queue_push_head_link (&cache_lru, link);
+			path = g_strdup (((CacheEntry *) link->data)->path);
+		}
+	}
+
+	g_mutex_unlock (&cache_mutex);
+
+	return path;
+}
+
+static void
+cache_insert (gchar *key, const gchar *path)
+{
+	CacheEntry *entry;
+
+	g_mutex_lock (&cache_mutex);
+
+	if (!cache_paths)
+		cache_paths = g_hash_table_new (g_str_hash, g_str_equal);
+
+	/* Another thread was faster */
+	if (g_hash_table_lookup (cache_paths, key)) {
+		g_mutex_unlock (&cache_mutex);
+		g_free (key);
+		return;
+	}
+
+	if (cache_lru.length >= ALBUMART_CACHE_SIZE) {
+		entry = g_queue_pop_tail (&cache_lru);
+		g_hash_table_remove (cache_paths, entry->key);
+		cache_entry_free (entry);
+	}
+
+	entry = g_slice_new (CacheEntry);
+	entry->key = key;
+	entry->path = g_strdup (path);
+	g_queue_push_head (&cache_lru, entry);
+	g_hash_table_insert (cache_paths, entry->key, cache_lru.head);
+
+	g_mutex_unlock (&cache_mutex);
+}
+
+static const gchar *
+get_art_dir (void)
+{
+	if (g_once_init_enter (&art_dir)) {
+		gchar *dir = g_build_filename (g_get_user_cache_dir (), "media-art", NULL);
+
+		if (!g_file_test (dir, G_FILE_TEST_EXISTS)) {
+			g_mkdir_with_parents (dir, 0770);
+		}
+
+		g_once_init_leave (&art_dir, dir);
+	}
+
+	return art_dir;
+}
+
 void
 hildon_thumbnail_util_get_albumart_path (const gchar *a, const gchar *b, const gchar *prefix, gchar **path)
 {
 	gchar *art_filename;
-	gchar *dir;
 	gchar *down1, *down2;
 	gchar *str1 = NULL, *str2 = NULL;
-	gchar *f_a = NULL, *f_b = NULL;
+	gchar *key;
 
 	/* http://live.gnome.org/MediaArtStorageSpec */
 
@@ -386,40 +501,36 @@ hildon_thumbnail_util_get_albumart_path (const gchar *a, const gchar *b, const g
 		return;
 	}
 
-	if (!a) 
-		f_a = g_strdup (" ");
-	else
-		f_a = strip_characters (a);
-
-	if (!b)
-		f_b = g_strdup (" ");
-	else
-		f_b = strip_characters (b);
-
-	down1 = g_utf8_strdown (f_a, -1);
-	down2 = g_utf8_strdown (f_b, -1);
-
-	g_free (f_a);
-	g_free (f_b);
+	if (!prefix)
+		prefix = "album";
 
-	dir = g_build_filename (g_get_user_cache_dir (), "media-art", NULL);
+	/* A NULL part isn't the same as an empty one, hence the markers */
+	key = g_strdup_printf ("%s\x1f%c%s\x1f%c%s", prefix,
+			       a ? 'v' : 'n', a ? a : "",
+			       b ? 'v' : 'n', b ? b : "");
 
-	if (!g_file_test (dir, G_FILE_TEST_EXISTS)) {
-		g_mkdir_with_parents (dir, 0770);
+	*path = cache_lookup (key);
+	if (*path) {
+		g_free (key);
+		return;
 	}
 
+	down1 = normalize_part (a);
+	down2 = normalize_part (b);
+
 	str1 = my_compute_checksum_for_data (G_CHECKSUM_MD5, (const guchar *) down1, strlen (down1));
 	str2 = my_compute_checksum_for_data (G_CHECKSUM_MD5, (const guchar *) down2, strlen (down2));
 
 	g_free (down1);
 	g_free (down2);
 
-	art_filename = g_strdup_printf ("%s-%s-%s.jpeg", prefix?prefix:"album", str1, str2);
+	art_filename = g_strdup_printf ("%s-%s-%s.jpeg", prefix, str1, str2);
 
-	*path = g_build_filename (dir, art_filename, NULL);
-	g_free (dir);
+	*path = g_build_filename (get_art_dir (), art_filename, NULL);
 	g_free (art_filename);
 	g_free (str1);
 	g_free (str2);
+
+	cache_insert (key, *path);
 }
 
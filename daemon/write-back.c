@@ -0,0 +1,422 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "write-back.h"
+
+#define WRITE_BACK_GROUP	"Write Back"
+
+/* A copy that failed for a reason that might go away is tried this many
+ * times, the first retry after RETRY_DELAY seconds and each next one
+ * after twice as long */
+#define MAX_ATTEMPTS		3
+#define RETRY_DELAY		2
+
+/* The items of one directory are written together, that's one look for
+ * its .thumblocal and one spin-up of the card or share for all of them */
+typedef struct {
+	gchar *dir;
+	GPtrArray *uris;
+	guint attempts;
+	gint64 not_before;
+} WriteBackBatch;
+
+/* The prefixes, one character per node, case insensitive */
+typedef struct PrefixNode PrefixNode;
+struct PrefixNode {
+	guchar c;
+	gboolean end;
+	PrefixNode *child, *next;
+};
+
+static const gchar *default_prefixes[] = {
+	"smb://", "file:///media",
+	"file:///mnt", "obex://", "ftp://",
+	"ftps://", "dav://", "nfs://",
+	"file:///home/user/MyDocs",
+	NULL };
+
+static PrefixNode *prefixes = NULL;
+static GMutex mutex;
+static GCond cond;
+static GQueue batches = G_QUEUE_INIT;
+static GHashTable *open_batches = NULL;
+static GThread *thread = NULL;
+static gboolean stopping = FALSE;
+
+static void
+prefix_add (PrefixNode **node, const gchar *prefix)
+{
+	const guchar *p = (const guchar *) prefix;
+
+	while (*p) {
+		guchar c = g_ascii_tolower (*p);
+		PrefixNode *n;
+
+		for (n = *node; n && n->c != c; n = n->next);
+
+		if (!n) {
+			n = g_slice_new0 (PrefixNode);
+			n->c = c;
+			n->next = *node;
+			*node = n;
+		}
+
+		p++;
+
+		if (!*p)
+			n->end = TRUE;
+
+		node = &n->child;
+	}
+}
+
+static gboolean
+prefix_match (PrefixNode *node, const gchar *uri)
+{
+	const guchar *p;
+
+	for (p = (const guchar *) uri; *p && node; p++) {
+		guchar c = g_ascii_tolower (*p);
+		PrefixNode *n;
+
+		for (n = node; n && n->c != c; n = n->next);
+
+		if (!n)
+			return FALSE;
+		if (n->end)
+			return TRUE;
+
+		node = n->child;
+	}
+
+	return FALSE;
+}
+
+static void
+prefix_free (PrefixNode *node)
+{
+	while (node) {
+		PrefixNode *next = node->next;
+
+		prefix_free (node->child);
+		g_slice_free (PrefixNode, node);
+		node = next;
+	}
+}
+
+/* Prefixes=smb://;file:///media in the [Write Back] group of write-back.conf
+ * replaces the default list */
+static void
+load_prefixes (void)
+{
+	gchar *config = g_build_filename (g_get_user_config_dir (), "hildon-thumbnailer", "write-back.conf", NULL);
+	GKeyFile *keyfile = g_key_file_new ();
+	GStrv list = NULL;
+	guint i;
+
+	if (g_key_file_load_from_file (keyfile, config, G_KEY_FILE_NONE, NULL))
+		list = g_key_file_get_string_list (keyfile, WRITE_BACK_GROUP, "Prefixes", NULL, NULL);
+
+	if (list) {
+		for (i = 0; list[i] != NULL; i++)
+			prefix_add (&prefixes, list[i]);
+		g_strfreev (list);
+	} else {
+		for (i = 0; default_prefixes[i] != NULL; i++)
+			prefix_add (&prefixes, default_prefixes[i]);
+	}
+
+	g_key_file_free (keyfile);
+	g_free (config);
+}
+
+static void
+free_batch (WriteBackBatch *batch)
+{
+	g_free (batch->dir);
+	g_ptr_array_free (batch->uris, TRUE);
+	g_slice_free (WriteBackBatch, batch);
+}
+
+static WriteBackBatch *
+new_batch (const gchar *dir)
+{
+	WriteBackBatch *batch = g_slice_new0 (WriteBackBatch);
+
+	batch->dir = g_strdup (dir);
+	batch->uris = g_ptr_array_new_with_free_func (g_free);
+
+	return batch;
+}
+
+static gboolean
+is_transient (GError *error)
+{
+	return error->domain == G_IO_ERROR &&
+	       (error->code == G_IO_ERROR_BUSY ||
+		error->code == G_IO_ERROR_TIMED_OUT ||
+		error->code == G_IO_ERROR_WOULD_BLOCK ||
+		error->code == G_IO_ERROR_HOST_NOT_FOUND);
+}
+
+/* Copies the JPEG and the PNG flavours of uri's thumbnails, whichever of
+ * those exist. Only a transient error is returned */
+static void
+write_item (const gchar *uri, GError **error)
+{
+	guint y;
+
+	for (y = 0; y < 2; y++) {
+		gchar *from[3] = { NULL, NULL, NULL };
+		gchar *to[3] = { NULL, NULL, NULL };
+		GError *nerror = NULL;
+		guint z;
+
+		hildon_thumbnail_util_get_thumb_paths (uri,
+						       &from[0],
+						       &from[1],
+						       &from[2],
+						       &to[0],
+						       &to[1],
+						       &to[2],
+						       (y == 0));
+
+		for (z = 0; z < 3 && !nerror; z++) {
+			GFile *from_file, *to_file;
+
+			from_file = g_file_new_for_path (from[z]);
+			to_file = g_file_new_for_uri (to[z]);
+
+			g_file_copy (from_file, to_file, 0, NULL,
+				     NULL, NULL, &nerror);
+
+			g_object_unref (from_file);
+			g_object_unref (to_file);
+		}
+
+		for (z = 0; z < 3; z++) {
+			g_free (from[z]);
+			g_free (to[z]);
+		}
+
+		if (nerror && is_transient (nerror)) {
+			g_propagate_error (error, nerror);
+			return;
+		}
+
+		g_clear_error (&nerror);
+	}
+}
+
+/* Returns what has to be tried again, if anything */
+static WriteBackBatch *
+write_batch (WriteBackBatch *batch)
+{
+	WriteBackBatch *retry = NULL;
+	GFile *dir, *local;
+	guint i;
+
+	dir = g_file_new_for_uri (batch->dir);
+	local = g_file_get_child (dir, ".thumblocal");
+
+	/* Only where somebody made one, we don't litter */
+	if (g_file_query_exists (local, NULL)) {
+		for (i = 0; i < batch->uris->len; i++) {
+			const gchar *uri = g_ptr_array_index (batch->uris, i);
+			GError *error = NULL;
+
+			hildon_thumbnail_trace_begin ("remote-copy", uri, NULL);
+			write_item (uri, &error);
+			hildon_thumbnail_trace_end ("remote-copy", uri, NULL);
+
+			if (!error)
+				continue;
+
+			if (batch->attempts + 1 < MAX_ATTEMPTS) {
+				if (!retry) {
+					retry = new_batch (batch->dir);
+					retry->attempts = batch->attempts + 1;
+					retry->not_before = g_get_monotonic_time () +
+						(RETRY_DELAY << batch->attempts) * G_TIME_SPAN_SECOND;
+				}
+				g_ptr_array_add (retry->uris, g_strdup (uri));
+			} else {
+				g_debug ("Giving up writing back %s: %s", uri, error->message);
+			}
+
+			g_error_free (error);
+		}
+	}
+
+	g_object_unref (local);
+	g_object_unref (dir);
+	free_batch (batch);
+
+	return retry;
+}
+
+/* Call with the mutex held. Returns the first batch that may go now, or
+ * sets wait_until to when the first one may */
+static WriteBackBatch *
+pop_ready (gint64 *wait_until)
+{
+	gint64 now = g_get_monotonic_time ();
+	GList *l;
+
+	*wait_until = 0;
+
+	for (l = batches.head; l; l = l->next) {
+		WriteBackBatch *batch = l->data;
+
+		if (batch->not_before <= now) {
+			g_queue_delete_link (&batches, l);
+			if (g_hash_table_lookup (open_batches, batch->dir) == batch)
+				g_hash_table_remove (open_batches, batch->dir);
+			return batch;
+		}
+
+		if (*wait_until == 0 || batch->not_before < *wait_until)
+			*wait_until = batch->not_before;
+	}
+
+	return NULL;
+}
+
+static gpointer
+write_back_thread (gpointer user_data)
+{
+	g_mutex_lock (&mutex);
+
+	while (!stopping) {
+		WriteBackBatch *batch, *retry;
+		gint64 wait_until;
+
+		batch = pop_ready (&wait_until);
+
+		if (!batch) {
+			if (wait_until)
+				g_cond_wait_until (&cond, &mutex, wait_until);
+			else
+				g_cond_wait (&cond, &mutex);
+			continue;
+		}
+
+		g_mutex_unlock (&mutex);
+		retry = write_batch (batch);
+		g_mutex_lock (&mutex);
+
+		if (retry)
+			g_queue_push_tail (&batches, retry);
+	}
+
+	g_mutex_unlock (&mutex);
+
+	return NULL;
+}
+
+gboolean
+write_back_wants (const gchar *uri)
+{
+	return prefix_match (prefixes, uri);
+}
+
+/* Called from the thumbnailer's threads after uri's thumbnails were made */
+void
+write_back_queue (const gchar *uri)
+{
+	const gchar *slash = strrchr (uri, '/');
+	WriteBackBatch *batch;
+	gchar *dir;
+
+	if (!slash)
+		return;
+
+	dir = g_strndup (uri, slash - uri);
+
+	g_mutex_lock (&mutex);
+
+	if (thread) {
+		batch = g_hash_table_lookup (open_batches, dir);
+
+		if (!batch) {
+			batch = new_batch (dir);
+			g_hash_table_replace (open_batches, batch->dir, batch);
+			g_queue_push_tail (&batches, batch);
+		}
+
+		g_ptr_array_add (batch->uris, g_strdup (uri));
+		g_cond_signal (&cond);
+	}
+
+	g_mutex_unlock (&mutex);
+
+	g_free (dir);
+}
+
+void
+write_back_init (void)
+{
+	load_prefixes ();
+
+	open_batches = g_hash_table_new (g_str_hash, g_str_equal);
+	thread = g_thread_new ("write-back", write_back_thread, NULL);
+}
+
+/* What is still queued is dropped, the thumbnails in ~/.thumbnails are
+ * what counts */
+void
+write_back_shutdown (void)
+{
+	GThread *joining;
+
+	g_mutex_lock (&mutex);
+	stopping = TRUE;
+	joining = thread;
+	thread = NULL;
+	g_cond_signal (&cond);
+	g_mutex_unlock (&mutex);
+
+	if (joining)
+		g_thread_join (joining);
+
+	g_queue_foreach (&batches, (GFunc) free_batch, NULL);
+	g_queue_clear (&batches);
+
+	if (open_batches)
+		g_hash_table_unref (open_batches);
+	open_batches = NULL;
+
+	prefix_free (prefixes);
+	prefixes = NULL;
+}
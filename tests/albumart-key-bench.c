@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <hildon-albumart-factory.h>
+
+/* Compares hildon_albumart_get_path against the MediaArtStorageSpec steps
+ * done the straightforward way, and times both. With --check it only
+ * compares */
+
+static const gchar *samples[] = {
+	"Pink Floyd",
+	"The Dark Side of the Moon",
+	"  Leading and trailing  ",
+	"Tabs\tand\t\tmore  tabs",
+	"Runs   of    spaces     here",
+	"Album (Remastered) [2011 Edition] {Deluxe} <Bonus>",
+	"(a(b)c)d",
+	"[a(b]c)d",
+	"(a)b(c",
+	"Unclosed ( paren",
+	"Close ) only",
+	"Weird_!@#$^&*+=|\\/\"'?~ chars",
+	"AC/DC",
+	"Guns N' Roses",
+	"Sigur Rós",
+	"Motörhead",
+	"ΑΣ*Β",
+	"Björk (Live)  \t Ísland",
+	"İstanbul",
+	"line\nbreak  \r\n",
+	" \n a",
+	"a  \n",
+	"",
+	" ",
+	"(only a block)",
+	NULL
+};
+
+static gchar *
+reference_strip (const gchar *original)
+{
+	const gchar *blocks[4] = { "()", "{}", "[]", "<>" };
+	GString *no_blocks = g_string_new ("");
+	const gchar *p = original;
+	gchar **strv;
+	gchar *str;
+
+	while (*p) {
+		const gchar *first = NULL, *close = NULL;
+		gint i;
+
+		for (i = 0; i < 4; i++) {
+			const gchar *o = strchr (p, blocks[i][0]);
+			const gchar *c = o ? strchr (o + 1, blocks[i][1]) : NULL;
+
+			if (c && (!first || o < first)) {
+				first = o;
+				close = c;
+			}
+		}
+
+		if (!first) {
+			g_string_append (no_blocks, p);
+			break;
+		}
+
+		g_string_append_len (no_blocks, p, first - p);
+		p = close + 1;
+	}
+
+	str = g_utf8_strdown (no_blocks->str, -1);
+	g_string_free (no_blocks, TRUE);
+
+	g_strdelimit (str, "()[]<>{}_!@#$^&*+=|\\/\"'?~", '*');
+	strv = g_strsplit (str, "*", -1);
+	g_free (str);
+	str = g_strjoinv (NULL, strv);
+	g_strfreev (strv);
+
+	g_strdelimit (str, "\t", ' ');
+	strv = g_strsplit (str, "  ", -1);
+	g_free (str);
+	str = g_strjoinv (" ", strv);
+	g_strfreev (strv);
+
+	return g_strstrip (str);
+}
+
+static gchar *
+reference_path (const gchar *a, const gchar *b, const gchar *kind)
+{
+	gchar *f_a, *f_b, *down1, *down2, *str1, *str2, *name, *path;
+
+	f_a = a ? reference_strip (a) : g_strdup (" ");
+	f_b = b ? reference_strip (b) : g_strdup (" ");
+	down1 = g_utf8_strdown (f_a, -1);
+	down2 = g_utf8_strdown (f_b, -1);
+
+	str1 = g_compute_checksum_for_string (G_CHECKSUM_MD5, down1, -1);
+	str2 = g_compute_checksum_for_string (G_CHECKSUM_MD5, down2, -1);
+
+	name = g_strdup_printf ("%s-%s-%s.jpeg", kind ? kind : "album", str1, str2);
+	path = g_build_filename (g_get_user_cache_dir (), "media-art", name, NULL);
+
+	g_free (f_a);
+	g_free (f_b);
+	g_free (down1);
+	g_free (down2);
+	g_free (str1);
+	g_free (str2);
+	g_free (name);
+
+	return path;
+}
+
+static gboolean
+check (void)
+{
+	gboolean ok = TRUE;
+	guint i, j;
+
+	for (i = 0; samples[i]; i++) {
+		for (j = 0; samples[j]; j++) {
+			gchar *expected = reference_path (samples[i], samples[j], "album");
+			gchar *got = hildon_albumart_get_path (samples[i], samples[j], "album");
+
+			if (strcmp (expected, got) != 0) {
+				g_printerr ("Mismatch for '%s' '%s':\n %s\n %s\n",
+					    samples[i], samples[j], expected, got);
+				ok = FALSE;
+			}
+
+			g_free (expected);
+			g_free (got);
+		}
+
+		for (j = 0; j < 2; j++) {
+			const gchar *a = j ? NULL : samples[i];
+			const gchar *b = j ? samples[i] : NULL;
+			gchar *expected = reference_path (a, b, "track");
+			gchar *got = hildon_albumart_get_path (a, b, "track");
+
+			if (strcmp (expected, got) != 0) {
+				g_printerr ("Mismatch for '%s' with NULL\n", samples[i]);
+				ok = FALSE;
+			}
+
+			g_free (expected);
+			g_free (got);
+		}
+	}
+
+	return ok;
+}
+
+static gdouble
+run (gboolean reference, guint rows, guint albums)
+{
+	gint64 start = g_get_monotonic_time ();
+	guint i;
+
+	for (i = 0; i < rows; i++) {
+		gchar *artist = g_strdup_printf ("Artist %u (Live)", i % albums);
+		gchar *album = g_strdup_printf ("The  Album\t#%u [Remastered]", i % albums);
+		gchar *path;
+
+		if (reference)
+			path = reference_path (artist, album, "album");
+		else
+			path = hildon_albumart_get_path (artist, album, "album");
+
+		g_free (path);
+		g_free (artist);
+		g_free (album);
+	}
+
+	return (g_get_monotonic_time () - start) / 1000.0;
+}
+
+int main (int argc, char **argv)
+{
+	const guint rows = 100000;
+
+	if (!check ())
+		return 1;
+
+	if (argc > 1 && strcmp (argv[1], "--check") == 0)
+		return 0;
+
+	/* A track list: few albums for a lot of rows, and a library scan
+	 * where about every key is new */
+	g_print ("track list:  reference %8.1f ms, get_path %8.1f ms\n",
+		 run (TRUE, rows, 50), run (FALSE, rows, 50));
+	g_print ("unique keys: reference %8.1f ms, get_path %8.1f ms\n",
+		 run (TRUE, rows, rows), run (FALSE, rows, rows));
+
+	return 0;
+}
@@ -0,0 +1,92 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+
+#include "art-item.h"
+
+/* A QueueMany of art that is partly there already: the art that is there
+ * gets its ReadyMany entries without a fetch, one per key */
+
+static const gchar *
+entry_string (GPtrArray *entries, guint i, guint field)
+{
+	GValueArray *entry = g_ptr_array_index (entries, i);
+
+	return g_value_get_string (g_value_array_get_nth (entry, field));
+}
+
+int main (int argc, char **argv)
+{
+	GPtrArray *items, *ready, *fetch;
+	ArtItem *item;
+	gchar *dir, *present, *absent, *other;
+	guint i;
+
+#if !GLIB_CHECK_VERSION (2, 36, 0)
+	g_type_init ();
+#endif
+
+	dir = g_dir_make_tmp ("art-item-XXXXXX", NULL);
+	g_assert (dir != NULL);
+
+	present = g_build_filename (dir, "present.jpeg", NULL);
+	absent = g_build_filename (dir, "absent.jpeg", NULL);
+	other = g_build_filename (dir, "other.jpeg", NULL);
+
+	g_assert (g_file_set_contents (present, "art", -1, NULL));
+	g_assert (g_file_set_contents (other, "art", -1, NULL));
+
+	items = g_ptr_array_new_with_free_func ((GDestroyNotify) art_item_free);
+
+	item = art_item_new (g_strdup (present));
+	art_item_add_key (item, "Artist", "Album", "album");
+	art_item_add_key (item, "artist", "album", "album");
+	g_ptr_array_add (items, item);
+
+	item = art_item_new (g_strdup (absent));
+	art_item_add_key (item, "Nobody", "Nothing", "album");
+	g_ptr_array_add (items, item);
+
+	item = art_item_new (g_strdup (other));
+	art_item_add_key (item, "Other", NULL, "album");
+	g_ptr_array_add (items, item);
+
+	ready = g_ptr_array_new_with_free_func ((GDestroyNotify) g_value_array_free);
+	fetch = g_ptr_array_new ();
+
+	for (i = 0; i < items->len; i++) {
+		item = g_ptr_array_index (items, i);
+
+		if (!art_item_take_present (item, ready))
+			g_ptr_array_add (fetch, item);
+	}
+
+	/* Only the absent art is left to fetch */
+	g_assert_cmpuint (fetch->len, ==, 1);
+	g_assert_cmpstr (((ArtItem *) g_ptr_array_index (fetch, 0))->path, ==, absent);
+
+	g_assert_cmpuint (ready->len, ==, 3);
+
+	g_assert_cmpstr (entry_string (ready, 0, 0), ==, "Artist");
+	g_assert_cmpstr (entry_string (ready, 0, 3), ==, present);
+	g_assert_cmpstr (entry_string (ready, 1, 0), ==, "artist");
+	g_assert_cmpstr (entry_string (ready, 1, 3), ==, present);
+	g_assert_cmpstr (entry_string (ready, 2, 0), ==, "Other");
+	g_assert_cmpstr (entry_string (ready, 2, 1), ==, "");
+	g_assert_cmpstr (entry_string (ready, 2, 3), ==, other);
+
+	g_ptr_array_free (fetch, TRUE);
+	g_ptr_array_unref (ready);
+	g_ptr_array_unref (items);
+
+	g_unlink (present);
+	g_unlink (other);
+	g_rmdir (dir);
+
+	g_free (present);
+	g_free (absent);
+	g_free (other);
+	g_free (dir);
+
+	return 0;
+}
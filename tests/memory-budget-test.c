@@ -0,0 +1,159 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "memory-budget.h"
+
+/* Writes just the headers of a few images and checks what the probes
+ * make of them, given a head read from the file the way the sniffer
+ * reads it */
+
+#define HEAD_SIZE	4096
+
+static const guchar jpeg[] = {
+	0xFF, 0xD8,
+	/* APP0, skipped over */
+	0xFF, 0xE0, 0x00, 0x06, 'J', 'F', 'I', 'F',
+	/* DHT shares the SOF range, must not be taken for one */
+	0xFF, 0xC4, 0x00, 0x03, 0x00,
+	/* Fill bytes, then SOF2 with 8 bits, 1200 high and 1600 wide */
+	0xFF, 0xFF, 0xC2, 0x00, 0x11, 0x08, 0x04, 0xB0, 0x06, 0x40, 0x03
+};
+
+/* The same with 3000 high and 4000 wide, 12 megapixels */
+static const guchar jpeg_12mp[] = {
+	0xFF, 0xD8,
+	0xFF, 0xE0, 0x00, 0x06, 'J', 'F', 'I', 'F',
+	0xFF, 0xC0, 0x00, 0x11, 0x08, 0x0B, 0xB8, 0x0F, 0xA0, 0x03
+};
+
+static const guchar png[] = {
+	0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n',
+	0x00, 0x00, 0x00, 0x0D, 'I', 'H', 'D', 'R',
+	0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20,
+	0x08, 0x06, 0x00, 0x00, 0x00
+};
+
+static const guchar gif[] = {
+	'G', 'I', 'F', '8', '9', 'a', 0x40, 0x01, 0xF0, 0x00,
+	0xF7, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00
+};
+
+static const guchar text[] = "Not an image at all, not even close";
+
+static gchar *
+write_file (const gchar *dir, const gchar *name, const guchar *data, gsize length)
+{
+	gchar *path = g_build_filename (dir, name, NULL);
+
+	g_assert (g_file_set_contents (path, (const gchar *) data, length, NULL));
+
+	return path;
+}
+
+/* Reads at most head_size bytes as the head, the probe gets the rest
+ * from the file */
+static gsize
+read_head (const gchar *path, guchar *head, gsize head_size, gint *fd)
+{
+	gssize len;
+
+	*fd = g_open (path, O_RDONLY, 0);
+	g_assert (*fd >= 0);
+
+	len = read (*fd, head, head_size);
+	g_assert (len >= 0);
+
+	return len;
+}
+
+static void
+check (const gchar *path, gsize head_size, gboolean ok, guint width, guint height, guint factor)
+{
+	guchar head[HEAD_SIZE];
+	guint w = 0, h = 0, f = 0;
+	gsize len;
+	gint fd;
+
+	len = read_head (path, head, head_size, &fd);
+	g_assert (memory_budget_probe_head (head, len, fd, &w, &h, &f) == ok);
+	close (fd);
+
+	if (ok) {
+		g_assert_cmpuint (w, ==, width);
+		g_assert_cmpuint (h, ==, height);
+		g_assert_cmpuint (f, ==, factor);
+	}
+
+	g_unlink (path);
+}
+
+static gsize
+estimate (const gchar *path)
+{
+	guchar head[HEAD_SIZE];
+	gsize len, cost;
+	gint fd;
+
+	len = read_head (path, head, sizeof (head), &fd);
+	cost = memory_budget_estimate_head (head, len, fd);
+	close (fd);
+
+	return cost;
+}
+
+int main (int argc, char **argv)
+{
+	gchar *tmp = g_dir_make_tmp ("memory-budget-XXXXXX", NULL);
+	gchar *path;
+
+	check (write_file (tmp, "a.jpg", jpeg, sizeof (jpeg)), HEAD_SIZE, TRUE, 1600, 1200, 1);
+	check (write_file (tmp, "a.png", png, sizeof (png)), HEAD_SIZE, TRUE, 65536, 32, 1);
+	check (write_file (tmp, "a.gif", gif, sizeof (gif)), HEAD_SIZE, TRUE, 320, 240, 2);
+	check (write_file (tmp, "a.txt", text, sizeof (text)), HEAD_SIZE, FALSE, 0, 0, 0);
+
+	/* The frame header lies beyond the head and is read from the file */
+	check (write_file (tmp, "a.jpg", jpeg, sizeof (jpeg)), 12, TRUE, 1600, 1200, 1);
+
+	/* Cut off before the frame header */
+	check (write_file (tmp, "b.jpg", jpeg, 20), HEAD_SIZE, FALSE, 0, 0, 0);
+
+	/* A 65536x32 RGBA image must be heavy with a 8 MB budget, what we
+	 * know nothing about costs nothing */
+	memory_budget_init (8 * 1024 * 1024);
+	path = write_file (tmp, "a.png", png, sizeof (png));
+	g_assert (memory_budget_is_heavy (estimate (path)));
+	g_assert_cmpuint (memory_budget_estimate_head (png, 0, -1), ==, 0);
+	g_unlink (path);
+	g_free (path);
+
+	/* With MEM_LIMIT on ARM the budget is 40 MB. A 12 megapixel JPEG is
+	 * decoded at 1/8 of its size and stays light */
+	memory_budget_init (40 * 1024 * 1024);
+	path = write_file (tmp, "c.jpg", jpeg_12mp, sizeof (jpeg_12mp));
+	g_assert_cmpuint (estimate (path), <, 2 * 1024 * 1024);
+	g_assert (!memory_budget_is_heavy (estimate (path)));
+	g_unlink (path);
+	g_free (path);
+	memory_budget_init (8 * 1024 * 1024);
+
+	/* The background doesn't wait, a heavy item only gets in alone */
+	g_assert (memory_budget_try_acquire (3 * 1024 * 1024));
+	g_assert (!memory_budget_try_acquire (5 * 1024 * 1024));
+	g_assert (memory_budget_try_acquire (4 * 1024 * 1024));
+	g_assert (!memory_budget_try_acquire (2 * 1024 * 1024));
+	memory_budget_release (4 * 1024 * 1024);
+	memory_budget_release (3 * 1024 * 1024);
+	g_assert (memory_budget_try_acquire (5 * 1024 * 1024));
+	g_assert (!memory_budget_try_acquire (1024 * 1024));
+	memory_budget_release (5 * 1024 * 1024);
+
+	g_rmdir (tmp);
+	g_free (tmp);
+
+	return 0;
+}
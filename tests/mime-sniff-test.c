@@ -0,0 +1,76 @@
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "mime-sniff.h"
+
+/* Feeds the signature matcher the first bytes of each format */
+
+typedef struct {
+	const gchar *head;
+	gsize len;
+	const gchar *mime_type;
+} SniffCase;
+
+static const SniffCase cases[] = {
+	{ "\377\330\377\340\0\020JFIF", 10, "image/jpeg" },
+	{ "\211PNG\r\n\032\n", 8, "image/png" },
+	{ "GIF89a", 6, "image/gif" },
+	{ "II*\0", 4, "image/tiff" },
+	{ "MM\0*", 4, "image/tiff" },
+	{ "RIFF\0\0\0\0WEBPVP8 ", 16, "image/webp" },
+	{ "RIFF\0\0\0\0AVI LIST", 16, "video/x-msvideo" },
+	{ "II*\0\020\0\0\0CR\002\0", 12, "image/x-canon-cr2" },
+	{ "IIRO\010\0\0\0", 8, "image/x-olympus-orf" },
+	{ "\0\0\0\030ftypmp42", 12, "video/mp4" },
+	{ "\0\0\0\024ftypqt  ", 12, "video/quicktime" },
+	{ "\0\0\0\040ftypM4A ", 12, "audio/mp4" },
+	{ "ID3\003\0", 5, "audio/mpeg" },
+	{ "\032\105\337\243\237\102\202\204webm", 16, "video/webm" },
+	{ "\032\105\337\243\243\102\202\210matroska", 20, "video/x-matroska" },
+	/* Brands that aren't only used for video */
+	{ "\0\0\0\030ftypisom", 12, NULL },
+	{ "\0\0\0\030ftypheic", 12, NULL },
+	{ "\0\0\0\034ftypavif", 12, NULL },
+	/* Too short to tell */
+	{ "\211PN", 3, NULL },
+	{ "RIFF\0\0\0\0", 8, NULL },
+	{ "hello", 5, NULL }
+};
+
+int main (int argc, char **argv)
+{
+	GError *error = NULL;
+	gchar *dir, *fifo, *mime_type = NULL;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (cases); i++) {
+		const gchar *found = mime_sniff ((const guchar *) cases[i].head,
+						 cases[i].len);
+
+		g_assert_cmpstr (found, ==, cases[i].mime_type);
+	}
+
+	/* A FIFO nobody writes to must not hang the sniffer */
+	dir = g_dir_make_tmp ("mime-sniff-XXXXXX", NULL);
+	g_assert (dir != NULL);
+	fifo = g_build_filename (dir, "fifo", NULL);
+	g_assert (mkfifo (fifo, 0600) == 0);
+
+	g_assert (!mime_sniff_file (fifo, &mime_type, NULL, NULL, &error));
+	g_assert (error != NULL);
+	g_assert (error->code == G_IO_ERROR_NOT_REGULAR_FILE);
+	g_assert (mime_type == NULL);
+	g_error_free (error);
+
+	g_unlink (fifo);
+	g_rmdir (dir);
+	g_free (fifo);
+	g_free (dir);
+
+	return 0;
+}
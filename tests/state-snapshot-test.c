@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "state-snapshot.h"
+
+/* Writes a snapshot, maps it again and checks that everything is there */
+
+static guint n_records = 0;
+
+static void
+check_record (const gchar * const *fields, guint n_fields, gpointer user_data)
+{
+	g_assert_cmpuint (n_fields, ==, 3);
+	g_assert_cmpstr (fields[0], ==, "0");
+	g_assert_cmpstr (fields[1], ==, "file:///a b.jpg");
+	g_assert_cmpstr (fields[2], ==, "");
+	n_records++;
+}
+
+int main (int argc, char **argv)
+{
+	gchar *tmp = g_dir_make_tmp ("state-snapshot-XXXXXX", NULL);
+	gchar *path;
+	StateWriter *writer;
+	StateOutcome outcome;
+	const gchar *fields[3] = { "0", "file:///a b.jpg", NULL };
+	guint i;
+
+	g_setenv ("XDG_CACHE_HOME", tmp, TRUE);
+
+	writer = state_writer_new ();
+
+	/* Added out of order and with a duplicate, the newest one must win */
+	for (i = 0; i < 1000; i++) {
+		gchar *uri = g_strdup_printf ("file:///%u.png", (i * 7919) % 1000);
+
+		memset (&outcome, 0, sizeof (outcome));
+		outcome.uri_hash = state_hash_uri (uri);
+		outcome.mtime = i;
+		outcome.flags = STATE_OUTCOME_FRESH;
+		outcome.stamp = 1;
+		state_writer_add_outcome (writer, &outcome);
+		g_free (uri);
+	}
+
+	outcome.uri_hash = state_hash_uri ("file:///dup.png");
+	outcome.mtime = 1;
+	outcome.flags = STATE_OUTCOME_FRESH;
+	outcome.stamp = 1;
+	state_writer_add_outcome (writer, &outcome);
+	outcome.mtime = 2;
+	outcome.flags = STATE_OUTCOME_FAILED;
+	outcome.stamp = 2;
+	state_writer_add_outcome (writer, &outcome);
+
+	state_writer_add_record (writer, STATE_RECORDS_PENDING, fields, 3);
+
+	g_assert (state_writer_commit (writer, NULL));
+
+	state_snapshot_init ();
+
+	for (i = 0; i < 1000; i++) {
+		gchar *uri = g_strdup_printf ("file:///%u.png", (i * 7919) % 1000);
+
+		g_assert (state_snapshot_lookup_outcome (state_hash_uri (uri), &outcome));
+		g_assert_cmpuint (outcome.mtime, ==, i);
+		g_free (uri);
+	}
+
+	g_assert (state_snapshot_lookup_outcome (state_hash_uri ("file:///dup.png"), &outcome));
+	g_assert_cmpuint (outcome.flags, ==, STATE_OUTCOME_FAILED);
+	g_assert (!state_snapshot_lookup_outcome (state_hash_uri ("file:///none.png"), &outcome));
+
+	state_snapshot_foreach_record (STATE_RECORDS_PENDING, check_record, NULL);
+	g_assert_cmpuint (n_records, ==, 1);
+
+	state_snapshot_shutdown ();
+
+	/* A truncated snapshot must be ignored as a whole */
+	path = g_build_filename (tmp, "hildon-thumbnailer", "state.snapshot", NULL);
+	g_assert (truncate (path, 100) == 0);
+
+	state_snapshot_init ();
+	g_assert (!state_snapshot_lookup_outcome (state_hash_uri ("file:///dup.png"), &outcome));
+	state_snapshot_shutdown ();
+
+	g_unlink (path);
+	g_free (path);
+	path = g_build_filename (tmp, "hildon-thumbnailer", NULL);
+	g_rmdir (path);
+	g_rmdir (tmp);
+	g_free (path);
+	g_free (tmp);
+
+	return 0;
+}
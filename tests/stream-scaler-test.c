@@ -0,0 +1,144 @@
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "stream-scaler.h"
+
+/* Pushes small images through the scaler and checks the averages */
+
+static GdkPixbuf *
+scale (const guchar *pixels, guint width, guint height, guint dst_width, guint dst_height, gboolean has_alpha)
+{
+	StreamScaler *scaler = stream_scaler_new (width, height, dst_width, dst_height, has_alpha);
+	guint n = has_alpha ? 4 : 3;
+	guint y;
+
+	for (y = 0; y < height; y++)
+		stream_scaler_push_row (scaler, pixels + y * width * n);
+
+	return stream_scaler_finish (scaler);
+}
+
+static void
+test_checkerboard (void)
+{
+	guchar pixels[4 * 4 * 3];
+	GdkPixbuf *pixbuf;
+	guchar *p;
+	guint x, y;
+
+	for (y = 0; y < 4; y++)
+		for (x = 0; x < 4; x++)
+			memset (pixels + (y * 4 + x) * 3, ((x + y) % 2) ? 255 : 0, 3);
+
+	/* Every 2x2 block has two black and two white pixels */
+	pixbuf = scale (pixels, 4, 4, 2, 2, FALSE);
+	g_assert (pixbuf);
+
+	for (y = 0; y < 2; y++) {
+		p = gdk_pixbuf_get_pixels (pixbuf) + y * gdk_pixbuf_get_rowstride (pixbuf);
+		for (x = 0; x < 2 * 3; x++)
+			g_assert_cmpuint (p[x], ==, 128);
+	}
+
+	g_object_unref (pixbuf);
+}
+
+static void
+test_fractional (void)
+{
+	/* 3 pixels into 2, the middle one is split over both */
+	guchar pixels[3 * 3] = { 0, 0, 0, 90, 90, 90, 180, 180, 180 };
+	GdkPixbuf *pixbuf = scale (pixels, 3, 1, 2, 1, FALSE);
+	guchar *p = gdk_pixbuf_get_pixels (pixbuf);
+
+	g_assert_cmpuint (p[0], ==, 30);
+	g_assert_cmpuint (p[3], ==, 150);
+
+	g_object_unref (pixbuf);
+}
+
+static void
+test_alpha (void)
+{
+	/* A transparent black pixel next to an opaque red one stays red */
+	guchar pixels[2 * 4] = { 0, 0, 0, 0, 255, 0, 0, 255 };
+	GdkPixbuf *pixbuf = scale (pixels, 2, 1, 1, 1, TRUE);
+	guchar *p = gdk_pixbuf_get_pixels (pixbuf);
+
+	g_assert_cmpuint (p[0], ==, 255);
+	g_assert_cmpuint (p[1], ==, 0);
+	g_assert_cmpuint (p[3], ==, 128);
+
+	g_object_unref (pixbuf);
+}
+
+static void
+test_fit (void)
+{
+	guint width, height;
+
+	stream_scaler_fit (100, 50, 10000, 0, &width, &height);
+	g_assert_cmpuint (width, ==, 100);
+	g_assert_cmpuint (height, ==, 50);
+
+	stream_scaler_fit (12000, 9000, 320 * 320, 256, &width, &height);
+	g_assert_cmpuint (width * height, <=, 320 * 320);
+	g_assert_cmpuint (width, >=, 360);
+
+	stream_scaler_fit (100000, 10, 1000, 0, &width, &height);
+	g_assert_cmpuint (height, ==, 1);
+	g_assert_cmpuint (width, ==, 1000);
+
+	/* A panorama keeps enough height for the flavors */
+	stream_scaler_fit (10000, 800, 320 * 320, 256, &width, &height);
+	g_assert_cmpuint (height, ==, 256);
+	g_assert_cmpuint (width, ==, 3200);
+
+	/* But it isn't scaled up */
+	stream_scaler_fit (100000, 10, 1000, 256, &width, &height);
+	g_assert_cmpuint (height, ==, 10);
+	g_assert_cmpuint (width, ==, 100000);
+}
+
+#ifdef HAVE_PNG
+static void
+test_panorama_png (void)
+{
+	gchar *tmp = g_dir_make_tmp ("stream-scaler-XXXXXX", NULL);
+	gchar *path = g_build_filename (tmp, "panorama.png", NULL);
+	GdkPixbuf *pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, 10000, 800);
+	GError *error = NULL;
+
+	gdk_pixbuf_fill (pixbuf, 0x336699ff);
+	g_assert (gdk_pixbuf_save (pixbuf, path, "png", NULL, NULL));
+	g_object_unref (pixbuf);
+
+	pixbuf = stream_scaler_load_png (path, 320 * 320, 256, &error);
+	g_assert_no_error (error);
+	g_assert_cmpint (gdk_pixbuf_get_width (pixbuf), ==, 3200);
+	g_assert_cmpint (gdk_pixbuf_get_height (pixbuf), ==, 256);
+	g_assert_cmpuint (gdk_pixbuf_get_pixels (pixbuf)[0], ==, 0x33);
+	g_object_unref (pixbuf);
+
+	g_unlink (path);
+	g_rmdir (tmp);
+	g_free (path);
+	g_free (tmp);
+}
+#endif
+
+int main (int argc, char **argv)
+{
+	test_checkerboard ();
+	test_fractional ();
+	test_alpha ();
+	test_fit ();
+#ifdef HAVE_PNG
+	test_panorama_png ();
+#endif
+
+	return 0;
+}
@@ -23,6 +23,9 @@
 
 #include <stdlib.h>
 #include <gio/gio.h>
+#include <gmodule.h>
+
+#include <hildon-thumbnail-plugin.h>
 
 #include "gst-thumb-thumber.h"
 
@@ -41,6 +44,7 @@ static gchar   *bus_path;
 static gboolean standard;
 static gboolean cropped;
 static gint     timeout = 600;
+static gint     jobs = 0;
 
 static GOptionEntry  config_entries[] = {
 	{ "timeout", 't', 0, 
@@ -63,6 +67,10 @@ static GOptionEntry  config_entries[] = {
 	  G_OPTION_ARG_NONE, &standard, 
 	  "Enable standard (normal/large) thumbnails ", 
 	  NULL },
+	{ "jobs", 'j', 0, 
+	  G_OPTION_ARG_INT, &jobs, 
+	  "Number of videos to thumbnail in parallel (default: Jobs in gst-video-thumbnailer.conf, or 2) ", 
+	  NULL },
 	{ "dynamic-register", 'd', 0, 
 	  G_OPTION_ARG_NONE, &dynamic_register, 
 	  "Dynamic registration using org.freedesktop.Thumbnailer.Manager", 
@@ -80,6 +88,55 @@ mount_pre_unmount_cb (GVolumeMonitor *volume_monitor,
 	exit (0);
 }
 
+/* We are started by D-Bus activation without arguments, so the number of
+ * parallel jobs can also be set in the config file */
+static gint
+get_configured_jobs (void)
+{
+	GKeyFile *keyfile;
+	gchar    *config;
+	gint      value = 0;
+
+	config = g_build_filename (g_get_user_config_dir (), "hildon-thumbnailer",
+				   "gst-video-thumbnailer.conf", NULL);
+	keyfile = g_key_file_new ();
+
+	if (g_key_file_load_from_file (keyfile, config, G_KEY_FILE_NONE, NULL))
+		value = g_key_file_get_integer (keyfile, "Hildon Thumbnailer", "Jobs", NULL);
+
+	g_key_file_free (keyfile);
+	g_free (config);
+
+	return value;
+}
+
+/* The thumbnails are written by the daemon's output plugins, so that they
+ * end up in the same places and the same metadata as the daemon's own */
+static void
+load_outputplugins (void)
+{
+	GDir *dir;
+	const gchar *plugin;
+
+	dir = g_dir_open (OUTPUTPLUGINS_DIR, 0, NULL);
+
+	if (!dir)
+		return;
+
+	while ((plugin = g_dir_read_name (dir)) != NULL) {
+		gchar *full;
+
+		if (!g_str_has_suffix (plugin, "." G_MODULE_SUFFIX))
+			continue;
+
+		full = g_build_filename (OUTPUTPLUGINS_DIR, plugin, NULL);
+		hildon_thumbnail_outplugin_load (full);
+		g_free (full);
+	}
+
+	g_dir_close (dir);
+}
+
 gboolean
 gst_thumb_main_quit (void)
 {
@@ -126,6 +183,8 @@ main (gint argc, gchar *argv[])
 
   	g_print ("Initializing gstreamer video thumbnailer...\n");
 
+	load_outputplugins ();
+
 	thumber = thumber_new ();
 
 	thumber_dbus_register (thumber, bus_name, bus_path, &error);
@@ -135,6 +194,16 @@ main (gint argc, gchar *argv[])
 	g_object_set_property (G_OBJECT(thumber), "timeout", &val);
 	g_value_unset (&val);
 
+	if (jobs <= 0)
+		jobs = get_configured_jobs ();
+
+	if (jobs > 0) {
+		g_value_init (&val, G_TYPE_INT);
+		g_value_set_int (&val, CLAMP (jobs, 1, 8));
+		g_object_set_property (G_OBJECT(thumber), "jobs", &val);
+		g_value_unset (&val);
+	}
+
 	g_value_init (&val, G_TYPE_BOOLEAN);
 	g_value_set_boolean (&val, standard);
 	g_object_set_property (G_OBJECT(thumber), "standard", &val);
@@ -23,16 +23,44 @@
  */
 
 #include "gst-thumb-pipe.h"
+#include "gst-thumb-probe.h"
 
 #include <string.h>
+#include <math.h>
 
+#include <gio/gio.h>
 #include <gst/gst.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
+#include <hildon-thumbnail-plugin.h>
+
+#include "utils.h"
+
 #define THUMBER_PIPE_ERROR_DOMAIN "ThumberPipeError"
 #define SEEK_TIMEOUT 5
 #define PIPE_TIMEOUT 10
-#define VALID_VARIANCE_THRESHOLD  256.0
+
+/* Bounding boxes of the flavors, same as the gdkpixbuf plugin */
+#define LARGE_SIZE       256
+#define NORMAL_SIZE      128
+#define CROPPED_SIZE     124
+
+/* Instead of taking the first frame that isn't flat we seek to a few
+ * points spread over the video and keep the frame with the most detail.
+ * Each seek goes to the key unit before its point and stays in PAUSED, the
+ * candidate is the frame that the sink prerolls there. While all we find
+ * are blank frames we try up to SEEK_POINTS of them */
+#define MAX_CANDIDATES   4
+#define SEEK_POINTS      (MAX_CANDIDATES * 2)
+
+/* Frames are scored on a copy that is at most SCORE_SIZE pixels wide */
+#define SCORE_SIZE       64
+
+/* Luma entropy in bits. A candidate scoring this high is as good as it
+ * gets and ends the search early, below MIN_SCORE a frame is considered
+ * blank (black or fade) and only used when there is nothing else */
+#define GOOD_SCORE       7.0
+#define MIN_SCORE        3.0
 
 
 static void           newpad_callback                  (GstElement       *decodebin,
@@ -49,23 +77,21 @@ static gboolean       wait_for_state_change            (ThumberPipe *pipe,
 							GstState     state,
 							GError     **error);
 
-static gboolean       wait_for_image_buffer            (ThumberPipe *pipe,
+static gboolean       sample_frames                    (ThumberPipe *pipe,
 							const gchar *uri,
 							GError     **error);
 
-static gboolean       create_thumbnails                (const gchar *uri,
+static gboolean       create_thumbnails                (ThumberPipe *pipe,
+							const gchar *uri,
 							GdkPixbuf   *pixbuf,
-							gboolean     standard,
-							gboolean     cropped,
 							GError     **error);
 
-static gboolean       check_for_valid_thumb            (GdkPixbuf   *pixbuf);
+static gdouble        frame_score                      (GdkPixbuf   *pixbuf);
 
 static gboolean       initialize                       (ThumberPipe *pipe,
-							const gchar *mime,
-							guint size,
 							GError **error);
 static void           deinitialize                     (ThumberPipe *pipe);
+static void           reset                            (ThumberPipe *pipe);
 
 typedef struct {
 	GstElement     *pipeline;
@@ -82,7 +108,23 @@ typedef struct {
 	gboolean        standard;
 	gboolean        cropped;
 
-	GdkPixbuf      *backup_pixbuf;
+	/* The flavors the current file still needs, the frame gets decoded
+	 * at the size of the largest of them */
+	gboolean        want_large;
+	gboolean        want_normal;
+	gboolean        want_cropped;
+	guint64         mtime;
+
+	/* Best candidate frame of the current run */
+	GdkPixbuf      *best_pixbuf;
+	gdouble         best_score;
+	guint           candidates;
+
+	/* What the current pipeline was last used for. We only build a new
+	 * pipeline when the container or the video codec changes */
+	gchar          *mime;
+	gchar          *codec;
+	gboolean        codec_changed;
 } ThumberPipePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (ThumberPipe, thumber_pipe, G_TYPE_OBJECT)
@@ -199,6 +241,12 @@ thumber_pipe_finalize (GObject *object)
 	ThumberPipePrivate *priv;
 	priv = THUMBER_PIPE_GET_PRIVATE (object);
 
+	if (priv->pipeline)
+		deinitialize (THUMBER_PIPE (object));
+
+	g_free (priv->mime);
+	g_free (priv->codec);
+
 	G_OBJECT_CLASS (thumber_pipe_parent_class)->finalize (object);
 }
 
@@ -237,31 +285,108 @@ thumber_pipe_init (ThumberPipe *object)
 gboolean
 thumber_pipe_run (ThumberPipe *pipe,
 		  const gchar *uri,
+		  const gchar *mime,
 		  GError     **error)
 {
 	ThumberPipePrivate *priv;
 	gchar              *filename;
 	gboolean            success = FALSE;
+	gboolean            err_file = FALSE;
 	GError             *lerror  = NULL;
-	gint64              duration = 0;
-	gint64              seek;
+	GFile              *file;
+	GFileInfo          *info;
+	GdkPixbuf          *embedded;
 
 	priv = THUMBER_PIPE_GET_PRIVATE (pipe);
 
-	priv->backup_pixbuf = NULL;
-
 	g_return_val_if_fail (pipe != NULL, FALSE);
 	g_return_val_if_fail (uri != NULL, FALSE);
 
-	if (!initialize (pipe,
-			 "dummy",
-			 256,
-			 &lerror)) {
+	if (!mime)
+		mime = "unknown/unknown";
+
+	priv->best_pixbuf = NULL;
+	priv->best_score  = 0.0;
+	priv->candidates  = 0;
+
+	file = g_file_new_for_uri (uri);
+	info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+				  G_FILE_QUERY_INFO_NONE, NULL, &lerror);
+	filename = g_file_get_path (file);
+	g_object_unref (file);
+
+	if (!info) {
+		g_free (filename);
 		g_propagate_error (error, lerror);
 		return FALSE;
 	}
 
-	filename = g_filename_from_uri (uri, NULL, NULL);
+	priv->mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+	g_object_unref (info);
+
+	/* Don't decode anything if all the flavors are up to date */
+	priv->want_large = priv->standard &&
+		hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_LARGE,
+						       priv->mtime, uri, &err_file);
+	priv->want_normal = priv->standard &&
+		hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_NORMAL,
+						       priv->mtime, uri, &err_file);
+	priv->want_cropped = priv->cropped &&
+		hildon_thumbnail_outplugins_needs_out (HILDON_THUMBNAIL_PLUGIN_OUTTYPE_CROPPED,
+						       priv->mtime, uri, &err_file);
+
+	if (!priv->want_large && !priv->want_normal && !priv->want_cropped) {
+		g_free (filename);
+
+		if (err_file) {
+			g_set_error (error,
+				     error_quark (),
+				     THUMBNAIL_ERROR,
+				     "Had error before");
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	/* A cover or the camera's thumbnail is a lot cheaper than decoding a
+	 * frame. If we can't use it, or it is too small for the flavors we
+	 * need, we decode one after all */
+	embedded = thumber_probe_embedded (uri,
+					   priv->want_large ? LARGE_SIZE :
+					   priv->want_normal ? NORMAL_SIZE : 0,
+					   priv->want_cropped ? CROPPED_SIZE : 0);
+
+	if (embedded) {
+		success = create_thumbnails (pipe, uri, embedded, &lerror);
+		g_object_unref (embedded);
+
+		if (success) {
+			g_free (filename);
+			return TRUE;
+		}
+
+		g_clear_error (&lerror);
+	}
+
+	/* Building the pipeline and plugging the decoders is the expensive
+	 * part, for a series of files of the same kind we keep the pipeline
+	 * around in READY and only swap the location */
+
+	if (priv->pipeline &&
+	    (priv->codec_changed || g_strcmp0 (priv->mime, mime) != 0))
+		deinitialize (pipe);
+
+	if (!priv->pipeline) {
+		if (!initialize (pipe, &lerror)) {
+			g_free (filename);
+			g_propagate_error (error, lerror);
+			return FALSE;
+		}
+
+		g_free (priv->mime);
+		priv->mime = g_strdup (mime);
+	}
 
 	g_object_set (priv->source, "location",
 		      filename,
@@ -271,47 +396,63 @@ thumber_pipe_run (ThumberPipe *pipe,
 
 	gst_element_set_state (priv->pipeline, GST_STATE_PAUSED);
 	if (!wait_for_state_change (pipe, GST_STATE_PAUSED, &lerror)) {
-		g_propagate_error (error, lerror);
 		success = FALSE;
 		goto cleanup;
 	}
 
-	if (!gst_element_query_duration (priv->pipeline, GST_FORMAT_TIME,
-					 &duration)) {
-		goto skip_seek;
-	}
-	
-	if (duration > 120 * GST_SECOND) {
-		seek = 45 * GST_SECOND;
+	success = sample_frames (pipe, uri, &lerror);
+
+ cleanup:
+
+	/* A pipeline that failed might be in any state, don't reuse it */
+	if (success) {
+		reset (pipe);
 	} else {
-		seek = duration/3;
-	}
-	
-	if (gst_element_seek (priv->pipeline, 1.0, GST_FORMAT_TIME,
-			      GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
-			      GST_SEEK_TYPE_SET, seek,
-			      GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE)) {
-		/* Wait for the seek to finish */
-		gst_element_get_state (priv->pipeline, NULL, NULL,
-				       SEEK_TIMEOUT * GST_SECOND);
+		deinitialize (pipe);
+
+		/* So that the out-plugins don't have us retry this file
+		 * until it changes */
+		hildon_thumbnail_outplugins_put_error (priv->mtime, uri, lerror);
+		g_propagate_error (error, lerror);
 	}
 
-skip_seek:
+	return success;
+}
 
-	gst_element_set_state (priv->pipeline, GST_STATE_PLAYING);
-	if (!wait_for_image_buffer (pipe, uri, &lerror)) {
-		g_propagate_error (error, lerror);
-		success = FALSE;
-		goto cleanup;
-        }
+static void
+reset (ThumberPipe *pipe)
+{
+	ThumberPipePrivate *priv;
+	GstPad             *videopad;
+	GstBus             *bus;
 
-	success = TRUE;
+	priv = THUMBER_PIPE_GET_PRIVATE (pipe);
 
- cleanup:
+	/* READY closes the file and makes decodebin drop its decoders and
+	 * pads, but the elements stay */
+	gst_element_set_state (priv->pipeline, GST_STATE_READY);
+	gst_element_get_state (priv->pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
 
-	deinitialize (pipe);
+	videopad = gst_element_get_static_pad (priv->sinkbin, "sink");
+	if (videopad) {
+		GstPad *peer = gst_pad_get_peer (videopad);
+		if (peer) {
+			gst_pad_unlink (peer, videopad);
+			gst_object_unref (peer);
+		}
+		gst_object_unref (videopad);
+	}
 
-	return success;
+	/* Drop what is left of the previous file's messages */
+	bus = gst_element_get_bus (priv->pipeline);
+	gst_bus_set_flushing (bus, TRUE);
+	gst_bus_set_flushing (bus, FALSE);
+	gst_object_unref (bus);
+
+	if (priv->best_pixbuf) {
+		g_object_unref (priv->best_pixbuf);
+		priv->best_pixbuf = NULL;
+	}
 }
 
 static void
@@ -321,6 +462,10 @@ deinitialize (ThumberPipe *pipe)
 
 	priv = THUMBER_PIPE_GET_PRIVATE (pipe);
 
+	g_free (priv->codec);
+	priv->codec = NULL;
+	priv->codec_changed = FALSE;
+
 	gst_element_set_state (priv->pipeline, GST_STATE_NULL);
 	/* State changes to NULL are synchronous */
 	gst_object_unref (priv->pipeline);
@@ -336,14 +481,14 @@ deinitialize (ThumberPipe *pipe)
 	priv->video_filter = NULL;
 	priv->video_sink   = NULL;
 
-	if (priv->backup_pixbuf) {
-		g_object_unref (priv->backup_pixbuf);
-		priv->backup_pixbuf = NULL;
+	if (priv->best_pixbuf) {
+		g_object_unref (priv->best_pixbuf);
+		priv->best_pixbuf = NULL;
 	}
 }
 
 static gboolean
-initialize (ThumberPipe *pipe, const gchar *mime, guint size, GError **error)
+initialize (ThumberPipe *pipe, GError **error)
 {
 	ThumberPipePrivate *priv;
 	GstPad             *videopad;
@@ -423,6 +568,10 @@ initialize (ThumberPipe *pipe, const gchar *mime, guint size, GError **error)
 		return FALSE;
 	}
 
+	/* We read last-pixbuf after each preroll, nobody reads the bus
+	 * messages with the frames in them */
+	g_object_set (priv->video_sink, "post-messages", FALSE, NULL);
+
 	gst_bin_add_many (GST_BIN(priv->sinkbin),
 			  priv->video_scaler,
 			  priv->video_color,
@@ -527,6 +676,24 @@ newpad_callback (GstElement       *decodebin,
 	gst_object_unref (videopad);
 }
 
+/* Scale for a frame of width x height so that it is large enough for
+ * every flavor we want. We never scale up, the scaler would only make up
+ * pixels that the flavors then have to throw away again */
+static gdouble
+target_scale (ThumberPipePrivate *priv, gint width, gint height)
+{
+	gdouble scale = 0.0;
+
+	if (priv->want_large)
+		scale = MAX (scale, (gdouble) LARGE_SIZE / MAX (width, height));
+	if (priv->want_normal)
+		scale = MAX (scale, (gdouble) NORMAL_SIZE / MAX (width, height));
+	if (priv->want_cropped)
+		scale = MAX (scale, (gdouble) CROPPED_SIZE / MIN (width, height));
+
+	return scale > 0.0 ? MIN (scale, 1.0) : 1.0;
+}
+
 static gboolean
 stream_continue_callback (GstElement    *bin,
 			  GstPad        *pad,
@@ -557,28 +724,39 @@ stream_continue_callback (GstElement    *bin,
 		return FALSE;
 	}
 
-	for (i = gst_caps_get_size(caps) - 1; i >= 0; i--) {
+	/* Remember the first encoded video format we see. When the next file
+	 * has another one, the pipeline gets rebuilt before the file after it */
+	if (g_str_has_prefix (gst_structure_get_name (str), "video/x-") &&
+	    !g_str_has_prefix (gst_structure_get_name (str), "video/x-raw")) {
+		if (!priv->codec)
+			priv->codec = g_strdup (gst_structure_get_name (str));
+		else if (strcmp (priv->codec, gst_structure_get_name (str)) != 0)
+			priv->codec_changed = TRUE;
+	}
+
+	/* Let videoscale do the work at the size of the largest flavor we
+	 * need, the others are derived from that frame */
+	for (i = 0; i < gst_caps_get_size (caps); i++) {
 		gint width, height;
 		str = gst_caps_get_structure (caps, i);
 		if (gst_structure_get_int (str, "width", &width) &&
-		    gst_structure_get_int (str, "height", &height)) {
-			double scale;
+		    gst_structure_get_int (str, "height", &height) &&
+		    width > 0 && height > 0) {
+			GstCaps *filter;
+			gdouble  scale;
 
-			if (width < height) {
-				scale = 256.0/width;
-			} else {
-				scale = 256.0/height;
-			}
+			scale = target_scale (priv, width, height);
 
-			caps = gst_caps_new_simple ("video/x-raw-rgb",
-						    "width", G_TYPE_INT, (int)(width*scale),
-						    "height", G_TYPE_INT, (int)(height*scale),
-						    NULL);
+			filter = gst_caps_new_simple ("video/x-raw-rgb",
+						      "width", G_TYPE_INT, MAX (1, (gint) (width * scale + 0.5)),
+						      "height", G_TYPE_INT, MAX (1, (gint) (height * scale + 0.5)),
+						      NULL);
 			
 			g_object_set (G_OBJECT (priv->video_filter),
-				      "caps", caps,
+				      "caps", filter,
 				      NULL);			
-			gst_caps_unref (caps);
+			gst_caps_unref (filter);
+			break;
 		}
 	}
 
@@ -677,286 +855,223 @@ wait_for_state_change (ThumberPipe *pipe,
 	return TRUE;
 }
 
+/* Scores the frame that the sink prerolled and keeps it when it beats the
+ * best one so far */
 static gboolean
-wait_for_image_buffer (ThumberPipe *pipe,
-		       const gchar *uri,
-		       GError     **error)
+add_candidate (ThumberPipePrivate *priv)
 {
-       ThumberPipePrivate *priv;
-       GstBus             *bus;
-       gint64              timeout = PIPE_TIMEOUT * GST_SECOND;
+	GdkPixbuf *pix = NULL;
+	gdouble    score;
 
-       priv = THUMBER_PIPE_GET_PRIVATE (pipe);
+	g_object_get (G_OBJECT (priv->video_sink), "last-pixbuf", &pix, NULL);
 
-       bus = gst_element_get_bus (priv->pipeline);
+	if (!pix)
+		return FALSE;
 
-       while (TRUE) {
-               GstMessage *message;
-               GstElement *src;
-		
-	       message = gst_bus_timed_pop (bus, timeout);
-
-               if (!message) {
-                       g_set_error (error,
-                                    error_quark (),
-                                    RUNNING_ERROR,
-                                    "Pipeline timed out");
-                       goto error;
-               }
-
-               src = (GstElement*)GST_MESSAGE_SRC (message);
-
-               switch (GST_MESSAGE_TYPE (message)) {
-               case GST_MESSAGE_ELEMENT: {
-                       const GstStructure *s = gst_message_get_structure (message);
-                       const gchar *name = gst_structure_get_name (s);
-
-		       if (strcmp (name, "preroll-pixbuf") == 0 ||
-                           strcmp (name, "pixbuf") == 0 ) {
-                               GdkPixbuf *pix = NULL;
-			       
-                               g_object_get (G_OBJECT (priv->video_sink), "last-pixbuf", &pix, NULL);
-			       
-                               if (!pix) {
-                                       g_set_error (error,
-                                                    error_quark (),
-                                                    RUNNING_ERROR,
-                                                    "Non-existing image buffer returned by pipeline");
-				       gst_message_unref (message);
-                                       goto error;
-                               }
-			       
-			       if (check_for_valid_thumb (pix)) {
-				       if (!create_thumbnails (uri,
-							       pix,
-							       priv->standard,
-							       priv->cropped,
-							       error)) {
-					       g_object_unref (pix);
-					       gst_message_unref (message);
-					       goto error;
-				       } else {
-					       g_object_unref (pix);
-					       gst_message_unref (message);
-					       goto success;
-				       }
-			       } else {
-                                       /* If not good, get the first as backup in case there are
-					  no good ones and then continue
-				       */
-				       if (!priv->backup_pixbuf) {
-					       priv->backup_pixbuf = pix;
-				       } else {
-					       g_object_unref (pix);
-				       }
-			       }
-                       }
-		       break;
-               }
-		       
-               case GST_MESSAGE_ERROR: {
-                       GError *lerror = NULL;
-
-                       gst_message_parse_error (message, &lerror, NULL);
-
-                       if (lerror != NULL) {
-                               g_propagate_error (error, lerror);
-                       } else {
-                               g_set_error (error,
-                                            error_quark (),
-                                            RUNNING_ERROR,
-                                            "Undefined error running the pipeline");
-                       }
-		       
-		       gst_message_unref (message);
-		       goto error;
-                       break;
-               }
-               case GST_MESSAGE_EOS: {
-		       if (priv->backup_pixbuf) {
-			       if (!create_thumbnails (uri,
-						       priv->backup_pixbuf,
-						       priv->standard,
-						       priv->cropped,
-						       error)) {
-				       g_object_unref (priv->backup_pixbuf);
-				       priv->backup_pixbuf = NULL;
-				       gst_message_unref (message);
-				       goto error;
-			       } else {
-				       g_object_unref (priv->backup_pixbuf);
-				       priv->backup_pixbuf = NULL;
-				       gst_message_unref (message);
-				       goto success;
-			       }
-		       }
-		       
-                       g_set_error (error,
-				    error_quark (),
-                                 RUNNING_ERROR,
-                                    "Reached end-of-file without proper content");
-		       gst_message_unref (message);		       
-		       goto error;
-                       break;
-               }
-               default:
-                       /* Nothing to do here */
-                       break;
-               }
-
-               gst_message_unref (message);
-       }
-
-       g_assert_not_reached ();
+	score = frame_score (pix);
+	priv->candidates++;
 
- error:
-       gst_object_unref (bus);
-       return FALSE;
+	if (!priv->best_pixbuf || score > priv->best_score) {
+		if (priv->best_pixbuf)
+			g_object_unref (priv->best_pixbuf);
+		priv->best_pixbuf = pix;
+		priv->best_score = score;
+	} else {
+		g_object_unref (pix);
+	}
 
- success:
-       gst_object_unref (bus);
-       return TRUE;
+	return TRUE;
 }
 
-
-
-static gchar *
-compute_checksum (GChecksumType  checksum_type,
-		  const guchar  *data,
-		  gsize          length)
+/* The pipeline is in PAUSED. We never go to PLAYING: every seek flushes
+ * and the sink prerolls the key frame at the new position, which is the
+ * only frame that gets decoded there */
+static gboolean
+sample_frames (ThumberPipe *pipe,
+	       const gchar *uri,
+	       GError     **error)
 {
-  GChecksum *checksum;
-  gchar *retval;
+	ThumberPipePrivate *priv;
+	gint64              duration = 0;
+	gboolean            success;
+	guint               i;
 
-  checksum = g_checksum_new (checksum_type);
-  if (!checksum)
-    return NULL;
+	priv = THUMBER_PIPE_GET_PRIVATE (pipe);
 
-  g_checksum_update (checksum, data, length);
-  retval = g_strdup (g_checksum_get_string (checksum));
-  g_checksum_free (checksum);
+	if (!gst_element_query_duration (priv->pipeline, GST_FORMAT_TIME,
+					 &duration))
+		duration = 0;
+
+	for (i = 0; duration > 0 && i < SEEK_POINTS; i++) {
+		/* The odd points first, so that the first MAX_CANDIDATES
+		 * are spread over the whole video already */
+		guint  k = i < SEEK_POINTS / 2 ? 2 * i + 1 : 2 * (i - SEEK_POINTS / 2);
+		gint64 seek = duration / (SEEK_POINTS + 1) * (k + 1);
+
+		if (!gst_element_seek (priv->pipeline, 1.0, GST_FORMAT_TIME,
+				       GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
+				       GST_SEEK_TYPE_SET, seek,
+				       GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE))
+			break;
 
-  return retval;
-}
+		if (gst_element_get_state (priv->pipeline, NULL, NULL,
+					   SEEK_TIMEOUT * GST_SECOND) != GST_STATE_CHANGE_SUCCESS)
+			break;
 
-static GdkPixbuf*
-crop_resize (GdkPixbuf *src, int width, int height) {
-	int x = width, y = height;
-	int a = gdk_pixbuf_get_width(src);
-	int b = gdk_pixbuf_get_height(src);
+		add_candidate (priv);
 
-	GdkPixbuf *dest;
+		/* While we only have blank frames we keep looking a bit
+		 * longer, a dark intro shouldn't end up as the thumbnail */
+		if (priv->best_score >= GOOD_SCORE ||
+		    (priv->candidates >= MAX_CANDIDATES &&
+		     priv->best_score >= MIN_SCORE))
+			break;
+	}
 
-	// This is the automagic cropper algorithm 
-	// It is an optimized version of a system of equations
-	// Basically it maximizes the final size while minimizing the scale
+	/* Not seekable, or no seek got anywhere: the frame that prerolled
+	 * when we went to PAUSED is what we have */
+	if (!priv->best_pixbuf && !add_candidate (priv)) {
+		g_set_error (error,
+			     error_quark (),
+			     RUNNING_ERROR,
+			     "Non-existing image buffer returned by pipeline");
+		return FALSE;
+	}
 
-	int nx, ny;
-	double na, nb;
-	double offx = 0, offy = 0;
-	double scax, scay;
+	success = create_thumbnails (pipe, uri, priv->best_pixbuf, error);
 
-	g_return_val_if_fail (src != NULL, NULL);
+	g_object_unref (priv->best_pixbuf);
+	priv->best_pixbuf = NULL;
 
-	na = a;
-	nb = b;
+	return success;
+}
 
-	if(a < x && b < y) {
-		//nx = a;
-		//ny = b;
-		g_object_ref(src);
-		return src;
+/* Shannon entropy of the luma histogram, in bits (0 to 8). Black frames,
+ * fades and title cards score low, frames with actual picture content
+ * high */
+static gdouble
+frame_score (GdkPixbuf *pixbuf)
+{
+	GdkPixbuf *small;
+	guint      hist[256];
+	guchar    *pixels;
+	gint       width, height, rowstride, n_channels;
+	gint       x, y;
+	guint      total;
+	gdouble    entropy = 0.0;
+
+	g_return_val_if_fail (pixbuf != NULL, 0.0);
+
+	width  = gdk_pixbuf_get_width (pixbuf);
+	height = gdk_pixbuf_get_height (pixbuf);
+
+	if (width <= 0 || height <= 0)
+		return 0.0;
+
+	if (width > SCORE_SIZE) {
+		height = MAX (1, height * SCORE_SIZE / width);
+		width  = SCORE_SIZE;
+		small  = gdk_pixbuf_scale_simple (pixbuf, width, height,
+						  GDK_INTERP_NEAREST);
 	} else {
-		int u, v;
+		small = g_object_ref (pixbuf);
+	}
 
-		nx = u = x;
-		ny = v = y;
+	pixels     = gdk_pixbuf_get_pixels (small);
+	rowstride  = gdk_pixbuf_get_rowstride (small);
+	n_channels = gdk_pixbuf_get_n_channels (small);
 
-		if(a < x) {
-			nx = a;
-			u = a;
-		}
+	memset (hist, 0, sizeof (hist));
 
-		if(b < y) {
-			ny = b;
-		 	v = b;
-		}
+	for (y = 0; y < height; y++) {
+		const guchar *p = pixels + y * rowstride;
 
-		if(a * y < b * x) {
-			nb = (double)a * v / u;
-			// Center
-			offy = (double)(b - nb) / 2;
-		} else {
-			na = (double)b * u / v;
-			// Center
-			offx = (double)(a - na) / 2;
+		for (x = 0; x < width; x++, p += n_channels) {
+			/* BT.601 luma, weights sum up to 256 */
+			hist[(77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8]++;
 		}
 	}
 
-	// gdk_pixbuf_scale has crappy inputs
-	scax = scay = (double)nx / na;
+	g_object_unref (small);
+
+	total = (guint) (width * height);
+
+	for (x = 0; x < 256; x++) {
+		gdouble prob;
+
+		if (hist[x] == 0)
+			continue;
+
+		prob = (gdouble) hist[x] / total;
+		entropy -= prob * log2 (prob);
+	}
+
+	return entropy;
+}
 
-	offx = -offx * scax;
-	offy = -offy * scay;
+/* Scales pixbuf down to fit in a size x size box */
+static GdkPixbuf *
+scale_to_fit (GdkPixbuf *pixbuf, gint size)
+{
+	gint    a = gdk_pixbuf_get_width (pixbuf);
+	gint    b = gdk_pixbuf_get_height (pixbuf);
+	gdouble scale;
 
-	dest = gdk_pixbuf_new (gdk_pixbuf_get_colorspace(src),
-			       gdk_pixbuf_get_has_alpha(src), 
-			       gdk_pixbuf_get_bits_per_sample(src), 
-			       nx, ny);
+	if (a <= size && b <= size)
+		return g_object_ref (pixbuf);
 
-	gdk_pixbuf_scale (src, dest, 0, 0, nx, ny, offx, offy, scax, scay,
-			  GDK_INTERP_BILINEAR);
+	scale = (gdouble) size / MAX (a, b);
 
-	return dest;
+	return gdk_pixbuf_scale_simple (pixbuf,
+					MAX (1, (gint) (scale * a + 0.5)),
+					MAX (1, (gint) (scale * b + 0.5)),
+					GDK_INTERP_BILINEAR);
 }
 
 static gboolean
-check_for_valid_thumb (GdkPixbuf   *pixbuf)
+output_flavor (GdkPixbuf *pic,
+	       HildonThumbnailPluginOutType type,
+	       guint64 mtime,
+	       const gchar *uri,
+	       GError **error)
 {
-       guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-       int     rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-       int     height = gdk_pixbuf_get_height(pixbuf);
-       int     samples = (rowstride * height);
-       int     i;
-       float   avg = 0.0f;
-       float   variance = 0.0f;
-
-       g_return_val_if_fail (pixbuf != NULL, FALSE);
-
-       /* We calculate the variance of one element (bpp=24) */
-
-       for (i = 0; i < samples; i=i+3) {
-               avg += (float) pixels[i];
-       }
-       avg /= ((float) samples);
-
-       /* Calculate the variance */
-       for (i = 0; i < samples; i=i+3) {
-               float tmp = ((float) pixels[i] - avg);
-	       variance += tmp * tmp;
-       }
-
-       variance /= ((float) (samples - 1));
-       
-       return (variance > VALID_VARIANCE_THRESHOLD);
+	GError *lerror = NULL;
+
+	hildon_thumbnail_outplugins_do_out (gdk_pixbuf_get_pixels (pic),
+					    gdk_pixbuf_get_width (pic),
+					    gdk_pixbuf_get_height (pic),
+					    gdk_pixbuf_get_rowstride (pic),
+					    gdk_pixbuf_get_bits_per_sample (pic),
+					    gdk_pixbuf_get_has_alpha (pic),
+					    type,
+					    mtime,
+					    uri,
+					    &lerror);
+
+	g_object_unref (pic);
+
+	if (lerror) {
+		g_propagate_error (error, lerror);
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
+/* All flavors come from the one decoded frame, and are written by the
+ * same out-plugins the daemon uses */
 static gboolean
-create_thumbnails (const gchar *uri,
+create_thumbnails (ThumberPipe *pipe,
+		   const gchar *uri,
 		   GdkPixbuf *pixbuf,
-		   gboolean standard,
-		   gboolean cropped,
 		   GError **error)
 {
-	GdkPixbuf *pic;
-	gchar *png_name;
-	gchar *jpg_name;
-	gchar *filename;
-	gchar *checksum;
-	GError *lerror = NULL;
+	ThumberPipePrivate *priv;
+	gint a, b;
 
 	g_return_val_if_fail (uri != NULL, FALSE);
-	g_return_val_if_fail (pixbuf != NULL, FALSE);
+
+	priv = THUMBER_PIPE_GET_PRIVATE (pipe);
 
 	if (!pixbuf) {
 		g_set_error (error,
@@ -966,115 +1081,44 @@ create_thumbnails (const gchar *uri,
 		return FALSE;
 	}
 
-	checksum = compute_checksum (G_CHECKSUM_MD5, (const guchar *)uri, strlen (uri));
-	png_name = g_strdup_printf ("%s.png", checksum);
-	jpg_name = g_strdup_printf ("%s.jpeg", checksum);
-
-	g_free (checksum);
-
-	if (standard) {
-		int a;
-		int b;
-		double scale;
-
-		a = gdk_pixbuf_get_width (pixbuf);
-		b = gdk_pixbuf_get_height (pixbuf);
+	a = gdk_pixbuf_get_width (pixbuf);
+	b = gdk_pixbuf_get_height (pixbuf);
 
-		if (a <= 0 || b <= 0) {
-			g_set_error (error,
-				     error_quark (),
-				     THUMBNAIL_ERROR,
-				     "Invalid size of frame in buffer");
-			return FALSE;
-		}
-
-		if (a < b) {
-			scale = (double)256/(double)b;
-		} else {
-			scale = (double)256/(double)a;
-		}
-
-		pic = gdk_pixbuf_scale_simple (pixbuf,
-					       (int)(scale * a),
-					       (int)(scale * b),
-					       GDK_INTERP_BILINEAR);
-
-		filename = g_build_filename (g_get_home_dir (), ".thumbnails", "large", png_name, NULL);
-		if (!gdk_pixbuf_save (pic,
-				      filename,
-				      "jpeg",
-				      &lerror,
-				      NULL)) {
-			g_propagate_error (error, lerror);
-			
-			g_free (png_name);
-			g_free (jpg_name);
-
-			g_free (filename);
-
-			g_object_unref (pic);
-
-			return FALSE;
-		}	
-		g_object_unref (pic);
-
-		g_free (filename);
-
-		pic = gdk_pixbuf_scale_simple (pixbuf,
-					       (int)(scale * a/2.0),
-					       (int)(scale * b/2.0),
-					       GDK_INTERP_BILINEAR);
-		
-		filename = g_build_filename (g_get_home_dir (), ".thumbnails", "normal", png_name, NULL);
-		if (!gdk_pixbuf_save (pic,
-				      filename,
-				      "jpeg",
-				      &lerror,
-				      NULL)) {
-			g_propagate_error (error, lerror);
-			
-			g_free (png_name);
-			g_free (jpg_name);
-
-			g_free (filename);
-
-			g_object_unref (pic);
-
-			return FALSE;
-		}
-		g_object_unref (pic);
-
-		g_free (filename);
+	if (a <= 0 || b <= 0) {
+		g_set_error (error,
+			     error_quark (),
+			     THUMBNAIL_ERROR,
+			     "Invalid size of frame in buffer");
+		return FALSE;
 	}
 
-	if (cropped) {
-		pic = crop_resize (pixbuf, 124, 124);
-		
-		filename = g_build_filename (g_get_home_dir (), ".thumbnails", "cropped", jpg_name, NULL);
-		if (!gdk_pixbuf_save (pic,
-				      filename,
-				      "jpeg",
-				      &lerror,
-				      NULL)) {
-			g_propagate_error (error, lerror);
-			
-			g_free (png_name);
-			g_free (jpg_name);
+	if (priv->want_large &&
+	    !output_flavor (scale_to_fit (pixbuf, LARGE_SIZE),
+			    HILDON_THUMBNAIL_PLUGIN_OUTTYPE_LARGE,
+			    priv->mtime, uri, error))
+		return FALSE;
 
-			g_free (filename);
+	if (priv->want_normal &&
+	    !output_flavor (scale_to_fit (pixbuf, NORMAL_SIZE),
+			    HILDON_THUMBNAIL_PLUGIN_OUTTYPE_NORMAL,
+			    priv->mtime, uri, error))
+		return FALSE;
+
+	if (priv->want_cropped) {
+		GdkPixbuf *pic;
 
-			g_object_unref (pic);
+		/* Like the gdkpixbuf plugin: the largest square in the
+		 * middle, unless the frame is too small for that */
+		if (a < CROPPED_SIZE || b < CROPPED_SIZE)
+			pic = scale_to_fit (pixbuf, CROPPED_SIZE);
+		else
+			pic = hildon_thumbnail_crop_resize (pixbuf, CROPPED_SIZE, CROPPED_SIZE);
 
+		if (!output_flavor (pic,
+				    HILDON_THUMBNAIL_PLUGIN_OUTTYPE_CROPPED,
+				    priv->mtime, uri, error))
 			return FALSE;
-		}
-		g_object_unref (pic);
-		
-		g_free (filename);
 	}
 
-	g_free (png_name);
-	g_free (jpg_name);
-
 	return TRUE;
 }
-
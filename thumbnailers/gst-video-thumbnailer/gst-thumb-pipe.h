@@ -50,6 +50,7 @@ GType		thumber_pipe_get_type	            (void) G_GNUC_CONST;
 ThumberPipe    *thumber_pipe_new                    (void);
 gboolean        thumber_pipe_run                    (ThumberPipe *pipe,
 						     const gchar *uri,
+						     const gchar *mime,
 						     GError     **error);
 
 #endif
@@ -0,0 +1,487 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2009 Nokia Corporation.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Looks for a picture that comes with a video so that we don't have to
+ * decode a frame: the THM file a camera writes next to a clip, the covr
+ * item of MP4 and QuickTime files and the cover attachment of Matroska */
+
+#include "gst-thumb-probe.h"
+#include "plugin-util.h"
+
+#include <string.h>
+
+#include <gio/gio.h>
+
+/* An embedded picture larger than this isn't a thumbnail */
+#define MAX_IMAGE_SIZE   (1024*1024*16)
+
+/* Matroska element IDs, with their length marker bits */
+#define MKV_EBML         0x1a45dfa3
+#define MKV_SEGMENT      0x18538067
+#define MKV_SEEK_HEAD    0x114d9b74
+#define MKV_SEEK         0x4dbb
+#define MKV_SEEK_ID      0x53ab
+#define MKV_SEEK_POS     0x53ac
+#define MKV_CLUSTER      0x1f43b675
+#define MKV_ATTACHMENTS  0x1941a469
+#define MKV_ATTACHED     0x61a7
+#define MKV_FILE_NAME    0x466e
+#define MKV_FILE_MIME    0x4660
+#define MKV_FILE_DATA    0x465c
+
+#define MKV_UNKNOWN_SIZE G_MAXUINT64
+
+#define BE32(p)		(((guint32) (p)[0] << 24) | ((guint32) (p)[1] << 16) | \
+			 ((guint32) (p)[2] << 8) | (guint32) (p)[3])
+
+static GBytes *
+read_image (GInputStream *stream, guint64 offset, guint64 len)
+{
+	guchar *image;
+
+	if (len == 0 || len > MAX_IMAGE_SIZE)
+		return NULL;
+
+	image = g_malloc (len);
+
+	if (!plugin_util_read_at (stream, offset, image, len)) {
+		g_free (image);
+		return NULL;
+	}
+
+	return g_bytes_new_take (image, len);
+}
+
+/* moov/udta/meta/ilst/covr/data, like in music files */
+static GBytes *
+mp4_find_cover (GInputStream *stream, guint64 file_size)
+{
+	const gchar *path[] = { "moov", "udta", "meta", "ilst", "covr", "data", NULL };
+	guint64 start = 0, end = file_size;
+	guint i;
+
+	for (i = 0; path[i]; i++) {
+		if (!plugin_util_mp4_find_box (stream, start, end, path[i], &start, &end))
+			return NULL;
+		/* meta is a full box: version and flags first */
+		if (strcmp (path[i], "meta") == 0)
+			start += 4;
+	}
+
+	/* data has a type and a locale in front of the image */
+	if (end - start <= 8)
+		return NULL;
+
+	return read_image (stream, start + 8, end - start - 8);
+}
+
+/* An EBML element header at pos: the ID with its marker bits, and the
+ * size of the data that follows the header */
+static gboolean
+mkv_read_header (GInputStream *stream, guint64 pos, guint64 end, guint32 *id, guint64 *size, guint *hlen)
+{
+	guchar buffer[12];
+	guint id_len, size_len, avail, i;
+	guint64 value;
+	gboolean unknown;
+
+	if (pos + 2 > end)
+		return FALSE;
+
+	avail = MIN (sizeof (buffer), end - pos);
+
+	if (!plugin_util_read_at (stream, pos, buffer, avail))
+		return FALSE;
+
+	for (id_len = 1; id_len <= 4; id_len++) {
+		if (buffer[0] & (0x80 >> (id_len - 1)))
+			break;
+	}
+
+	if (id_len > 4 || id_len >= avail)
+		return FALSE;
+
+	for (size_len = 1; size_len <= 8; size_len++) {
+		if (buffer[id_len] & (0x80 >> (size_len - 1)))
+			break;
+	}
+
+	if (size_len > 8 || id_len + size_len > avail)
+		return FALSE;
+
+	*id = 0;
+	for (i = 0; i < id_len; i++)
+		*id = (*id << 8) | buffer[i];
+
+	value = buffer[id_len] & (0xff >> size_len);
+	unknown = value == (guint64) (0xff >> size_len);
+	for (i = 1; i < size_len; i++) {
+		value = (value << 8) | buffer[id_len + i];
+		unknown = unknown && buffer[id_len + i] == 0xff;
+	}
+
+	*size = unknown ? MKV_UNKNOWN_SIZE : value;
+	*hlen = id_len + size_len;
+
+	return TRUE;
+}
+
+static guint64
+mkv_read_uint (GInputStream *stream, guint64 pos, guint64 size)
+{
+	guchar buffer[8];
+	guint64 value = 0;
+	guint i;
+
+	if (size == 0 || size > 8 || !plugin_util_read_at (stream, pos, buffer, size))
+		return 0;
+
+	for (i = 0; i < size; i++)
+		value = (value << 8) | buffer[i];
+
+	return value;
+}
+
+/* The SeekHead tells where Attachments is, it's often after the clusters */
+static guint64
+mkv_seek_attachments (GInputStream *stream, guint64 segment, guint64 pos, guint64 end)
+{
+	while (pos < end) {
+		guint32 id;
+		guint64 size;
+		guint hlen;
+
+		if (!mkv_read_header (stream, pos, end, &id, &size, &hlen) ||
+		    size == MKV_UNKNOWN_SIZE || size > end - pos - hlen)
+			return 0;
+
+		if (id == MKV_SEEK) {
+			guint64 child = pos + hlen, child_end = pos + hlen + size;
+			guint32 seek_id = 0;
+			guint64 seek_pos = 0;
+
+			while (child < child_end) {
+				guint32 cid;
+				guint64 csize;
+				guint chlen;
+
+				if (!mkv_read_header (stream, child, child_end, &cid, &csize, &chlen) ||
+				    csize == MKV_UNKNOWN_SIZE)
+					break;
+
+				if (cid == MKV_SEEK_ID)
+					seek_id = mkv_read_uint (stream, child + chlen, csize);
+				else if (cid == MKV_SEEK_POS)
+					seek_pos = mkv_read_uint (stream, child + chlen, csize);
+
+				child += chlen + csize;
+			}
+
+			if (seek_id == MKV_ATTACHMENTS && seek_pos)
+				return segment + seek_pos;
+		}
+
+		pos += hlen + size;
+	}
+
+	return 0;
+}
+
+/* The picture of one AttachedFile, if it is one. Matroska says covers are
+ * called cover.jpg or cover.png, with small_cover for a small one */
+static GBytes *
+mkv_read_attached (GInputStream *stream, guint64 pos, guint64 end, gint *rank)
+{
+	guint64 data_pos = 0, data_size = 0;
+	gchar name[64] = "", mime[32] = "";
+
+	while (pos < end) {
+		guint32 id;
+		guint64 size;
+		guint hlen;
+
+		if (!mkv_read_header (stream, pos, end, &id, &size, &hlen) ||
+		    size == MKV_UNKNOWN_SIZE || size > end - pos - hlen)
+			return NULL;
+
+		if (id == MKV_FILE_NAME)
+			plugin_util_read_at (stream, pos + hlen, (guchar *) name, MIN (size, sizeof (name) - 1));
+		else if (id == MKV_FILE_MIME)
+			plugin_util_read_at (stream, pos + hlen, (guchar *) mime, MIN (size, sizeof (mime) - 1));
+		else if (id == MKV_FILE_DATA) {
+			data_pos = pos + hlen;
+			data_size = size;
+		}
+
+		pos += hlen + size;
+	}
+
+	if (!data_pos || !g_str_has_prefix (mime, "image/"))
+		return NULL;
+
+	if (g_ascii_strncasecmp (name, "cover.", 6) == 0)
+		*rank = 2;
+	else if (g_ascii_strncasecmp (name, "small_cover.", 12) == 0)
+		*rank = 1;
+	else
+		*rank = 0;
+
+	return read_image (stream, data_pos, data_size);
+}
+
+static GBytes *
+mkv_find_cover (GInputStream *stream, guint64 file_size)
+{
+	guint64 pos, segment, segment_end, attachments = 0, attachments_end;
+	GBytes *best = NULL;
+	gint best_rank = -1;
+	guint32 id;
+	guint64 size;
+	guint hlen, elements;
+
+	if (!mkv_read_header (stream, 0, file_size, &id, &size, &hlen) ||
+	    id != MKV_EBML || size == MKV_UNKNOWN_SIZE)
+		return NULL;
+
+	pos = hlen + size;
+
+	if (!mkv_read_header (stream, pos, file_size, &id, &size, &hlen) ||
+	    id != MKV_SEGMENT)
+		return NULL;
+
+	segment = pos + hlen;
+	segment_end = size == MKV_UNKNOWN_SIZE || size > file_size - segment ?
+		file_size : segment + size;
+
+	/* The top level elements before the first cluster, one of them is
+	 * either Attachments or a SeekHead that points to it */
+	for (pos = segment, elements = 0; pos < segment_end && elements < 32; elements++) {
+		if (!mkv_read_header (stream, pos, segment_end, &id, &size, &hlen) ||
+		    size == MKV_UNKNOWN_SIZE || size > segment_end - pos - hlen)
+			break;
+
+		if (id == MKV_ATTACHMENTS) {
+			attachments = pos;
+			break;
+		}
+
+		if (id == MKV_SEEK_HEAD && !attachments)
+			attachments = mkv_seek_attachments (stream, segment, pos + hlen, pos + hlen + size);
+
+		if (id == MKV_CLUSTER)
+			break;
+
+		pos += hlen + size;
+	}
+
+	if (!attachments ||
+	    !mkv_read_header (stream, attachments, segment_end, &id, &size, &hlen) ||
+	    id != MKV_ATTACHMENTS || size == MKV_UNKNOWN_SIZE ||
+	    size > segment_end - attachments - hlen)
+		return NULL;
+
+	attachments_end = attachments + hlen + size;
+
+	for (pos = attachments + hlen; pos < attachments_end && best_rank < 2; pos += hlen + size) {
+		if (!mkv_read_header (stream, pos, attachments_end, &id, &size, &hlen) ||
+		    size == MKV_UNKNOWN_SIZE || size > attachments_end - pos - hlen)
+			break;
+
+		if (id == MKV_ATTACHED) {
+			gint rank = 0;
+			GBytes *image = mkv_read_attached (stream, pos + hlen,
+							   pos + hlen + size, &rank);
+
+			if (image && rank > best_rank) {
+				if (best)
+					g_bytes_unref (best);
+				best = image;
+				best_rank = rank;
+			} else if (image) {
+				g_bytes_unref (image);
+			}
+		}
+	}
+
+	return best;
+}
+
+/* CANON/MVI_0001.MOV comes with CANON/MVI_0001.THM, a small JPEG */
+static GBytes *
+find_sidecar (GFile *file)
+{
+	gchar *basename = g_file_get_basename (file);
+	GFile *parent = g_file_get_parent (file);
+	const gchar *extensions[] = { ".THM", ".thm", NULL };
+	GBytes *image = NULL;
+	gchar *dot;
+	guint i;
+
+	/* Reading a whole file to find out whether it is there is only
+	 * cheap when it's local */
+	if (!basename || !parent || !g_file_has_uri_scheme (file, "file"))
+		goto out;
+
+	dot = strrchr (basename, '.');
+	if (dot)
+		*dot = '\0';
+
+	for (i = 0; !image && extensions[i]; i++) {
+		gchar *name = g_strconcat (basename, extensions[i], NULL);
+		GFile *sidecar = g_file_get_child (parent, name);
+		gchar *contents;
+		gsize len;
+
+		if (g_file_load_contents (sidecar, NULL, &contents, &len, NULL, NULL)) {
+			if (len > 0 && len <= MAX_IMAGE_SIZE)
+				image = g_bytes_new_take (contents, len);
+			else
+				g_free (contents);
+		}
+
+		g_object_unref (sidecar);
+		g_free (name);
+	}
+
+out:
+	if (parent)
+		g_object_unref (parent);
+	g_free (basename);
+
+	return image;
+}
+
+/* What the picture has to cover: its long side box, its short side square
+ * (for the cropped flavor). 0 is for a flavor that isn't wanted */
+typedef struct {
+	gint box;
+	gint square;
+	gboolean too_small;
+} ProbeSize;
+
+static void
+on_size_prepared (GdkPixbufLoader *loader, gint width, gint height, gpointer user_data)
+{
+	ProbeSize *want = user_data;
+	gdouble scale;
+
+	/* A camera's THM is usually 160x120, scaling that up to the large
+	 * flavor looks worse than the frame we can decode */
+	if (MAX (width, height) < want->box || MIN (width, height) < want->square) {
+		want->too_small = TRUE;
+		return;
+	}
+
+	scale = MAX ((gdouble) want->box / MAX (width, height),
+		     (gdouble) want->square / MIN (width, height));
+
+	if (scale < 1.0)
+		gdk_pixbuf_loader_set_size (loader,
+					    MAX (1, (gint) (width * scale + 0.5)),
+					    MAX (1, (gint) (height * scale + 0.5)));
+}
+
+static GdkPixbuf *
+decode_image (GBytes *image, gint box, gint square)
+{
+	GdkPixbufLoader *loader = gdk_pixbuf_loader_new ();
+	GdkPixbuf *pixbuf = NULL;
+	ProbeSize want = { box, square, FALSE };
+	gsize len;
+	const guchar *data = g_bytes_get_data (image, &len);
+
+	g_signal_connect (loader, "size-prepared", G_CALLBACK (on_size_prepared),
+			  &want);
+
+	if (gdk_pixbuf_loader_write (loader, data, len, NULL) &&
+	    gdk_pixbuf_loader_close (loader, NULL)) {
+		pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+		if (pixbuf && !want.too_small)
+			g_object_ref (pixbuf);
+		else
+			pixbuf = NULL;
+	} else {
+		gdk_pixbuf_loader_close (loader, NULL);
+	}
+
+	g_object_unref (loader);
+
+	return pixbuf;
+}
+
+/* A picture that stands for the video at uri, decoded at about the size
+ * that covers box on its long side and square on its short side. NULL when
+ * there is none that large and we'll have to decode a frame */
+GdkPixbuf *
+thumber_probe_embedded (const gchar *uri, gint box, gint square)
+{
+	GFile *file;
+	GFileInfo *info;
+	GFileInputStream *stream;
+	GBytes *image;
+	GdkPixbuf *pixbuf = NULL;
+	guchar magic[8];
+	guint64 file_size;
+
+	file = g_file_new_for_uri (uri);
+
+	image = find_sidecar (file);
+
+	if (image) {
+		pixbuf = decode_image (image, box, square);
+		g_bytes_unref (image);
+		image = NULL;
+	}
+
+	if (!pixbuf) {
+		info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+					  G_FILE_QUERY_INFO_NONE, NULL, NULL);
+		stream = g_file_read (file, NULL, NULL);
+
+		if (info && stream && plugin_util_read_at (G_INPUT_STREAM (stream), 0, magic, 8)) {
+			file_size = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
+
+			if (memcmp (magic + 4, "ftyp", 4) == 0 || memcmp (magic + 4, "moov", 4) == 0)
+				image = mp4_find_cover (G_INPUT_STREAM (stream), file_size);
+			else if (BE32 (magic) == MKV_EBML)
+				image = mkv_find_cover (G_INPUT_STREAM (stream), file_size);
+		}
+
+		if (stream) {
+			g_input_stream_close (G_INPUT_STREAM (stream), NULL, NULL);
+			g_object_unref (stream);
+		}
+		if (info)
+			g_object_unref (info);
+	}
+
+	if (image) {
+		pixbuf = decode_image (image, box, square);
+		g_bytes_unref (image);
+	}
+
+	g_object_unref (file);
+
+	return pixbuf;
+}
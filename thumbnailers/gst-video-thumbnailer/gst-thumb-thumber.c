@@ -25,6 +25,8 @@
 #include "config.h"
 
 #define DEFAULT_QUIT_TIMEOUT 30
+#define DEFAULT_JOBS         2
+#define MAX_JOBS             8
 
 #include "gst-thumb-thumber.h"
 
@@ -62,6 +64,8 @@ void thumber_dbus_method_create_many (Thumber *object, GStrv uris, gchar *mime_h
 #include "gst-video-thumbnailer-glue.h"
 
 static gboolean thumber_process_func (gpointer data);
+static gboolean thumber_job_done     (gpointer data);
+static void     thumber_job_func     (gpointer data, gpointer user_data);
 static void     thumber_set_state (Thumber *thumber, ThumberState state);
 
 static void     request_resources (Thumber *thumber);
@@ -69,6 +73,7 @@ static void     release_resources (Thumber *thumber);
 
 typedef struct FileInfo FileInfo;
 typedef struct TaskInfo TaskInfo;
+typedef struct JobInfo JobInfo;
 
 typedef struct {
 	/* Properties */
@@ -79,12 +84,15 @@ typedef struct {
 	guint            quit_timeout_id;
 	gint             quit_timeout;
 
-	TaskInfo        *current_task;
-
 	GQueue          *task_queue;
 	GQueue          *file_queue;
 
-	ThumberPipe     *pipe;
+	/* Pipelines run on the pool's threads, at most jobs at a time. Idle
+	 * pipes are kept in pipes so that the next file can reuse one */
+	gint             jobs;
+	guint            running;
+	GThreadPool     *pool;
+	GAsyncQueue     *pipes;
 
 	ThumberState     state;
 #ifdef HAVE_PLAYBACK
@@ -98,13 +106,25 @@ typedef struct {
 G_DEFINE_TYPE_WITH_PRIVATE (Thumber, thumber, G_TYPE_OBJECT)
 
 struct FileInfo {
-	gchar *uri;
+	gchar    *uri;
+	TaskInfo *task;
 };
 
 struct TaskInfo {
 	guint   id;
 	gchar  *mime;
 	GSList *files;
+	guint   pending;
+};
+
+/* A file that is handed to the pool, and the result it comes back with */
+struct JobInfo {
+	Thumber  *thumber;
+	FileInfo *file;
+	gboolean  standard;
+	gboolean  cropped;
+	gboolean  success;
+	GError   *error;
 };
 
 enum {
@@ -197,7 +217,8 @@ enum {
 	PROP_0,
 	PROP_STANDARD,
 	PROP_CROPPED,
-	PROP_TIMEOUT
+	PROP_TIMEOUT,
+	PROP_JOBS
 };
 
 Thumber *
@@ -260,6 +281,26 @@ thumber_set_timeout (Thumber *thumber, gint timeout)
 	priv->quit_timeout = timeout;
 }
 
+static gint
+thumber_get_jobs (Thumber *thumber)
+{
+	ThumberPrivate *priv;
+
+	priv = THUMBER_GET_PRIVATE (thumber);
+	return priv->jobs;
+}
+
+static void
+thumber_set_jobs (Thumber *thumber, gint jobs)
+{
+	ThumberPrivate *priv;
+
+	priv = THUMBER_GET_PRIVATE (thumber);
+	priv->jobs = jobs;
+
+	g_thread_pool_set_max_threads (priv->pool, jobs, NULL);
+}
+
 static void
 thumber_set_property (GObject      *object,
 		      guint         prop_id,
@@ -276,6 +317,9 @@ thumber_set_property (GObject      *object,
 	case PROP_TIMEOUT:
 		thumber_set_timeout (THUMBER (object), g_value_get_int (value));
 		break;		
+	case PROP_JOBS:
+		thumber_set_jobs (THUMBER (object), g_value_get_int (value));
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	}
@@ -305,6 +349,10 @@ thumber_get_property (GObject    *object,
 		g_value_set_int (value,
 				 thumber_get_timeout (THUMBER (object)));
 		break;		
+	case PROP_JOBS:
+		g_value_set_int (value,
+				 thumber_get_jobs (THUMBER (object)));
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	}
@@ -314,17 +362,20 @@ static void
 thumber_finalize (GObject *object)
 {
 	ThumberPrivate *priv;
+	ThumberPipe    *pipe;
 
 	priv = THUMBER_GET_PRIVATE (object);
 
+	/* Each job holds a reference, so no job can be running here */
+	g_thread_pool_free (priv->pool, TRUE, TRUE);
+
 #ifdef HAVE_PLAYBACK
 	pb_playback_destroy (priv->playback); 
 	priv->playback = NULL;
 #endif
-	if (priv->pipe) {
-		g_object_unref (priv->pipe);
-		priv->pipe = NULL;
-	}
+	while ((pipe = g_async_queue_try_pop (priv->pipes)) != NULL)
+		g_object_unref (pipe);
+	g_async_queue_unref (priv->pipes);
 
 	g_queue_foreach (priv->task_queue, (GFunc) task_info_free, (gpointer)TRUE);
 	g_queue_free (priv->task_queue);
@@ -375,6 +426,16 @@ thumber_class_init (ThumberClass *klass)
 							  DEFAULT_QUIT_TIMEOUT,
 							  G_PARAM_READWRITE));
 
+       g_object_class_install_property (object_class,
+					PROP_JOBS,
+					g_param_spec_int ("jobs",
+							  "Jobs",
+							  "Number of videos that are thumbnailed in parallel",
+							  1,
+							  MAX_JOBS,
+							  DEFAULT_JOBS,
+							  G_PARAM_READWRITE));
+
 
 	signals[READY_SIGNAL] =
 		g_signal_new ("ready",
@@ -437,9 +498,11 @@ thumber_init (Thumber *object)
 	priv->idle_id    = 0;
 	priv->quit_timeout_id = 0;
 
-	priv->current_task = NULL;
-
-	priv->pipe       = NULL;
+	priv->jobs       = DEFAULT_JOBS;
+	priv->running    = 0;
+	priv->pool       = g_thread_pool_new (thumber_job_func, object,
+					      DEFAULT_JOBS, FALSE, NULL);
+	priv->pipes      = g_async_queue_new ();
 
 	priv->state = THUMBER_STATE_NULL;
 }
@@ -681,6 +744,20 @@ quit_timeout_cb (gpointer user_data)
 	return FALSE;
 }
 
+static void
+schedule_process (Thumber *thumber)
+{
+	ThumberPrivate *priv;
+	priv = THUMBER_GET_PRIVATE (thumber);
+
+	if (priv->idle_id == 0) {
+		priv->idle_id = g_idle_add (thumber_process_func, 
+					    thumber);
+		g_source_set_can_recurse (g_main_context_find_source_by_id (NULL, priv->idle_id),
+					  FALSE);
+	}
+}
+
 static void
 thumber_set_state (Thumber *thumber,
 		   ThumberState state)
@@ -690,12 +767,7 @@ thumber_set_state (Thumber *thumber,
 
 	switch (state) {
 	case THUMBER_STATE_WORKING:
-		if (priv->idle_id == 0) {
-			priv->idle_id = g_idle_add (thumber_process_func, 
-						    thumber);
-			g_source_set_can_recurse (g_main_context_find_source_by_id (NULL, priv->idle_id),
-						  FALSE);
-		}
+		schedule_process (thumber);
 		if (priv->quit_timeout_id != 0) {
 			g_source_remove (priv->quit_timeout_id);
 			priv->quit_timeout_id = 0;
@@ -791,14 +863,103 @@ thumber_populate_file_queue (Thumber *thumber, TaskInfo *task) {
 		FileInfo *info;
 		info = list->data;
 
+		info->task = task;
+		task->pending++;
+
 		add_file (thumber, info);
 	}
 }
 
-/* Recurrency is not allowed so there is no risk of new item being started
-   before the previous is done even though the pipeline bus is polled
-   in the mainloop
-*/
+/* Runs on a thread of the pool. Reuses an idle pipe if there is one, and
+ * reports back to the main loop when done */
+static void
+thumber_job_func (gpointer data, gpointer user_data)
+{
+	JobInfo        *job = data;
+	ThumberPrivate *priv;
+	ThumberPipe    *pipe;
+
+	priv = THUMBER_GET_PRIVATE (job->thumber);
+
+	pipe = g_async_queue_try_pop (priv->pipes);
+	if (!pipe)
+		pipe = thumber_pipe_new ();
+
+	g_object_set (pipe,
+		      "standard", job->standard,
+		      "cropped", job->cropped,
+		      NULL);
+
+	job->success = thumber_pipe_run (pipe,
+					 job->file->uri,
+					 job->file->task->mime,
+					 &job->error);
+
+	g_async_queue_push (priv->pipes, pipe);
+
+	g_idle_add (thumber_job_done, job);
+}
+
+/* Back in the main loop: the signals are only ever emitted from here */
+static gboolean
+thumber_job_done (gpointer data)
+{
+	JobInfo        *job = data;
+	Thumber        *thumber = job->thumber;
+	TaskInfo       *task = job->file->task;
+	ThumberPrivate *priv;
+
+	priv = THUMBER_GET_PRIVATE (thumber);
+
+	if (!job->success) {
+		if (job->error) {
+			g_signal_emit (thumber,
+				       signals[ERROR_SIGNAL],
+				       0,
+				       job->file->uri,
+				       1,
+				       job->error->message);
+			g_error_free (job->error);
+		} else {
+			g_signal_emit (thumber,
+				       signals[ERROR_SIGNAL],
+				       0,
+				       job->file->uri,
+				       0,
+				       "Undefined error");
+		}
+	} else {
+		g_signal_emit (thumber,
+			       signals[READY_SIGNAL],
+			       0,
+			       job->file->uri);
+	}
+
+	file_info_free (job->file);
+	priv->running--;
+
+	if (--task->pending == 0) {
+		g_signal_emit (thumber,
+			       signals[FINISHED_SIGNAL],
+			       0,
+			       task->id);
+		task_info_free (task, FALSE);
+	}
+
+	/* A free slot for the next file, or the last one is done and we can
+	 * give the resources back */
+	if (priv->state == THUMBER_STATE_WORKING)
+		schedule_process (thumber);
+
+	g_slice_free (JobInfo, job);
+	g_object_unref (thumber);
+
+	return FALSE;
+}
+
+/* Hands out files to the pool until all jobs are busy. The pipelines poll
+ * their bus on the pool's threads, so the main loop stays free for D-Bus.
+ * Gets scheduled again each time a job is done */
 
 static gboolean
 thumber_process_func (gpointer data)
@@ -807,94 +968,58 @@ thumber_process_func (gpointer data)
 	FileInfo *file;
 	TaskInfo *task;
 	ThumberPrivate *priv;
-	GError *error = NULL;
+	ThumberPipe *pipe;
 	thumber = THUMBER (data);
 	priv = THUMBER_GET_PRIVATE (thumber);
 
-	if (priv && priv->pipe &&
-	    ((file = g_queue_pop_head (priv->file_queue)) != NULL)) {
+	while (priv->running < (guint) priv->jobs) {
+		JobInfo *job;
+
+		if ((file = g_queue_pop_head (priv->file_queue)) == NULL) {
+			if ((task = g_queue_pop_head (priv->task_queue)) == NULL)
+				break;
 
-		if (!thumber_pipe_run (priv->pipe,
-				       file->uri,
-				       &error)) {
-			if (error) {
-				g_signal_emit (thumber,
-					       signals[ERROR_SIGNAL],
-					       0,
-					       file->uri,
-					       1,
-					       error->message);
-				g_error_free (error);
-				error = NULL;
-			} else {
-				g_signal_emit (thumber,
-					       signals[ERROR_SIGNAL],
-					       0,
-					       file->uri,
-					       0,
-					       "Undefined error");
-			}
-		} else {
 			g_signal_emit (thumber,
-				       signals[READY_SIGNAL],
+				       signals[STARTED_SIGNAL],
 				       0,
-				       file->uri);
-		}
+				       task->id);
 
-		file_info_free (file);
-			
-	} else {
+			thumber_populate_file_queue (thumber, task);
 
-		if (priv->current_task) {
-			g_signal_emit (thumber,
-				       signals[FINISHED_SIGNAL],
-				       0,
-				       priv->current_task->id);
-			task_info_free (priv->current_task, FALSE);
-			priv->current_task = NULL;
+			if (task->pending == 0) {
+				g_signal_emit (thumber,
+					       signals[FINISHED_SIGNAL],
+					       0,
+					       task->id);
+				task_info_free (task, FALSE);
+			}
+
+			continue;
 		}
 
-		if ((task = g_queue_pop_head (priv->task_queue)) != NULL) {
-			GValue val = {0, };
+		job = g_slice_new0 (JobInfo);
+		job->thumber  = g_object_ref (thumber);
+		job->file     = file;
+		job->standard = priv->standard;
+		job->cropped  = priv->cropped;
 
+		priv->running++;
+		g_thread_pool_push (priv->pool, job, NULL);
+	}
 
-			if (priv->pipe) {
-				g_object_unref (priv->pipe);
-				priv->pipe = NULL;
-			}
-			
-			priv->pipe = thumber_pipe_new ();		       			
-
-			g_value_init (&val, G_TYPE_BOOLEAN);
-			g_value_set_boolean (&val, priv->standard);
-			g_object_set_property (G_OBJECT(priv->pipe), "standard", &val);
-			g_value_unset (&val);
-			
-			g_value_init (&val, G_TYPE_BOOLEAN);
-			g_value_set_boolean (&val, priv->cropped);
-			g_object_set_property (G_OBJECT(priv->pipe), "cropped", &val);
-			g_value_unset (&val);
+	priv->idle_id = 0;
 
-			thumber_populate_file_queue (thumber, task);
-			
-			priv->current_task = task;
-			g_signal_emit (thumber,
-				       signals[STARTED_SIGNAL],
-				       0,
-				       priv->current_task->id);
-		} else {
-			if (priv->pipe) {
-				g_object_unref (priv->pipe);
-				priv->pipe = NULL;
-			}
+	if (priv->running == 0 &&
+	    g_queue_is_empty (priv->file_queue) &&
+	    g_queue_is_empty (priv->task_queue)) {
 
-			release_resources (thumber);
+		/* The pipes keep their pipeline between files and tasks,
+		 * but not once we're out of work */
+		while ((pipe = g_async_queue_try_pop (priv->pipes)) != NULL)
+			g_object_unref (pipe);
 
-			priv->idle_id = 0;
-			return FALSE;
-		}
+		release_resources (thumber);
 	}
-	
-	return TRUE;
-}
 
+	return FALSE;
+}
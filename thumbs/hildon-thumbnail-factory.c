@@ -28,6 +28,7 @@
 #include "hildon-thumber-common.h"
 #include "thumbnailer-client.h"
 #include "thumbnailer-marshal.h"
+#include "request-batch.h"
 #include "utils.h"
 
 #include <stdlib.h>
@@ -78,6 +79,7 @@ static gboolean show_debug = FALSE, had_init = FALSE;
 static DBusGProxy *proxy;
 static DBusGConnection *connection;
 static GHashTable *tasks;
+static RequestBatch *batch;
 
 typedef struct {
 	gchar *file;
@@ -377,6 +379,78 @@ create_pixbuf_and_callback (ThumbsItem *item, gchar *large, gchar *normal, gchar
 			g_object_unref (pixbuf);
 }
 
+static gboolean
+uri_in (const gchar *uri, GStrv uris)
+{
+	guint i;
+
+	for (i = 0; uris && uris[i]; i++)
+		if (strcmp (uris[i], uri) == 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+static void
+finish_item (ThumbsItem *item)
+{
+	gchar *large = NULL, *normal = NULL, *cropped = NULL;
+	gchar *path;
+
+	/* Get the large small and cropped path for the original
+	 * URI */
+
+	hildon_thumbnail_util_get_thumb_paths (item->uri, &large, 
+						&normal, &cropped,
+						NULL, NULL, NULL,
+						FALSE);
+
+	if (item->flags & HILDON_THUMBNAIL_FLAG_CROP) {
+		path = cropped;
+	} 
+	else if (item->width > 128 || item->height > 128) {
+		path = large;
+	} 
+	else {
+		path = normal;
+	}
+
+	if (!g_file_test (path, G_FILE_TEST_EXISTS)) {
+
+		g_free (large); large = NULL;
+		g_free (normal); normal = NULL;
+		g_free (cropped); cropped = NULL;
+
+		hildon_thumbnail_util_get_thumb_paths (item->uri, &large, 
+						       &normal, &cropped,
+						       NULL, NULL, NULL,
+						       TRUE);
+	}
+
+	create_pixbuf_and_callback (item, large, normal, cropped, FALSE);
+
+	g_free (cropped);
+	g_free (normal);
+	g_free (large);
+}
+
+/* Delivers the items one by one, a callback might cancel the others */
+static void
+finish_items (GList *items)
+{
+	GList *l;
+
+	for (l = items; l; l = l->next) {
+		ThumbsItem *item = l->data;
+
+		if (!item->canceled)
+			finish_item (item);
+		thumb_item_free (item);
+	}
+
+	g_list_free (items);
+}
+
 static void
 on_task_error (DBusGProxy *proxy_,
 		  guint       handle,
@@ -386,73 +460,94 @@ on_task_error (DBusGProxy *proxy_,
 		  gpointer    user_data)
 {
 	gchar *key = g_strdup_printf ("%d", handle);
-	ThumbsItem *item = g_hash_table_lookup (tasks, key);
+	GQueue *items = g_hash_table_lookup (tasks, key);
+	GList *failed = NULL, *l, *next;
 
-	if (item) {
-		if (!item->errors) {
-			item->errors = g_string_new (error_message);
-		} else {
-			g_string_append (item->errors, " - ");
-			g_string_append (item->errors, error_message);
+	if (items) {
+		for (l = items->head; l; l = next) {
+			ThumbsItem *item = l->data;
+
+			next = l->next;
+
+			/* Without a list it's about the whole task */
+			if (failed_uris && failed_uris[0] &&
+			    !uri_in (item->uri, failed_uris))
+				continue;
+
+			if (!item->errors) {
+				item->errors = g_string_new (error_message);
+			} else {
+				g_string_append (item->errors, " - ");
+				g_string_append (item->errors, error_message);
+			}
+
+			if (failed_uris && failed_uris[0]) {
+				g_queue_delete_link (items, l);
+				failed = g_list_prepend (failed, item);
+			}
 		}
+
+		if (g_queue_is_empty (items))
+			g_hash_table_remove (tasks, key);
 	}
 
 	g_free (key);
+
+	finish_items (g_list_reverse (failed));
 }
 
+/* The items of a task are called back as soon as their own thumbnail is
+ * there, not when the whole batch is done */
 static void
-on_task_finished (DBusGProxy *proxy_,
-		  guint       handle,
-		  gpointer    user_data)
+on_task_ready (DBusGProxy *proxy_,
+	       GStrv       uris,
+	       gpointer    user_data)
 {
-	gchar *key = g_strdup_printf ("%d", handle);
-	ThumbsItem *item = g_hash_table_lookup (tasks, key);
-
-	if (item) {
-			gchar *large = NULL, *normal = NULL, *cropped = NULL;
-			gchar *path;
-
-			/* Get the large small and cropped path for the original
-			 * URI */
-			
-			hildon_thumbnail_util_get_thumb_paths (item->uri, &large, 
-								&normal, &cropped,
-								NULL, NULL, NULL,
-								FALSE);
-
-			if (item->flags & HILDON_THUMBNAIL_FLAG_CROP) {
-				path = cropped;
-			} 
-			else if (item->width > 128 || item->height > 128) {
-				path = large;
-			} 
-			else {
-				path = normal;
-			}
+	GHashTableIter iter;
+	GQueue *items;
+	GList *ready = NULL, *l, *next;
+
+	g_hash_table_iter_init (&iter, tasks);
 
-			if (!g_file_test (path, G_FILE_TEST_EXISTS)) {
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &items)) {
+		for (l = items->head; l; l = next) {
+			ThumbsItem *item = l->data;
 
-				g_free (large); large = NULL;
-				g_free (normal); normal = NULL;
-				g_free (cropped); cropped = NULL;
+			next = l->next;
 
-				hildon_thumbnail_util_get_thumb_paths (item->uri, &large, 
-								       &normal, &cropped,
-								       NULL, NULL, NULL,
-								       TRUE);
+			if (uri_in (item->uri, uris)) {
+				g_queue_delete_link (items, l);
+				ready = g_list_prepend (ready, item);
 			}
+		}
 
-			create_pixbuf_and_callback (item, large, normal, cropped, FALSE);
+		if (g_queue_is_empty (items))
+			g_hash_table_iter_remove (&iter);
+	}
 
-			g_free (cropped);
-			g_free (normal);
-			g_free (large);
+	finish_items (g_list_reverse (ready));
+}
 
-			/* Remove the key from the hash, which means that we declare it 
-			 * handled. */
-			g_hash_table_remove (tasks, key);
+static void
+on_task_finished (DBusGProxy *proxy_,
+		  guint       handle,
+		  gpointer    user_data)
+{
+	gchar *key = g_strdup_printf ("%d", handle);
+	GQueue *items;
+	ThumbsItem *item;
+
+	/* What wasn't Ready nor failed on its own */
+	while ((items = g_hash_table_lookup (tasks, key)) &&
+	       (item = g_queue_pop_head (items))) {
+		finish_item (item);
+		thumb_item_free (item);
 	}
 
+	/* Remove the key from the hash, which means that we declare it 
+	 * handled. */
+	g_hash_table_remove (tasks, key);
+
 	g_free (key);
 
 }
@@ -577,23 +672,43 @@ hildon_thumbnail_factory_clean_cache(gint max_size, time_t min_mtime)
 	g_free (cropped_dir);
 }
 
-static gboolean waiting_for_cb = FALSE;
+static void
+free_items (GQueue *items)
+{
+	g_queue_free_full (items, (GDestroyNotify) thumb_item_free);
+}
 
 static void 
-on_got_handle (DBusGProxy *proxy_, guint OUT_handle, GError *error, gpointer userdata)
+on_got_handle (guint handle, GError *error, gpointer userdata)
 {
 	ThumbsItem *item = userdata;
-	gchar *key = g_strdup_printf ("%d", OUT_handle);
-	item->handle_id = OUT_handle;
-	if (!error) {
-		/* Register the item as being handled */
-		g_hash_table_replace (tasks, key, item);
-	} else {
+	GQueue *items;
+	gchar *key;
+
+	if (item->canceled) {
+		thumb_item_free (item);
+		return;
+	}
+
+	if (error) {
 		item->callback (item, item->user_data, NULL, error);
-		g_free (key);
+		thumb_item_free (item);
+		return;
 	}
-	waiting_for_cb = FALSE;
 
+	/* Register the item as being handled, next to the others that went
+	 * in the same Queue call */
+	item->handle_id = handle;
+	key = g_strdup_printf ("%d", handle);
+	items = g_hash_table_lookup (tasks, key);
+
+	if (!items) {
+		items = g_queue_new ();
+		g_hash_table_replace (tasks, key, items);
+	} else
+		g_free (key);
+
+	g_queue_push_tail (items, item);
 }
 
 typedef struct {
@@ -660,6 +775,33 @@ have_all_cb (gpointer user_data)
 	return FALSE;
 }
 
+/* The daemon doesn't try again what failed before until the out plugins'
+ * fail file for it is gone, the JPEG or the PNG one */
+static void
+unlink_fail_files (const gchar *uri)
+{
+	guint y;
+
+	for (y = 0; y < 2; y++) {
+		gchar *large = NULL, *normal = NULL, *cropped = NULL;
+		gchar *name, *path;
+
+		hildon_thumbnail_util_get_thumb_paths (uri, &large, &normal, &cropped,
+						       NULL, NULL, NULL, (y == 0));
+
+		name = g_path_get_basename (large);
+		path = g_build_filename (g_get_home_dir (), ".thumbnails", "fail",
+					 "hildon-thumbnail", name, NULL);
+		g_unlink (path);
+
+		g_free (path);
+		g_free (name);
+		g_free (large);
+		g_free (normal);
+		g_free (cropped);
+	}
+}
+
 static gboolean
 new_enough (const gchar *orig_uri, const gchar *thumb_path)
 {
@@ -718,8 +860,6 @@ HildonThumbnailFactoryHandle hildon_thumbnail_factory_load_custom(
 	gchar *large = NULL, *normal = NULL, *cropped = NULL;
 	gchar *local_large = NULL, *local_normal = NULL, *local_cropped = NULL;
 	ThumbsItem *item;
-	GStrv uris;
-	GStrv mimes;
 	gboolean have_all = FALSE;
 	guint y = 0;
 	gboolean do_cropped = TRUE;
@@ -776,6 +916,7 @@ HildonThumbnailFactoryHandle hildon_thumbnail_factory_load_custom(
 		g_unlink (large);
 		g_unlink (normal);
 		g_unlink (cropped);
+		unlink_fail_files (uri);
 	} else {
 		gchar *path, *luri;
 		GFile *local;
@@ -840,27 +981,8 @@ HildonThumbnailFactoryHandle hildon_thumbnail_factory_load_custom(
 	g_free (local_cropped);
 
 	if (!have_all) {
-
 		init ();
-		uris = (GStrv) g_malloc0 (sizeof (gchar *) * 2);
-		uris[0] = g_strdup (uri);
-
-		if (mime_type) {
-			mimes = (GStrv) g_malloc0 (sizeof (gchar *) * 2);
-			mimes[0] = g_strdup (mime_type);
-		} else
-			mimes = NULL;
-
-		waiting_for_cb = TRUE;
-		org_freedesktop_thumbnailer_Generic_queue_async (proxy, 
-								 (const char **) uris, 
-								 (const char **) mimes,
-								 0, 
-								 on_got_handle, item);
-
-		g_strfreev (uris);
-		if (mimes)
-			g_strfreev (mimes);
+		request_batch_add (batch, uri, mime_type, on_got_handle, item);
 	}
 
 	return THUMBS_HANDLE (item);
@@ -884,29 +1006,50 @@ on_cancelled (DBusGProxy *proxy_, GError *error, gpointer userdata)
 void hildon_thumbnail_factory_cancel(HildonThumbnailFactoryHandle handle)
 {
 	ThumbsItem *item = THUMBS_ITEM (handle);
+	guint handle_id = item->handle_id;
+	GQueue *items;
 	gchar *key;
 
 	init();
 
-	if (item->handle_id == 0)
+	/* Not sent yet, the daemon never hears of it */
+	if (request_batch_remove (batch, item)) {
+		thumb_item_free (item);
 		return;
+	}
+
+	item->canceled = TRUE;
+
+	/* Queue() didn't return yet, it's dropped when it does */
+	if (handle_id == 0)
+		return;
+
+	key = g_strdup_printf ("%d", handle_id);
+	items = g_hash_table_lookup (tasks, key);
 
-	key = g_strdup_printf ("%d", item->handle_id);
 	/* Unregister the item */
-	g_hash_table_remove (tasks, key);
-	g_free (key);
+	if (items && g_queue_remove (items, item)) {
+		thumb_item_free (item);
 
-	/* We don't do real canceling, we just do unqueing */
-	org_freedesktop_thumbnailer_Generic_unqueue_async (proxy, item->handle_id, 
-							   on_cancelled, item);
+		/* We don't do real canceling, we just do unqueing. Only once
+		 * none of the items that share the task is left */
+		if (g_queue_is_empty (items)) {
+			g_hash_table_remove (tasks, key);
+			org_freedesktop_thumbnailer_Generic_unqueue_async (proxy, handle_id, 
+									   on_cancelled, NULL);
+		}
+	}
 
+	g_free (key);
 }
 
 void hildon_thumbnail_factory_wait()
 {
 	init();
 
-	while (waiting_for_cb)
+	request_batch_flush (batch);
+
+	while (request_batch_busy (batch))
 		g_main_context_iteration (NULL, FALSE);
 
 	while(g_hash_table_size (tasks) != 0) {
@@ -1008,6 +1151,11 @@ void hildon_thumbnail_factory_set_debug(gboolean debug)
 	show_debug = debug;
 }
 
+void hildon_thumbnail_factory_set_batch_window(guint msec)
+{
+	request_batch_set_window (msec);
+}
+
 
 
 static void init (void) {
@@ -1016,7 +1164,7 @@ static void init (void) {
 
 		tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
 					       (GDestroyNotify) g_free,
-					       (GDestroyNotify) thumb_item_free);
+					       (GDestroyNotify) free_items);
 
 		connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
 
@@ -1036,9 +1184,19 @@ static void init (void) {
 					   THUMBNAILER_PATH,
 					   THUMBNAILER_INTERFACE);
 
+		batch = request_batch_new (proxy);
+
 		dbus_g_proxy_add_signal (proxy, "Finished", 
 					G_TYPE_UINT, G_TYPE_INVALID);
 
+		dbus_g_object_register_marshaller (g_cclosure_marshal_VOID__BOXED,
+					G_TYPE_NONE,
+					G_TYPE_STRV,
+					G_TYPE_INVALID);
+
+		dbus_g_proxy_add_signal (proxy, "Ready", 
+					G_TYPE_STRV, G_TYPE_INVALID);
+
 		dbus_g_object_register_marshaller (thumbnailer_marshal_VOID__UINT_BOXED_INT_STRING,
 					G_TYPE_NONE,
 					G_TYPE_UINT, 
@@ -1064,6 +1222,11 @@ static void init (void) {
 				     NULL,
 				     NULL);
 
+		dbus_g_proxy_connect_signal (proxy, "Ready",
+				     G_CALLBACK (on_task_ready),
+				     NULL,
+				     NULL);
+
 	}
 
 	had_init = TRUE;
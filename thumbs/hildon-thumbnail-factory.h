@@ -397,6 +397,17 @@ void hildon_thumbnail_factory_clean_cache(gint max_size, time_t min_mtime);
  */
 void hildon_thumbnail_factory_set_debug(gboolean debug);
 
+/**
+ * hildon_thumbnail_factory_set_batch_window:
+ * @msec: how long to collect requests, in milliseconds
+ *
+ * Requests that aren't cached yet are collected and sent to the thumbnailer
+ * together. By default that's what was asked for within one main loop
+ * iteration; a window of @msec collects for that long instead. Callbacks
+ * still come per request, as soon as its thumbnail is there
+ */
+void hildon_thumbnail_factory_set_batch_window(guint msec);
+
 /**
  * HILDON_THUMBNAIL_OPTION_PREFIX:
  *
@@ -26,10 +26,12 @@
 #include <glib/gfileutils.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "hildon-thumbnail-factory.h"
 #include "thumbnailer-client.h"
 #include "thumbnailer-marshal.h"
+#include "request-batch.h"
 #include "utils.h"
 
 #define THUMBNAILER_SERVICE      "org.freedesktop.thumbnailer"
@@ -55,6 +57,7 @@ typedef struct {
 typedef struct {
 	DBusGProxy *proxy;
 	GHashTable *tasks;
+	RequestBatch *batch;
 } HildonThumbnailFactoryPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (HildonThumbnailFactory, hildon_thumbnail_factory, G_TYPE_OBJECT)
@@ -288,6 +291,35 @@ create_pixbuf_and_callback (HildonThumbnailRequestPrivate *r_priv)
 }
 
 
+static gboolean
+uri_in (const gchar *uri, GStrv uris)
+{
+	guint i;
+
+	for (i = 0; uris && uris[i]; i++)
+		if (strcmp (uris[i], uri) == 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Calls back one by one, a callback might unqueue the others */
+static void
+finish_requests (GList *requests)
+{
+	GList *l;
+
+	for (l = requests; l; l = l->next) {
+		HildonThumbnailRequestPrivate *r_priv = REQUEST_GET_PRIVATE (l->data);
+
+		if (! r_priv->unqueued)
+			create_pixbuf_and_callback (r_priv);
+		g_object_unref (l->data);
+	}
+
+	g_list_free (requests);
+}
+
 static void
 on_task_finished (DBusGProxy *proxy,
 		  guint       handle,
@@ -295,18 +327,56 @@ on_task_finished (DBusGProxy *proxy,
 {
 	HildonThumbnailFactoryPrivate *f_priv = FACTORY_GET_PRIVATE (user_data);
 	gchar *key = g_strdup_printf ("%d", handle);
-	HildonThumbnailRequest *request = g_hash_table_lookup (f_priv->tasks, key);
+	HildonThumbnailRequest *request;
+	GQueue *requests;
 
-	if (request) {
+	/* What wasn't Ready nor failed on its own */
+	while ((requests = g_hash_table_lookup (f_priv->tasks, key)) &&
+	       (request = g_queue_pop_head (requests))) {
 		HildonThumbnailRequestPrivate *r_priv = REQUEST_GET_PRIVATE (request);
                 if (! r_priv->unqueued)
                         create_pixbuf_and_callback (r_priv);
-		g_hash_table_remove (f_priv->tasks, key);
+		g_object_unref (request);
 	}
 
+	g_hash_table_remove (f_priv->tasks, key);
+
 	g_free (key);
 }
 
+/* The requests of a task are called back as soon as their own thumbnail
+ * is there, not when the whole batch is done */
+static void
+on_task_ready (DBusGProxy *proxy,
+	       GStrv       uris,
+	       gpointer    user_data)
+{
+	HildonThumbnailFactoryPrivate *f_priv = FACTORY_GET_PRIVATE (user_data);
+	GHashTableIter iter;
+	GQueue *requests;
+	GList *ready = NULL, *l, *next;
+
+	g_hash_table_iter_init (&iter, f_priv->tasks);
+
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &requests)) {
+		for (l = requests->head; l; l = next) {
+			HildonThumbnailRequestPrivate *r_priv = REQUEST_GET_PRIVATE (l->data);
+
+			next = l->next;
+
+			if (uri_in (r_priv->uris[0], uris)) {
+				ready = g_list_prepend (ready, l->data);
+				g_queue_delete_link (requests, l);
+			}
+		}
+
+		if (g_queue_is_empty (requests))
+			g_hash_table_iter_remove (&iter);
+	}
+
+	finish_requests (g_list_reverse (ready));
+}
+
 static gboolean waiting_for_cb = FALSE;
 
 static void
@@ -319,20 +389,40 @@ on_task_error (DBusGProxy *proxy,
 {
 	HildonThumbnailFactoryPrivate *f_priv = FACTORY_GET_PRIVATE (user_data);
 	gchar *key = g_strdup_printf ("%d", handle);
-	HildonThumbnailRequest *request = g_hash_table_lookup (f_priv->tasks, key);
+	GQueue *requests = g_hash_table_lookup (f_priv->tasks, key);
+	GList *failed = NULL, *l, *next;
 
-	if (request) {
-		HildonThumbnailRequestPrivate *r_priv = REQUEST_GET_PRIVATE (request);
+	if (requests) {
+		for (l = requests->head; l; l = next) {
+			HildonThumbnailRequestPrivate *r_priv = REQUEST_GET_PRIVATE (l->data);
 
-		if (!r_priv->errors) {
-			r_priv->errors = g_string_new (error_message);
-		} else {
-			g_string_append (r_priv->errors, " - ");
-			g_string_append (r_priv->errors, error_message);
+			next = l->next;
+
+			/* Without a list it's about the whole task */
+			if (failed_uris && failed_uris[0] &&
+			    !uri_in (r_priv->uris[0], failed_uris))
+				continue;
+
+			if (!r_priv->errors) {
+				r_priv->errors = g_string_new (error_message);
+			} else {
+				g_string_append (r_priv->errors, " - ");
+				g_string_append (r_priv->errors, error_message);
+			}
+
+			if (failed_uris && failed_uris[0]) {
+				failed = g_list_prepend (failed, l->data);
+				g_queue_delete_link (requests, l);
+			}
 		}
+
+		if (g_queue_is_empty (requests))
+			g_hash_table_remove (f_priv->tasks, key);
 	}
 
 	g_free (key);
+
+	finish_requests (g_list_reverse (failed));
 }
 
 
@@ -345,6 +435,12 @@ have_all_for_request_cb (gpointer user_data)
 	return FALSE;
 }
 
+static void
+free_requests (GQueue *requests)
+{
+	g_queue_free_full (requests, g_object_unref);
+}
+
 static void
 hildon_thumbnail_factory_init (HildonThumbnailFactory *self)
 {
@@ -362,13 +458,15 @@ hildon_thumbnail_factory_init (HildonThumbnailFactory *self)
 
 	f_priv->tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
 				       (GDestroyNotify) g_free,
-				       (GDestroyNotify) g_object_unref);
+				       (GDestroyNotify) free_requests);
 
 	f_priv->proxy = dbus_g_proxy_new_for_name (connection, 
 				   THUMBNAILER_SERVICE,
 				   THUMBNAILER_PATH,
 				   THUMBNAILER_INTERFACE);
 
+	f_priv->batch = request_batch_new (f_priv->proxy);
+
 	dbus_g_proxy_add_signal (f_priv->proxy, "Finished", 
 				G_TYPE_UINT, G_TYPE_INVALID);
 
@@ -396,6 +494,20 @@ hildon_thumbnail_factory_init (HildonThumbnailFactory *self)
 			     G_CALLBACK (on_task_error),
 			     self,
 			     NULL);
+
+	dbus_g_object_register_marshaller (g_cclosure_marshal_VOID__BOXED,
+					G_TYPE_NONE,
+					G_TYPE_STRV,
+					G_TYPE_INVALID);
+
+	dbus_g_proxy_add_signal (f_priv->proxy, "Ready", 
+				 G_TYPE_STRV,
+				 G_TYPE_INVALID);
+
+	dbus_g_proxy_connect_signal (f_priv->proxy, "Ready",
+			     G_CALLBACK (on_task_ready),
+			     self,
+			     NULL);
 }
 
 static void
@@ -421,6 +533,7 @@ hildon_thumbnail_factory_finalize (GObject *object)
 {
 	HildonThumbnailFactoryPrivate *f_priv = FACTORY_GET_PRIVATE (object);
 
+	request_batch_free (f_priv->batch);
 	g_object_unref (f_priv->proxy);
 	g_hash_table_unref (f_priv->tasks);
 }
@@ -457,31 +570,43 @@ hildon_thumbnail_factory_class_init (HildonThumbnailFactoryClass *klass)
 
 
 static void 
-on_got_handle (DBusGProxy *proxy, guint OUT_handle, GError *error, gpointer userdata)
+on_got_handle (guint handle, GError *error, gpointer userdata)
 {
 	HildonThumbnailRequest *request = userdata;
 	HildonThumbnailRequestPrivate *r_priv;
+	HildonThumbnailFactoryPrivate *f_priv;
+	GQueue *requests;
 
 	g_return_if_fail (request != NULL);
 	r_priv = REQUEST_GET_PRIVATE (request);
 	g_return_if_fail (r_priv != NULL);
 
-	if (! r_priv->unqueued)
-	{
-		HildonThumbnailFactoryPrivate *f_priv;
-		f_priv = FACTORY_GET_PRIVATE (r_priv->factory);
-		g_return_if_fail (f_priv != NULL);
+	if (r_priv->unqueued) {
+		g_object_unref (request);
+		return;
+	}
 
-		gchar *key = g_strdup_printf ("%d", OUT_handle);
-		r_priv->key = key;
-		g_hash_table_replace (f_priv->tasks, g_strdup (key), 
-				      request);
+	if (error) {
+		r_priv->errors = g_string_new (error->message);
+		create_pixbuf_and_callback (r_priv);
+		g_object_unref (request);
+		return;
 	}
-	else
-	  g_object_unref (request);
 
-	waiting_for_cb = FALSE;
+	f_priv = FACTORY_GET_PRIVATE (r_priv->factory);
+	g_return_if_fail (f_priv != NULL);
+
+	/* The requests that went in the same Queue call share the key */
+	r_priv->key = g_strdup_printf ("%d", handle);
+	requests = g_hash_table_lookup (f_priv->tasks, r_priv->key);
 
+	if (!requests) {
+		requests = g_queue_new ();
+		g_hash_table_replace (f_priv->tasks, g_strdup (r_priv->key),
+				      requests);
+	}
+
+	g_queue_push_tail (requests, request);
 }
 
 static HildonThumbnailRequest*
@@ -499,7 +624,6 @@ hildon_thumbnail_factory_request_generic (HildonThumbnailFactory *self,
 	HildonThumbnailRequestPrivate *r_priv = REQUEST_GET_PRIVATE (request);
 	HildonThumbnailFactoryPrivate *f_priv = FACTORY_GET_PRIVATE (self);
 	gboolean have = FALSE;
-	GStrv mime_types = NULL;
 	guint y, i, x;
 
 	gchar *paths[3] = { NULL, NULL, NULL };
@@ -566,30 +690,16 @@ hildon_thumbnail_factory_request_generic (HildonThumbnailFactory *self,
 	r_priv->cropped = cropped;
 #endif
 
-	mime_types = (GStrv) g_malloc0 (sizeof (gchar *) * 2);
-
-	if (mime_type) {
-		mime_types[0] = g_strdup (mime_type);
-	} else {
-		mime_types[0] = NULL;
-	}
-
-	waiting_for_cb = TRUE;
 	if (!have) {
-		org_freedesktop_thumbnailer_Generic_queue_async (f_priv->proxy, 
-								 (const char **) r_priv->uris, 
-								 (const char **) mime_types,
-								 0, 
-								 on_got_handle, 
-								 g_object_ref (request));
+		request_batch_add (f_priv->batch, uri, mime_type,
+				   on_got_handle, g_object_ref (request));
 	} else {
+		waiting_for_cb = TRUE;
 		g_idle_add_full (G_PRIORITY_DEFAULT, have_all_for_request_cb, 
 				 (GSourceFunc) g_object_ref (request),
 				 (GDestroyNotify) g_object_unref);
 	}
 
-	g_strfreev (mime_types);
-
 	return request;
 }
 
@@ -640,6 +750,11 @@ hildon_thumbnail_factory_join (HildonThumbnailFactory *self)
 {
 	HildonThumbnailFactoryPrivate *f_priv = FACTORY_GET_PRIVATE (self);
 
+	request_batch_flush (f_priv->batch);
+
+	while (request_batch_busy (f_priv->batch))
+		g_main_context_iteration (NULL, FALSE);
+
 	while (waiting_for_cb)
 		g_main_context_iteration (NULL, FALSE);
 
@@ -651,12 +766,6 @@ hildon_thumbnail_factory_join (HildonThumbnailFactory *self)
 static void 
 on_unqueued (DBusGProxy *proxy, GError *error, gpointer userdata)
 {
-	HildonThumbnailRequest *request = userdata;
-	HildonThumbnailRequestPrivate *r_priv = REQUEST_GET_PRIVATE (request);
-	HildonThumbnailFactoryPrivate *f_priv = FACTORY_GET_PRIVATE (r_priv->factory);
-
-	g_hash_table_remove (f_priv->tasks, r_priv->key);
-	g_object_unref (request);
 }
 
 void 
@@ -664,6 +773,7 @@ hildon_thumbnail_request_unqueue (HildonThumbnailRequest *self)
 {
 	HildonThumbnailRequestPrivate *r_priv;
 	HildonThumbnailFactoryPrivate *f_priv;
+	GQueue *requests;
 	guint handle;
 
 	g_return_if_fail (self != NULL);
@@ -676,15 +786,33 @@ hildon_thumbnail_request_unqueue (HildonThumbnailRequest *self)
 
 	r_priv->unqueued = TRUE;
 
+	/* Not sent yet, the daemon never hears of it */
+	if (request_batch_remove (f_priv->batch, self)) {
+		g_object_unref (self);
+		return;
+	}
+
 	/* if Queue() didn't return yet, r_priv->key is NULL and we cannot
          * unqueue it.
          */
-	if (r_priv->key) {
+	if (!r_priv->key)
+		return;
+
+	requests = g_hash_table_lookup (f_priv->tasks, r_priv->key);
+
+	if (!requests || !g_queue_remove (requests, self))
+		return;
+
+	/* The others that share the task still want it */
+	if (g_queue_is_empty (requests)) {
 		handle = atoi (r_priv->key);
+		g_hash_table_remove (f_priv->tasks, r_priv->key);
 		org_freedesktop_thumbnailer_Generic_unqueue_async (f_priv->proxy, handle,
 								   on_unqueued, 
-								   g_object_ref (self));
+								   NULL);
 	}
+
+	g_object_unref (self);
 }
 
 void 
@@ -692,7 +820,12 @@ hildon_thumbnail_request_join (HildonThumbnailRequest *self)
 {
 	HildonThumbnailRequestPrivate *r_priv = REQUEST_GET_PRIVATE (self);
 	HildonThumbnailFactoryPrivate *f_priv = FACTORY_GET_PRIVATE (r_priv->factory);
-	HildonThumbnailRequest *found;
+	GQueue *requests;
+
+	request_batch_flush (f_priv->batch);
+
+	while (request_batch_busy (f_priv->batch))
+		g_main_context_iteration (NULL, FALSE);
 
 	while (waiting_for_cb)
 		g_main_context_iteration (NULL, FALSE);
@@ -700,11 +833,11 @@ hildon_thumbnail_request_join (HildonThumbnailRequest *self)
 	if (!r_priv->key)
 		return;
 
-	found = g_hash_table_lookup (f_priv->tasks, r_priv->key);
+	requests = g_hash_table_lookup (f_priv->tasks, r_priv->key);
 
-	while (found) {
+	while (requests && g_queue_find (requests, self)) {
 		g_main_context_iteration (NULL, FALSE);
-		found = g_hash_table_lookup (f_priv->tasks, r_priv->key);
+		requests = g_hash_table_lookup (f_priv->tasks, r_priv->key);
 	}
 }
 
@@ -0,0 +1,251 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+#include <dbus/dbus-glib.h>
+
+#include "thumbnailer-client.h"
+#include "request-batch.h"
+
+/* The daemon hands tasks of more than 50 items to its one large-task
+ * thread, a batch stays below that */
+#define MAX_BATCH	50
+
+typedef struct {
+	gchar *uri;
+	gchar *mime_type;
+	RequestBatchFunc func;
+	gpointer item;
+} BatchEntry;
+
+struct RequestBatch {
+	DBusGProxy *proxy;
+	GPtrArray *collecting;
+	guint flush_id;
+	guint in_flight;
+	guint ref_count;
+};
+
+typedef struct {
+	RequestBatch *batch;
+	GPtrArray *entries;
+} SentBatch;
+
+static guint window = 0;
+
+static void
+entry_free (BatchEntry *entry)
+{
+	g_free (entry->uri);
+	g_free (entry->mime_type);
+	g_slice_free (BatchEntry, entry);
+}
+
+static void
+batch_unref (RequestBatch *batch)
+{
+	if (--batch->ref_count > 0)
+		return;
+
+	g_ptr_array_free (batch->collecting, TRUE);
+	g_object_unref (batch->proxy);
+	g_slice_free (RequestBatch, batch);
+}
+
+static void
+on_got_handle (DBusGProxy *proxy, guint OUT_handle, GError *error, gpointer userdata)
+{
+	SentBatch *sent = userdata;
+	guint i;
+
+	sent->batch->in_flight--;
+
+	for (i = 0; i < sent->entries->len; i++) {
+		BatchEntry *entry = g_ptr_array_index (sent->entries, i);
+
+		entry->func (OUT_handle, error, entry->item);
+	}
+
+	if (error)
+		g_error_free (error);
+
+	g_ptr_array_free (sent->entries, TRUE);
+	batch_unref (sent->batch);
+	g_slice_free (SentBatch, sent);
+}
+
+void
+request_batch_flush (RequestBatch *batch)
+{
+	GHashTable *seen;
+	SentBatch *sent;
+	GStrv uris, mimes;
+	gboolean have_mimes = FALSE;
+	guint i, n = 0;
+
+	if (batch->flush_id) {
+		g_source_remove (batch->flush_id);
+		batch->flush_id = 0;
+	}
+
+	if (batch->collecting->len == 0)
+		return;
+
+	uris = (GStrv) g_malloc0 (sizeof (gchar *) * (batch->collecting->len + 1));
+	mimes = (GStrv) g_malloc0 (sizeof (gchar *) * (batch->collecting->len + 1));
+	seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+	/* The same URI twice is made once, both items get the handle. An
+	 * empty hint is no hint to the daemon */
+	for (i = 0; i < batch->collecting->len; i++) {
+		BatchEntry *entry = g_ptr_array_index (batch->collecting, i);
+
+		if (g_hash_table_lookup (seen, entry->uri))
+			continue;
+		g_hash_table_insert (seen, entry->uri, entry);
+
+		uris[n] = g_strdup (entry->uri);
+		mimes[n] = g_strdup (entry->mime_type ? entry->mime_type : "");
+		if (entry->mime_type)
+			have_mimes = TRUE;
+		n++;
+	}
+
+	g_hash_table_unref (seen);
+
+	sent = g_slice_new (SentBatch);
+	sent->batch = batch;
+	sent->entries = batch->collecting;
+	batch->collecting = g_ptr_array_new_with_free_func ((GDestroyNotify) entry_free);
+	batch->ref_count++;
+	batch->in_flight++;
+
+	org_freedesktop_thumbnailer_Generic_queue_async (batch->proxy,
+							 (const char **) uris,
+							 have_mimes ? (const char **) mimes : NULL,
+							 0,
+							 on_got_handle, sent);
+
+	g_strfreev (uris);
+	g_strfreev (mimes);
+}
+
+static gboolean
+flush_cb (gpointer user_data)
+{
+	RequestBatch *batch = user_data;
+
+	batch->flush_id = 0;
+	request_batch_flush (batch);
+
+	return FALSE;
+}
+
+void
+request_batch_add (RequestBatch *batch, const gchar *uri, const gchar *mime_type, RequestBatchFunc func, gpointer item)
+{
+	BatchEntry *entry = g_slice_new (BatchEntry);
+
+	entry->uri = g_strdup (uri);
+	entry->mime_type = g_strdup (mime_type);
+	entry->func = func;
+	entry->item = item;
+
+	g_ptr_array_add (batch->collecting, entry);
+
+	if (batch->collecting->len >= MAX_BATCH) {
+		request_batch_flush (batch);
+		return;
+	}
+
+	if (batch->flush_id)
+		return;
+
+	/* Without a window it goes once the current dispatch returned, that
+	 * is before the main loop gets to redrawing */
+	if (window > 0)
+		batch->flush_id = g_timeout_add (window, flush_cb, batch);
+	else
+		batch->flush_id = g_idle_add_full (G_PRIORITY_DEFAULT, flush_cb,
+						   batch, NULL);
+}
+
+/* Takes item out if it wasn't sent yet, the caller gets it back */
+gboolean
+request_batch_remove (RequestBatch *batch, gpointer item)
+{
+	guint i;
+
+	for (i = 0; i < batch->collecting->len; i++) {
+		BatchEntry *entry = g_ptr_array_index (batch->collecting, i);
+
+		if (entry->item == item) {
+			g_ptr_array_remove_index (batch->collecting, i);
+
+			if (batch->collecting->len == 0 && batch->flush_id) {
+				g_source_remove (batch->flush_id);
+				batch->flush_id = 0;
+			}
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Whether items are collected or waiting for their handle */
+gboolean
+request_batch_busy (RequestBatch *batch)
+{
+	return batch->collecting->len > 0 || batch->in_flight > 0;
+}
+
+/* A window of 0 sends what was asked for within one main loop iteration */
+void
+request_batch_set_window (guint msec)
+{
+	window = msec;
+}
+
+RequestBatch *
+request_batch_new (DBusGProxy *proxy)
+{
+	RequestBatch *batch = g_slice_new0 (RequestBatch);
+
+	batch->proxy = g_object_ref (proxy);
+	batch->collecting = g_ptr_array_new_with_free_func ((GDestroyNotify) entry_free);
+	batch->ref_count = 1;
+
+	return batch;
+}
+
+/* What was collected is still sent, the replies still come */
+void
+request_batch_free (RequestBatch *batch)
+{
+	request_batch_flush (batch);
+	batch_unref (batch);
+}
@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+#ifndef __REQUEST_BATCH_H__
+#define __REQUEST_BATCH_H__
+
+/*
+ * This file is part of hildon-thumbnail package
+ *
+ * Copyright (C) 2005 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <glib.h>
+#include <dbus/dbus-glib.h>
+
+G_BEGIN_DECLS
+
+/* Collects the requests made within one main loop iteration, or within
+ * the configured window, and sends them as one Queue call. Every item
+ * gets the handle of the task it ended up in, or the error of the call;
+ * the items of one batch share that handle */
+
+typedef struct RequestBatch RequestBatch;
+
+typedef void (*RequestBatchFunc) (guint handle, GError *error, gpointer item);
+
+RequestBatch *request_batch_new        (DBusGProxy *proxy);
+void          request_batch_free       (RequestBatch *batch);
+void          request_batch_add        (RequestBatch *batch,
+					const gchar *uri,
+					const gchar *mime_type,
+					RequestBatchFunc func,
+					gpointer item);
+gboolean      request_batch_remove     (RequestBatch *batch,
+					gpointer item);
+void          request_batch_flush      (RequestBatch *batch);
+gboolean      request_batch_busy       (RequestBatch *batch);
+void          request_batch_set_window (guint msec);
+
+G_END_DECLS
+
+#endif